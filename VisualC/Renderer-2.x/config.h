@@ -4,4 +4,8 @@
 #define HANDLERAYTRACER
 #define SIMD_SSE
 
+// Visual Studio 2019 (16.4) and later, with /std:c++17, have the floating
+// point std::from_chars - without it, the PLY loader reads with strtod
+//#define HAVE_FLOAT_FROM_CHARS
+
 #endif
@@ -61,6 +61,20 @@ using namespace std;
 
 unsigned g_reportCounter = 0;
 
+// Creates a leaf for the triangles of the work entries. Since Recurse creates
+// the left subtree before the right one, the leaves take consecutive ranges
+// of the tree's _triIndices, in depth-first order.
+template <class BBoxEntry>
+static BVHNode *CreateLeaf(BVHTree& tree, const BBoxEntry *work, int size)
+{
+    BVHLeaf *leaf = tree._arena.New<BVHLeaf>();
+    leaf->_start = tree._triIndices.size();
+    leaf->_count = size;
+    for(int j=0; j<size; j++)
+	tree._triIndices.push_back(work[j]._triIdx);
+    return leaf;
+}
+
 #ifndef SIMD_SSE
 
 #define BUILDING_BVH_MSG "Building BVH: "
@@ -81,30 +95,31 @@ struct BBoxTmp {
     Vector3 _top;
     // Center point, ie 0.5*(top-bottom)
     Vector3 _center;
-    // Triangle
-    const Triangle *_pTri;
+    // Triangle (index in Scene::_triangles)
+    int _triIdx;
     BBoxTmp()
 	:
 	_bottom(FLT_MAX,FLT_MAX,FLT_MAX),
 	_top(-FLT_MAX,-FLT_MAX,-FLT_MAX),
-	_pTri(NULL)
+	_triIdx(-1)
 	{}
 };
-typedef vector<BBoxTmp> BBoxEntries;
+typedef BBoxTmp* BBoxEntries;
 
-// This builds the BVH, finding optimal split planes for each depth
-BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
+// This builds the BVH, finding optimal split planes for each depth.
+// The work entries are partitioned in place, with the help of 'scratch'
+// (as big as the initial work list, shared by all levels).
+BVHNode *Recurse(
+    BVHTree& tree, int size, BBoxEntries work, BBoxEntries scratch,
+    REPORTPRM(float pct=0.) int depth=0)
 {
     REPORT( coord pctSpan  = 11.f/pow(3.f,depth); )
-    if (work.size()<4) {
-	BVHLeaf *leaf = new BVHLeaf;
-	for(BBoxEntries::iterator it=work.begin(); it!=work.end(); ++it)
-	    leaf->_triangles.push_back(it->_pTri);
-	return leaf;
-    }
+    if (size<4)
+	return CreateLeaf(tree, work, size);
+
     // Start by finding the working list's bounding box
     Vector3 bottom(FLT_MAX,FLT_MAX,FLT_MAX), top(-FLT_MAX,-FLT_MAX,-FLT_MAX);
-    for(unsigned i=0; i<work.size(); i++) {
+    for(int i=0; i<size; i++) {
 	BBoxTmp& v = work[i];
 	bottom.assignSmaller(v._bottom);
 	top.assignBigger(v._top);
@@ -114,7 +129,7 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
     coord side2 = top._y-bottom._y;
     coord side3 = top._z-bottom._z;
     // The current box has a cost of (No of triangles)*surfaceArea
-    coord minCost = work.size() * (side1*side2 + side2*side3 + side3*side1);
+    coord minCost = size * (side1*side2 + side2*side3 + side3*side1);
     coord bestSplit = FLT_MAX; // will indicate no split with better cost found (below)
     int bestAxis = -1;
 
@@ -167,7 +182,7 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
 	    // The number of triangles in the left and right bboxes
 	    int countLeft=0, countRight=0;
 	    // For each test split, allocate triangles based on their bounding boxes centers
-	    for(unsigned i=0; i<work.size(); i++) {
+	    for(int i=0; i<size; i++) {
 		BBoxTmp& v = work[i];
 
 		coord value;
@@ -208,18 +223,16 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
     }
 
     // We found no split to improve the cost, create a BVH leaf
-    if (bestAxis == -1) {
-	BVHLeaf *leaf = new BVHLeaf;
-	for(BBoxEntries::iterator it=work.begin(); it!=work.end(); ++it)
-	    leaf->_triangles.push_back(it->_pTri);
-	return leaf;
-    }
+    if (bestAxis == -1)
+	return CreateLeaf(tree, work, size);
 
-    // Create a BVH inner node, split with the optimal value we found above
-    BBoxEntries left, right;
+    // Create a BVH inner node, split with the optimal value we found above.
+    // The left entries are compacted at the start of 'work', the right ones
+    // are gathered in 'scratch' and then copied after them (keeping the order).
+    int countLeft=0, countRight=0;
     Vector3 lbottom(FLT_MAX,FLT_MAX,FLT_MAX), ltop(-FLT_MAX,-FLT_MAX,-FLT_MAX);
     Vector3 rbottom(FLT_MAX,FLT_MAX,FLT_MAX), rtop(-FLT_MAX,-FLT_MAX,-FLT_MAX);
-    for(int i=0; i<(int)work.size(); i++) {
+    for(int i=0; i<size; i++) {
 	BBoxTmp& v = work[i];
 
 	coord value;
@@ -240,9 +253,9 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
 		v._center._y,
 		v._center._z);
 	    #endif
-	    left.push_back(v);
 	    lbottom.assignSmaller(v._bottom);
 	    ltop.assignBigger(v._top);
+	    work[countLeft++] = v;
 	} else {
 	    #ifdef DEBUG_LOG_BVH
 	    printf("RADD: B(%f %f %f) T(%f %f %f) C(%f %f %f)\n",
@@ -256,12 +269,14 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
 		v._center._y,
 		v._center._z);
 	    #endif
-	    right.push_back(v);
 	    rbottom.assignSmaller(v._bottom);
 	    rtop.assignBigger(v._top);
+	    scratch[countRight++] = v;
 	}
     }
-    BVHInner *inner = new BVHInner;
+    copy(scratch, scratch + countRight, work + countLeft);
+
+    BVHInner *inner = tree._arena.New<BVHInner>();
     #ifdef PROGRESS_REPORT
     if ((PRINT_REPORT_EVERY&g_reportCounter++) == 0) {
 	printf("\b\b\b%2d%%", int(pct+3.f*pctSpan)); // Update progress indicator
@@ -271,7 +286,7 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
 	SDL_WM_SetCaption(caption.str().c_str(), caption.str().c_str());
     }
     #endif
-    inner->_left = Recurse(left, REPORTPRM(pct+3.f*pctSpan) depth+1);
+    inner->_left = Recurse(tree, countLeft, work, scratch, REPORTPRM(pct+3.f*pctSpan) depth+1);
     inner->_left->_bottom = lbottom;
     inner->_left->_top = ltop;
     #ifdef PROGRESS_REPORT
@@ -283,7 +298,7 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
 	SDL_WM_SetCaption(caption.str().c_str(), caption.str().c_str());
     }
     #endif
-    inner->_right = Recurse(right, REPORTPRM(pct+6.f*pctSpan) depth+1);
+    inner->_right = Recurse(tree, countRight, work + countLeft, scratch, REPORTPRM(pct+6.f*pctSpan) depth+1);
     inner->_right->_bottom = rbottom;
     inner->_right->_top = rtop;
 
@@ -319,24 +334,29 @@ BVHNode *Recurse(BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
     return inner;
 }
 
-BVHNode *CreateBVH(const Scene *pScene)
+BVHTree *CreateBVH(const Scene *pScene)
 {
     vector<BBoxTmp> work;
     Vector3 bottom(FLT_MAX,FLT_MAX,FLT_MAX), top(-FLT_MAX,-FLT_MAX,-FLT_MAX);
 
+    ASSERT_OR_DIE(pScene->_triangles.size());
+
     puts("Gathering bounding box info from all triangles...");
     for(int j=0; j<(int)pScene->_triangles.size(); j++) {
 	const Triangle& triangle = pScene->_triangles[j];
 
 	BBoxTmp b;
-	b._pTri = &triangle;
-
-	b._bottom.assignSmaller(*triangle._vertexA);
-	b._bottom.assignSmaller(*triangle._vertexB);
-	b._bottom.assignSmaller(*triangle._vertexC);
-	b._top.assignBigger(*triangle._vertexA);
-	b._top.assignBigger(*triangle._vertexB);
-	b._top.assignBigger(*triangle._vertexC);
+	b._triIdx = j;
+
+	const Vertex& vA = pScene->_vertices[triangle._idxA];
+	const Vertex& vB = pScene->_vertices[triangle._idxB];
+	const Vertex& vC = pScene->_vertices[triangle._idxC];
+	b._bottom.assignSmaller(vA);
+	b._bottom.assignSmaller(vB);
+	b._bottom.assignSmaller(vC);
+	b._top.assignBigger(vA);
+	b._top.assignBigger(vB);
+	b._top.assignBigger(vC);
 
 	bottom.assignSmaller(b._bottom);
 	top.assignBigger(b._top);
@@ -362,12 +382,16 @@ BVHNode *CreateBVH(const Scene *pScene)
     // ...and pass it to the recursive function that creates the SAH AABB BVH
     // (Surface Area Heuristic, Axis-Aligned Bounding Boxes, Bounding Volume Hierarchy)
     printf("Creating Bounding Volume Hierarchy data...    "); fflush(stdout);
-    BVHNode *root = Recurse(work);
+    BVHTree *pTree = new BVHTree;
+    pTree->_triIndices.reserve(work.size());
+    vector<BBoxTmp> scratch(work.size());
+    BVHNode *root = Recurse(*pTree, work.size(), &work[0], &scratch[0]);
     printf("\b\b\b100%%\n");
     root->_bottom = bottom;
     root->_top = top;
+    pTree->_root = root;
 
-    return root;
+    return pTree;
 }
 
 #else
@@ -388,13 +412,13 @@ struct BBoxTmp {
     __m128 _top;
     // Center point, ie 0.5*(top-bottom)
     __m128 _center;
-    // Triangle
-    const Triangle *_pTri;
+    // Triangle (index in Scene::_triangles)
+    int _triIdx;
     BBoxTmp()
 	:
 	_bottom(_mm_set1_ps(FLT_MAX)),
 	_top(_mm_set1_ps(-FLT_MAX)),
-	_pTri(NULL)
+	_triIdx(-1)
 	{
 	}
 };
@@ -420,18 +444,18 @@ BBoxTmp* alignedAlloc(size_t n)
 }
 */
 
-// This builds the BVH, finding optimal split planes for each depth
-BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=0)
+// This builds the BVH, finding optimal split planes for each depth.
+// The work entries are partitioned in place, with the help of 'scratch'
+// (as big as the initial work list, shared by all levels).
+BVHNode *Recurse(
+    BVHTree& tree, int size, BBoxEntries work, BBoxEntries scratch,
+    REPORTPRM(float pct=0.) int depth=0)
 {
     __m128 hlp;
 
     REPORT( coord pctSpan  = 11.f/pow(3.f,depth); )
-    if (size<4) {
-	BVHLeaf *leaf = new BVHLeaf;
-	for(int j=0; j<size; j++)
-	    leaf->_triangles.push_back(work[j]._pTri);
-	return leaf;
-    }
+    if (size<4)
+	return CreateLeaf(tree, work, size);
 
     // Start by finding the working list's bounding box
     __m128 ssebottom(_mm_set1_ps(FLT_MAX)), ssetop(_mm_set1_ps(-FLT_MAX));
@@ -463,7 +487,6 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 
     coord bestSplit = FLT_MAX; // will indicate no split with better cost found (below)
     int bestAxis = -1;
-    int bestCountLeft = 0, bestCountRight = 0;
 
     // Try all different axis
     for (int testAxis=0; testAxis<3; testAxis++) {
@@ -571,25 +594,17 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 		minCost = totalCost;
 		bestSplit = testSplit;
 		bestAxis = axis;
-		bestCountLeft = countLeft;
-		bestCountRight = countRight;
 	    }
 	}
     }
 
     // We found no split to improve the cost, create a BVH leaf
-    if (bestAxis == -1) {
-	BVHLeaf *leaf = new BVHLeaf;
-	for(int j=0; j<size; j++)
-	    leaf->_triangles.push_back(work[j]._pTri);
-	return leaf;
-    }
-
-    // Create a BVH inner node, split with the optimal value we found above
-    BBoxEntries left, right;
-    left  = (BBoxTmp*)_mm_malloc(bestCountLeft*sizeof(BBoxTmp), 16);
-    right = (BBoxTmp*)_mm_malloc(bestCountRight*sizeof(BBoxTmp), 16);
+    if (bestAxis == -1)
+	return CreateLeaf(tree, work, size);
 
+    // Create a BVH inner node, split with the optimal value we found above.
+    // The left entries are compacted at the start of 'work', the right ones
+    // are gathered in 'scratch' and then copied after them (keeping the order).
     int countLeft=0, countRight=0;
     __m128 lbottom(_mm_set1_ps(FLT_MAX)), ltop(_mm_set1_ps(-FLT_MAX));
     __m128 rbottom(_mm_set1_ps(FLT_MAX)), rtop(_mm_set1_ps(-FLT_MAX));
@@ -617,7 +632,7 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 	    #endif
 	    lbottom = _mm_min_ps(lbottom, v._bottom);
 	    ltop = _mm_max_ps(ltop, v._top);
-	    left[countLeft++] = v;
+	    work[countLeft++] = v;
 	} else {
 	    #ifdef DEBUG_LOG_BVH
 	    SSETOVECTOR3(dbb, v._bottom)
@@ -630,16 +645,17 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 	    #endif
 	    rbottom = _mm_min_ps(rbottom, v._bottom);
 	    rtop = _mm_max_ps(rtop, v._top);
-	    right[countRight++] = v;
+	    scratch[countRight++] = v;
 	}
     }
+    copy(scratch, scratch + countRight, work + countLeft);
 
     SSETOVECTOR3(vlBottom, lbottom)
     SSETOVECTOR3(vlTop, ltop)
     SSETOVECTOR3(vrBottom, rbottom)
     SSETOVECTOR3(vrTop, rtop)
 
-    BVHInner *inner = new BVHInner;
+    BVHInner *inner = tree._arena.New<BVHInner>();
     #ifdef PROGRESS_REPORT
     if ((PRINT_REPORT_EVERY&g_reportCounter++) == 0) {
 	printf("\b\b\b%2d%%", int(pct+3.f*pctSpan)); // Update progress indicator
@@ -649,7 +665,7 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 	SDL_WM_SetCaption(caption.str().c_str(), caption.str().c_str());
     }
     #endif
-    inner->_left = Recurse(countLeft, left, REPORTPRM(pct+3.f*pctSpan) depth+1);
+    inner->_left = Recurse(tree, countLeft, work, scratch, REPORTPRM(pct+3.f*pctSpan) depth+1);
     inner->_left->_bottom = vlBottom;
     inner->_left->_top = vlTop;
     #ifdef PROGRESS_REPORT
@@ -661,7 +677,7 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
 	SDL_WM_SetCaption(caption.str().c_str(), caption.str().c_str());
     }
     #endif
-    inner->_right = Recurse(countRight, right, REPORTPRM(pct+6.f*pctSpan) depth+1);
+    inner->_right = Recurse(tree, countRight, work + countLeft, scratch, REPORTPRM(pct+6.f*pctSpan) depth+1);
     inner->_right->_bottom = vrBottom;
     inner->_right->_top = vrTop;
 
@@ -696,16 +712,15 @@ BVHNode *Recurse(int size, BBoxEntries& work, REPORTPRM(float pct=0.) int depth=
     }
     #endif
 
-    _mm_free(left);
-    _mm_free(right);
     return inner;
 }
 
-BVHNode *CreateBVH(const Scene *pScene)
+BVHTree *CreateBVH(const Scene *pScene)
 {
     __m128 hlp;
 
     BBoxEntries work = (BBoxTmp*)_mm_malloc(pScene->_triangles.size()*sizeof(BBoxTmp), 16);
+    BBoxEntries scratch = (BBoxTmp*)_mm_malloc(pScene->_triangles.size()*sizeof(BBoxTmp), 16);
     __m128 bottom(_mm_set1_ps(FLT_MAX)), top(_mm_set1_ps(-FLT_MAX));
 
     ASSERT_OR_DIE(pScene->_triangles.size());
@@ -715,11 +730,11 @@ BVHNode *CreateBVH(const Scene *pScene)
 	const Triangle& triangle = pScene->_triangles[j];
 
 	BBoxTmp b;
-	b._pTri = &triangle;
+	b._triIdx = j;
 
-	const Vertex *p1 = triangle._vertexA;
-	const Vertex *p2 = triangle._vertexB;
-	const Vertex *p3 = triangle._vertexC;
+	const Vertex *p1 = &pScene->_vertices[triangle._idxA];
+	const Vertex *p2 = &pScene->_vertices[triangle._idxB];
+	const Vertex *p3 = &pScene->_vertices[triangle._idxC];
 	b._bottom = _mm_min_ps(b._bottom, _mm_set_ps(p1->_x, p1->_y, p1->_z, 0.));
 	b._bottom = _mm_min_ps(b._bottom, _mm_set_ps(p2->_x, p2->_y, p2->_z, 0.));
 	b._bottom = _mm_min_ps(b._bottom, _mm_set_ps(p3->_x, p3->_y, p3->_z, 0.));
@@ -748,7 +763,9 @@ BVHNode *CreateBVH(const Scene *pScene)
     // ...and pass it to the recursive function that creates the SAH AABB BVH
     // (Surface Area Heuristic, Axis-Aligned Bounding Boxes, Bounding Volume Hierarchy)
     printf("Creating Bounding Volume Hierarchy data...    "); fflush(stdout);
-    BVHNode *root = Recurse(pScene->_triangles.size(), work);
+    BVHTree *pTree = new BVHTree;
+    pTree->_triIndices.reserve(pScene->_triangles.size());
+    BVHNode *root = Recurse(*pTree, pScene->_triangles.size(), work, scratch);
     printf("\b\b\b100%%\n");
 
     SSETOVECTOR3(b, bottom)
@@ -756,9 +773,11 @@ BVHNode *CreateBVH(const Scene *pScene)
 
     root->_bottom = b;
     root->_top = t;
+    pTree->_root = root;
 
+    _mm_free(scratch);
     _mm_free(work);
-    return root;
+    return pTree;
 }
 
 #endif
@@ -20,9 +20,15 @@
 #ifndef __BVH_H__
 #define __BVH_H__
 
-#include <list>
+#include <new>
+#include <vector>
+#include <cstdlib>
 
 #include "Types.h"
+#include "Defines.h"
+
+// The BVH while it is being built. Once it is copied in the cache-friendly
+// form (see Scene::CreateCFBVH) it is not needed anymore.
 
 struct BVHNode {
     Vector3 _bottom;
@@ -36,19 +42,63 @@ struct BVHInner : BVHNode {
     virtual bool IsLeaf() { return false; }
 };
 
-struct Triangle;
 struct BVHLeaf : BVHNode {
-    std::list<const Triangle*> _triangles;
+    // The leaf's triangles: _count entries of BVHTree::_triIndices, from _start
+    unsigned _start;
+    unsigned _count;
     virtual bool IsLeaf() { return true; }
 };
 
+// Size of the blocks the BVHArena allocates nodes from
+#define BVH_ARENA_BLOCK (1<<20)
+
+// Bump allocator for the nodes of a BVH under construction: they are carved
+// out of big blocks, and released all together - block by block, without
+// visiting the nodes (which have nothing to destruct).
+class BVHArena {
+    std::vector<char*> _blocks;
+    size_t _used;
+
+    BVHArena(const BVHArena&);
+    BVHArena& operator=(const BVHArena&);
+public:
+    BVHArena():_used(BVH_ARENA_BLOCK) {}
+    ~BVHArena() {
+	for(unsigned i=0; i<_blocks.size(); i++)
+	    free(_blocks[i]);
+    }
+
+    template <class T>
+    T *New() {
+	size_t bytes = (sizeof(T) + 15) & ~size_t(15);
+	if (_used + bytes > BVH_ARENA_BLOCK) {
+	    _blocks.push_back((char*) malloc(BVH_ARENA_BLOCK));
+	    ASSERT_OR_DIE(_blocks.back());
+	    _used = 0;
+	}
+	void *p = _blocks.back() + _used;
+	_used += bytes;
+	return new(p) T;
+    }
+
+    size_t Bytes() const { return _blocks.size()*size_t(BVH_ARENA_BLOCK); }
+};
+
+struct BVHTree {
+    BVHNode *_root;
+    // Indexes in Scene::_triangles. The leaves own consecutive ranges of it,
+    // in the order a depth-first (left child first) walk visits them
+    std::vector<int> _triIndices;
+    BVHArena _arena;
+
+    BVHTree():_root(NULL) {}
+};
+
 struct Scene;
-BVHNode *CreateBVH(const Scene *pScene);
+BVHTree *CreateBVH(const Scene *pScene);
 
 // More cache-able form of BVHNodes: 32 bytes
 
-typedef const Triangle *PtrTriangle;
-
 struct CacheFriendlyBVHNode {
     Vector3 _bottom;
     Vector3 _top;
@@ -64,6 +114,88 @@ struct CacheFriendlyBVHNode {
     } u;
 };
 
+// Even smaller form, used when BVH_QUANTIZED is defined (see Defines.h): 16 bytes.
+//
+// An inner node doesn't store its own box; it stores the boxes of its two children,
+// quantized to 8 bits per plane relative to its own (decoded) box. The traversal
+// starts from the (full precision) root box, and decodes the children boxes
+// in registers, on its way down. The two children of an inner node are stored
+// next to each other, so only the index of the left one is needed.
+
+struct QuantizedBVHNode {
+    union {
+	struct {
+	    unsigned char _bottom[2][3]; // [left/right child][x/y/z]
+	    unsigned char _top[2][3];
+	} inner;
+	struct {
+	    unsigned _startIndexInTriIndexList;
+	    unsigned _unused[2];
+	} leaf;
+    } u;
+    // Inner nodes: index of the left child (the right one is at _idxLeftOrCount+1)
+    // Leaves: number of triangles, with the top-most bit set
+    unsigned _idxLeftOrCount;
+};
+
+// Decodes one quantized coordinate q of the parent range [bottom,top].
+// The ends are returned exactly (bottom + scale*255 may round below top),
+// so a child that touches its parent's box never ends up outside it.
+inline coord DecodeQuantizedCoord(coord bottom, coord top, coord scale, unsigned q)
+{
+    if (q == 0) return bottom;
+    if (q == 255) return top;
+    return bottom + scale*q;
+}
+
+// Decodes the box of child 'c' (0:left, 1:right) of a quantized inner node,
+// whose own box is (bottom,top). Used both when building and when traversing,
+// so that both sides see exactly the same floating point boxes.
+inline void DecodeQuantizedChild(
+    const QuantizedBVHNode& node, int c,
+    const Vector3& bottom, const Vector3& top,
+    Vector3& childBottom, Vector3& childTop)
+{
+    for(int k=0; k<3; k++) {
+	coord scale = (top._v[k] - bottom._v[k])*(1.f/255.f);
+	childBottom._v[k] = DecodeQuantizedCoord(bottom._v[k], top._v[k], scale, node.u.inner._bottom[c][k]);
+	childTop._v[k]    = DecodeQuantizedCoord(bottom._v[k], top._v[k], scale, node.u.inner._top[c][k]);
+    }
+}
+
+// Marks the absence of a node, e.g. the parent of the root (see Scene::_pBVHParents)
+#define BVH_NO_NODE 0xFFFFFFFFu
+
+// Fixed-size stack used by the BVH traversals, that never overflows: when full,
+// a push overwrites the oldest entry (the one closest to the root) and _overflowed
+// is set. When such a stack empties, the traversal continues via the parent links
+// of the nodes, from the last node it visited (see BVH_IntersectTriangles).
+// No heap allocation, and no limit on the depth of the BVH.
+template <class T>
+struct BVHShortStack {
+    T _entries[BVH_STACK_SIZE];
+    unsigned _top;
+    unsigned _count;
+    bool _overflowed;
+
+    BVHShortStack():_top(0), _count(0), _overflowed(false) {}
+
+    bool empty() const { return !_count; }
+
+    void push(const T& entry) {
+	_entries[_top++ & (BVH_STACK_SIZE-1)] = entry;
+	if (_count == BVH_STACK_SIZE)
+	    _overflowed = true;
+	else
+	    _count++;
+    }
+
+    const T& pop() {
+	_count--;
+	return _entries[--_top & (BVH_STACK_SIZE-1)];
+    }
+};
+
 void CreateCFBVH(Scene *);
 
 #endif
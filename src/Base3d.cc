@@ -24,30 +24,36 @@
 #include "3d.h"
 #include "Screen.h"
 
+Material::Material(unsigned r, unsigned g, unsigned b, bool twoSided)
+    :
+    _colorf((float)r,(float)g,(float)b), // For use in all other cases
+    _color(Screen::MapRGB(r,g,b)), // For use with DrawPixel
+    _twoSided(twoSided)
+{}
+
 Triangle::Triangle(
-    const Vertex *vertexA,
-    const Vertex *vertexB,
-    const Vertex *vertexC,
-    unsigned r, unsigned g, unsigned b,
-    bool twosided, bool triNormalProvided, Vector3 triNormal)
+    const std::vector<Vertex>& vertices,
+    unsigned idxA, unsigned idxB, unsigned idxC,
+    unsigned material,
+    bool triNormalProvided, Vector3 triNormal)
     :
-    _vertexA(vertexA), _vertexB(vertexB), _vertexC(vertexC),
+    _idxA(idxA), _idxB(idxB), _idxC(idxC),
+    _material(material)
+{
+    const Vertex& vertexA = vertices[idxA];
+    const Vertex& vertexB = vertices[idxB];
+    const Vertex& vertexC = vertices[idxC];
 
-    _center((vertexA->_x + vertexB->_x + vertexC->_x)/3.0f,
-	    (vertexA->_y + vertexB->_y + vertexC->_y)/3.0f,
-	    (vertexA->_z + vertexB->_z + vertexC->_z)/3.0f),
+    _center = Vector3(
+	(vertexA._x + vertexB._x + vertexC._x)/3.0f,
+	(vertexA._y + vertexB._y + vertexC._y)/3.0f,
+	(vertexA._z + vertexB._z + vertexC._z)/3.0f);
 
-    _colorf((float)r,(float)g,(float)b), // For use in all other cases
-    _color(SDL_MapRGB(Screen::_surface->format, r,g,b)), // For use with DrawPixel
-    _twoSided(twosided),
-    _bottom(FLT_MAX,FLT_MAX,FLT_MAX), // Will be updated after centering in Loader
-    _top(-FLT_MAX,-FLT_MAX,-FLT_MAX) // Will be updated after centering in Loader
-{
     if (!triNormalProvided) {
 	_normal = Vector3(
-	    (vertexA->_normal._x + vertexB->_normal._x + vertexC->_normal._x)/3.0f,
-	    (vertexA->_normal._y + vertexB->_normal._y + vertexC->_normal._y)/3.0f,
-	    (vertexA->_normal._z + vertexB->_normal._z + vertexC->_normal._z)/3.0f);
+	    (vertexA._normal._x + vertexB._normal._x + vertexC._normal._x)/3.0f,
+	    (vertexA._normal._y + vertexB._normal._y + vertexC._normal._y)/3.0f,
+	    (vertexA._normal._z + vertexB._normal._z + vertexC._normal._z)/3.0f);
 	_normal.normalize();
     } else {
 	_normal = triNormal;
@@ -24,45 +24,74 @@
 
 #include "Types.h"
 
+// Kept small, since all the rendering modes go through the vertices:
+// position and normal only. The (8-bit) ambient occlusion coefficients
+// are in their own array, Scene::_ambientOcclusion.
 struct Vertex : public Vector3
 {
     Vector3 _normal;
-    unsigned _ambientOcclusionCoeff;
 
-    Vertex(coord x, coord y, coord z, coord nx, coord ny, coord nz, unsigned char amb=60)
+    Vertex(coord x, coord y, coord z, coord nx, coord ny, coord nz)
 	:
-	Vector3(x,y,z), _normal(nx, ny, nz), _ambientOcclusionCoeff(amb)
+	Vector3(x,y,z), _normal(nx, ny, nz)
     {
 	// assert |nx,ny,nz| = 1
     }
+    // For loaders that fill pre-sized arrays (e.g. in parallel)
+    Vertex() {}
 };
 
-struct Triangle
-{
-    const Vertex *_vertexA, *_vertexB, *_vertexC;
-    Vector3 _center;
-    Vector3 _normal;
+// Ambient occlusion coefficient of vertices whose files don't provide one
+#define DEFAULT_AMBIENT_OCCLUSION 60
 
-    // Color: 
+// What the triangles share, when they look the same
+// (see Scene::_materials - they refer to these via their index)
+struct Material
+{
+    // Color:
     Pixel _colorf;
     // precomputed for SDL surface
     Uint32 _color;
 
-    // Should we backface cull this triangle?
+    // Should we backface cull the triangles?
     bool _twoSided;
 
-    // Raytracing intersection pre-computed cache:
-    coord _d, _d1, _d2, _d3;
-    Vector3 _e1, _e2, _e3;
-    Vector3 _bottom;
-    Vector3 _top;
+    Material(unsigned r, unsigned g, unsigned b, bool twoSided);
+};
+
+// Only what the rasterizers need per triangle - 40 bytes.
+// The raytracer's data are in Scene::_triangleIntersectionData.
+struct Triangle
+{
+    // Indexes of the vertices in Scene::_vertices
+    unsigned _idxA, _idxB, _idxC;
+    // Index in Scene::_materials
+    unsigned _material;
+    Vector3 _center;
+    Vector3 _normal;
 
     Triangle(
-	const Vertex *vertexA,
-	const Vertex *vertexB,
-	const Vertex *vertexC,
-	unsigned r, unsigned g, unsigned b,
-	bool twosided = false, bool triNormalProvided=false, Vector3 triNormal=Vector3(0.,0.,0.) );
+	const std::vector<Vertex>& vertices,
+	unsigned idxA, unsigned idxB, unsigned idxC,
+	unsigned material,
+	bool triNormalProvided=false, Vector3 triNormal=Vector3(0.,0.,0.) );
+    // For loaders that fill pre-sized arrays (e.g. in parallel)
+    Triangle() {}
+};
+
+// Raytracing intersection pre-computed cache - 64 bytes, a cache line.
+// The triangle's plane is dot(_normal, p) = _d, and its edges' planes
+// (perpendicular to it, facing inwards) dot(_e1, p) = _d1 etc.
+struct TriangleIntersectionData
+{
+    Vector3 _normal;
+    coord _d;
+    Vector3 _e1;
+    coord _d1;
+    Vector3 _e2;
+    coord _d2;
+    Vector3 _e3;
+    coord _d3;
 };
 
 #endif
@@ -0,0 +1,298 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+#include "3d.h"
+#include "Clock.h"
+#include "CullingHierarchy.h"
+
+///////////////////////////////////////////////
+// Creation of the culling hierarchy
+///////////////////////////////////////////////
+
+// Spreads the lower 10 bits of v, so that there are two zero bits between each
+static unsigned SpreadBits(unsigned v)
+{
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v <<  8)) & 0x0300F00F;
+    v = (v | (v <<  4)) & 0x030C30C3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+// 30-bit Morton code of a point, in the box [bottom, bottom+1/invExtent]
+static unsigned MortonCode(const Vector3& p, const Vector3& bottom, const Vector3& invExtent)
+{
+    unsigned code = 0;
+    for(int k=0; k<3; k++) {
+	coord t = (p._v[k] - bottom._v[k])*invExtent._v[k];
+	int q = std::max(0, std::min(1023, int(t*1023.f)));
+	code |= SpreadBits(q) << (2-k);
+    }
+    return code;
+}
+
+// Computes bounding sphere and normal cone of the triangles [start, end)
+static void ComputeBounds(const Scene& scene, unsigned start, unsigned end, ClusterBounds& bounds)
+{
+    // Bounding box (and from it, sphere) and average normal...
+    Vector3 bottom(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vector3 top(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Vector3 sumOfNormals(0.f, 0.f, 0.f);
+    bool twoSided = false;
+    for(unsigned i=start; i<end; i++) {
+	const Triangle& triangle = scene._triangles[i];
+	const Vertex *corners[3] = {
+	    &scene._vertices[triangle._idxA], &scene._vertices[triangle._idxB], &scene._vertices[triangle._idxC] };
+	for(int c=0; c<3; c++) {
+	    bottom.assignSmaller(*corners[c]);
+	    top.assignBigger(*corners[c]);
+	}
+	sumOfNormals += triangle._normal;
+	twoSided = twoSided || scene._materials[triangle._material]._twoSided;
+    }
+
+    // ...and the normal cone around it. The axis must be of unit length
+    // even when the cone is not used: a _coneSin of 2 only disables the
+    // culling test in CullNode for those.
+    coord coneSin = 2.f;
+    Vector3 axis = sumOfNormals;
+    if (axis.lengthsq() > 0.f) {
+	axis.normalize();
+	if (!twoSided) {
+	    coord minCos = 1.f;
+	    for(unsigned i=start; i<end; i++)
+		minCos = std::min(minCos, dot(scene._triangles[i]._normal, axis));
+	    if (minCos > 0.f)
+		coneSin = sqrt(std::max(0.f, 1.f - minCos*minCos));
+	}
+    }
+
+    bounds._center = bottom;
+    bounds._center += top;
+    bounds._center *= 0.5f;
+    bounds._radius = distance(bottom, top)*0.5f;
+    bounds._coneAxis = axis;
+    bounds._coneSin = coneSin;
+}
+
+// Creates the node for clusters [first, first+count) (and its children),
+// returning its index in _cullingNodes.
+static unsigned BuildCullingNode(Scene& scene, unsigned first, unsigned count)
+{
+    unsigned idx = scene._cullingNodes.size();
+    scene._cullingNodes.push_back(CullingNode());
+    unsigned idxRight = 0;
+    if (count > 1) {
+	unsigned half = count/2;
+	BuildCullingNode(scene, first, half);
+	idxRight = BuildCullingNode(scene, first + half, count - half);
+    }
+
+    CullingNode& node = scene._cullingNodes[idx];
+    if (count == 1) {
+	static_cast<ClusterBounds&>(node) = scene._clusters[first];
+    } else {
+	const TriangleCluster& last = scene._clusters[first + count - 1];
+	ComputeBounds(scene, scene._clusters[first]._start, last._start + last._count, node);
+    }
+    node._firstCluster = first;
+    node._clusterCount = count;
+    node._idxRight = idxRight;
+    return idx;
+}
+
+// Marks triangles that don't belong to (and are not queued for) any cluster
+#define NOT_ASSIGNED 0xFFFFFFFFu
+
+void Scene::CreateClusters()
+{
+    _clusters.clear();
+    _cullingNodes.clear();
+    if (_triangles.empty())
+	return;
+
+    Clock me;
+    unsigned total = _triangles.size();
+
+    // Morton order of the triangles, by their centers
+    Vector3 bottom(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vector3 top(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for(unsigned i=0; i<total; i++) {
+	bottom.assignSmaller(_triangles[i]._center);
+	top.assignBigger(_triangles[i]._center);
+    }
+    Vector3 invExtent;
+    for(int k=0; k<3; k++)
+	invExtent._v[k] = (top._v[k] > bottom._v[k]) ? 1.f/(top._v[k] - bottom._v[k]) : 0.f;
+    std::vector<std::pair<unsigned, int> > sorted(total);
+    for(unsigned i=0; i<total; i++)
+	sorted[i] = std::make_pair(MortonCode(_triangles[i]._center, bottom, invExtent), int(i));
+    std::sort(sorted.begin(), sorted.end());
+
+    // The triangles that use each vertex (to grow the clusters over them)
+    std::vector<unsigned> firstOfVertex;
+    std::vector<int> trianglesOfVertex;
+    BuildVertexTriangles(firstOfVertex, trianglesOfVertex);
+
+    // Grow the clusters, breadth-first over shared vertices
+    // ('order' collects the triangles, cluster after cluster)
+    std::vector<unsigned> clusterOf(total, NOT_ASSIGNED);
+    std::vector<int> order;
+    std::vector<int> queue;
+    unsigned nextSeed = 0;
+    order.reserve(total);
+    _clusters.reserve(total/CLUSTER_TRIANGLES + 1);
+    while(order.size() < total) {
+	unsigned idxCluster = _clusters.size();
+	TriangleCluster cluster = TriangleCluster();
+	cluster._start = order.size();
+	cluster._count = 0;
+	queue.clear();
+	unsigned head = 0;
+	while(cluster._count < CLUSTER_TRIANGLES) {
+	    int t;
+	    if (head < queue.size())
+		t = queue[head++];
+	    else {
+		// No (more) neighbours - continue from the next unassigned
+		// triangle in Morton order, i.e. a nearby one
+		while(nextSeed < total && clusterOf[sorted[nextSeed].second] != NOT_ASSIGNED)
+		    nextSeed++;
+		if (nextSeed == total)
+		    break;
+		t = sorted[nextSeed].second;
+		clusterOf[t] = idxCluster;
+	    }
+	    order.push_back(t);
+	    cluster._count++;
+
+	    unsigned corners[3] = { _triangles[t]._idxA, _triangles[t]._idxB, _triangles[t]._idxC };
+	    for(int c=0; c<3; c++) {
+		unsigned v = corners[c];
+		for(unsigned k=firstOfVertex[v]; k<firstOfVertex[v+1]; k++) {
+		    int neighbour = trianglesOfVertex[k];
+		    if (clusterOf[neighbour] == NOT_ASSIGNED) {
+			clusterOf[neighbour] = idxCluster;
+			queue.push_back(neighbour);
+		    }
+		}
+	    }
+	}
+	// The queued triangles that didn't fit, go back to the pool
+	for(unsigned q=head; q<queue.size(); q++)
+	    clusterOf[queue[q]] = NOT_ASSIGNED;
+	_clusters.push_back(cluster);
+    }
+
+    // Store the triangles in that order, so that each cluster is a contiguous
+    // range of _triangles (the rasterizers then walk memory sequentially)
+    {
+	std::vector<Triangle> reordered;
+	reordered.reserve(total);
+	for(unsigned i=0; i<total; i++)
+	    reordered.push_back(_triangles[order[i]]);
+	_triangles.swap(reordered);
+    }
+    for(unsigned i=0; i<_clusters.size(); i++)
+	ComputeBounds(*this, _clusters[i]._start, _clusters[i]._start + _clusters[i]._count, _clusters[i]);
+
+    // Finally, the culling hierarchy over them
+    _cullingNodes.reserve(2*_clusters.size());
+    BuildCullingNode(*this, 0, _clusters.size());
+
+    printf("Creating %u clusters (and %u culling nodes) took %.2f seconds\n",
+	unsigned(_clusters.size()), unsigned(_cullingNodes.size()), me.readMS()/1000.);
+}
+
+///////////////////////////////////////////////
+// Culling, per frame
+///////////////////////////////////////////////
+
+ViewFrustum::ViewFrustum(
+    const Vector3& eye, const Matrix3& mv, coord tanX, coord tanY, coord clipDistance)
+    :
+    _eye(eye),
+    _mv(mv),
+    _clipDistance(clipDistance)
+{
+    _planes[0] = Vector3( 1.f,  0.f, -tanX);
+    _planes[1] = Vector3(-1.f,  0.f, -tanX);
+    _planes[2] = Vector3( 0.f,  1.f, -tanY);
+    _planes[3] = Vector3( 0.f, -1.f, -tanY);
+    for(int i=0; i<4; i++)
+	_planes[i].normalize();
+}
+
+static void CullNode(
+    const Scene& scene, const ViewFrustum& frustum, bool cullBackfaces,
+    unsigned idx, bool inside, std::vector<unsigned>& visible)
+{
+    const CullingNode& node = scene._cullingNodes[idx];
+
+    // Is the node outside the view frustum?
+    // (no need to check, if its parent was completely inside)
+    if (!inside) {
+	Vector3 center = Transform(node._center, frustum._eye, frustum._mv);
+	coord r = node._radius;
+	if (center._z + r < frustum._clipDistance)
+	    return;
+	inside = center._z - r > frustum._clipDistance;
+	for(int i=0; i<4; i++) {
+	    coord d = dot(frustum._planes[i], center);
+	    if (d > r)
+		return;
+	    inside = inside && d < -r;
+	}
+    }
+
+    // Do all its triangles face away from the eye? For all points p
+    // in the bounding sphere and normals n in the cone, dot(eye-p, n)<0
+    // when the angle between (eye-center) and the cone axis is more
+    // than 90 degrees plus the cone angle (plus the sphere's spread).
+    if (cullBackfaces) {
+	Vector3 toEye = frustum._eye;
+	toEye -= node._center;
+	coord distanceToEye = toEye.length();
+	if (dot(toEye, node._coneAxis) < -(node._coneSin*(distanceToEye + node._radius) + node._radius))
+	    return;
+    }
+
+    if (!node._idxRight) {
+	visible.push_back(node._firstCluster);
+	return;
+    }
+    CullNode(scene, frustum, cullBackfaces, idx+1, inside, visible);
+    CullNode(scene, frustum, cullBackfaces, node._idxRight, inside, visible);
+}
+
+void Scene::CullClusters(
+    const ViewFrustum& frustum, bool cullBackfaces, std::vector<unsigned>& visible) const
+{
+    visible.clear();
+    if (_cullingNodes.empty())
+	return;
+    CullNode(*this, frustum, cullBackfaces, 0, false, visible);
+}
@@ -0,0 +1,86 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __cullinghierarchy_h__
+#define __cullinghierarchy_h__
+
+#include "Types.h"
+#include "Algebra.h"
+
+// Triangle clusters, and the culling hierarchy built on top of them
+// (see Scene::CreateClusters, called at the end of Scene::load).
+//
+// The mesh is partitioned in small clusters of up to CLUSTER_TRIANGLES
+// triangles each: a cluster starts from the first unassigned triangle
+// (in Morton order of the triangles' centers), and grows over the triangles
+// that share vertices with it, breadth-first. Triangle soups (no shared
+// vertices) fall back to the next triangles in Morton order, so clusters
+// are spatially compact either way. Each cluster gets a bounding sphere
+// and a normal cone, and the rasterizers, wireframe and shadow buffer
+// passes cull and schedule their work per cluster.
+//
+// Scene::_triangles is reordered so that each cluster is a contiguous range
+// of it. The clusters are stored in the order they were created (roughly,
+// along a Morton curve), so the culling hierarchy is simply the cluster table
+// split in halves, recursively - each node covers a contiguous range of it.
+// The raytracer's BVH would do as well, but takes far too long to build
+// for this (tens of seconds for a million triangles).
+
+// Bounds of a set of triangles
+struct ClusterBounds {
+    // Bounding sphere
+    Vector3 _center;
+    coord _radius;
+    // Normal cone: all the triangles' normals are within an angle 'a'
+    // of _coneAxis, and _coneSin = sin(a). Sets of one-sided triangles
+    // only, with a < 90 degrees, can be backface culled as a whole;
+    // for all others, _coneSin is set to 2 (i.e. never cull).
+    Vector3 _coneAxis;
+    coord _coneSin;
+};
+
+struct TriangleCluster : ClusterBounds {
+    // Range of the cluster's triangles in Scene::_triangles
+    unsigned _start;
+    unsigned _count;
+};
+
+struct CullingNode : ClusterBounds {
+    // Range of the node's clusters in Scene::_clusters
+    unsigned _firstCluster;
+    unsigned _clusterCount;
+    // Index of the right child - the left one is stored right after
+    // this node. 0 for leaves (the root is at index 0).
+    unsigned _idxRight;
+};
+
+// What is visible from an 'eye' looking down the z axis of its space
+// (i.e. the one 'mv' transforms to, after subtracting 'eye'): points
+// with |x| <= tanX*z and |y| <= tanY*z, and z >= clipDistance.
+struct ViewFrustum {
+    Vector3 _eye;
+    Matrix3 _mv;
+    // Side planes, in the eye's space (normals point outwards)
+    Vector3 _planes[4];
+    coord _clipDistance;
+
+    ViewFrustum(const Vector3& eye, const Matrix3& mv, coord tanX, coord tanY, coord clipDistance);
+};
+
+#endif
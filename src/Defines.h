@@ -22,20 +22,53 @@
 
 #define TRI_MAGIC	0xDEADBEEF
 #define TRI_MAGICNORMAL 0xDEADC0DE
+// The .bvh caches store triangle indexes, which depend on the order the
+// clusters put the triangles in (see CullingHierarchy.h), and so on the
+// vertices the triangles share (see Weld.cc) - so these change whenever
+// that order does, to rebuild the caches of older versions.
+#define BVH_MAGIC	0xB5B5C040
+#define BVH_MAGICQUANTIZED 0xB5B5C018
+// Default width and height of the lights' shadow buffers (see the -s option)
 #define SHADOWMAPSIZE	1024
-#define WIDTH		800
-#define HEIGHT		600
+
+// Size of the rendered frames, set at startup (see the -g option, in renderer.cc) -
+// and the distance of the screen from the eye, in pixels (i.e. the field of view)
+#define DEFAULT_WIDTH	800
+#define DEFAULT_HEIGHT	600
+extern int g_width, g_height;
+#define WIDTH		g_width
+#define HEIGHT		g_height
 #define SCREEN_DIST	(HEIGHT*2)
 
 #define AMBIENT		96.f
 #define DIFFUSE		128.f
 #define SPECULAR	192.f
 
-// Maximum allowed depth of BVH
-// Checked at BVH build time, no runtime crash possible, see CreateCFBVH()
+// Size of the (short) stack used in the BVH traversals - must be a power of 2.
+// Deeper BVHs are handled as well, via the parent links of the nodes
+// (see BVHShortStack in BVH.h), so this just needs to cover typical depths.
 #define BVH_STACK_SIZE 32
 
-#define TRIANGLES_PER_THREAD  50
+// Use 16-byte quantized BVH nodes instead of the 32-byte CacheFriendlyBVHNodes.
+// Halves the memory traffic of the raytracer's BVH traversal, at the cost
+// of decoding the child boxes during it (and of slightly looser boxes).
+// Pays off when the BVH doesn't fit in the CPU caches (multi-million triangles).
+//#define BVH_QUANTIZED
+
+// Instrument the raytracer: count BVH nodes visited, triangles tested and rays
+// (per pixel and per thread), print the totals of each frame, dump the counters
+// in raystats.csv/raystats.bin, and show a heatmap instead of the image.
+// See RayStatistics.h - when not defined, the counting compiles out entirely.
+//#define RAY_STATISTICS
+
+// Maximum number of triangles in the clusters the scene is split into
+// (see CullingHierarchy.h); also the unit of work of the rasterizers' threads.
+#define CLUSTER_TRIANGLES 64
+
+// Radius (in shadow buffer pixels) of the box filter that blurs the variance
+// shadow maps (see Light::PrefilterShadowBuffer) - the soft shadows of mode 8
+// with the -v option have penumbrae of about twice that.
+#define VSM_BLUR_RADIUS 2
 
 #define ASSERT_OR_DIE(x) do {                \
     if (!(x)) {                              \
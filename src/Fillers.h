@@ -139,6 +139,10 @@ struct FatPointPhongAndShadowed : FatPointPhong {};
 struct FatPointPhongAndSoftShadowed : FatPointPhongAndShadowed {
 };
 
+// Identical interpolations with FatPointPhong; difference is in LightingEquation used
+struct FatPointPhongAndVarianceShadowed : FatPointPhongAndShadowed {
+};
+
 // The Filler functions 'setup' the interpolation per triangle;
 // the signature must therefore be able to convey all the information
 // required by all rendering modes. We don't want to waste CPU cycles
@@ -175,7 +179,7 @@ void Filler(
 
 template<>
 void inline Filler(
-    const Scene& /*scene*/,
+    const Scene& scene,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
     const Triangle& triangle, const Camera&, TriangleCarrier<FatPointAmbient>& tri)
@@ -187,8 +191,8 @@ void inline Filler(
 
 #define AMBIENT_VERTEX(l, L)										\
     COMMON_VERTEX(l, L)											\
-    tri.xformed ## L ._color = triangle._colorf;							\
-    tri.xformed ## L ._color *= triangle._vertex ## L ->_ambientOcclusionCoeff/255.f;
+    tri.xformed ## L ._color = scene._materials[triangle._material]._colorf;				\
+    tri.xformed ## L ._color *= scene._ambientOcclusion[triangle._idx ## L]/255.f;
 
     AMBIENT_VERTEX(a, A)
     AMBIENT_VERTEX(b, B)
@@ -203,17 +207,15 @@ void inline Filler(
     const Scene& scene,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
-    const Triangle& triangle, const Camera& camera, TriangleCarrier<FatPointGouraud>& tri)
+    const Triangle& triangle, const Camera&, TriangleCarrier<FatPointGouraud>& tri)
 {
-    // No shadow checking
-    LightingEquation<NoShadows> compute(scene);
+    // The vertices are already lit, for this frame (see PrepareVertices in Rasterizers.cc)
+    const Pixel& color = scene._materials[triangle._material]._colorf;
 
 #define GOURAUD_VERTEX(l, L)											\
     COMMON_VERTEX(l, L)												\
-    tri.xformed ## L._color = Pixel();										\
-    Vector3 normal ## L = camera._mv.multiplyRightWith( triangle._vertex ## L->_normal);			\
-    compute.ComputePixel(											\
-	inCameraSpace ## L, normal ## L, triangle._colorf, (coord)triangle._vertex ## L->_ambientOcclusionCoeff,	\
+    LightingEquation<NoShadows>::Shade(										\
+	color, scene._vertexDiffuse[triangle._idx ## L], scene._vertexSpecular[triangle._idx ## L],		\
 	tri.xformed ## L._color);
 
     GOURAUD_VERTEX(a, A)
@@ -229,7 +231,7 @@ void inline Filler(
 // (it has to work with all TriangleCarrier<Phong...> types, so we need a template)
 
 template <class TriangleCarrier>
-void PhongSetup(TriangleCarrier& tri, const Triangle& triangle, const Camera& eye,
+void PhongSetup(TriangleCarrier& tri, const Scene& scene, const Triangle& triangle, const Camera& eye,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC)
 {
@@ -237,10 +239,10 @@ void PhongSetup(TriangleCarrier& tri, const Triangle& triangle, const Camera& ey
     COMMON_VERTEX(l, L)									    \
     tri.xformed ## L._x = inCameraSpace ## L._x/inCameraSpace ## L._z;			    \
     tri.xformed ## L._y = inCameraSpace ## L._y/inCameraSpace ## L._z;			    \
-    tri.xformed ## L._ambientOcclusionCoeff = (coord) triangle._vertex ## L->_ambientOcclusionCoeff;
+    tri.xformed ## L._ambientOcclusionCoeff = (coord) scene._ambientOcclusion[triangle._idx ## L];
 
 #define PHONG_VERTEX_2(l, L) \
-    tri.xformed ## L._normal = eye._mv.multiplyRightWith( triangle._vertex ## L->_normal );
+    tri.xformed ## L._normal = eye._mv.multiplyRightWith( scene._vertices[triangle._idx ## L]._normal );
 
     PHONG_VERTEX(a, A)
     PHONG_VERTEX(b, B)
@@ -251,7 +253,7 @@ void PhongSetup(TriangleCarrier& tri, const Triangle& triangle, const Camera& ey
     PHONG_VERTEX_2(b, B)
     PHONG_VERTEX_2(c, C)
 
-    tri.color = triangle._colorf; // Store this in the TriangleCarrier, so we can use it in LightingEquation
+    tri.color = scene._materials[triangle._material]._colorf; // Store this in the TriangleCarrier, so we can use it in LightingEquation
 }
 
 //
@@ -260,13 +262,13 @@ void PhongSetup(TriangleCarrier& tri, const Triangle& triangle, const Camera& ey
 
 template<>
 void inline Filler(
-    const Scene& /*scene*/,
+    const Scene& scene,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
     const Triangle& triangle, const Camera& eye, TriangleCarrier<FatPointPhong>& tri)
 {
     // Common setup for all 3 Phong modes (Phong, PhongShadowed, PhongSoftShadowed)
-    PhongSetup(tri,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
+    PhongSetup(tri,scene,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
 }
 
 //
@@ -275,13 +277,13 @@ void inline Filler(
 
 template<>
 void inline Filler(
-    const Scene& /*scene*/,
+    const Scene& scene,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
     const Triangle& triangle, const Camera& eye, TriangleCarrier<FatPointPhongAndShadowed>& tri)
 {
     // Same setup data as Phong (the difference is in how Plot<FatPointPhongAndShadowed> works)
-    PhongSetup(tri,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
+    PhongSetup(tri,scene,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
 }
 
 //
@@ -290,13 +292,43 @@ void inline Filler(
 
 template<>
 void inline Filler(
-    const Scene& /*scene*/,
+    const Scene& scene,
     const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
     const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
     const Triangle& triangle, const Camera& eye, TriangleCarrier<FatPointPhongAndSoftShadowed>& tri)
 {
     // Same setup data as Phong (the difference is in how Plot<FatPointPhongAndSoftShadowed> works)
-    PhongSetup(tri,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
+    PhongSetup(tri,scene,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
+}
+
+//
+// Phong, ZBuffer, Variance ShadowMaps
+//
+
+template<>
+void inline Filler(
+    const Scene& scene,
+    const coord& ax, const coord& ay, const coord& bx, const coord& by, const coord& cx, const coord& cy,
+    const Vector3& inCameraSpaceA, const Vector3& inCameraSpaceB, const Vector3& inCameraSpaceC,
+    const Triangle& triangle, const Camera& eye, TriangleCarrier<FatPointPhongAndVarianceShadowed>& tri)
+{
+    // Same setup data as Phong (the difference is in how Plot<FatPointPhongAndVarianceShadowed> works)
+    PhongSetup(tri,scene,triangle,eye,ax,ay,bx,by,cx,cy,inCameraSpaceA,inCameraSpaceB,inCameraSpaceC);
 }
 
+#ifdef SIMD_SSE2
+// The Phong modes shade the visible pixels of their spans 4 at a time
+// (see Screen::PlotSpan in Screen.cc, and LightingEquation::ComputePixels)
+#define BATCHED_SPANS(TypeOfPoint) \
+template<> \
+void Screen::PlotSpan( \
+    int y, int x, int steps, TypeOfPoint& v, const TypeOfPoint& dLR, \
+    const TriangleCarrier<TypeOfPoint>& tri, const Camera& camera);
+
+BATCHED_SPANS(FatPointPhong)
+BATCHED_SPANS(FatPointPhongAndShadowed)
+BATCHED_SPANS(FatPointPhongAndSoftShadowed)
+BATCHED_SPANS(FatPointPhongAndVarianceShadowed)
+#endif
+
 #endif
@@ -22,21 +22,13 @@
 #include <vector>
 #include <list>
 #include <fstream>
-
-#ifdef USE_OPENMP
-#include <omp.h>
-#endif
-
-#ifdef USE_TBB
-#include "tbb/blocked_range.h"
-#include "tbb/parallel_for.h"
-#endif
-
-#include <assert.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 
 #include "3d.h"
 #include "Algebra.h"
-#include "ScanConverter.h"
+#include "Parallel.h"
 
 // If you want to look at the shadowbuffer (curious, are we? :-)
 // just uncomment DUMP_SHADOWFILE below, recompile, run, and
@@ -47,118 +39,6 @@
 //
 //#define DUMP_SHADOWFILE
 
-// To cope with the requirements of TBB, OpenMP and single-threaded
-// in one single code block, we need to declare a helper class,
-// DrawSceneInShadowBuffer. TBB wants a functor to call for each thread
-// spawned from the "tbb::parallel_for" below, so DrawSceneInShadowBuffer
-// provides one.
-// We use the preprocessor to make this class do the right thing
-// for all cases... which should be simple, but it isn't :-)
-//
-// TBB:
-// the operator() will be called, with the range of indexes
-// that this thread is to work on. We simply call DrawTriangles
-// with this range, and since we are already in the scope of our
-// working thread, we allocate scanline buffers on our thread stack
-// (i.e. DrawTriangles stack space under TBB is thread-private).
-//
-// OpenMP and SingleThreaded:
-// For these, we directly call DrawTriangles(0, totalTriangles).
-// This means that when DrawTriangles runs, we are not in thread-scope (yet).
-// For SingleThreaded, we just declare stack-based containers
-// (we could have used "static", but the cost is low anyway).
-//
-// For OpenMP:
-// We use the pragma omp parallel to use many threads working on
-// the triangle drawing loop. Since thread scope starts AFTER
-// the "for" (and not before, as is the case for TBB), we need
-// thread-specific storage for our scanline buffers.
-// We use OpenMP's "private" to specify this; however, this also
-// means that OpenMP's threads get their own copies from "auto-storage"
-// (stack) and in an uninitialized state - we therefore need to
-// call .resize() on the containers.
-//    We could have called resize() before the loop and used
-// threadprivate and copyin, but GCC doesn't support these for classes
-// (it supports them only for primitives).
-
-class DrawSceneInShadowBuffer {
-    const Scene& scene;
-    Matrix3& mv;
-    Light& light;
-public:
-    DrawSceneInShadowBuffer(const Scene& s, Matrix3& m, Light& l)
-	:
-	scene(s),
-	mv(m),
-	light(l)
-    {}
-    void DrawTriangles(int iStartingTriangleIndex, int iOnePastEndingTriangleIndex) const
-    {
-	std::vector<unsigned> lines;
-	std::vector<Vector3>  left;
-	std::vector<Vector3>  right;
-#if defined(USE_OPENMP)
-	#pragma omp parallel for private(lines, left, right) schedule(dynamic,TRIANGLES_PER_THREAD)
-#endif
-	for(int j=iStartingTriangleIndex; j<iOnePastEndingTriangleIndex; j++) {
-
-	    lines.resize(SHADOWMAPSIZE);
-	    left.resize(SHADOWMAPSIZE);
-	    right.resize(SHADOWMAPSIZE);
-
-	    // Draw this triangle into the shadow buffer
-	    const Triangle& triangle = scene._triangles[j];
-/*
-	    // Only draw triangles that don't face this light (convex objects)
-	    Vector3 triToLight = *this;
-	    triToLight -= triangle._center;
-	    //triToLight.normalize();
-	    if (dot(triToLight, triangle._normal)>0)
-		continue;
-*/
-	    // Ok, this triangle is facing this light, go...
-	    Vector3 worldPointA = *triangle._vertexA;
-	    Vector3 worldPointB = *triangle._vertexB;
-	    Vector3 worldPointC = *triangle._vertexC; // so far, object space
-	    worldPointA -= light;
-	    worldPointB -= light;
-	    worldPointC -= light; // now, worldspace - light
-	    Vector3 xformedA = mv.multiplyRightWith(worldPointA);
-	    Vector3 xformedB = mv.multiplyRightWith(worldPointB);
-	    Vector3 xformedC = mv.multiplyRightWith(worldPointC); // now, lightspace
-
-	    // Rasterize the triangle in linear interpolation fashion in the shadow buffer
-
-	    // Project x,y on light's 'screen'
-	    xformedA._x = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedA._x/xformedA._z;
-	    xformedA._y = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedA._y/xformedA._z;
-	    xformedA._z  = 1.0f/xformedA._z;
-
-	    xformedB._x = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedB._x/xformedB._z;
-	    xformedB._y = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedB._y/xformedB._z;
-	    xformedB._z  = 1.0f/xformedB._z;
-
-	    xformedC._x = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedC._x/xformedC._z;
-	    xformedC._y = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2 * xformedC._y/xformedC._z;
-	    xformedC._z  = 1.0f/xformedC._z;
-
-	    if (xformedA._y<0 && xformedB._y<0 && xformedC._y<0) continue;
-	    if (xformedA._y>=SHADOWMAPSIZE &&
-		xformedB._y>=SHADOWMAPSIZE &&
-		xformedC._y>=SHADOWMAPSIZE) continue;
-
-	    light.InterpolateTriangleOnShadowBuffer(xformedA, xformedB, xformedC, &lines[0], &left[0], &right[0]);
-	}
-    }
-
-#ifdef USE_TBB
-    // TBB expects functors, and this one simply delegates to DrawTriangles
-    void operator()(const tbb::blocked_range<size_t>& r) const {
-	DrawTriangles(r.begin(), r.end());
-    }
-#endif
-};
-
 void Light::CalculatePositionInCameraSpace(const Camera& camera)
 {
     // During Phong and PhongShadowmap rendering, we interpolate
@@ -215,83 +95,292 @@ void Light::CalculateXformFromCameraToLightSpace(const Camera& eye)
     mv._row3 = eye._mv.multiplyRightWith(lightToWorldCenter);
 }
 
+///////////////////////////////////////////////
+// Fitting the shadow buffer to the scene
+///////////////////////////////////////////////
+
+// Instead of a fixed field of view (that either clips the scene, or wastes
+// most of the shadow buffer around it, depending on the light's distance),
+// the shadow buffer spans exactly the (x/z, y/z) extent of the vertices in
+// front of the light - each time the light moves.
+
+// Vertices per task, in the passes over the light space vertices
+#define FIT_BLOCK 4096
+
+// Tangent of the widest half-angle the shadow buffer covers, so that
+// vertices almost beside the light don't squeeze the rest of the scene
+// into a few shadow pixels
+#define MAX_SHADOW_TAN 2.f
+
+// The extent of the (x/z, y/z) of a block's vertices in front of the light
+// (the _screenX/_screenY of TransformedVertices::Perspective)
+class ShadowExtentOfBlock {
+    const TransformedVertices& _xformed;
+    coord *_bounds;
+public:
+    ShadowExtentOfBlock(const TransformedVertices& xformed, coord *bounds)
+	:_xformed(xformed), _bounds(bounds) {}
+
+    void operator()(int block) const {
+	unsigned start = block*FIT_BLOCK;
+	unsigned end = std::min<unsigned>(start + FIT_BLOCK, _xformed._z.size());
+	coord minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+	for(unsigned i=start; i<end; i++)
+	    if (_xformed._z[i] > 0.f) {
+		minX = std::min(minX, _xformed._screenX[i]);
+		maxX = std::max(maxX, _xformed._screenX[i]);
+		minY = std::min(minY, _xformed._screenY[i]);
+		maxY = std::max(maxY, _xformed._screenY[i]);
+	    }
+	coord *bounds = &_bounds[4*block];
+	bounds[0] = minX; bounds[1] = maxX;
+	bounds[2] = minY; bounds[3] = maxY;
+    }
+};
+
+// From (x/z, y/z) to shadow buffer pixels
+class ProjectOnShadowBuffer {
+    TransformedVertices& _xformed;
+    const TransformedVertices::Projection& _p;
+public:
+    ProjectOnShadowBuffer(TransformedVertices& xformed, const TransformedVertices::Projection& p)
+	:_xformed(xformed), _p(p) {}
+
+    void operator()(int block) const {
+	unsigned start = block*FIT_BLOCK;
+	unsigned end = std::min<unsigned>(start + FIT_BLOCK, _xformed._z.size());
+	for(unsigned i=start; i<end; i++) {
+	    coord x = _xformed._screenX[i], y = _xformed._screenY[i];
+	    _xformed._screenX[i] = _p._centerX + _p._xx*x + _p._xy*y;
+	    _xformed._screenY[i] = _p._centerY + _p._yx*x + _p._yy*y;
+	}
+    }
+};
+
+// Sets _shadowProjection, and projects _lightSpaceVertices (transformed
+// with TransformedVertices::Perspective) with it. Returns the tangents of
+// the half-angles of the light's (symmetric) frustum that contains them.
+void Light::FitShadowBufferToVertices(coord& tanX, coord& tanY)
+{
+    TransformedVertices& xformed = _lightSpaceVertices;
+    int blocks = (xformed._z.size() + FIT_BLOCK - 1)/FIT_BLOCK;
+    coord minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+    if (blocks) {
+	std::vector<coord> bounds(4*blocks);
+	ParallelFor(0, blocks, 1, ShadowExtentOfBlock(xformed, &bounds[0]));
+	for(int i=0; i<blocks; i++) {
+	    minX = std::min(minX, bounds[4*i]);
+	    maxX = std::max(maxX, bounds[4*i+1]);
+	    minY = std::min(minY, bounds[4*i+2]);
+	    maxY = std::max(maxY, bounds[4*i+3]);
+	}
+    }
+    minX = std::max(minX, -MAX_SHADOW_TAN); maxX = std::min(maxX, MAX_SHADOW_TAN);
+    minY = std::max(minY, -MAX_SHADOW_TAN); maxY = std::min(maxY, MAX_SHADOW_TAN);
+    if (minX > maxX || minY > maxY) {
+	// Nothing in front of the light
+	minX = minY = -1.f;
+	maxX = maxY = 1.f;
+    }
+    // (a single point, or line, still needs a non-empty extent)
+    const coord Margin = 1e-4f;
+    if (maxX - minX < Margin) { minX -= Margin; maxX += Margin; }
+    if (maxY - minY < Margin) { minY -= Margin; maxY += Margin; }
+
+    // The extent spans the shadow buffer, from the center of its first
+    // pixel to the center of its last one
+    TransformedVertices::Projection& p = _shadowProjection;
+    p._xx = (_shadowMapSize - 1)/(maxX - minX);
+    p._xy = 0.f;
+    p._centerX = 0.5f - p._xx*minX;
+    p._yx = 0.f;
+    p._yy = (_shadowMapSize - 1)/(maxY - minY);
+    p._centerY = 0.5f - p._yy*minY;
+    if (blocks)
+	ParallelFor(0, blocks, 1, ProjectOnShadowBuffer(xformed, p));
+
+    tanX = std::max(-minX, maxX) + Margin;
+    tanY = std::max(-minY, maxY) + Margin;
+
+    _shadowPixelTan = std::max(1.f/p._xx, 1.f/p._yy);
+}
+
+// The shadow buffer looks at the world center, and covers at most
+// MAX_SHADOW_TAN to each side - so the scene is all in it, only if its
+// bounding sphere is in front of the light and inside that cone. The lights
+// near the scene (or inside it - e.g. the ones of a lights file) are not
+// far enough for that: the parts of the scene beside them or behind them
+// would get no shadows, so they get none at all (see main).
+bool Light::CanShadowScene(const Scene& scene) const
+{
+    if (scene._cullingNodes.empty())
+	return true;
+    Vector3 toCenter = scene._cullingNodes[0]._center;
+    toCenter -= *this;
+    coord distance = toCenter.length();
+    coord radius = scene._cullingNodes[0]._radius;
+    Vector3 axis(-_x, -_y, -_z);
+    coord axisLength = axis.length();
+    if (distance <= radius || axisLength <= 0.f)
+	return false;
+    // (and right above or below the world center, the light space axes
+    // - see CalculateXformFromWorldToLightSpace - are undefined)
+    Vector3 zenith(0., 0., 1.);
+    if (cross(axis, zenith).length() < 1e-4f*axisLength)
+	return false;
+
+    // The angle between the axis and the center, plus the half-angle the
+    // sphere spans, within the (narrowest) half-angle of the shadow buffer
+    coord cosine = dot(axis, toCenter)/(axisLength*distance);
+    cosine = std::min(std::max(cosine, -1.f), 1.f);
+    return acosf(cosine) + asinf(radius/distance) < atanf(MAX_SHADOW_TAN);
+}
+
+void Light::SwapShadowBuffer(Light& other)
+{
+    std::swap(static_cast<Vector3&>(*this), static_cast<Vector3&>(other));
+    std::swap(_worldToLightSpace, other._worldToLightSpace);
+    std::swap(_shadowMapSize, other._shadowMapSize);
+    _shadowBuffer.swap(other._shadowBuffer);
+    std::swap(_shadowProjection, other._shadowProjection);
+    std::swap(_shadowPixelTan, other._shadowPixelTan);
+    _shadowMoments.swap(other._shadowMoments);
+    std::swap(_lightSpaceVertices, other._lightSpaceVertices);
+    std::swap(_shadowBufferOrigin, other._shadowBufferOrigin);
+}
+
+void Light::UpdateShadowBuffer(const Scene& scene, bool prefilter)
+{
+    if (!_shadowBuffer.empty() && !(_shadowBufferOrigin != *this))
+	return;
+    ClearShadowBuffer();
+    RenderSceneIntoShadowBuffer(scene);
+    if (prefilter)
+	PrefilterShadowBuffer();
+    _shadowBufferOrigin = *this;
+}
+
 void Light::RenderSceneIntoShadowBuffer(const Scene& scene)
 {
+    if (_shadowBuffer.empty())
+	ClearShadowBuffer();
+
     CalculateXformFromWorldToLightSpace();
 
-#ifdef USE_TBB
-    // For TBB, use the parallel_for construct.
-    // Different threads will execute for segments of the triangles' vector,
-    // calling the operator(), which in turn calls DrawTriangles for the vector's segment.
-    // We use the third parameter of parallel_for to chop the triangle list down
-    // into batches of 100 triangles - the dynamic scheduler will feed these batches
-    // to our threads, keeping them busy (just like schedule(dynamic,100) for OpenMP)
-    tbb::parallel_for(
-	tbb::blocked_range<size_t>(0, scene._triangles.size(), 100),
-	DrawSceneInShadowBuffer(scene, _worldToLightSpace, *this) );
-#else
-    // For both OpenMP and single-threaded, call the DrawTriangles member
-    // of the DrawSceneInShadowBuffer, requesting drawing of ALL triangles.
-    // For OpenMP, the appropriate pragma inside DrawTriangles will make it execute via SMP...
-    DrawSceneInShadowBuffer(scene, _worldToLightSpace, *this).DrawTriangles(0, scene._triangles.size());
-#endif
+    // Transform all vertices to light space (once, no matter how many triangles use them)
+    // and fit the shadow buffer to the part of the scene in front of the light
+    _lightSpaceVertices.Update(
+	scene._vertices, *this, _worldToLightSpace, TransformedVertices::Perspective);
+    coord tanX, tanY;
+    FitShadowBufferToVertices(tanX, tanY);
+
+    // Skip the clusters that are outside the light's view - but not the ones
+    // facing away from it, since the shadow buffer needs these, too.
+    std::vector<unsigned> visible;
+    scene.CullClusters(
+	ViewFrustum(*this, _worldToLightSpace, tanX, tanY, 0.f), false, visible);
+    if (visible.empty())
+	return;
+
+    // Draw them, in tiles (see ShadowRasterizer.cc)
+    RasterizeShadowBuffer(scene, visible);
 
 #ifdef DUMP_SHADOWFILE
     fstream test("shadow", ios::binary | ios::out);
-    for(unsigned i=0; i<SHADOWMAPSIZE; i++)
-    	test.write(reinterpret_cast<char *>(&_shadowBuffer[i][0]), SHADOWMAPSIZE*sizeof(coord));
+    for(int i=0; i<_shadowMapSize; i++)
+    	test.write(reinterpret_cast<char *>(&_shadowBuffer[i*_shadowMapSize]), _shadowMapSize*sizeof(coord));
 #endif
 }
 
-class AccessShadowPixelX {
-    const Vector3& _v;
-public:
-    AccessShadowPixelX(const Vector3& v):_v(v) {}
-    coord operator()() const { return _v._x; }
-};
+///////////////////////////////////////////////
+// Variance shadow maps (mode 8, with -v)
+///////////////////////////////////////////////
+
+// Instead of counting the occluders around each pixel (the 3x3 loop of
+// LightingEquation<SoftShadowMapping>), the variance shadow maps keep the
+// mean and the variance of the occluders' depths around each shadow pixel:
+// Chebyshev's inequality then bounds the percentage of them that are closer
+// to the light than the pixel (see LightingEquation<VarianceShadowMapping>).
+// Since averages can be blurred in advance, this is done once per update of
+// the shadow buffer, with a separable box filter (of VSM_BLUR_RADIUS) whose
+// passes work on rows in parallel - and then each pixel needs a single
+// (bilinear) fetch of the blurred moments.
+//
+// The filter only averages the shadow pixels inside the shadow buffer,
+// so the ones near its borders just use less of them.
 
-inline void Light::PlotShadowPixel(int y, const Vector3& v)
+// The empty shadow pixels are infinitely far (1/z = 0) - so they
+// don't pull the mean depth towards huge negative numbers.
+static inline coord ShadowDepth(coord invZ)
 {
-    int idx = (int) v._x;
-    if (idx>=0 && idx<(int)SHADOWMAPSIZE)
-	if (_shadowBuffer[y][idx] < v._z)
-	    _shadowBuffer[y][idx] = v._z;
+    return invZ > 0.f ? invZ : 0.f;
 }
 
-void Light::InterpolateTriangleOnShadowBuffer(
-    const Vector3& v1, const Vector3& v2, const Vector3& v3,
-    unsigned *lines,
-    Vector3 *left,
-    Vector3 *right)
-{
-    ScanConverter<Vector3,AccessShadowPixelX,SHADOWMAPSIZE>
-	scanner(lines, left, right);
-
-    scanner.ScanConvert(int(v1._y), v1, int(v2._y), v2);
-    scanner.ScanConvert(int(v2._y), v2, int(v3._y), v3);
-    scanner.ScanConvert(int(v1._y), v1, int(v3._y), v3);
-
-    // Time for linear interpolation
-    for(int y=scanner._minimum; y<=scanner._maximum; y++) {
-	if (lines[y] == 1) {
-	    PlotShadowPixel(y, left[y]);
-	} else {
-	    int x1 = (int) left[y]._x;
-	    int x2 = (int) right[y]._x;
-	    int steps = abs(x2-x1);
-	    if (!steps) {
-		PlotShadowPixel(y, left[y]);
-		PlotShadowPixel(y, right[y]);
-	    } else {
-		Vector3 start = left[y];
-		Vector3 dLR = right[y]; dLR -= start; dLR /= (coord)steps;
-		PlotShadowPixel(y, start);
-		while(steps--) {
-		    start += dLR;
-		    PlotShadowPixel(y, start);
-		}
+// Horizontal pass, from the shadow buffer to (unblurred, vertically) moments
+class BlurShadowRow {
+    const Light& _light;
+    ShadowMoments *_rows;
+public:
+    BlurShadowRow(const Light& light, ShadowMoments *rows)
+	:_light(light), _rows(rows) {}
+
+    void operator()(int y) const {
+	int size = _light._shadowMapSize;
+	const coord *depths = &_light._shadowBuffer[y*size];
+	ShadowMoments *out = &_rows[y*size];
+	for(int x=0; x<size; x++) {
+	    int from = std::max(x - VSM_BLUR_RADIUS, 0);
+	    int to = std::min(x + VSM_BLUR_RADIUS, size - 1);
+	    coord sum = 0.f, sumOfSquares = 0.f;
+	    for(int k=from; k<=to; k++) {
+		coord d = ShadowDepth(depths[k]);
+		sum += d;
+		sumOfSquares += d*d;
 	    }
+	    coord inv = 1.f/(to - from + 1);
+	    out[x]._mean = sum*inv;
+	    out[x]._meanOfSquares = sumOfSquares*inv;
 	}
     }
-}
+};
 
+// Vertical pass: each row of the result averages the rows around it
+// (all of them contiguous in memory, unlike a walk down the columns)
+class BlurShadowColumns {
+    int _size;
+    const ShadowMoments *_rows;
+    ShadowMoments *_moments;
+public:
+    BlurShadowColumns(int size, const ShadowMoments *rows, ShadowMoments *moments)
+	:_size(size), _rows(rows), _moments(moments) {}
+
+    void operator()(int y) const {
+	int from = std::max(y - VSM_BLUR_RADIUS, 0);
+	int to = std::min(y + VSM_BLUR_RADIUS, _size - 1);
+	coord inv = 1.f/(to - from + 1);
+	ShadowMoments *out = &_moments[y*_size];
+	for(int x=0; x<_size; x++)
+	    out[x]._mean = out[x]._meanOfSquares = 0.f;
+	for(int k=from; k<=to; k++) {
+	    const ShadowMoments *row = &_rows[k*_size];
+	    for(int x=0; x<_size; x++) {
+		out[x]._mean += row[x]._mean;
+		out[x]._meanOfSquares += row[x]._meanOfSquares;
+	    }
+	}
+	for(int x=0; x<_size; x++) {
+	    out[x]._mean *= inv;
+	    out[x]._meanOfSquares *= inv;
+	}
+    }
+};
+
+void Light::PrefilterShadowBuffer()
+{
+    if (_shadowBuffer.empty())
+	return;
+    std::vector<ShadowMoments> rows(_shadowBuffer.size());
+    _shadowMoments.resize(_shadowBuffer.size());
+    ParallelFor(0, _shadowMapSize, 16, BlurShadowRow(*this, &rows[0]));
+    ParallelFor(0, _shadowMapSize, 16, BlurShadowColumns(_shadowMapSize, &rows[0], &_shadowMoments[0]));
+}
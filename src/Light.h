@@ -21,44 +21,133 @@
 #define __light_h__
 
 #include <limits>
+#include <cmath>
+#include <algorithm>
 
 #include "Algebra.h"
+#include "TransformedVertices.h"
 #include <list>
+#include <vector>
 
 struct Scene;
 struct Camera;
 struct Triangle;
 
+// The depth bias of the shadow tests (see Light::ShadowThreshold), in shadow
+// pixels: a constant part, and a part scaled by the slope of the surface
+// (the tangent of its angle to the light, up to SHADOW_MAX_SLOPE) - enough
+// for the 3x3 neighbours of the soft shadows
+#define SHADOW_BIAS_TEXELS	2.f
+#define SHADOW_SLOPE_BIAS_TEXELS 2.f
+#define SHADOW_MAX_SLOPE	10.f
+
+// The first two moments of the (1/z) depths in the shadow buffer,
+// averaged around each shadow pixel (see Light::PrefilterShadowBuffer)
+struct ShadowMoments {
+    coord _mean;
+    coord _meanOfSquares;
+};
+
 struct Light : public Vector3
 {
     Matrix3 _worldToLightSpace;
     Matrix3 _cameraToLightSpace;
     Vector3 _inCameraSpace;
 
-    // Shadow buffer, used in modes 7 and 8
-    coord _shadowBuffer[SHADOWMAPSIZE][SHADOWMAPSIZE];
+    // Scales the diffuse/specular contribution of the light in the raytracer,
+    // and is used for picking lights when there are too many of them
+    // (see Scene::_lightSamplesPerHit)
+    coord _power;
+
+    // Beyond this distance the light contributes nothing - and it fades
+    // smoothly towards it (see Falloff). 0 means unlimited: only the lights
+    // loaded with the -l option have one, so that the per-pixel lighting
+    // can skip them where they don't reach (see LightClusters.h)
+    coord _range;
+
+    // Shadow buffer, used in modes 7 and 8: _shadowMapSize*_shadowMapSize
+    // 1/z values, row after row. Empty until ClearShadowBuffer is called
+    // (i.e. no shadows) - so lights that cast none don't pay for it.
+    int _shadowMapSize;
+    std::vector<coord> _shadowBuffer;
+
+    // How light space maps on the shadow buffer (fitted to the scene,
+    // every time it is rendered - see RenderSceneIntoShadowBuffer)
+    TransformedVertices::Projection _shadowProjection;
+
+    // The tangent of the angle a shadow pixel spans, from the light (of its
+    // widest side) - set with _shadowProjection
+    coord _shadowPixelTan;
+
+    // The variance shadow map, used in mode 8 with the -v option:
+    // _shadowMapSize*_shadowMapSize moments of the shadow buffer, blurred.
+    // Empty until PrefilterShadowBuffer is called (i.e. no shadows).
+    std::vector<ShadowMoments> _shadowMoments;
+
+    // The scene's vertices in light space, projected on the shadow buffer
+    TransformedVertices _lightSpaceVertices;
 
-    Light(coord x, coord y, coord z)
+    // Where the shadow buffer was rendered from (see UpdateShadowBuffer)
+    Vector3 _shadowBufferOrigin;
+
+    Light(coord x, coord y, coord z, coord power = 1.f, int shadowMapSize = SHADOWMAPSIZE)
 	:
-	Vector3(x,y,z)
+	Vector3(x,y,z),
+	_power(power),
+	_range(0.f),
+	_shadowMapSize(shadowMapSize),
+	_shadowPixelTan(0.f)
     {
-	ClearShadowBuffer();
+	_shadowProjection = TransformedVertices::Perspective;
     }
 
+    // The fraction of the light that reaches a point 'distanceSq' away from it
+    // (squared): (1-(d/range)^2)^2, which falls to 0 (with a 0 slope) at the range
+    coord Falloff(coord distanceSq) const
+    {
+	if (_range <= 0.f)
+	    return 1.f;
+	coord t = distanceSq/(_range*_range);
+	if (t >= 1.f)
+	    return 0.f;
+	return (1.f - t)*(1.f - t);
+    }
+
+    // The (1/z) depth the shadow buffer must exceed, to shadow a point at
+    // 'invZ' (its 1/z in light space) - whose normal is at an angle to the
+    // light with the given cosine. Over a shadow pixel, the surface's distance
+    // from the light changes by (distance * _shadowPixelTan * tan(angle)):
+    // the bias is a multiple of that, i.e. relative to the distance, so that
+    // it suits the lights near the scene as well as the ones far from it.
+    coord ShadowThreshold(coord invZ, coord cosine) const
+    {
+	coord sine = sqrtf(std::max(1.f - cosine*cosine, 0.f));
+	coord slope = cosine*SHADOW_MAX_SLOPE > sine ? sine/cosine : SHADOW_MAX_SLOPE;
+	return invZ*(1.f + _shadowPixelTan*(SHADOW_BIAS_TEXELS + SHADOW_SLOPE_BIAS_TEXELS*slope));
+    }
+
+    // Whether the shadow buffer can contain the whole scene (see Light.cc)
+    bool CanShadowScene(const Scene&) const;
+
     void ClearShadowBuffer()
     {
+	_shadowBuffer.resize(_shadowMapSize*_shadowMapSize);
 	// For both float and double, a "body" of 0xFE..FE is a huge negative number
-	memset(reinterpret_cast<void*>(&_shadowBuffer[0][0]), 254, sizeof(_shadowBuffer));
+	memset(reinterpret_cast<void*>(&_shadowBuffer[0]), 254, _shadowBuffer.size()*sizeof(coord));
     }
 
-    void PlotShadowPixel(int y, const Vector3& v);
-    void InterpolateTriangleOnShadowBuffer(
-	const Vector3& v1, const Vector3& v2, const Vector3& v3,
-	unsigned *lines,
-	Vector3 *left,
-	Vector3 *right);
+    // Exchanges the position and everything rendered from it (shadow buffer,
+    // moments, projection) with another light's (see ShadowRegenerator)
+    void SwapShadowBuffer(Light& other);
+
+    // Renders (and, for variance shadow maps, prefilters) the shadow buffer -
+    // unless the light hasn't moved since it was last rendered
+    void UpdateShadowBuffer(const Scene&, bool prefilter);
 
     void RenderSceneIntoShadowBuffer(const Scene&);
+    void FitShadowBufferToVertices(coord& tanX, coord& tanY);
+    void RasterizeShadowBuffer(const Scene&, const std::vector<unsigned>& visible);
+    void PrefilterShadowBuffer();
 
     void CalculatePositionInCameraSpace(const Camera& camera);
     void CalculateXformFromCameraToLightSpace(const Camera& eye);
@@ -0,0 +1,152 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <algorithm>
+
+#include "3d.h"
+#include "LightClusters.h"
+#include "Parallel.h"
+
+// The depth slices start no closer than this to the camera
+// (nothing closer is rendered anyway - see ClipPlaneDistance)
+#define LIGHT_CLUSTERS_NEAR 0.1f
+
+// The tiles covering the screen coordinates lo..hi, along an axis
+// of 'size' pixels - false if none does
+static bool TilesOf(coord lo, coord hi, int size, int& first, int& last)
+{
+    if (hi < 0.f || lo >= size)
+	return false;
+    first = std::max(int(lo), 0)/LIGHT_TILE;
+    last = std::min(int(hi), size - 1)/LIGHT_TILE;
+    return first <= last;
+}
+
+// Fills the lists of a row of tiles: counts the lights of each cluster,
+// turns the counts to (end) offsets, and then walks the lights backwards,
+// placing each one before the ones after it
+class FillLightClusterRow {
+    LightClusters& _clusters;
+public:
+    FillLightClusterRow(LightClusters& clusters)
+	:_clusters(clusters) {}
+
+    void operator()(int tileY) const {
+	const std::vector<LightClusters::Extent>& extents = _clusters._extents;
+	LightClusters::Row& row = _clusters._rows[tileY];
+	const int clusters = LIGHT_TILES_X*LIGHT_SLICES;
+
+	row._first.assign(clusters + 1, 0);
+	for(unsigned i=0; i<extents.size(); i++) {
+	    const LightClusters::Extent& e = extents[i];
+	    if (e._x0 > e._x1 || tileY < e._y0 || tileY > e._y1)
+		continue;
+	    for(int x=e._x0; x<=e._x1; x++)
+		for(int s=e._s0; s<=e._s1; s++)
+		    row._first[x*LIGHT_SLICES + s]++;
+	}
+	for(int c=1; c<clusters; c++)
+	    row._first[c] += row._first[c-1];
+	row._first[clusters] = row._first[clusters-1];
+
+	row._lights.resize(row._first[clusters]);
+	for(unsigned i=extents.size(); i-- > 0; ) {
+	    const LightClusters::Extent& e = extents[i];
+	    if (e._x0 > e._x1 || tileY < e._y0 || tileY > e._y1)
+		continue;
+	    for(int x=e._x0; x<=e._x1; x++)
+		for(int s=e._s0; s<=e._s1; s++)
+		    row._lights[--row._first[x*LIGHT_SLICES + s]] = i;
+	}
+    }
+};
+
+void LightClusters::Update(const Scene& scene, const Camera& eye)
+{
+    unsigned lightsNo = scene._lights.size();
+    _all.resize(lightsNo);
+    bool anyRange = false;
+    for(unsigned i=0; i<lightsNo; i++) {
+	_all[i] = i;
+	if (scene._lights[i]->_range > 0.f)
+	    anyRange = true;
+    }
+
+    // The depths of the scene (its bounding sphere, in camera space)
+    _clustered = false;
+    if (!anyRange || scene._cullingNodes.empty())
+	return;
+    Vector3 center = scene._cullingNodes[0]._center;
+    center -= eye;
+    center = eye._mv.multiplyRightWith(center);
+    coord radius = scene._cullingNodes[0]._radius;
+    _near = std::max(center._z - radius, LIGHT_CLUSTERS_NEAR);
+    _far = center._z + radius;
+    if (_far <= _near)
+	return;
+    _slicesPerUnit = LIGHT_SLICES/(_far - _near);
+    _clustered = true;
+
+    // The clusters each light may reach
+    _extents.resize(lightsNo);
+    for(unsigned i=0; i<lightsNo; i++) {
+	const Light& light = *scene._lights[i];
+	Extent& e = _extents[i];
+	e._x0 = e._y0 = e._s0 = 0;
+	e._x1 = LIGHT_TILES_X - 1;
+	e._y1 = LIGHT_TILES_Y - 1;
+	e._s1 = LIGHT_SLICES - 1;
+	coord r = light._range;
+	if (r <= 0.f)
+	    continue;
+
+	const Vector3& c = light._inCameraSpace;
+	if (c._z + r < _near || c._z - r >= _far) {
+	    e._x0 = 1; e._x1 = 0;
+	    continue;
+	}
+	e._s0 = std::max(int((c._z - r - _near)*_slicesPerUnit), 0);
+	e._s1 = std::min(int((c._z + r - _near)*_slicesPerUnit), LIGHT_SLICES - 1);
+
+	// Unless the sphere is all in front of the camera, it may cover any pixel
+	if (c._z - r <= LIGHT_CLUSTERS_NEAR)
+	    continue;
+
+	// The projections (x/z, y/z) of the box around the sphere are
+	// extreme at its corners - nearest or farthest ones
+	coord invNear = 1.f/(c._z - r), invFar = 1.f/(c._z + r);
+	coord loY = std::min((c._y - r)*invNear, (c._y - r)*invFar);
+	coord hiY = std::max((c._y + r)*invNear, (c._y + r)*invFar);
+	coord loX = std::min((c._x - r)*invNear, (c._x - r)*invFar);
+	coord hiX = std::max((c._x + r)*invNear, (c._x + r)*invFar);
+	// (a pixel of margin, for the rounding of LightsAt)
+	if (!TilesOf(WIDTH/2 + SCREEN_DIST*loY - 1.f, WIDTH/2 + SCREEN_DIST*hiY + 1.f,
+		WIDTH, e._x0, e._x1) ||
+	    !TilesOf(HEIGHT/2 - SCREEN_DIST*hiX - 1.f, HEIGHT/2 - SCREEN_DIST*loX + 1.f,
+		HEIGHT, e._y0, e._y1))
+	{
+	    e._x0 = 1; e._x1 = 0;
+	}
+    }
+
+    _rows.resize(LIGHT_TILES_Y);
+    ParallelFor(0, LIGHT_TILES_Y, 1, FillLightClusterRow(*this));
+}
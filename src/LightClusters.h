@@ -0,0 +1,115 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __lightclusters_h__
+#define __lightclusters_h__
+
+#include <vector>
+#include <algorithm>
+
+#include "Defines.h"
+#include "Types.h"
+
+struct Scene;
+struct Camera;
+
+// Size (in pixels) of the screen tiles, and number of depth slices per tile
+#define LIGHT_TILE	32
+#define LIGHT_SLICES	16
+
+#define LIGHT_TILES_X	((WIDTH + LIGHT_TILE - 1)/LIGHT_TILE)
+#define LIGHT_TILES_Y	((HEIGHT + LIGHT_TILE - 1)/LIGHT_TILE)
+
+// Per-frame lists of the lights that may reach each part of the view, so
+// that the lighting equation (see LightingEq.h) skips the lights whose
+// range (Light::_range) ends before the pixel it computes.
+//
+// The view is split in "clusters": screen tiles of LIGHT_TILE pixels, each
+// one cut in LIGHT_SLICES slices of equal depth, between the nearest and the
+// farthest point of the scene's bounding sphere. Each light goes in the
+// clusters its sphere of influence overlaps (conservatively: the screen
+// rectangle and depth range that contain the sphere) - and the lights without
+// a range, in all of them. Update builds the lists of each row of tiles in
+// parallel; LightsAt then finds a point's list with a projection and two
+// multiplications.
+//
+// Points outside the clusters (off-screen vertices, in the Gouraud mode)
+// just get all the lights - and so does everything, when no light has
+// a range (i.e. unless lights were loaded with the -l option).
+struct LightClusters {
+    // The lights of the clusters of a row of tiles: those of the cluster
+    // c = tileX*LIGHT_SLICES + slice are _lights[_first[c]] ... _lights[_first[c+1]-1],
+    // as indexes in Scene::_lights (in increasing order)
+    struct Row {
+	std::vector<unsigned> _first;
+	std::vector<unsigned> _lights;
+    };
+
+    // The clusters a light may reach: tiles _x0.._x1, _y0.._y1 and slices
+    // _s0.._s1 - none, if _x0 > _x1
+    struct Extent {
+	int _x0, _x1, _y0, _y1, _s0, _s1;
+    };
+
+    std::vector<Row> _rows;
+    std::vector<Extent> _extents;
+
+    // All the lights - for the points outside the clusters
+    std::vector<unsigned> _all;
+
+    // Set if any light has a range (and the scene is in front of the camera)
+    bool _clustered;
+
+    // The depths the slices span (in camera space), and slices per unit of depth
+    coord _near, _far;
+    coord _slicesPerUnit;
+
+    LightClusters()
+	:
+	_clustered(false),
+	_near(0.f), _far(0.f),
+	_slicesPerUnit(0.f)
+	{}
+
+    // Rebuilds the lists - for the lights' current Light::_inCameraSpace
+    void Update(const Scene&, const Camera&);
+
+    // The lights that may reach a point (in camera space): *begin ... *(end-1)
+    void LightsAt(const Vector3& inCameraSpace, const unsigned *& begin, const unsigned *& end) const
+    {
+	if (_clustered && inCameraSpace._z >= _near && inCameraSpace._z < _far) {
+	    coord invZ = 1.f/inCameraSpace._z;
+	    coord x = WIDTH/2 + SCREEN_DIST*inCameraSpace._y*invZ;
+	    coord y = HEIGHT/2 - SCREEN_DIST*inCameraSpace._x*invZ;
+	    if (x >= 0.f && x < WIDTH && y >= 0.f && y < HEIGHT) {
+		int slice = std::min(int((inCameraSpace._z - _near)*_slicesPerUnit), LIGHT_SLICES-1);
+		const Row& row = _rows[int(y)/LIGHT_TILE];
+		int c = (int(x)/LIGHT_TILE)*LIGHT_SLICES + slice;
+		const unsigned *lights = row._lights.empty() ? NULL : &row._lights[0];
+		begin = lights + row._first[c];
+		end = lights + row._first[c+1];
+		return;
+	    }
+	}
+	begin = _all.empty() ? NULL : &_all[0];
+	end = begin + _all.size();
+    }
+};
+
+#endif
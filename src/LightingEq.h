@@ -21,6 +21,13 @@
 #define __LIGHTING_H__
 
 #include <assert.h>
+#include <float.h>
+
+#include <algorithm>
+
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "Defines.h"
 #include "Types.h"
@@ -29,9 +36,51 @@
 enum LightingMode {
     NoShadows,
     ShadowMapping,
-    SoftShadowMapping
+    SoftShadowMapping,
+    VarianceShadowMapping
+};
+
+// For VarianceShadowMapping: the variance of the depths is taken to be at
+// least VSM_MIN_VARIANCE (so that flat surfaces don't shadow themselves),
+// and percentages of light below VSM_BLEEDING_CUTOFF become darkness.
+#define VSM_MIN_VARIANCE	1e-7f
+#define VSM_BLEEDING_CUTOFF	0.2f
+
+#ifdef SIMD_SSE2
+// Up to 4 pixels of the same triangle, to shade at once - one per SSE lane
+// (see LightingEquation::ComputePixels, and Screen::PlotSpan in Screen.cc).
+// They are stored as the Phong FatPoints interpolate them: camera space
+// (x/z, y/z, 1/z), the (not normalized) normal and the ambient occlusion
+// coefficient. Lanes past _count are copies of the first pixel.
+struct ShadingBatch {
+    enum { Size = 4 };
+    int _count;
+    int _screenX[Size];
+    float _x[Size], _y[Size], _z[Size];
+    float _normalX[Size], _normalY[Size], _normalZ[Size];
+    float _ambientOcclusionCoeff[Size];
 };
 
+// 1/sqrt(x), from the (12-bit) SSE approximation and a Newton-Raphson step
+static inline __m128 ReciprocalSqrt4(__m128 x)
+{
+    __m128 y = _mm_rsqrt_ps(x);
+    __m128 yyx = _mm_mul_ps(_mm_mul_ps(y, y), x);
+    return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), _mm_sub_ps(_mm_set1_ps(3.f), yyx));
+}
+
+static inline __m128 Dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+// Lane i of a vector is lane i of 'a' where 'mask' is set, of 'b' elsewhere
+static inline __m128 Select4(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
+
 template <LightingMode lightingMode>
 class LightingEquation {
     const Scene& _scene;
@@ -48,18 +97,36 @@ public:
 	const Pixel& material,
 	const coord ambientOcclusionCoeff,
 	Pixel& target)
+    {
+	coord diffuse, specular;
+	ComputeLighting(inCameraSpace, normalInCameraSpace, ambientOcclusionCoeff, diffuse, specular);
+	Shade(material, diffuse, specular, target);
+    }
+
+    // The color of a point is its material's, scaled by 'diffuse' (which
+    // includes the ambient component) plus 'specular' on all channels -
+    // see Shade. The Gouraud mode computes these once per vertex, and
+    // shades each triangle's material with them (see Fillers.h).
+    void ComputeLighting(
+	const Vector3& inCameraSpace,
+	const Vector3& normalInCameraSpace,
+	const coord ambientOcclusionCoeff,
+	coord& diffuse,
+	coord& specular)
     {
 	// First, add the ambient component...
-	target = material;
-	coord ambient = (coord) ((AMBIENT*ambientOcclusionCoeff/255.0)/255.0);
-	target *= ambient;
+	diffuse = (coord) ((AMBIENT*ambientOcclusionCoeff/255.0)/255.0);
+	specular = 0.f;
 
-	for(unsigned i=0; i<_scene._lights.size(); i++) {
+	// Only the lights that may reach us (see LightClusters.h)
+	const unsigned *idxLight, *idxLightEnd;
+	_scene._lightClusters.LightsAt(inCameraSpace, idxLight, idxLightEnd);
+	for(; idxLight != idxLightEnd; idxLight++) {
 
-	    Light& light = *_scene._lights[i];
+	    Light& light = *_scene._lights[*idxLight];
 
 	    // This light's diffuse and specular contribution
-	    Pixel dColor = Pixel(); // start with black
+	    coord lightDiffuse = 0.f, lightSpecular = 0.f; // start with black
 
 	    // We calculate the vector from point to light (in camera space).
 	    // The camera-space light coordinates are already precalculated
@@ -67,10 +134,17 @@ public:
 	    Vector3 pointToLight = light._inCameraSpace;
 	    pointToLight -= inCameraSpace;
 
+	    // (and the ones that do, fade with the distance)
+	    coord falloff = light.Falloff(pointToLight.lengthsq());
+	    if (falloff <= 0.f)
+		continue;
+
 	    int cntInShadow=0;
+	    coord lit = 1.f; // percentage of light, for VarianceShadowMapping
 
-	    // Compile-time check (template param)
-	    if (lightingMode != NoShadows) {
+	    // Compile-time check (template param) - and lights that never
+	    // rendered their shadow buffer cast no shadows
+	    if (lightingMode != NoShadows && !light._shadowBuffer.empty()) {
 
 		// We will use the precalculated (Light::CalculateXformFromCameraToLightSpace)
 		// Matrix3 that allows us to go directly from camera space to light space.
@@ -81,21 +155,31 @@ public:
 		// ...and we transform it to light space coordinates:
 		Vector3 inLightSpace = light._cameraToLightSpace.multiplyRightWith(lightToPoint);
 
-		// In light space, we check the Shadowmap Z-value:
-		inLightSpace._x = SHADOWMAPSIZE/2  + SHADOWMAPSIZE*2*inLightSpace._x/inLightSpace._z;
-		inLightSpace._y = SHADOWMAPSIZE/2 + SHADOWMAPSIZE*2*inLightSpace._y/inLightSpace._z;
-		inLightSpace._z = 1.0f/inLightSpace._z;
-		int sx = (int) inLightSpace._x;
-		int sy = (int) inLightSpace._y;
+		// In light space, we check the Shadowmap Z-value
+		// (projecting just like Light::RenderSceneIntoShadowBuffer did).
+		// The points the shadow map doesn't cover - outside it, or behind
+		// the light - are lit, in all the shadowing modes: they are placed
+		// just outside it (and so are the ones projecting far outside it,
+		// so that the conversions don't overflow).
+		const TransformedVertices::Projection& p = light._shadowProjection;
+		const int size = light._shadowMapSize;
+		coord shadowX = -2.f, shadowY = -2.f, invZ = 0.f;
+		if (inLightSpace._z > 0.f) {
+		    invZ = 1.0f/inLightSpace._z;
+		    coord x = inLightSpace._x*invZ, y = inLightSpace._y*invZ;
+		    shadowX = std::min(std::max(p._centerX + p._xx*x + p._xy*y, -2.f), size + 1.f);
+		    shadowY = std::min(std::max(p._centerY + p._yx*x + p._yy*y, -2.f), size + 1.f);
+		}
+		int sx = (int) shadowX;
+		int sy = (int) shadowY;
+		// (the cosine of the light's angle to the normal, for the bias)
+		coord cosine = dot(normalInCameraSpace, pointToLight)/pointToLight.length();
+		coord depth = light.ShadowThreshold(invZ, cosine);
 
 		if (lightingMode == ShadowMapping) { // Compile-time check (template param)
 
-		    if ((sx<0) || (sx>=SHADOWMAPSIZE) || (sy<0) || (sy>=SHADOWMAPSIZE))
-			// ooops, our shadow map doesn't cover this...
-			// (We should emit warning here...)
-			continue;
-
-		    if (!(light._shadowBuffer[sy][sx] < (inLightSpace._z+0.001)))
+		    if ((sx>=0) && (sx<size) && (sy>=0) && (sy<size) &&
+			!(light._shadowBuffer[sy*size + sx] < depth))
 			// in shadow, try next light
 			continue;
 
@@ -103,19 +187,50 @@ public:
 		    int basex=sx, basey=sy;
 		    for(int d=-1;d<=1;d++) {
 			sy = basey + d;
-			if ((sy<0) || (sy>=(int)SHADOWMAPSIZE))
+			if ((sy<0) || (sy>=size))
 			    continue;
 			for(int e=-1;e<=1;e++) {
 			    sx = basex + e;
-			    if ((sx<0) || (sx>=(int)SHADOWMAPSIZE))
+			    if ((sx<0) || (sx>=size))
 				continue;
 
-			    if (light._shadowBuffer[sy][sx] > (inLightSpace._z+0.001))
+			    if (light._shadowBuffer[sy*size + sx] > depth)
 				cntInShadow++;
 			}
 		    }
 		    // OK, we've now measured how many (cntInShadow) shadow pixels exist around us
 		    // cntInShadow/9 is the percentage of shadowing...
+
+		} else if (lightingMode == VarianceShadowMapping) { // Compile-time check (template param)
+		    // One bilinear fetch of the prefiltered moments of the depths around us
+		    // (see Light::PrefilterShadowBuffer)...
+		    coord fx = shadowX - 0.5f;
+		    coord fy = shadowY - 0.5f;
+		    if (!light._shadowMoments.empty() &&
+			fx>=0.f && fx<size-1 && fy>=0.f && fy<size-1)
+		    {
+			int mx = (int) fx, my = (int) fy;
+			coord wx = fx - mx, wy = fy - my;
+			const ShadowMoments *m = &light._shadowMoments[my*size + mx];
+			coord mean =
+			    (1.f-wy)*((1.f-wx)*m[0]._mean + wx*m[1]._mean) +
+			    wy*((1.f-wx)*m[size]._mean + wx*m[size+1]._mean);
+			coord meanOfSquares =
+			    (1.f-wy)*((1.f-wx)*m[0]._meanOfSquares + wx*m[1]._meanOfSquares) +
+			    wy*((1.f-wx)*m[size]._meanOfSquares + wx*m[size+1]._meanOfSquares);
+
+			// ...and if we are behind their mean (i.e. farther from the light),
+			// Chebyshev's inequality gives the (maximum) percentage of them
+			// that are not closer than us: variance/(variance + distance^2)
+			coord distanceFromMean = mean - depth;
+			if (distanceFromMean > 0.f) {
+			    coord variance = std::max(meanOfSquares - mean*mean, VSM_MIN_VARIANCE);
+			    lit = variance/(variance + distanceFromMean*distanceFromMean);
+			    // The bound is loose where occluders of different depths overlap,
+			    // making their shadows "bleed" light: cut off its lower part
+			    lit = std::max(0.f, (lit - VSM_BLEEDING_CUTOFF)/(1.f - VSM_BLEEDING_CUTOFF));
+			}
+		    }
 		}
 	    }
 
@@ -125,9 +240,7 @@ public:
 	    if (intensity<0.) {
 		; // in shadow, let it be in ambient
 	    } else {
-		Pixel diffuse = material;
-		diffuse *= (coord) (DIFFUSE*intensity/255.);   // diffuse set to a maximum of 130/255
-		dColor += diffuse;
+		lightDiffuse = (coord) (DIFFUSE*intensity/255.);   // diffuse set to a maximum of 130/255
 
 		// Specular color
 		// We will use the half vector: pointToLight + point to camera
@@ -148,26 +261,308 @@ public:
 		    intensity2 *= intensity2;
 		    intensity2 *= intensity2;
 		    intensity2 *= intensity2;
-		    dColor += Pixel(
-			(unsigned char)(SPECULAR*intensity2),
-			(unsigned char)(SPECULAR*intensity2),
-			(unsigned char)(SPECULAR*intensity2));
+		    lightSpecular = (unsigned char)(SPECULAR*intensity2);
 		}
 	    }
 
 	    // Compile-time check (template params)
+	    coord scale = light._power*falloff;
 	    if (lightingMode == SoftShadowMapping) {
 		if (cntInShadow)
-		    dColor *= (9.0f-cntInShadow)/9.0f;
+		    scale *= (9.0f-cntInShadow)/9.0f;
+	    } else if (lightingMode == VarianceShadowMapping) {
+		if (lit < 1.f)
+		    scale *= lit;
 	    }
 
-	    target += dColor;
+	    diffuse += lightDiffuse*scale;
+	    specular += lightSpecular*scale;
 	}
+    }
+
+    // The color of a point of the given material, lit with the results of ComputeLighting
+    static void Shade(
+	const Pixel& material,
+	coord diffuse,
+	coord specular,
+	Pixel& target)
+    {
+	target = material;
+	target *= diffuse;
+	target += Pixel(specular, specular, specular);
 
 	if (target._b>255) target._b = 255;
 	if (target._g>255) target._g = 255;
 	if (target._r>255) target._r = 255;
     }
+
+#ifdef SIMD_SSE2
+    // ComputePixel, for the pixels of a ShadingBatch (made of 'material'):
+    // the same equation, with one pixel per SSE lane. Their colors are
+    // returned in r, g and b (clamped to 255).
+    void ComputePixels(
+	const ShadingBatch& batch,
+	const Pixel& material,
+	__m128& r, __m128& g, __m128& b)
+    {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+
+	// True camera space (as in IlluminatePixel, see Screen.cc)
+	__m128 z = _mm_loadu_ps(batch._z);
+	__m128 px = _mm_div_ps(_mm_loadu_ps(batch._x), z);
+	__m128 py = _mm_div_ps(_mm_loadu_ps(batch._y), z);
+	__m128 pz = _mm_div_ps(one, z);
+
+	// The lights that may reach the pixels: if they are not the same for all
+	// of them (i.e. the batch crosses clusters), shade them one by one
+	float x[ShadingBatch::Size], y[ShadingBatch::Size], zz[ShadingBatch::Size];
+	_mm_storeu_ps(x, px); _mm_storeu_ps(y, py); _mm_storeu_ps(zz, pz);
+	const unsigned *idxLight, *idxLightEnd;
+	_scene._lightClusters.LightsAt(Vector3(x[0], y[0], zz[0]), idxLight, idxLightEnd);
+	for(int i=1; i<batch._count; i++) {
+	    const unsigned *begin, *end;
+	    _scene._lightClusters.LightsAt(Vector3(x[i], y[i], zz[i]), begin, end);
+	    if (begin != idxLight || end != idxLightEnd) {
+		float cr[ShadingBatch::Size], cg[ShadingBatch::Size], cb[ShadingBatch::Size];
+		for(int j=0; j<ShadingBatch::Size; j++) {
+		    Vector3 normal(batch._normalX[j], batch._normalY[j], batch._normalZ[j]);
+		    normal.normalize();
+		    Pixel color;
+		    ComputePixel(
+			Vector3(x[j], y[j], zz[j]), normal, material,
+			batch._ambientOcclusionCoeff[j], color);
+		    cr[j] = color._r; cg[j] = color._g; cb[j] = color._b;
+		}
+		r = _mm_loadu_ps(cr); g = _mm_loadu_ps(cg); b = _mm_loadu_ps(cb);
+		return;
+	    }
+	}
+
+	__m128 nx = _mm_loadu_ps(batch._normalX);
+	__m128 ny = _mm_loadu_ps(batch._normalY);
+	__m128 nz = _mm_loadu_ps(batch._normalZ);
+	__m128 invLength = ReciprocalSqrt4(Dot4(nx, ny, nz, nx, ny, nz));
+	nx = _mm_mul_ps(nx, invLength);
+	ny = _mm_mul_ps(ny, invLength);
+	nz = _mm_mul_ps(nz, invLength);
+
+	// The vector from the points to the camera (for the specular color)
+	invLength = ReciprocalSqrt4(Dot4(px, py, pz, px, py, pz));
+	__m128 cx = _mm_sub_ps(zero, _mm_mul_ps(px, invLength));
+	__m128 cy = _mm_sub_ps(zero, _mm_mul_ps(py, invLength));
+	__m128 cz = _mm_sub_ps(zero, _mm_mul_ps(pz, invLength));
+
+	// First, add the ambient component...
+	float ambient[ShadingBatch::Size];
+	for(int i=0; i<ShadingBatch::Size; i++)
+	    ambient[i] = (coord) ((AMBIENT*batch._ambientOcclusionCoeff[i]/255.0)/255.0);
+	__m128 ambient4 = _mm_loadu_ps(ambient);
+	r = _mm_mul_ps(_mm_set1_ps(material._r), ambient4);
+	g = _mm_mul_ps(_mm_set1_ps(material._g), ambient4);
+	b = _mm_mul_ps(_mm_set1_ps(material._b), ambient4);
+
+	for(; idxLight != idxLightEnd; idxLight++) {
+
+	    const Light& light = *_scene._lights[*idxLight];
+
+	    // The vectors from the points to the light (in camera space)
+	    __m128 lx = _mm_sub_ps(_mm_set1_ps(light._inCameraSpace._x), px);
+	    __m128 ly = _mm_sub_ps(_mm_set1_ps(light._inCameraSpace._y), py);
+	    __m128 lz = _mm_sub_ps(_mm_set1_ps(light._inCameraSpace._z), pz);
+	    __m128 distanceSq = Dot4(lx, ly, lz, lx, ly, lz);
+
+	    // The directions to the light, and their cosines with the normals
+	    __m128 invDistance = ReciprocalSqrt4(distanceSq);
+	    __m128 ux = _mm_mul_ps(lx, invDistance);
+	    __m128 uy = _mm_mul_ps(ly, invDistance);
+	    __m128 uz = _mm_mul_ps(lz, invDistance);
+	    __m128 intensity = Dot4(nx, ny, nz, ux, uy, uz);
+
+	    // The lanes the light reaches (and isn't shadowed in), and
+	    // what scales its contribution there
+	    __m128 active = _mm_cmpeq_ps(zero, zero);
+	    __m128 scale = _mm_set1_ps(light._power);
+	    if (light._range > 0.f) {
+		// Light::Falloff
+		__m128 t = _mm_div_ps(distanceSq, _mm_set1_ps(light._range*light._range));
+		__m128 falloff = _mm_max_ps(_mm_sub_ps(one, t), zero);
+		falloff = _mm_mul_ps(falloff, falloff);
+		active = _mm_cmpgt_ps(falloff, zero);
+		if (!_mm_movemask_ps(active))
+		    continue;
+		scale = _mm_mul_ps(scale, falloff);
+	    }
+
+	    // Compile-time check (template param) - and lights that never
+	    // rendered their shadow buffer cast no shadows
+	    if (lightingMode != NoShadows && !light._shadowBuffer.empty()) {
+
+		// From the light to the points, in light space...
+		const Matrix3& m = light._cameraToLightSpace;
+		__m128 tx = _mm_sub_ps(zero, lx), ty = _mm_sub_ps(zero, ly), tz = _mm_sub_ps(zero, lz);
+		__m128 sx = Dot4(
+		    _mm_set1_ps(m._row1._x), _mm_set1_ps(m._row1._y), _mm_set1_ps(m._row1._z), tx, ty, tz);
+		__m128 sy = Dot4(
+		    _mm_set1_ps(m._row2._x), _mm_set1_ps(m._row2._y), _mm_set1_ps(m._row2._z), tx, ty, tz);
+		__m128 sz = Dot4(
+		    _mm_set1_ps(m._row3._x), _mm_set1_ps(m._row3._y), _mm_set1_ps(m._row3._z), tx, ty, tz);
+
+		// ...projected on the shadow buffer. As in ComputePixel, the points
+		// behind the light are placed just outside it, and so are lit.
+		const TransformedVertices::Projection& p = light._shadowProjection;
+		const int size = light._shadowMapSize;
+		__m128 inFront = _mm_cmpgt_ps(sz, zero);
+		__m128 invZ = _mm_and_ps(inFront, _mm_div_ps(one, Select4(inFront, sz, one)));
+		sx = _mm_mul_ps(sx, invZ);
+		sy = _mm_mul_ps(sy, invZ);
+		// (clamped a bit outside the shadow map - i.e. still outside it -
+		// so that the conversions and the 3x3 neighbours don't overflow)
+		__m128 lowest = _mm_set1_ps(-2.f), highest = _mm_set1_ps(size + 1.f);
+		__m128 shadowX = Select4(inFront, _mm_add_ps(
+		    _mm_add_ps(_mm_set1_ps(p._centerX), _mm_mul_ps(_mm_set1_ps(p._xx), sx)),
+		    _mm_mul_ps(_mm_set1_ps(p._xy), sy)), lowest);
+		__m128 shadowY = Select4(inFront, _mm_add_ps(
+		    _mm_add_ps(_mm_set1_ps(p._centerY), _mm_mul_ps(_mm_set1_ps(p._yx), sx)),
+		    _mm_mul_ps(_mm_set1_ps(p._yy), sy)), lowest);
+		shadowX = _mm_min_ps(_mm_max_ps(shadowX, lowest), highest);
+		shadowY = _mm_min_ps(_mm_max_ps(shadowY, lowest), highest);
+		// (Light::ShadowThreshold)
+		__m128 maxSlope = _mm_set1_ps(SHADOW_MAX_SLOPE);
+		__m128 sine = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(one, _mm_mul_ps(intensity, intensity)), zero));
+		__m128 slope = Select4(
+		    _mm_cmpgt_ps(_mm_mul_ps(intensity, maxSlope), sine),
+		    _mm_div_ps(sine, Select4(_mm_cmpgt_ps(intensity, zero), intensity, one)), maxSlope);
+		__m128 bias = _mm_mul_ps(_mm_set1_ps(light._shadowPixelTan), _mm_add_ps(
+		    _mm_set1_ps(SHADOW_BIAS_TEXELS), _mm_mul_ps(_mm_set1_ps(SHADOW_SLOPE_BIAS_TEXELS), slope)));
+		__m128 depth = _mm_mul_ps(invZ, _mm_add_ps(one, bias));
+		int shadowPixelX[ShadingBatch::Size], shadowPixelY[ShadingBatch::Size];
+		_mm_storeu_si128((__m128i*)shadowPixelX, _mm_cvttps_epi32(shadowX));
+		_mm_storeu_si128((__m128i*)shadowPixelY, _mm_cvttps_epi32(shadowY));
+		const coord *shadowBuffer = &light._shadowBuffer[0];
+
+		if (lightingMode == ShadowMapping) { // Compile-time check (template param)
+
+		    // The points in shadow get nothing from the light (and the ones
+		    // outside the shadow map are lit: nothing is closer to the light)
+		    float samples[ShadingBatch::Size];
+		    for(int i=0; i<ShadingBatch::Size; i++) {
+			int sx = shadowPixelX[i], sy = shadowPixelY[i];
+			samples[i] = (sx<0 || sx>=size || sy<0 || sy>=size) ?
+			    -FLT_MAX : shadowBuffer[sy*size + sx];
+		    }
+		    active = _mm_and_ps(active, _mm_cmplt_ps(_mm_loadu_ps(samples), depth));
+		    if (!_mm_movemask_ps(active))
+			continue;
+
+		} else if (lightingMode == SoftShadowMapping) { // Soft shadows (compile-time check, template param)
+
+		    // The 9 shadow pixels around each point (the ones outside the
+		    // shadow map are "infinitely" far from the light)...
+		    float samples[9][ShadingBatch::Size];
+		    for(int i=0; i<ShadingBatch::Size; i++) {
+			int basex = shadowPixelX[i], basey = shadowPixelY[i];
+			if (basex>=1 && basex<size-1 && basey>=1 && basey<size-1) {
+			    const coord *p = &shadowBuffer[(basey-1)*size + basex-1];
+			    for(int d=0; d<3; d++, p+=size) {
+				samples[3*d][i] = p[0];
+				samples[3*d+1][i] = p[1];
+				samples[3*d+2][i] = p[2];
+			    }
+			} else {
+			    for(int d=0; d<3; d++)
+				for(int e=0; e<3; e++) {
+				    int sx = basex + e - 1, sy = basey + d - 1;
+				    samples[3*d+e][i] = (sx<0 || sx>=size || sy<0 || sy>=size) ?
+					-FLT_MAX : shadowBuffer[sy*size + sx];
+				}
+			}
+		    }
+		    // ...and how many of them are closer to the light than the points
+		    __m128 cntInShadow = zero;
+		    for(int k=0; k<9; k++)
+			cntInShadow = _mm_add_ps(cntInShadow,
+			    _mm_and_ps(_mm_cmpgt_ps(_mm_loadu_ps(samples[k]), depth), one));
+		    scale = _mm_mul_ps(scale,
+			_mm_div_ps(_mm_sub_ps(_mm_set1_ps(9.f), cntInShadow), _mm_set1_ps(9.f)));
+
+		} else if (lightingMode == VarianceShadowMapping) { // Compile-time check (template param)
+
+		    // The bilinear fetches of the moments are done lane by lane...
+		    float means[ShadingBatch::Size], meansOfSquares[ShadingBatch::Size], valid[ShadingBatch::Size];
+		    float fxs[ShadingBatch::Size], fys[ShadingBatch::Size];
+		    _mm_storeu_ps(fxs, _mm_sub_ps(shadowX, _mm_set1_ps(0.5f)));
+		    _mm_storeu_ps(fys, _mm_sub_ps(shadowY, _mm_set1_ps(0.5f)));
+		    for(int i=0; i<ShadingBatch::Size; i++) {
+			coord fx = fxs[i], fy = fys[i];
+			means[i] = meansOfSquares[i] = valid[i] = 0.f;
+			if (!light._shadowMoments.empty() &&
+			    fx>=0.f && fx<size-1 && fy>=0.f && fy<size-1)
+			{
+			    int mx = (int) fx, my = (int) fy;
+			    coord wx = fx - mx, wy = fy - my;
+			    const ShadowMoments *m = &light._shadowMoments[my*size + mx];
+			    means[i] =
+				(1.f-wy)*((1.f-wx)*m[0]._mean + wx*m[1]._mean) +
+				wy*((1.f-wx)*m[size]._mean + wx*m[size+1]._mean);
+			    meansOfSquares[i] =
+				(1.f-wy)*((1.f-wx)*m[0]._meanOfSquares + wx*m[1]._meanOfSquares) +
+				wy*((1.f-wx)*m[size]._meanOfSquares + wx*m[size+1]._meanOfSquares);
+			    valid[i] = 1.f;
+			}
+		    }
+		    // ...and Chebyshev's inequality, for all of them at once
+		    __m128 mean = _mm_loadu_ps(means);
+		    __m128 distanceFromMean = _mm_sub_ps(mean, depth);
+		    __m128 variance = _mm_max_ps(
+			_mm_sub_ps(_mm_loadu_ps(meansOfSquares), _mm_mul_ps(mean, mean)),
+			_mm_set1_ps(VSM_MIN_VARIANCE));
+		    __m128 lit = _mm_div_ps(variance,
+			_mm_add_ps(variance, _mm_mul_ps(distanceFromMean, distanceFromMean)));
+		    lit = _mm_max_ps(zero, _mm_div_ps(
+			_mm_sub_ps(lit, _mm_set1_ps(VSM_BLEEDING_CUTOFF)),
+			_mm_set1_ps(1.f - VSM_BLEEDING_CUTOFF)));
+		    __m128 behind = _mm_and_ps(
+			_mm_cmpgt_ps(_mm_loadu_ps(valid), zero), _mm_cmpgt_ps(distanceFromMean, zero));
+		    scale = _mm_mul_ps(scale, Select4(behind, lit, one));
+		}
+	    }
+
+	    // Diffuse color
+	    // (in shadow, where it is negative: let it be in ambient)
+	    active = _mm_and_ps(active, _mm_cmpge_ps(intensity, zero));
+	    if (!_mm_movemask_ps(active))
+		continue;
+	    __m128 diffuse = _mm_div_ps(_mm_mul_ps(intensity, _mm_set1_ps(DIFFUSE)), _mm_set1_ps(255.f));
+	    __m128 dr = _mm_mul_ps(_mm_set1_ps(material._r), diffuse);
+	    __m128 dg = _mm_mul_ps(_mm_set1_ps(material._g), diffuse);
+	    __m128 db = _mm_mul_ps(_mm_set1_ps(material._b), diffuse);
+
+	    // Specular color, from the half vector (see ComputePixel)
+	    __m128 hx = _mm_add_ps(ux, cx), hy = _mm_add_ps(uy, cy), hz = _mm_add_ps(uz, cz);
+	    __m128 intensity2 = _mm_mul_ps(
+		Dot4(hx, hy, hz, nx, ny, nz), ReciprocalSqrt4(Dot4(hx, hy, hz, hx, hy, hz)));
+	    __m128 specularMask = _mm_cmpgt_ps(intensity2, zero);
+	    intensity2 = _mm_mul_ps(intensity2, intensity2);
+	    intensity2 = _mm_mul_ps(intensity2, intensity2);
+	    intensity2 = _mm_mul_ps(intensity2, intensity2);
+	    intensity2 = _mm_mul_ps(intensity2, intensity2);
+	    intensity2 = _mm_mul_ps(intensity2, intensity2);
+	    // (added as unsigned chars, in ComputePixel)
+	    __m128 specular = _mm_and_ps(specularMask,
+		_mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(_mm_set1_ps(SPECULAR), intensity2))));
+
+	    r = _mm_add_ps(r, _mm_and_ps(active, _mm_mul_ps(_mm_add_ps(dr, specular), scale)));
+	    g = _mm_add_ps(g, _mm_and_ps(active, _mm_mul_ps(_mm_add_ps(dg, specular), scale)));
+	    b = _mm_add_ps(b, _mm_and_ps(active, _mm_mul_ps(_mm_add_ps(db, specular), scale)));
+	}
+
+	const __m128 maximum = _mm_set1_ps(255.f);
+	r = _mm_min_ps(r, maximum);
+	g = _mm_min_ps(g, maximum);
+	b = _mm_min_ps(b, maximum);
+    }
+#endif
 };
 
 
@@ -23,9 +23,14 @@
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <cfloat>
+#include <climits>
 #include <map>
+#include <algorithm>
+#include <cctype>
+#ifdef HAVE_FLOAT_FROM_CHARS
+#include <charconv>
+#endif
 
 #include <string.h>
 #include <assert.h>
@@ -38,6 +43,8 @@
 #include "3d.h"
 #include "Defines.h"
 #include "Exceptions.h"
+#include "Parallel.h"
+#include "MappedFile.h"
 
 using std::string;
 
@@ -47,6 +54,24 @@ namespace enums {
         Green = 1,
         Blue = 2
     };
+
+    enum PlyFormat {
+        PlyAscii,
+        PlyBinaryLittleEndian,
+        PlyBinaryBigEndian
+    };
+
+    enum PlyType {
+        PlyNone,
+        PlyInt8,
+        PlyUint8,
+        PlyInt16,
+        PlyUint16,
+        PlyInt32,
+        PlyUint32,
+        PlyFloat32,
+        PlyFloat64
+    };
 }
 
 using namespace enums;
@@ -74,8 +99,1054 @@ struct MaterialColors {
     bool _twoSided;
 };
 
+// Fills Scene::_materials, with one entry per distinct color (and sidedness),
+// returning the index of the requested one
+class MaterialTable {
+    std::vector<Material>& _materials;
+    typedef std::pair<unsigned, unsigned> Key;
+    std::map<Key, unsigned> _index;
+    // Consecutive triangles usually have the same color - skip the lookup then
+    Key _lastKey;
+    unsigned _lastIndex;
+public:
+    MaterialTable(std::vector<Material>& materials)
+        :_materials(materials), _lastKey(~0u, ~0u), _lastIndex(0) {}
+
+    unsigned operator()(unsigned r, unsigned g, unsigned b, bool twoSided=false) {
+        Key key((r<<16) | g, (b<<1) | (twoSided?1:0));
+        if (key == _lastKey)
+            return _lastIndex;
+        _lastKey = key;
+        std::map<Key, unsigned>::iterator it = _index.find(key);
+        if (it != _index.end())
+            return _lastIndex = it->second;
+        _materials.push_back(Material(r, g, b, twoSided));
+        _index[key] = _materials.size() - 1;
+        return _lastIndex = _materials.size() - 1;
+    }
+};
+
+// A block of a .tri file (see the format in Scene::load): how many vertices
+// and triangles it has, where they are, and their indexes in the scene
+struct TriFileBlock {
+    size_t _pointsOffset;
+    size_t _trisOffset;
+    Uint32 _firstPoint, _points;
+    Uint32 _firstTri, _tris;
+};
+
+// The block with the i-th vertex (first=&TriFileBlock::_firstPoint,
+// count=&TriFileBlock::_points), or triangle (_firstTri, _tris)
+static unsigned FindTriFileBlock(
+    const std::vector<TriFileBlock>& blocks,
+    Uint32 TriFileBlock::*first, Uint32 TriFileBlock::*count, unsigned i)
+{
+    // The last block starting at (or before) i...
+    unsigned lo = 0, hi = blocks.size();
+    while(hi - lo > 1) {
+        unsigned mid = (lo + hi)/2;
+        if (blocks[mid].*first <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    // ...that is not empty
+    while(i >= blocks[lo].*first + blocks[lo].*count)
+        lo++;
+    return lo;
+}
+
 const coord Scene::MaxCoordAfterRescale = 1.2f;
 
+// The passes over the whole scene after loading (bounding box, rescaling,
+// normals and planes, the raytracer's intersection data) run in parallel,
+// over blocks of this many triangles (or vertices).
+#define LOAD_BLOCK 4096
+
+static int LoadBlocks(unsigned total)
+{
+    return (total + LOAD_BLOCK - 1)/LOAD_BLOCK;
+}
+
+// Copies a block of vertices out of a (mapped) .tri file
+class TriFileVertices {
+    const MappedFile& _file;
+    const std::vector<TriFileBlock>& _blocks;
+    bool _hasNormals;
+    std::vector<Vertex>& _vertices;
+public:
+    TriFileVertices(
+        const MappedFile& file, const std::vector<TriFileBlock>& blocks,
+        bool hasNormals, std::vector<Vertex>& vertices)
+        :
+        _file(file), _blocks(blocks), _hasNormals(hasNormals), _vertices(vertices)
+        {}
+
+    void operator()(int chunk) const {
+        unsigned start = chunk*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _vertices.size());
+        size_t stride = _hasNormals ? 24 : 12;
+        unsigned b = FindTriFileBlock(_blocks, &TriFileBlock::_firstPoint, &TriFileBlock::_points, start);
+        for(unsigned i=start; i<end; i++) {
+            while(i >= _blocks[b]._firstPoint + _blocks[b]._points)
+                b++;
+            const unsigned char *p =
+                _file.Data() + _blocks[b]._pointsOffset + (i - _blocks[b]._firstPoint)*stride;
+            // Without normals, they will be calculated in fix_normals()
+            float v[6] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+            memcpy(v, p, stride);
+            _vertices[i] = Vertex(v[0], v[1], v[2], v[3], v[4], v[5]);
+        }
+    }
+};
+
+// Creates a block of triangles out of a (mapped) .tri file - all but their
+// materials. Marks the block in 'malformed' if any index is out of range.
+class TriFileTriangles {
+    const MappedFile& _file;
+    const std::vector<TriFileBlock>& _blocks;
+    bool _hasColors;
+    const std::vector<Vertex>& _vertices;
+    std::vector<Triangle>& _triangles;
+    std::vector<unsigned char>& _malformed;
+public:
+    TriFileTriangles(
+        const MappedFile& file, const std::vector<TriFileBlock>& blocks, bool hasColors,
+        const std::vector<Vertex>& vertices, std::vector<Triangle>& triangles,
+        std::vector<unsigned char>& malformed)
+        :
+        _file(file), _blocks(blocks), _hasColors(hasColors),
+        _vertices(vertices), _triangles(triangles), _malformed(malformed)
+        {}
+
+    void operator()(int chunk) const {
+        unsigned start = chunk*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _triangles.size());
+        size_t stride = _hasColors ? 24 : 12;
+        unsigned b = FindTriFileBlock(_blocks, &TriFileBlock::_firstTri, &TriFileBlock::_tris, start);
+        for(unsigned i=start; i<end; i++) {
+            while(i >= _blocks[b]._firstTri + _blocks[b]._tris)
+                b++;
+            const unsigned char *p =
+                _file.Data() + _blocks[b]._trisOffset + (i - _blocks[b]._firstTri)*stride;
+            Uint32 idx[3];
+            memcpy(idx, p, sizeof(idx));
+            // The indexes are into all the vertices up to (and including) this block's
+            Uint32 limit = _blocks[b]._firstPoint + _blocks[b]._points;
+            if (idx[0]>=limit || idx[1]>=limit || idx[2]>=limit) {
+                _malformed[chunk] = 1;
+                return;
+            }
+            _triangles[i] = Triangle(_vertices, idx[0], idx[1], idx[2], 0);
+        }
+    }
+};
+
+// PLY files (http://paulbourke.net/dataformats/ply/)
+//
+// The header describes the body: its format (ascii, or binary little/big
+// endian) and its elements, each with a number of records and a list of
+// (scalar or list) properties per record. Of these, we use:
+//
+//    element vertex: x, y, z - and nx, ny, nz if they are all there
+//                    (otherwise fix_normals() calculates the normals) -
+//                    and red, as the ambient occlusion coefficient
+//                    (shadevis stores it as a gray vertex color)
+//    element face:   vertex_indices (or vertex_index), as a triangle fan,
+//                    and red, green, blue (white if missing)
+//
+// and skip everything else. Binary bodies are decoded in place, out of
+// the mapped file; ASCII ones are split in chunks of lines, that are
+// parsed in parallel.
+
+static const size_t PlyTypeBytes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+
+struct PlyProperty {
+    string _name;
+    PlyType _type;      // of the value (or of the list's items)
+    PlyType _countType; // of the list's count (PlyNone: not a list)
+};
+
+struct PlyElement {
+    string _name;
+    unsigned _count;
+    std::vector<PlyProperty> _properties;
+
+    // Index of the property called 'name' (-1 if there's none)
+    int Find(const char *name) const {
+        for(unsigned i=0; i<_properties.size(); i++)
+            if (_properties[i]._name == name)
+                return i;
+        return -1;
+    }
+};
+
+struct PlyHeader {
+    PlyFormat _format;
+    std::vector<PlyElement> _elements;
+    size_t _bodyOffset;
+
+    // The elements we use (-1 if missing)...
+    int _vertex, _face;
+    // ...and their properties we use (-1 if missing)
+    int _x, _y, _z, _nx, _ny, _nz, _occlusion;
+    int _indices, _red, _green, _blue;
+
+    bool HasNormals() const { return _nx != -1 && _ny != -1 && _nz != -1; }
+    bool HasColors() const { return _red != -1 || _green != -1 || _blue != -1; }
+};
+
+static void SplitPlyHeaderLine(const char *p, const char *end, std::vector<string>& words)
+{
+    words.clear();
+    while(p < end) {
+        while(p < end && isspace((unsigned char) *p))
+            p++;
+        const char *word = p;
+        while(p < end && !isspace((unsigned char) *p))
+            p++;
+        if (p != word)
+            words.push_back(string(word, p));
+    }
+}
+
+static PlyType ParsePlyType(const string& name)
+{
+    static const char *names[][2] = {
+        { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+        { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+    };
+    for(int i=0; i<8; i++)
+        if (name == names[i][0] || name == names[i][1])
+            return PlyType(PlyInt8 + i);
+    THROW((string("Malformed 3D file (unknown PLY type '") + name + string("')")).c_str());
+}
+
+static void ParsePlyHeader(const MappedFile& file, PlyHeader& header)
+{
+    const char *data = (const char *) file.Data();
+    const char *p = data, *end = data + file.Size();
+    std::vector<string> words;
+    bool first = true;
+    header._format = PlyAscii; // Some exporters don't write the format line
+    while(true) {
+        const char *eol = (p < end) ? (const char *) memchr(p, '\n', end - p) : NULL;
+        if (!eol)
+            THROW("Malformed 3D file (PLY header)");
+        SplitPlyHeaderLine(p, eol, words);
+        p = eol + 1;
+        if (first) {
+            if (words.size() != 1 || words[0] != "ply")
+                THROW("Malformed 3D file (not a PLY file)");
+            first = false;
+        } else if (words.empty())
+            continue;
+        else if (words[0] == "end_header")
+            break;
+        else if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "ascii")
+                header._format = PlyAscii;
+            else if (words[1] == "binary_little_endian")
+                header._format = PlyBinaryLittleEndian;
+            else if (words[1] == "binary_big_endian")
+                header._format = PlyBinaryBigEndian;
+            else
+                THROW((string("Unknown PLY format '") + words[1] + string("'")).c_str());
+        } else if (words[0] == "element") {
+            PlyElement element;
+            if (words.size() != 3 || !isdigit((unsigned char)words[2][0]))
+                THROW("Malformed 3D file (PLY element)");
+            char *countEnd;
+            unsigned long count = strtoul(words[2].c_str(), &countEnd, 10);
+            if (*countEnd || count > UINT_MAX)
+                THROW("Malformed 3D file (PLY element)");
+            element._count = unsigned(count);
+            element._name = words[1];
+            header._elements.push_back(element);
+        } else if (words[0] == "property") {
+            if (header._elements.empty())
+                THROW("Malformed 3D file (PLY property outside of an element)");
+            PlyProperty property;
+            if (words.size() == 5 && words[1] == "list") {
+                property._countType = ParsePlyType(words[2]);
+                property._type = ParsePlyType(words[3]);
+                property._name = words[4];
+            } else if (words.size() == 3) {
+                property._countType = PlyNone;
+                property._type = ParsePlyType(words[1]);
+                property._name = words[2];
+            } else
+                THROW("Malformed 3D file (PLY property)");
+            header._elements.back()._properties.push_back(property);
+        }
+        // comments, obj_info etc are ignored
+    }
+    header._bodyOffset = p - data;
+
+    header._vertex = header._face = -1;
+    for(unsigned i=0; i<header._elements.size(); i++)
+        if (header._elements[i]._name == "vertex" && header._vertex == -1)
+            header._vertex = i;
+        else if (header._elements[i]._name == "face" && header._face == -1)
+            header._face = i;
+
+    header._x = header._y = header._z = header._nx = header._ny = header._nz = -1;
+    header._occlusion = -1;
+    if (header._vertex != -1) {
+        const PlyElement& vertex = header._elements[header._vertex];
+        header._x = vertex.Find("x");
+        header._y = vertex.Find("y");
+        header._z = vertex.Find("z");
+        if (header._x == -1 || header._y == -1 || header._z == -1)
+            THROW("Malformed 3D file (PLY vertices without x, y, z)");
+        header._nx = vertex.Find("nx");
+        header._ny = vertex.Find("ny");
+        header._nz = vertex.Find("nz");
+        header._occlusion = vertex.Find("red");
+    }
+
+    header._indices = header._red = header._green = header._blue = -1;
+    if (header._face != -1) {
+        const PlyElement& face = header._elements[header._face];
+        header._indices = face.Find("vertex_indices");
+        if (header._indices == -1)
+            header._indices = face.Find("vertex_index");
+        if (header._indices == -1 || face._properties[header._indices]._countType == PlyNone)
+            THROW("Malformed 3D file (PLY faces without vertex_indices)");
+        if (header._vertex == -1)
+            THROW("Malformed 3D file (PLY faces without vertices)");
+        header._red = face.Find("red");
+        header._green = face.Find("green");
+        header._blue = face.Find("blue");
+    }
+}
+
+template <class T>
+static double PlyValue(const unsigned char *raw)
+{
+    T value;
+    memcpy(&value, raw, sizeof(T));
+    return value;
+}
+
+// Reads the values of a binary PLY body, straight out of the mapped file
+class PlyBinaryReader {
+    const unsigned char *_p, *_end;
+    bool _swap;
+public:
+    bool _ok;
+
+    PlyBinaryReader(const unsigned char *p, const unsigned char *end, bool swap)
+        :_p(p), _end(end), _swap(swap), _ok(true) {}
+
+    const unsigned char *Position() const { return _p; }
+
+    double Next(PlyType type) {
+        size_t bytes = PlyTypeBytes[type];
+        if (size_t(_end - _p) < bytes) {
+            _ok = false;
+            return 0.;
+        }
+        unsigned char raw[8];
+        if (_swap)
+            for(size_t i=0; i<bytes; i++)
+                raw[i] = _p[bytes - 1 - i];
+        else
+            memcpy(raw, _p, bytes);
+        _p += bytes;
+        switch(type) {
+        case PlyInt8:    return PlyValue<Sint8>(raw);
+        case PlyUint8:   return PlyValue<Uint8>(raw);
+        case PlyInt16:   return PlyValue<Sint16>(raw);
+        case PlyUint16:  return PlyValue<Uint16>(raw);
+        case PlyInt32:   return PlyValue<Sint32>(raw);
+        case PlyUint32:  return PlyValue<Uint32>(raw);
+        case PlyFloat32: return PlyValue<float>(raw);
+        case PlyFloat64: return PlyValue<double>(raw);
+        default:         return 0.;
+        }
+    }
+
+    void Skip(double count, PlyType type) {
+        if (count < 0. || count*PlyTypeBytes[type] > double(_end - _p))
+            _ok = false;
+        else
+            _p += size_t(count)*PlyTypeBytes[type];
+    }
+};
+
+// Reads the values of a line of an ASCII PLY body
+class PlyAsciiReader {
+    const char *_p, *_end;
+public:
+    bool _ok;
+
+    PlyAsciiReader(const char *p, const char *end)
+        :_p(p), _end(end), _ok(true) {}
+
+    double Next(PlyType type) {
+        while(_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r'))
+            _p++;
+#ifdef HAVE_FLOAT_FROM_CHARS
+        // from_chars: no locale, no copies, and (unlike strtod) it stops at _end
+        std::from_chars_result result;
+        double value;
+        if (type == PlyFloat32) {
+            float f;
+            result = std::from_chars(_p, _end, f);
+            value = f;
+        } else if (type == PlyFloat64)
+            result = std::from_chars(_p, _end, value);
+        else {
+            long long i;
+            result = std::from_chars(_p, _end, i);
+            value = double(i);
+        }
+        if (result.ec != std::errc()) {
+            _ok = false;
+            return 0.;
+        }
+        _p = result.ptr;
+        return value;
+#else
+        // strtod needs a terminated string - and the line isn't
+        // (it is in the mapped file), so copy the value out first
+        char token[64];
+        size_t len = 0;
+        while(_p + len < _end && len < sizeof(token) - 1 &&
+              !isspace((unsigned char)_p[len]))
+        {
+            token[len] = _p[len];
+            len++;
+        }
+        token[len] = 0;
+        char *tokenEnd;
+        double value;
+        if (type == PlyFloat32 || type == PlyFloat64)
+            value = strtod(token, &tokenEnd);
+        else
+            value = double(strtoll(token, &tokenEnd, 10));
+        if (!len || tokenEnd != token + len) {
+            _ok = false;
+            return 0.;
+        }
+        _p += len;
+        return value;
+#endif
+    }
+
+    void Skip(double count, PlyType type) {
+        for(double i=0.; i<count && _ok; i++)
+            (void) Next(type);
+    }
+};
+
+// Reads a record of 'element': the values of its scalar properties go in
+// 'values' (indexed like the properties), the items of its list property
+// 'list' in 'items' - and any other lists are skipped. Clears in._ok if
+// the record is malformed.
+template <class Reader>
+static void ReadPlyRecord(
+    Reader& in, const PlyElement& element, int list, double *values, std::vector<Uint32>& items)
+{
+    items.clear();
+    for(unsigned i=0; i<element._properties.size() && in._ok; i++) {
+        const PlyProperty& property = element._properties[i];
+        if (property._countType == PlyNone)
+            values[i] = in.Next(property._type);
+        else {
+            double count = in.Next(property._countType);
+            if (int(i) != list)
+                in.Skip(count, property._type);
+            else if (count < 0.)
+                in._ok = false;
+            else
+                for(double k=0.; k<count && in._ok; k++) {
+                    double item = in.Next(property._type);
+                    // Negative indexes become invalid ones
+                    items.push_back(item < 0. || item > 4294967295. ? ~0u : Uint32(item));
+                }
+        }
+    }
+}
+
+// Vertex colors and face colors can be stored as bytes or as floats (0..1)
+static unsigned PlyColor(double value, PlyType type)
+{
+    if (type == PlyFloat32 || type == PlyFloat64)
+        value *= 255.;
+    return unsigned(std::min(std::max(value, 0.), 255.));
+}
+
+static void StorePlyVertex(const PlyHeader& header, const double *values, Scene& scene, unsigned i)
+{
+    // Without normals, they will be calculated in fix_normals()
+    coord nx = 0., ny = 0., nz = 0.;
+    if (header.HasNormals()) {
+        nx = values[header._nx];
+        ny = values[header._ny];
+        nz = values[header._nz];
+    }
+    scene._vertices[i] = Vertex(values[header._x], values[header._y], values[header._z], nx, ny, nz);
+    if (header._occlusion != -1) {
+        PlyType type = header._elements[header._vertex]._properties[header._occlusion]._type;
+        scene._ambientOcclusion[i] = (unsigned char) PlyColor(values[header._occlusion], type);
+    }
+}
+
+static Uint32 PlyFaceColor(const PlyHeader& header, const double *values)
+{
+    const std::vector<PlyProperty>& properties = header._elements[header._face]._properties;
+    unsigned r = 255, g = 255, b = 255;
+    if (header._red != -1)
+        r = PlyColor(values[header._red], properties[header._red]._type);
+    if (header._green != -1)
+        g = PlyColor(values[header._green], properties[header._green]._type);
+    if (header._blue != -1)
+        b = PlyColor(values[header._blue], properties[header._blue]._type);
+    return (r<<16) | (g<<8) | b;
+}
+
+// The triangles of a face (a fan, for polygons), or false if any of its
+// indexes is out of range. The triangles' centers need the vertices, so
+// they must all be loaded by now.
+static bool StorePlyFace(
+    const std::vector<Uint32>& items, Scene& scene, unsigned firstTriangle,
+    Uint32 color, std::vector<Uint32>& colors)
+{
+    for(unsigned k=0; k<items.size(); k++)
+        if (items[k] >= scene._vertices.size())
+            return false;
+    for(unsigned k=2; k<items.size(); k++) {
+        unsigned i = firstTriangle + k - 2;
+        scene._triangles[i] = Triangle(scene._vertices, items[0], items[k-1], items[k], 0);
+        if (!colors.empty())
+            colors[i] = color;
+    }
+    return true;
+}
+
+// Where the records of an element of a binary PLY body are - and, for the
+// faces, which triangles each one becomes
+struct PlyBinaryRecords {
+    size_t _start, _end;
+    // If all records are the same (lists with the same number of items),
+    // they take '_stride' bytes and make '_trianglesPerRecord' triangles...
+    size_t _stride;
+    unsigned _trianglesPerRecord;
+    // ...otherwise, this is where each one starts, and its first triangle
+    // (plus the total, at the end)
+    std::vector<size_t> _offsets;
+    std::vector<unsigned> _firstTriangle;
+
+    size_t Offset(unsigned i) const {
+        return _offsets.empty() ? _start + i*_stride : _offsets[i];
+    }
+    unsigned FirstTriangle(unsigned i) const {
+        return _firstTriangle.empty() ? i*_trianglesPerRecord : _firstTriangle[i];
+    }
+};
+
+// Checks that a block of records has lists of the same lengths as the first
+// one (i.e. that they are all at multiples of its size); marks it in 'bad'
+// if not.
+class PlyCheckStride {
+    const MappedFile& _file;
+    const PlyBinaryRecords& _records;
+    unsigned _count;
+    bool _swap;
+    const std::vector<size_t>& _countOffsets;
+    const std::vector<PlyType>& _countTypes;
+    const std::vector<double>& _counts;
+    std::vector<unsigned char>& _bad;
+public:
+    PlyCheckStride(
+        const MappedFile& file, const PlyBinaryRecords& records, unsigned count, bool swap,
+        const std::vector<size_t>& countOffsets, const std::vector<PlyType>& countTypes,
+        const std::vector<double>& counts, std::vector<unsigned char>& bad)
+        :
+        _file(file), _records(records), _count(count), _swap(swap),
+        _countOffsets(countOffsets), _countTypes(countTypes), _counts(counts), _bad(bad)
+        {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _count);
+        const unsigned char *fileEnd = _file.Data() + _file.Size();
+        for(unsigned i=start; i<end; i++)
+            for(unsigned k=0; k<_countOffsets.size(); k++) {
+                PlyBinaryReader in(_file.Data() + _records.Offset(i) + _countOffsets[k], fileEnd, _swap);
+                if (in.Next(_countTypes[k]) != _counts[k]) {
+                    _bad[block] = 1;
+                    return;
+                }
+            }
+    }
+};
+
+// Finds the records of element 'e' of a binary PLY body, that start at 'start'
+static void LocatePlyRecords(
+    const MappedFile& file, const PlyHeader& header, bool swap, int e, size_t start,
+    PlyBinaryRecords& records)
+{
+    const PlyElement& element = header._elements[e];
+    const unsigned char *data = file.Data(), *fileEnd = data + file.Size();
+    int list = (e == header._face) ? header._indices : -1;
+    records._start = start;
+    records._stride = 0;
+    records._trianglesPerRecord = 0;
+    if (!element._count) {
+        records._end = start;
+        return;
+    }
+
+    // The size of the first record, and where (and how long) its lists are
+    std::vector<size_t> countOffsets;
+    std::vector<PlyType> countTypes;
+    std::vector<double> counts;
+    PlyBinaryReader in(data + start, fileEnd, swap);
+    for(unsigned i=0; i<element._properties.size() && in._ok; i++) {
+        const PlyProperty& property = element._properties[i];
+        if (property._countType == PlyNone) {
+            in.Skip(1., property._type);
+            continue;
+        }
+        countOffsets.push_back(in.Position() - (data + start));
+        countTypes.push_back(property._countType);
+        counts.push_back(in.Next(property._countType));
+        in.Skip(counts.back(), property._type);
+        if (int(i) == list && counts.back() >= 3.)
+            records._trianglesPerRecord = unsigned(counts.back()) - 2;
+    }
+    if (!in._ok)
+        THROW("Malformed 3D file");
+    records._stride = in.Position() - (data + start);
+
+    // If all the others are the same, that's all we need...
+    bool same = file.Contains(start, element._count*records._stride);
+    if (same && !countOffsets.empty()) {
+        std::vector<unsigned char> bad(LoadBlocks(element._count), 0);
+        ParallelFor(0, LoadBlocks(element._count), 1,
+            PlyCheckStride(file, records, element._count, swap, countOffsets, countTypes, counts, bad));
+        same = std::find(bad.begin(), bad.end(), 1) == bad.end();
+    }
+    if (same) {
+        records._end = start + element._count*records._stride;
+        return;
+    }
+
+    // ...if not, walk over them
+    records._offsets.resize(element._count);
+    if (list != -1)
+        records._firstTriangle.resize(element._count + 1);
+    std::vector<double> values(element._properties.size());
+    std::vector<Uint32> items;
+    PlyBinaryReader walker(data + start, fileEnd, swap);
+    unsigned triangles = 0;
+    for(unsigned i=0; i<element._count; i++) {
+        records._offsets[i] = walker.Position() - data;
+        ReadPlyRecord(walker, element, list, &values[0], items);
+        if (!walker._ok)
+            THROW("Malformed 3D file");
+        if (list != -1) {
+            records._firstTriangle[i] = triangles;
+            if (items.size() >= 3)
+                triangles += items.size() - 2;
+        }
+    }
+    if (list != -1)
+        records._firstTriangle[element._count] = triangles;
+    records._end = walker.Position() - data;
+}
+
+// Decodes a block of the vertices of a binary PLY body
+class PlyBinaryVertices {
+    const MappedFile& _file;
+    const PlyHeader& _header;
+    const PlyBinaryRecords& _records;
+    bool _swap;
+    Scene& _scene;
+public:
+    PlyBinaryVertices(
+        const MappedFile& file, const PlyHeader& header, const PlyBinaryRecords& records,
+        bool swap, Scene& scene)
+        :
+        _file(file), _header(header), _records(records), _swap(swap), _scene(scene)
+        {}
+
+    void operator()(int block) const {
+        const PlyElement& element = _header._elements[_header._vertex];
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, element._count);
+        std::vector<double> values(element._properties.size());
+        std::vector<Uint32> items;
+        for(unsigned i=start; i<end; i++) {
+            PlyBinaryReader in(_file.Data() + _records.Offset(i), _file.Data() + _file.Size(), _swap);
+            ReadPlyRecord(in, element, -1, &values[0], items);
+            StorePlyVertex(_header, &values[0], _scene, i);
+        }
+    }
+};
+
+// Decodes a block of the faces of a binary PLY body into their triangles;
+// marks it in 'malformed' if any index is out of range
+class PlyBinaryFaces {
+    const MappedFile& _file;
+    const PlyHeader& _header;
+    const PlyBinaryRecords& _records;
+    bool _swap;
+    Scene& _scene;
+    std::vector<Uint32>& _colors;
+    std::vector<unsigned char>& _malformed;
+public:
+    PlyBinaryFaces(
+        const MappedFile& file, const PlyHeader& header, const PlyBinaryRecords& records,
+        bool swap, Scene& scene, std::vector<Uint32>& colors, std::vector<unsigned char>& malformed)
+        :
+        _file(file), _header(header), _records(records), _swap(swap), _scene(scene),
+        _colors(colors), _malformed(malformed)
+        {}
+
+    void operator()(int block) const {
+        const PlyElement& element = _header._elements[_header._face];
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, element._count);
+        std::vector<double> values(element._properties.size());
+        std::vector<Uint32> items;
+        for(unsigned i=start; i<end; i++) {
+            PlyBinaryReader in(_file.Data() + _records.Offset(i), _file.Data() + _file.Size(), _swap);
+            ReadPlyRecord(in, element, _header._indices, &values[0], items);
+            if (!StorePlyFace(
+                    items, _scene, _records.FirstTriangle(i), PlyFaceColor(_header, &values[0]), _colors)) {
+                _malformed[block] = 1;
+                return;
+            }
+        }
+    }
+};
+
+// Bytes of ASCII PLY body per chunk parsed in parallel
+#define PLY_ASCII_CHUNK (1<<18)
+
+// An ASCII PLY body has a record per (non-blank) line
+static bool IsBlankLine(const char *p, const char *end)
+{
+    for(; p<end; p++)
+        if (*p != ' ' && *p != '\t' && *p != '\r')
+            return false;
+    return true;
+}
+
+static const char *EndOfLine(const char *p, const char *end)
+{
+    const char *eol = (const char *) memchr(p, '\n', end - p);
+    return eol ? eol : end;
+}
+
+// Counts the records in each chunk of an ASCII PLY body
+class PlyAsciiCountRecords {
+    const std::vector<const char *>& _chunks;
+    std::vector<unsigned>& _records;
+public:
+    PlyAsciiCountRecords(const std::vector<const char *>& chunks, std::vector<unsigned>& records)
+        :_chunks(chunks), _records(records) {}
+
+    void operator()(int chunk) const {
+        unsigned records = 0;
+        for(const char *p = _chunks[chunk]; p < _chunks[chunk+1]; ) {
+            const char *eol = EndOfLine(p, _chunks[chunk+1]);
+            if (!IsBlankLine(p, eol))
+                records++;
+            p = eol + 1;
+        }
+        _records[chunk] = records;
+    }
+};
+
+// The triangles of a face, as parsed (before the Triangles can be created)
+struct PlyTriangle {
+    Uint32 _idx[3];
+    Uint32 _color;
+};
+
+// Parses the records of a chunk of an ASCII PLY body: the vertices go
+// straight in the scene, the triangles in the chunk's list. Marks it in
+// 'malformed' if any record can't be parsed, or has an index out of range.
+class PlyAsciiParse {
+    const PlyHeader& _header;
+    const std::vector<const char *>& _chunks;
+    const std::vector<unsigned>& _firstRecord;
+    const std::vector<unsigned>& _firstRecordOfElement;
+    Scene& _scene;
+    std::vector<std::vector<PlyTriangle> >& _triangles;
+    std::vector<unsigned char>& _malformed;
+public:
+    PlyAsciiParse(
+        const PlyHeader& header, const std::vector<const char *>& chunks,
+        const std::vector<unsigned>& firstRecord, const std::vector<unsigned>& firstRecordOfElement,
+        Scene& scene, std::vector<std::vector<PlyTriangle> >& triangles,
+        std::vector<unsigned char>& malformed)
+        :
+        _header(header), _chunks(chunks), _firstRecord(firstRecord),
+        _firstRecordOfElement(firstRecordOfElement), _scene(scene),
+        _triangles(triangles), _malformed(malformed)
+        {}
+
+    void operator()(int chunk) const {
+        unsigned elements = _header._elements.size();
+        unsigned record = _firstRecord[chunk];
+        unsigned e = 0;
+        std::vector<double> values;
+        std::vector<Uint32> items;
+        for(const char *p = _chunks[chunk]; p < _chunks[chunk+1]; ) {
+            const char *eol = EndOfLine(p, _chunks[chunk+1]);
+            if (IsBlankLine(p, eol)) {
+                p = eol + 1;
+                continue;
+            }
+            while(e < elements && record >= _firstRecordOfElement[e+1])
+                e++;
+            // Only the vertices and faces matter (and nothing after the last element)
+            if (int(e) == _header._vertex || int(e) == _header._face) {
+                const PlyElement& element = _header._elements[e];
+                values.resize(element._properties.size());
+                PlyAsciiReader in(p, eol);
+                if (int(e) == _header._vertex) {
+                    ReadPlyRecord(in, element, -1, &values[0], items);
+                    if (in._ok)
+                        StorePlyVertex(_header, &values[0], _scene, record - _firstRecordOfElement[e]);
+                } else {
+                    ReadPlyRecord(in, element, _header._indices, &values[0], items);
+                    for(unsigned k=0; k<items.size() && in._ok; k++)
+                        if (items[k] >= _scene._vertices.size())
+                            in._ok = false;
+                    PlyTriangle triangle;
+                    triangle._color = PlyFaceColor(_header, &values[0]);
+                    for(unsigned k=2; k<items.size() && in._ok; k++) {
+                        triangle._idx[0] = items[0];
+                        triangle._idx[1] = items[k-1];
+                        triangle._idx[2] = items[k];
+                        _triangles[chunk].push_back(triangle);
+                    }
+                }
+                if (!in._ok) {
+                    _malformed[chunk] = 1;
+                    return;
+                }
+            }
+            record++;
+            p = eol + 1;
+        }
+    }
+};
+
+// Creates the Triangles of a chunk of an ASCII PLY body
+class PlyAsciiTriangles {
+    const std::vector<std::vector<PlyTriangle> >& _parsed;
+    const std::vector<unsigned>& _firstTriangle;
+    Scene& _scene;
+    std::vector<Uint32>& _colors;
+public:
+    PlyAsciiTriangles(
+        const std::vector<std::vector<PlyTriangle> >& parsed,
+        const std::vector<unsigned>& firstTriangle, Scene& scene, std::vector<Uint32>& colors)
+        :_parsed(parsed), _firstTriangle(firstTriangle), _scene(scene), _colors(colors) {}
+
+    void operator()(int chunk) const {
+        for(unsigned k=0; k<_parsed[chunk].size(); k++) {
+            const PlyTriangle& triangle = _parsed[chunk][k];
+            unsigned i = _firstTriangle[chunk] + k;
+            _scene._triangles[i] = Triangle(
+                _scene._vertices, triangle._idx[0], triangle._idx[1], triangle._idx[2], 0);
+            if (!_colors.empty())
+                _colors[i] = triangle._color;
+        }
+    }
+};
+
+// Loads a PLY file in 'scene' - returning whether it had vertex normals
+static bool LoadPLY(const char *filename, Scene& scene, MaterialTable& materials)
+{
+    MappedFile file(filename);
+    PlyHeader header;
+    ParsePlyHeader(file, header);
+
+    unsigned totalVertices = header._vertex != -1 ? header._elements[header._vertex]._count : 0;
+    scene._vertices.resize(totalVertices);
+    if (header._occlusion != -1)
+        scene._ambientOcclusion.resize(totalVertices);
+
+    // The face colors (packed as 0xRRGGBB) are turned into materials at the
+    // end, serially - the table of materials is shared
+    std::vector<Uint32> colors;
+
+    if (header._format == PlyAscii) {
+        // Split the body in chunks of whole lines...
+        const char *data = (const char *) file.Data();
+        const char *body = data + header._bodyOffset, *end = data + file.Size();
+        std::vector<const char *> chunks(1, body);
+        while(chunks.back() < end) {
+            const char *p = chunks.back() + std::min<size_t>(PLY_ASCII_CHUNK, end - chunks.back());
+            if (p < end)
+                p = EndOfLine(p, end) + 1;
+            chunks.push_back(std::min(p, end));
+        }
+        int totalChunks = chunks.size() - 1;
+
+        // ...count the records in each one, to know which they are...
+        std::vector<unsigned> records(totalChunks), firstRecord(totalChunks + 1, 0);
+        ParallelFor(0, totalChunks, 1, PlyAsciiCountRecords(chunks, records));
+        for(int i=0; i<totalChunks; i++)
+            firstRecord[i+1] = firstRecord[i] + records[i];
+        std::vector<unsigned> firstRecordOfElement(header._elements.size() + 1, 0);
+        for(unsigned e=0; e<header._elements.size(); e++)
+            firstRecordOfElement[e+1] = firstRecordOfElement[e] + header._elements[e]._count;
+        if (firstRecord[totalChunks] < firstRecordOfElement[header._elements.size()])
+            THROW("Malformed 3D file (truncated PLY body)");
+
+        // ...parse them (the vertices first, since the triangles need them)...
+        std::vector<std::vector<PlyTriangle> > parsed(totalChunks);
+        std::vector<unsigned char> malformed(totalChunks, 0);
+        ParallelFor(0, totalChunks, 1,
+            PlyAsciiParse(header, chunks, firstRecord, firstRecordOfElement, scene, parsed, malformed));
+        if (std::find(malformed.begin(), malformed.end(), 1) != malformed.end())
+            THROW("Malformed 3D file (PLY record)");
+
+        // ...and create the triangles
+        std::vector<unsigned> firstTriangle(totalChunks + 1, 0);
+        for(int i=0; i<totalChunks; i++)
+            firstTriangle[i+1] = firstTriangle[i] + parsed[i].size();
+        scene._triangles.resize(firstTriangle[totalChunks]);
+        if (header.HasColors())
+            colors.resize(scene._triangles.size());
+        ParallelFor(0, totalChunks, 1, PlyAsciiTriangles(parsed, firstTriangle, scene, colors));
+    } else {
+        Uint32 one = 1;
+        bool littleEndianHost = *(unsigned char *) &one == 1;
+        bool swap = littleEndianHost != (header._format == PlyBinaryLittleEndian);
+
+        // Find where each element is...
+        std::vector<PlyBinaryRecords> records(header._elements.size());
+        size_t offset = header._bodyOffset;
+        for(unsigned e=0; e<header._elements.size(); e++) {
+            LocatePlyRecords(file, header, swap, e, offset, records[e]);
+            offset = records[e]._end;
+        }
+
+        // ...and decode the vertices, then the faces
+        if (header._vertex != -1)
+            ParallelFor(0, LoadBlocks(totalVertices), 1,
+                PlyBinaryVertices(file, header, records[header._vertex], swap, scene));
+        if (header._face != -1) {
+            const PlyBinaryRecords& faces = records[header._face];
+            unsigned totalFaces = header._elements[header._face]._count;
+            scene._triangles.resize(faces.FirstTriangle(totalFaces));
+            if (header.HasColors())
+                colors.resize(scene._triangles.size());
+            std::vector<unsigned char> malformed(LoadBlocks(totalFaces), 0);
+            ParallelFor(0, LoadBlocks(totalFaces), 1,
+                PlyBinaryFaces(file, header, faces, swap, scene, colors, malformed));
+            if (std::find(malformed.begin(), malformed.end(), 1) != malformed.end())
+                THROW("Malformed 3D file (triangle index)");
+        }
+    }
+
+    if (!colors.empty()) {
+        for(unsigned i=0; i<scene._triangles.size(); i++)
+            scene._triangles[i]._material =
+                materials(colors[i]>>16, (colors[i]>>8) & 0xFF, colors[i] & 0xFF);
+    } else {
+        // No colors? White, then... :-(
+        unsigned white = materials(255, 255, 255);
+        for(unsigned i=0; i<scene._triangles.size(); i++)
+            scene._triangles[i]._material = white;
+    }
+    return header.HasNormals();
+}
+
+// Bounding box of the vertices used by each block of triangles
+class TriangleBlockBounds {
+    const Scene& _scene;
+    Vector3 *_bottom, *_top;
+public:
+    TriangleBlockBounds(const Scene& scene, Vector3 *bottom, Vector3 *top)
+        :_scene(scene), _bottom(bottom), _top(top) {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._triangles.size());
+        Vector3 minp(FLT_MAX,FLT_MAX,FLT_MAX), maxp(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+        for(unsigned i=start; i<end; i++) {
+            const Triangle& triangle = _scene._triangles[i];
+            minp.assignSmaller(_scene._vertices[triangle._idxA]);
+            minp.assignSmaller(_scene._vertices[triangle._idxB]);
+            minp.assignSmaller(_scene._vertices[triangle._idxC]);
+            maxp.assignBigger(_scene._vertices[triangle._idxA]);
+            maxp.assignBigger(_scene._vertices[triangle._idxB]);
+            maxp.assignBigger(_scene._vertices[triangle._idxC]);
+        }
+        _bottom[block] = minp;
+        _top[block] = maxp;
+    }
+};
+
+// Moves a block of vertices by -origin, and scales them
+class RescaleVertexBlock {
+    Scene& _scene;
+    const Vector3& _origin;
+    coord _scale;
+public:
+    RescaleVertexBlock(Scene& scene, const Vector3& origin, coord scale)
+        :_scene(scene), _origin(origin), _scale(scale) {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._vertices.size());
+        for(unsigned i=start; i<end; i++) {
+            _scene._vertices[i] -= _origin;
+            _scene._vertices[i] *= _scale;
+        }
+    }
+};
+
+// The same for the centers of a block of triangles - whose planes are then
+// computed from the (already rescaled) vertices
+class RescaleTriangleBlock {
+    Scene& _scene;
+    const Vector3& _origin;
+    coord _scale;
+public:
+    RescaleTriangleBlock(Scene& scene, const Vector3& origin, coord scale)
+        :_scene(scene), _origin(origin), _scale(scale) {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._triangles.size());
+        for(unsigned i=start; i<end; i++) {
+            Triangle& triangle = _scene._triangles[i];
+            triangle._center -= _origin;
+            triangle._center *= _scale;
+
+            const Vertex& vertexA = _scene._vertices[triangle._idxA];
+            const Vertex& vertexB = _scene._vertices[triangle._idxB];
+            const Vertex& vertexC = _scene._vertices[triangle._idxC];
+
+            // edge vectors
+            Vector3 vc1=vertexB; vc1-=vertexA;
+            Vector3 vc2=vertexC; vc2-=vertexB;
+            Vector3 vc3=vertexA; vc3-=vertexC;
+
+            // plane of triangle (the raytracer's intersection data are based on it)
+            triangle._normal = cross(vc1, vc2);
+            Vector3 alt1 = cross(vc2, vc3);
+            if (alt1.length() > triangle._normal.length()) triangle._normal = alt1;
+            Vector3 alt2 = cross(vc3, vc1);
+            if (alt2.length() > triangle._normal.length()) triangle._normal = alt2;
+            triangle._normal.normalize();
+        }
+    }
+};
+
 #define SAFE_FREAD(a, b, c, d) do { \
   if (c != fread(a, b, c, d)) {     \
     THROW("Malformed 3D file");     \
@@ -84,6 +1155,8 @@ const coord Scene::MaxCoordAfterRescale = 1.2f;
 
 void Scene::load(const char *filename)
 {
+    MaterialTable materials(_materials);
+
     if (filename[0] == '@' && filename[1] == 'p') {     // Platform
         _vertices.reserve(4);
         _vertices.push_back(Vertex( 0.5, -0.5, 0.,  0.,0.,1.));
@@ -91,8 +1164,10 @@ void Scene::load(const char *filename)
         _vertices.push_back(Vertex(-0.5,  0.5, 0.,  0.,0.,1.));
         _vertices.push_back(Vertex(-0.5, -0.5, 0.,  0.,0.,1.));
         _triangles.reserve(2);
-        _triangles.push_back(Triangle(&_vertices[0], &_vertices[1], &_vertices[2], 255,0,0));
-        _triangles.push_back(Triangle(&_vertices[0], &_vertices[2], &_vertices[3], 255,0,0));
+        _ambientOcclusion.resize(4, DEFAULT_AMBIENT_OCCLUSION);
+        _triangles.push_back(Triangle(_vertices, 0, 1, 2, materials(255,0,0)));
+        _triangles.push_back(Triangle(_vertices, 0, 2, 3, materials(255,0,0)));
+        CreateClusters();
         return;
 
     }
@@ -118,106 +1193,74 @@ void Scene::load(const char *filename)
             //        ...
             //        idx,idx,idx (uint32 indices into the vertex array)
             //        (magic == TRI_MAGIC | TRI_MAGICNORMAL)? r,g,b (floats)
-            FILE *fp = fopen(filename, "rb");
-            if (!fp)
-                THROW((string("File '") + string(filename) + string("' not found!")).c_str());
+            MappedFile file(filename);
 
-            Uint32 totalPoints = 0, totalTris = 0;
             Uint32 magic;
-
-            SAFE_FREAD(&magic, 1, sizeof(Uint32), fp);
+            memcpy(&magic, file.At(0, sizeof(Uint32)), sizeof(Uint32));
+            size_t offset = sizeof(Uint32);
             if (magic != TRI_MAGIC && magic != TRI_MAGICNORMAL) {
                 // No magic, just vertices and points (no normals, no colors)
-                (void)fseek(fp, 0, SEEK_SET);
+                offset = 0;
             }
+            bool hasNormals = magic == TRI_MAGICNORMAL;
+            bool hasColors = magic == TRI_MAGIC || magic == TRI_MAGICNORMAL;
+            size_t vertexBytes = hasNormals ? 24 : 12;
+            size_t triangleBytes = hasColors ? 24 : 12;
 
-            // Calculate total number of vertices in order to reserve the vectors memory
-            unsigned currentOffset = ftell(fp);
-            ASSERT_OR_DIE(currentOffset != (unsigned) - 1);
-            unsigned currentTotalPoints = 0;
-            unsigned currentTotalTris = 0;
-            while(1) {
-                unsigned temp;
-                (void) fread(&temp, 1, sizeof(Uint32), fp);
-                if (feof(fp))
-                    break;
-                currentTotalPoints += temp;
-                (void) fseek(fp, temp*(magic==TRI_MAGICNORMAL?24:12), SEEK_CUR);
-                SAFE_FREAD(&temp, 1, sizeof(Uint32), fp);
-                if (feof(fp))
-                    break;
-                currentTotalTris += temp;
-                (void) fseek(fp, temp*24, SEEK_CUR);
+            // Find where the vertices and triangles of each block are
+            // (checking that they are all inside the file)...
+            std::vector<TriFileBlock> blocks;
+            Uint32 totalPoints = 0, totalTris = 0;
+            while(file.Size() - offset >= sizeof(Uint32)) {
+                TriFileBlock block;
+                memcpy(&block._points, file.At(offset, sizeof(Uint32)), sizeof(Uint32));
+                block._firstPoint = totalPoints;
+                block._pointsOffset = offset + sizeof(Uint32);
+                (void) file.At(block._pointsOffset, block._points*vertexBytes);
+                offset = block._pointsOffset + block._points*vertexBytes;
+
+                memcpy(&block._tris, file.At(offset, sizeof(Uint32)), sizeof(Uint32));
+                block._firstTri = totalTris;
+                block._trisOffset = offset + sizeof(Uint32);
+                (void) file.At(block._trisOffset, block._tris*triangleBytes);
+                offset = block._trisOffset + block._tris*triangleBytes;
+
+                totalPoints += block._points;
+                totalTris   += block._tris;
+                blocks.push_back(block);
             }
 
-            // Reserve the space, now that you know
-            if (magic == TRI_MAGICNORMAL || magic == TRI_MAGIC)
-                _vertices.reserve(currentTotalPoints);
-            else
-                // when we have no normals, we'll need extra space for fix_normals()...
-                _vertices.reserve(currentTotalTris*3);
-            _triangles.reserve(currentTotalTris);
+            // ...then parse them, in parallel: first the vertices...
+            _vertices.resize(totalPoints);
+            ParallelFor(0, LoadBlocks(totalPoints), 1,
+                TriFileVertices(file, blocks, hasNormals, _vertices));
 
-            // Now load them inside the std::vectors...
-            (void) fseek(fp, currentOffset, SEEK_SET);
-            do {
-                Uint32 noOfPoints;
-                (void) fread(&noOfPoints, 1, sizeof(Uint32), fp);
-                if (feof(fp))
-                    break;
-
-                for(Uint32 i=0; i<noOfPoints; i++) {
-                    float x,y,z;
-                    SAFE_FREAD(&x,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    SAFE_FREAD(&y,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    SAFE_FREAD(&z,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-
-                    float nx=0.,ny=0.,nz=0.;
-                    if (magic == TRI_MAGICNORMAL) {
-                      SAFE_FREAD(&nx,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                      SAFE_FREAD(&ny,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                      SAFE_FREAD(&nz,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    } else {
-                        nx = ny = nz = 0; // Will be calculated in fix_normals()
-                    }
-                    assert(_vertices.size() < _vertices.capacity());
-                    _vertices.push_back(Vertex(x,y,z, nx,ny,nz));
-                }
+            // ...then the triangles (that need the vertices for their centers)...
+            _triangles.resize(totalTris);
+            std::vector<unsigned char> malformed(LoadBlocks(totalTris), 0);
+            ParallelFor(0, LoadBlocks(totalTris), 1,
+                TriFileTriangles(file, blocks, hasColors, _vertices, _triangles, malformed));
+            if (std::find(malformed.begin(), malformed.end(), 1) != malformed.end())
+                THROW("Malformed 3D file (triangle index)");
 
-                Uint32 noOfTris;
-                SAFE_FREAD(&noOfTris, 1, sizeof(Uint32), fp);
-                if (feof(fp)) { THROW("Malformed 3D file"); }
-
-                for(Uint32 i=0; i<noOfTris; i++) {
-                    Uint32 idx1,idx2,idx3;
-                    SAFE_FREAD(&idx1,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    SAFE_FREAD(&idx2,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    SAFE_FREAD(&idx3,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                    if (idx1>=(totalPoints+noOfPoints)) { THROW("Malformed 3D file (idx1)"); }
-                    if (idx2>=(totalPoints+noOfPoints)) { THROW("Malformed 3D file (idx2)"); }
-                    if (idx3>=(totalPoints+noOfPoints)) { THROW("Malformed 3D file (idx3)"); }
-
-                    float r,g,b;
-                    if (magic == TRI_MAGIC || magic == TRI_MAGICNORMAL) {
-                      SAFE_FREAD(&r,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                      SAFE_FREAD(&g,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                      SAFE_FREAD(&b,1,4,fp); if (feof(fp)) { THROW("Malformed 3D file"); }
-                        r*=255.; g*=255.; b*=255.;
-                    } else {
-                        r = g = b = 255.0; // No colors? White, then... :-(
+            // ...and finally their colors, serially (the table of materials is shared)
+            if (hasColors) {
+                for(unsigned i=0; i<blocks.size(); i++) {
+                    const unsigned char *p = file.Data() + blocks[i]._trisOffset;
+                    Triangle *pTriangle = &_triangles[blocks[i]._firstTri];
+                    for(Uint32 j=0; j<blocks[i]._tris; j++, p+=triangleBytes, pTriangle++) {
+                        float rgb[3];
+                        memcpy(rgb, p + 3*sizeof(Uint32), sizeof(rgb));
+                        float r = rgb[0]*255., g = rgb[1]*255., b = rgb[2]*255.;
+                        pTriangle->_material = materials(unsigned(r),unsigned(g),unsigned(b));
                     }
-
-                    _triangles.push_back(
-                        Triangle(
-                            &_vertices[idx1], &_vertices[idx2], &_vertices[idx3],
-                            unsigned(r),unsigned(g),unsigned(b)));
                 }
-
-                totalPoints += noOfPoints;
-                totalTris   += noOfTris;
-            } while(!feof(fp));
-
-            fclose(fp);
+            } else {
+                // No colors? White, then... :-(
+                unsigned white = materials(255, 255, 255);
+                for(unsigned i=0; i<_triangles.size(); i++)
+                    _triangles[i]._material = white;
+            }
             if (magic != TRI_MAGICNORMAL)
                 fix_normals();
 
@@ -268,10 +1311,13 @@ void Scene::load(const char *filename)
 
                 _triangles.push_back(
                     Triangle(
-                        &_vertices[idx1], &_vertices[idx2], &_vertices[idx3],
-                        unsigned(r),unsigned(g),unsigned(b)));
+                        _vertices, idx1, idx2, idx3,
+                        materials(unsigned(r),unsigned(g),unsigned(b))));
             }
             fclose(fp);
+            // A vertex per triangle corner - share them, so that
+            // fix_normals() smooths across the triangles
+            WeldVertices();
             fix_normals();
         } else if (!strcmp(dt, "3ds") || !strcmp(dt, "3DS")) {
             int i = 0;
@@ -337,11 +1383,11 @@ void Scene::load(const char *filename)
                     assert(_triangles.size() < _triangles.capacity());
                     _triangles.push_back(
                         Triangle(
-                            &_vertices[currentTotalPoints + 3*i],
-                            &_vertices[currentTotalPoints + 3*i + 1],
-                            &_vertices[currentTotalPoints + 3*i + 2],
-                            r, g, b,
-                            pMat->second._twoSided,
+                            _vertices,
+                            currentTotalPoints + 3*i,
+                            currentTotalPoints + 3*i + 1,
+                            currentTotalPoints + 3*i + 2,
+                            materials(r, g, b, pMat != colors.end() && pMat->second._twoSided),
                             true,
                             Vector3(pMesh->faceL[i].normal[0],
                                     pMesh->faceL[i].normal[1],
@@ -351,80 +1397,32 @@ void Scene::load(const char *filename)
                 pMesh = pMesh->next;
             }
             free(p3DS);
+            // A vertex per face corner (with the normal of its smoothing
+            // group) - share the ones that are the same
+            WeldVertices();
         } else if (!strcmp(dt, "PLY") || !strcmp(dt, "ply")) {
-            // Only shadevis generated objects, not full blown parser!
-            std::ifstream file(filename, std::ios::in);
-            if (!file) {
-                THROW((string("Missing ")+string(filename)).c_str());
-            }
-            string line;
-            unsigned totalVertices=0, totalTriangles=0, lineNo=0;
-            bool inside = false;
-            while(getline(file, line)) {
-                lineNo++;
-                if (!inside) {
-                    if (line.substr(0, 14) == "element vertex") {
-                        std::istringstream str(line);
-                        string word1;
-                        str >> word1;
-                        str >> word1;
-                        str >> totalVertices;
-                        _vertices.reserve(totalVertices);
-                    } else if (line.substr(0, 12) == "element face") {
-                        std::istringstream str(line);
-                        string word1;
-                        str >> word1;
-                        str >> word1;
-                        str >> totalTriangles;
-                    } else if (line.substr(0, 10) == "end_header")
-                        inside = true;
-                } else {
-                    if (totalVertices) {
-                        totalVertices--;
-                        float x,y,z;
-                        unsigned ambientOcclusionCoeff;
-                        std::istringstream str(line);
-                        str >> x >> y >> z >> ambientOcclusionCoeff;
-                        _vertices.push_back(Vertex(x,y,z,0.,0.,0.,ambientOcclusionCoeff));
-                    } else if (totalTriangles) {
-                        totalTriangles--;
-                        unsigned dummy, idx1, idx2, idx3;
-                        std::istringstream str(line);
-                        if (str >> dummy >> idx1 >> idx2 >> idx3)
-                        {
-                            unsigned r, g, b;
-                            if (str >> r >> g >> b)
-                                ;
-                            else {
-                                r = 255; g = 255; b = 255;
-                            }
-                            _triangles.push_back(
-                                Triangle(
-                                    &_vertices[idx1], &_vertices[idx2], &_vertices[idx3],
-                                    r, g, b));
-                        }
-                    }
-                }
-            }
-            fix_normals();
+            if (!LoadPLY(filename, *this, materials))
+                fix_normals();
         } else
             THROW("Unknown extension (only .tri .3ds or .ply accepted)");
     } else
         THROW("No extension in filename (only .tri .3ds or .ply accepted)");
 
+    // Files without ambient occlusion data
+    _ambientOcclusion.resize(_vertices.size(), DEFAULT_AMBIENT_OCCLUSION);
+
     std::cout << "Vertexes: " << _vertices.size();
     std::cout << " Triangles: " << _triangles.size() << std::endl;
 
     // Center scene at world's center
 
+    int triangleBlocks = LoadBlocks(_triangles.size());
+    std::vector<Vector3> blockBottom(triangleBlocks), blockTop(triangleBlocks);
+    ParallelFor(0, triangleBlocks, 1, TriangleBlockBounds(*this, &blockBottom[0], &blockTop[0]));
     Vector3 minp(FLT_MAX,FLT_MAX,FLT_MAX), maxp(-FLT_MAX,-FLT_MAX,-FLT_MAX);
-    for(unsigned i=0; i<_triangles.size(); i++) {
-        minp.assignSmaller(*_triangles[i]._vertexA);
-        minp.assignSmaller(*_triangles[i]._vertexB);
-        minp.assignSmaller(*_triangles[i]._vertexC);
-        maxp.assignBigger(*_triangles[i]._vertexA);
-        maxp.assignBigger(*_triangles[i]._vertexB);
-        maxp.assignBigger(*_triangles[i]._vertexC);
+    for(int i=0; i<triangleBlocks; i++) {
+        minp.assignSmaller(blockBottom[i]);
+        maxp.assignBigger(blockTop[i]);
     }
     Vector3 origCenter = Vector3(
         (maxp._x+minp._x)/2,
@@ -444,76 +1442,168 @@ void Scene::load(const char *filename)
     maxi = std::max(maxi, (coord) fabs(maxp._y));
     maxi = std::max(maxi, (coord) fabs(maxp._z));
 
-    for(unsigned i=0; i<_vertices.size(); i++) {
-        _vertices[i] -= origCenter;
-        _vertices[i] *= MaxCoordAfterRescale/maxi;
-    }
-    for(unsigned i=0; i<_triangles.size(); i++) {
-        _triangles[i]._center -= origCenter;
-        _triangles[i]._center *= MaxCoordAfterRescale/maxi;
-    }
-    // Update triangle bounding boxes (used by BVH)
-    for(unsigned i=0; i<_triangles.size(); i++) {
-        _triangles[i]._bottom.assignSmaller(*_triangles[i]._vertexA);
-        _triangles[i]._bottom.assignSmaller(*_triangles[i]._vertexB);
-        _triangles[i]._bottom.assignSmaller(*_triangles[i]._vertexC);
-        _triangles[i]._top.assignBigger(*_triangles[i]._vertexA);
-        _triangles[i]._top.assignBigger(*_triangles[i]._vertexB);
-        _triangles[i]._top.assignBigger(*_triangles[i]._vertexC);
+    coord scale = MaxCoordAfterRescale/maxi;
+    ParallelFor(0, LoadBlocks(_vertices.size()), 1, RescaleVertexBlock(*this, origCenter, scale));
+    ParallelFor(0, triangleBlocks, 1, RescaleTriangleBlock(*this, origCenter, scale));
+    // Split the mesh in clusters, for the rasterizers' culling
+    CreateClusters();
+
+    ReportMemory();
+}
+
+class IntersectionDataBlock {
+    Scene& _scene;
+public:
+    IntersectionDataBlock(Scene& scene):_scene(scene) {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._triangles.size());
+        for(unsigned i=start; i<end; i++)
+            Compute(_scene._triangles[i], _scene._triangleIntersectionData[i]);
     }
-    // Pre-compute triangle intersection data (used by raytracer)
-    for(unsigned i=0; i<_triangles.size(); i++) {
-        Triangle& triangle = _triangles[i];
+
+    void Compute(const Triangle& triangle, TriangleIntersectionData& data) const {
+        const Vertex& vertexA = _scene._vertices[triangle._idxA];
+        const Vertex& vertexB = _scene._vertices[triangle._idxB];
+        const Vertex& vertexC = _scene._vertices[triangle._idxC];
 
         // Algorithm for triangle intersection is taken from Roman Kuchkuda's paper.
         // edge vectors
-        Vector3 vc1=*triangle._vertexB; vc1-=*triangle._vertexA;
-        Vector3 vc2=*triangle._vertexC; vc2-=*triangle._vertexB;
-        Vector3 vc3=*triangle._vertexA; vc3-=*triangle._vertexC;
-
-        // plane of triangle
-        triangle._normal = cross(vc1, vc2); 
-        Vector3 alt1 = cross(vc2, vc3);
-        if (alt1.length() > triangle._normal.length()) triangle._normal = alt1;
-        Vector3 alt2 = cross(vc3, vc1);
-        if (alt2.length() > triangle._normal.length()) triangle._normal = alt2;
-        triangle._normal.normalize();
-        triangle._d = dot(triangle._normal, *triangle._vertexA);
+        Vector3 vc1=vertexB; vc1-=vertexA;
+        Vector3 vc2=vertexC; vc2-=vertexB;
+        Vector3 vc3=vertexA; vc3-=vertexC;
+
+        // plane of triangle (its normal was computed at load time)
+        data._normal = triangle._normal;
+        data._d = dot(data._normal, vertexA);
 
         // edge planes
-        triangle._e1 = cross(triangle._normal, vc1); 
-        triangle._e1.normalize();
-        triangle._d1 = dot(triangle._e1, *triangle._vertexA);
-        triangle._e2 = cross(triangle._normal, vc2); 
-        triangle._e2.normalize();
-        triangle._d2 = dot(triangle._e2, *triangle._vertexB);
-        triangle._e3 = cross(triangle._normal, vc3); 
-        triangle._e3.normalize();
-        triangle._d3 = dot(triangle._e3, *triangle._vertexC);
+        data._e1 = cross(data._normal, vc1);
+        data._e1.normalize();
+        data._d1 = dot(data._e1, vertexA);
+        data._e2 = cross(data._normal, vc2);
+        data._e2.normalize();
+        data._d2 = dot(data._e2, vertexB);
+        data._e3 = cross(data._normal, vc3);
+        data._e3.normalize();
+        data._d3 = dot(data._e3, vertexC);
     }
+};
+
+void Scene::UpdateTriangleIntersectionData()
+{
+    if (_triangleIntersectionData.size() == _triangles.size())
+        return;
+
+    // Pre-compute triangle intersection data (used by raytracer)
+    _triangleIntersectionData.resize(_triangles.size());
+    ParallelFor(0, LoadBlocks(_triangles.size()), 1, IntersectionDataBlock(*this));
 }
 
-void Scene::fix_normals(void)
+void Scene::ReportMemory() const
+{
+    // The raytracer adds the intersection data and the BVH (see ReportBVHMemory)
+    double vertexBytes = double(_vertices.size())*(sizeof(Vertex) + sizeof(unsigned char));
+    double triangleBytes = double(_triangles.size())*sizeof(Triangle);
+    double otherBytes =
+        double(_materials.size())*sizeof(Material) +
+        double(_clusters.size())*sizeof(TriangleCluster) +
+        double(_cullingNodes.size())*sizeof(CullingNode);
+    double total = vertexBytes + triangleBytes + otherBytes;
+    printf("Scene memory: %.1f MB (vertices %.1f MB, triangles %.1f MB, materials and clusters %.1f MB)\n",
+        total/1048576., vertexBytes/1048576., triangleBytes/1048576., otherBytes/1048576.);
+    printf("              %.1f MB per million triangles, plus %.1f MB when raytracing\n",
+        total/1048576.*1e6/std::max<size_t>(_triangles.size(), 1),
+        1e6*sizeof(TriangleIntersectionData)/1048576.);
+}
+
+void Scene::BuildVertexTriangles(
+    std::vector<unsigned>& firstOfVertex, std::vector<int>& trianglesOfVertex) const
 {
-    for(unsigned j=0; j<_triangles.size(); j++) {
-        Vector3 worldPointA = *_triangles[j]._vertexA;
-        Vector3 worldPointB = *_triangles[j]._vertexB;
-        Vector3 worldPointC = *_triangles[j]._vertexC;
-        Vector3 AB = worldPointB;
-        AB -= worldPointA;
-        Vector3 AC = worldPointC;
-        AC -= worldPointA;
-        Vector3 cr = cross(AB, AC);
-        cr.normalize();
-        _triangles[j]._normal = cr;
-        const_cast<Vertex*>(_triangles[j]._vertexA)->_normal += cr;
-        const_cast<Vertex*>(_triangles[j]._vertexB)->_normal += cr;
-        const_cast<Vertex*>(_triangles[j]._vertexC)->_normal += cr;
-    }
-    for(unsigned j=0; j<_triangles.size(); j++) {
-        const_cast<Vertex*>(_triangles[j]._vertexA)->_normal.normalize();
-        const_cast<Vertex*>(_triangles[j]._vertexB)->_normal.normalize();
-        const_cast<Vertex*>(_triangles[j]._vertexC)->_normal.normalize();
+    unsigned total = _triangles.size();
+    firstOfVertex.assign(_vertices.size() + 1, 0);
+    for(unsigned i=0; i<total; i++) {
+        firstOfVertex[_triangles[i]._idxA + 1]++;
+        firstOfVertex[_triangles[i]._idxB + 1]++;
+        firstOfVertex[_triangles[i]._idxC + 1]++;
     }
+    for(unsigned v=0; v<_vertices.size(); v++)
+        firstOfVertex[v+1] += firstOfVertex[v];
+    trianglesOfVertex.resize(3*total);
+    std::vector<unsigned> fill(firstOfVertex.begin(), firstOfVertex.end() - 1);
+    for(unsigned i=0; i<total; i++) {
+        trianglesOfVertex[fill[_triangles[i]._idxA]++] = i;
+        trianglesOfVertex[fill[_triangles[i]._idxB]++] = i;
+        trianglesOfVertex[fill[_triangles[i]._idxC]++] = i;
+    }
+}
+
+// The (unit) normal of each triangle, in a block of them - or a zero one,
+// for the triangles without area, so that they add nothing to the normals
+// of their vertices (normalizing would make it a NaN, that would spread to
+// all the triangles sharing them, once welded)
+class FaceNormalBlock {
+    Scene& _scene;
+public:
+    FaceNormalBlock(Scene& scene):_scene(scene) {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._triangles.size());
+        for(unsigned j=start; j<end; j++) {
+            Triangle& triangle = _scene._triangles[j];
+            Vector3 AB = _scene._vertices[triangle._idxB];
+            AB -= _scene._vertices[triangle._idxA];
+            Vector3 AC = _scene._vertices[triangle._idxC];
+            AC -= _scene._vertices[triangle._idxA];
+            Vector3 cr = cross(AB, AC);
+            if (cr.length() > 0.f)
+                cr.normalize();
+            triangle._normal = cr;
+        }
+    }
+};
+
+// Each vertex of a block adds up the normals of its triangles - i.e. it
+// only writes to itself, so the blocks don't race with each other.
+class VertexNormalBlock {
+    Scene& _scene;
+    const std::vector<unsigned>& _firstOfVertex;
+    const std::vector<int>& _trianglesOfVertex;
+public:
+    VertexNormalBlock(
+        Scene& scene, const std::vector<unsigned>& firstOfVertex,
+        const std::vector<int>& trianglesOfVertex)
+        :
+        _scene(scene), _firstOfVertex(firstOfVertex), _trianglesOfVertex(trianglesOfVertex)
+        {}
+
+    void operator()(int block) const {
+        unsigned start = block*LOAD_BLOCK;
+        unsigned end = std::min<unsigned>(start + LOAD_BLOCK, _scene._vertices.size());
+        for(unsigned v=start; v<end; v++) {
+            if (_firstOfVertex[v] == _firstOfVertex[v+1])
+                continue; // not used by any triangle, leave it as it is
+            Vector3& normal = _scene._vertices[v]._normal;
+            for(unsigned k=_firstOfVertex[v]; k<_firstOfVertex[v+1]; k++)
+                normal += _scene._triangles[_trianglesOfVertex[k]]._normal;
+            // (zero if all its triangles are without area - and then
+            // they cover no pixels anyway)
+            if (normal.length() > 0.f)
+                normal.normalize();
+        }
+    }
+};
+
+void Scene::fix_normals(void)
+{
+    ParallelFor(0, LoadBlocks(_triangles.size()), 1, FaceNormalBlock(*this));
+
+    std::vector<unsigned> firstOfVertex;
+    std::vector<int> trianglesOfVertex;
+    BuildVertexTriangles(firstOfVertex, trianglesOfVertex);
+    ParallelFor(0, LoadBlocks(_vertices.size()), 1,
+        VertexNormalBlock(*this, firstOfVertex, trianglesOfVertex));
 }
 
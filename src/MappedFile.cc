@@ -0,0 +1,124 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "MappedFile.h"
+#include "Exceptions.h"
+
+using std::string;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char *filename)
+    :
+    _data(NULL), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(NULL)
+{
+    HANDLE file = CreateFileA(
+	filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+	OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+	THROW((string("File '") + string(filename) + string("' not found!")).c_str());
+    _file = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+	CloseHandle(file);
+	THROW((string("Failed to read '") + string(filename) + string("'")).c_str());
+    }
+    _size = (size_t) size.QuadPart;
+    if (!_size)
+	return;
+    _mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (_mapping)
+	_data = (const unsigned char *) MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!_data) {
+	if (_mapping)
+	    CloseHandle(_mapping);
+	CloseHandle(file);
+	THROW((string("Failed to map '") + string(filename) + string("' in memory")).c_str());
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data)
+	UnmapViewOfFile(_data);
+    if (_mapping)
+	CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE)
+	CloseHandle(_file);
+}
+
+#else
+
+MappedFile::MappedFile(const char *filename)
+    :
+    _data(NULL), _size(0)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+	THROW((string("File '") + string(filename) + string("' not found!")).c_str());
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	THROW((string("Failed to read '") + string(filename) + string("'")).c_str());
+    }
+    _size = (size_t) st.st_size;
+    if (!_size) {
+	close(fd);
+	return;
+    }
+    void *p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (p == MAP_FAILED)
+	THROW((string("Failed to map '") + string(filename) + string("' in memory")).c_str());
+#ifdef MADV_WILLNEED
+    // All of it will be read soon (and by many threads, so not sequentially)
+    (void) madvise(p, _size, MADV_WILLNEED);
+#endif
+    _data = (const unsigned char *) p;
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data)
+	munmap((void *) _data, _size);
+}
+
+#endif
+
+const unsigned char *MappedFile::At(size_t offset, size_t bytes) const
+{
+    if (!Contains(offset, bytes))
+	THROW("Malformed 3D file");
+    return _data + offset;
+}
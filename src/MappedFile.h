@@ -0,0 +1,57 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __mappedfile_h__
+#define __mappedfile_h__
+
+#include <cstddef>
+
+// A file mapped (read-only) in memory, for the loaders: they parse it in
+// place, without copying it through stdio buffers - and since the whole
+// of it is addressable, different threads can parse different parts of it.
+//
+// The constructor THROWs if the file can't be opened or mapped.
+class MappedFile {
+    const unsigned char *_data;
+    size_t _size;
+#ifdef _WIN32
+    void *_file;
+    void *_mapping;
+#endif
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+public:
+    MappedFile(const char *filename);
+    ~MappedFile();
+
+    const unsigned char *Data() const { return _data; }
+    size_t Size() const { return _size; }
+
+    // Is [offset, offset+bytes) inside the file?
+    bool Contains(size_t offset, size_t bytes) const {
+	return offset <= _size && bytes <= _size - offset;
+    }
+
+    // The data at 'offset', that must have 'bytes' bytes after it
+    // (THROWs "Malformed 3D file" if it doesn't)
+    const unsigned char *At(size_t offset, size_t bytes) const;
+};
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+#include "3d.h"
+#include "Clock.h"
+
+// Reordering of the mesh for cache locality (the -o option).
+//
+// The clusters (see CullingHierarchy.h) already put the triangles in
+// roughly Morton order. Here, the triangles of each cluster are reordered
+// with Tom Forsyth's "Linear-Speed Vertex Cache Optimisation", so that
+// consecutive triangles reuse the same vertices; and the vertices are then
+// renumbered in the order the triangles first use them, so that the vertex
+// data (and the TransformedVertices arrays) are accessed almost sequentially.
+// The clusters keep their ranges of _triangles (and their bounds).
+
+// Size of the (simulated) vertex cache the reordering optimizes for
+#define VERTEX_CACHE_SIZE 32
+
+// Forsyth's scoring parameters
+static const coord CacheDecayPower = 1.5f;
+static const coord LastTriangleScore = 0.75f;
+static const coord ValenceBoostScale = 2.0f;
+static const coord ValenceBoostPower = 0.5f;
+
+// How desirable it is to use a vertex next: more if it is in the cache
+// (but not in the last triangle, to avoid strips), and more if only a few
+// triangles still need it (so it can leave the cache for good).
+static coord VertexScore(int cachePosition, unsigned remainingTriangles)
+{
+    if (!remainingTriangles)
+	return -1.f;
+
+    coord score = 0.f;
+    if (cachePosition >= 0) {
+	if (cachePosition < 3)
+	    score = LastTriangleScore;
+	else {
+	    coord scaler = 1.f/(VERTEX_CACHE_SIZE - 3);
+	    score = pow(1.f - (cachePosition - 3)*scaler, CacheDecayPower);
+	}
+    }
+    score += ValenceBoostScale*pow(coord(remainingTriangles), -ValenceBoostPower);
+    return score;
+}
+
+// Misses per triangle of a FIFO cache with 'entries' entries of 'bytesPerEntry'
+// bytes each, over the scene's vertex data, when accessed in triangle order.
+// With bytesPerEntry=sizeof(Vertex), that's the classic ACMR (average cache
+// miss ratio) of a vertex cache; with 64, the CPU cache lines fetched.
+static coord MissesPerTriangle(const Scene& scene, unsigned entries, unsigned bytesPerEntry)
+{
+    unsigned keys = (scene._vertices.size()*sizeof(Vertex) + bytesPerEntry - 1)/bytesPerEntry;
+    // The value of 'misses' when each entry was loaded (0: never)
+    std::vector<unsigned> loadedAt(keys, 0);
+    unsigned misses = 0;
+    for(unsigned i=0; i<scene._triangles.size(); i++) {
+	unsigned corners[3] = {
+	    scene._triangles[i]._idxA, scene._triangles[i]._idxB, scene._triangles[i]._idxC };
+	for(int c=0; c<3; c++) {
+	    unsigned key = corners[c]*sizeof(Vertex)/bytesPerEntry;
+	    if (!loadedAt[key] || loadedAt[key] + entries <= misses)
+		loadedAt[key] = ++misses;
+	}
+    }
+    return misses/coord(std::max<size_t>(scene._triangles.size(), 1));
+}
+
+void Scene::OptimizeMeshOrder()
+{
+    if (_triangles.empty())
+	return;
+
+    Clock me;
+    coord acmrBefore = MissesPerTriangle(*this, VERTEX_CACHE_SIZE, sizeof(Vertex));
+    coord linesBefore = MissesPerTriangle(*this, 512, 64);
+
+    unsigned totalVertices = _vertices.size();
+    std::vector<unsigned> remaining(totalVertices, 0);
+    for(unsigned i=0; i<_triangles.size(); i++) {
+	remaining[_triangles[i]._idxA]++;
+	remaining[_triangles[i]._idxB]++;
+	remaining[_triangles[i]._idxC]++;
+    }
+    std::vector<int> cachePosition(totalVertices, -1);
+    std::vector<coord> score(totalVertices);
+    for(unsigned v=0; v<totalVertices; v++)
+	score[v] = VertexScore(-1, remaining[v]);
+
+    // Reorder the triangles of each cluster. The cache carries over from
+    // one cluster to the next, since they are neighbours in space, too.
+    std::vector<Triangle> reordered;
+    reordered.reserve(_triangles.size());
+    std::vector<unsigned> pending;
+    std::vector<unsigned> cache, newCache;
+    for(unsigned c=0; c<_clusters.size(); c++) {
+	pending.clear();
+	for(unsigned i=_clusters[c]._start; i<_clusters[c]._start + _clusters[c]._count; i++)
+	    pending.push_back(i);
+
+	while(!pending.empty()) {
+	    // Emit the pending triangle with the best score...
+	    unsigned best = 0;
+	    coord bestScore = -FLT_MAX;
+	    for(unsigned p=0; p<pending.size(); p++) {
+		const Triangle& triangle = _triangles[pending[p]];
+		coord triangleScore =
+		    score[triangle._idxA] + score[triangle._idxB] + score[triangle._idxC];
+		if (triangleScore > bestScore) {
+		    bestScore = triangleScore;
+		    best = p;
+		}
+	    }
+	    const Triangle& triangle = _triangles[pending[best]];
+	    reordered.push_back(triangle);
+	    pending[best] = pending.back();
+	    pending.pop_back();
+
+	    // ...move its vertices to the front of the cache...
+	    unsigned corners[3] = { triangle._idxA, triangle._idxB, triangle._idxC };
+	    newCache.assign(corners, corners + 3);
+	    for(unsigned k=0; k<cache.size(); k++)
+		if (cache[k] != corners[0] && cache[k] != corners[1] && cache[k] != corners[2])
+		    newCache.push_back(cache[k]);
+	    for(int k=0; k<3; k++)
+		remaining[corners[k]]--;
+
+	    // ...and update the scores of all the vertices in it
+	    // (and of the ones that just fell out of it)
+	    for(unsigned k=0; k<newCache.size(); k++) {
+		unsigned v = newCache[k];
+		cachePosition[v] = (k < VERTEX_CACHE_SIZE) ? int(k) : -1;
+		score[v] = VertexScore(cachePosition[v], remaining[v]);
+	    }
+	    if (newCache.size() > VERTEX_CACHE_SIZE)
+		newCache.resize(VERTEX_CACHE_SIZE);
+	    cache.swap(newCache);
+	}
+    }
+    _triangles.swap(reordered);
+
+    // Renumber the vertices in the order the triangles first use them
+    // (the ones no triangle uses go last, in their original order)
+    const unsigned NotPlaced = 0xFFFFFFFFu;
+    std::vector<unsigned> newIndex(totalVertices, NotPlaced);
+    std::vector<Vertex> renumbered;
+    std::vector<unsigned char> renumberedOcclusion;
+    renumbered.reserve(totalVertices);
+    renumberedOcclusion.reserve(totalVertices);
+    for(unsigned i=0; i<_triangles.size(); i++) {
+	unsigned corners[3] = { _triangles[i]._idxA, _triangles[i]._idxB, _triangles[i]._idxC };
+	for(int k=0; k<3; k++) {
+	    unsigned v = corners[k];
+	    if (newIndex[v] == NotPlaced) {
+		newIndex[v] = renumbered.size();
+		renumbered.push_back(_vertices[v]);
+		renumberedOcclusion.push_back(_ambientOcclusion[v]);
+	    }
+	}
+    }
+    for(unsigned v=0; v<totalVertices; v++)
+	if (newIndex[v] == NotPlaced) {
+	    newIndex[v] = renumbered.size();
+	    renumbered.push_back(_vertices[v]);
+	    renumberedOcclusion.push_back(_ambientOcclusion[v]);
+	}
+    _vertices.swap(renumbered);
+    _ambientOcclusion.swap(renumberedOcclusion);
+    for(unsigned i=0; i<_triangles.size(); i++) {
+	_triangles[i]._idxA = newIndex[_triangles[i]._idxA];
+	_triangles[i]._idxB = newIndex[_triangles[i]._idxB];
+	_triangles[i]._idxC = newIndex[_triangles[i]._idxC];
+    }
+    // The raytracer's per-triangle data follow the triangles' order
+    _triangleIntersectionData.clear();
+
+    _meshOrderOptimized = true;
+
+    printf("Reordering the mesh for the caches took %.2f seconds\n", me.readMS()/1000.);
+    printf("    Vertex cache misses per triangle (%d-entry FIFO): %.3f before, %.3f after\n",
+	VERTEX_CACHE_SIZE, acmrBefore, MissesPerTriangle(*this, VERTEX_CACHE_SIZE, sizeof(Vertex)));
+    printf("    Vertex data cache lines per triangle (32KB FIFO): %.3f before, %.3f after\n",
+	linesBefore, MissesPerTriangle(*this, 512, 64));
+}
@@ -0,0 +1,71 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __parallel_h__
+#define __parallel_h__
+
+#ifdef USE_TBB
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#endif
+
+#ifdef USE_OPENMP
+#include <omp.h>
+#endif
+
+// Calls body(i) for all i in [begin, end), using all the available cores
+// (via TBB or OpenMP, just like the renderers do), in batches of 'grain'
+// indexes that are dynamically scheduled to the threads.
+//
+// 'body' is a functor with a "void operator()(int i) const".
+
+#ifdef USE_TBB
+// TBB expects functors working on ranges, and this one delegates to body
+template <class Body>
+class ParallelForRange {
+    const Body& _body;
+public:
+    ParallelForRange(const Body& body):_body(body) {}
+    void operator()(const tbb::blocked_range<size_t>& r) const {
+	for(size_t i=r.begin(); i!=r.end(); i++)
+	    _body(int(i));
+    }
+};
+#endif
+
+template <class Body>
+void ParallelFor(int begin, int end, int grain, const Body& body)
+{
+#ifdef USE_TBB
+    if (begin<end)
+	tbb::parallel_for(
+	    tbb::blocked_range<size_t>(begin, end, grain),
+	    ParallelForRange<Body>(body));
+#else
+#ifdef USE_OPENMP
+    #pragma omp parallel for schedule(dynamic,grain)
+#else
+    (void) grain;
+#endif
+    for(int i=begin; i<end; i++)
+	body(i);
+#endif
+}
+
+#endif
@@ -20,6 +20,7 @@
 #include <config.h>
 
 #include <vector>
+#include <algorithm>
 
 #ifdef USE_TBB
 #include "tbb/blocked_range.h"
@@ -33,21 +34,32 @@
 #include "3d.h"
 #include "Screen.h"
 #include "Fillers.h"
+#include "Parallel.h"
 #include "Wu.h"
 
 // Clip distance for the triangles (they have a point closer than this, they dont get drawn)
 const coord ClipPlaneDistance = 0.2f;
 
+// What the camera sees: screen x comes from camera space y, screen y from x
+// (with a pixel of slack, for the triangles that just touch the borders)
+static ViewFrustum CameraFrustum(const Camera& eye)
+{
+    return ViewFrustum(
+	eye, eye._mv,
+	(HEIGHT/2 + 1)/coord(SCREEN_DIST), (WIDTH/2 + 1)/coord(SCREEN_DIST),
+	ClipPlaneDistance);
+}
+
 ////////////////////////////////////////
 // Rendering function for RENDER_POINTS
 ////////////////////////////////////////
 
-// After transformation in camera space, project and plot (used for point rendering)
-void inline ProjectAndPlot(const Vector3& xformed, Uint32 color, Screen& canvas)
+// Plot an (already transformed and projected) vertex - used for point rendering
+void inline ProjectAndPlot(const TransformedVertices& xformed, unsigned idx, Uint32 color, Screen& canvas)
 {
-    if (xformed._z>ClipPlaneDistance) {
-	int x = (int)(WIDTH/2  + SCREEN_DIST * xformed._y/xformed._z);
-	int y = (int)(HEIGHT/2 - SCREEN_DIST * xformed._x/xformed._z);
+    if (xformed._z[idx]>ClipPlaneDistance) {
+	int x = (int)xformed._screenX[idx];
+	int y = (int)xformed._screenY[idx];
 	if (y>=0 && y<(int)HEIGHT && x>=0 && x<(int)WIDTH)
 	    canvas.DrawPixel(y,x,color);
     }
@@ -56,7 +68,11 @@ void inline ProjectAndPlot(const Vector3& xformed, Uint32 color, Screen& canvas)
 void Scene::renderPoints(const Camera& eye, Screen& canvas, bool asTriangles)
 {
     canvas.ClearScreen();
-    Uint32 whitePixel = SDL_MapRGB(canvas._surface->format, 255,255,255);
+    Uint32 whitePixel = canvas.MapRGB(255,255,255);
+
+    // Transform all vertices to camera space (once, no matter how many triangles use them)
+    _cameraSpaceVertices.Update(_vertices, eye, eye._mv, TransformedVertices::OnScreen());
+    const TransformedVertices& xformed = _cameraSpaceVertices;
 
     if (!asTriangles) {
 	// Simple projection and ploting of a white point per vertex
@@ -69,7 +85,7 @@ void Scene::renderPoints(const Camera& eye, Screen& canvas, bool asTriangles)
 
 	    // Plot projected coordinates (on screen)
 	    ProjectAndPlot(
-		Transform(_vertices[j], eye, eye._mv),
+		xformed, j,
 		whitePixel,
 		canvas);
 	}
@@ -91,19 +107,18 @@ void Scene::renderPoints(const Camera& eye, Screen& canvas, bool asTriangles)
 	    if (dot(triToEye, _triangles[j]._normal)<0)
 		continue;
 
-	    // For each of the 3 vertices of triangle j of object i,
-	    // transform to camera space, project and plot them
+	    // Plot the 3 (projected) vertices of triangle j of object i
 	    ProjectAndPlot(
-		Transform(*_triangles[j]._vertexA, eye, eye._mv),
-		_triangles[j]._color,
+		xformed, _triangles[j]._idxA,
+		_materials[_triangles[j]._material]._color,
 		canvas);
 	    ProjectAndPlot(
-		Transform(*_triangles[j]._vertexB, eye, eye._mv),
-		_triangles[j]._color,
+		xformed, _triangles[j]._idxB,
+		_materials[_triangles[j]._material]._color,
 		canvas);
 	    ProjectAndPlot(
-		Transform(*_triangles[j]._vertexC, eye, eye._mv),
-		_triangles[j]._color,
+		xformed, _triangles[j]._idxC,
+		_materials[_triangles[j]._material]._color,
 		canvas);
 	}
     }
@@ -118,65 +133,77 @@ void Scene::renderWireframe(const Camera& eye, Screen& canvas)
 {
     canvas.ClearScreen();
 
-    Uint32 greyPixel = SDL_MapRGB(canvas._surface->format, 200,200,200);
-    // Or maybe use... _triangles[j]._color
+    Uint32 greyPixel = canvas.MapRGB(200,200,200);
+    // Or maybe use... _materials[_triangles[j]._material]._color
+
+    // Transform all vertices to camera space (once, no matter how many triangles use them)
+    _cameraSpaceVertices.Update(_vertices, eye, eye._mv, TransformedVertices::OnScreen());
+    const TransformedVertices& xformed = _cameraSpaceVertices;
+
+    // Skip the clusters that are off-screen, or facing away from us
+    std::vector<unsigned> visible;
+    CullClusters(CameraFrustum(eye), true, visible);
 
     // Perform culling, projection and use the triangle color
 #ifdef USE_OPENMP
-    #pragma omp parallel for
+    #pragma omp parallel for schedule(dynamic,1)
 #endif
-    for(int j=0; j<(int)_triangles.size(); j++) {
-
-	// First check if the triangle is visible from where we stand
-	// (closed objects only)
-	Vector3 triToEye = eye;
-	triToEye -= _triangles[j]._center;
-	// Normally we would normalize, but since we just need the sign
-	// of the dot product (to determine if it facing us or not)...
-	//triToEye.normalize();
-	if (dot(triToEye, _triangles[j]._normal)<0)
-	    continue;
-
-	// For each of the 3 vertices of triangle j of object i,
-	// transform to camera space
-	Vector3 xformedA = Transform(*_triangles[j]._vertexA, eye, eye._mv);
-	Vector3 xformedB = Transform(*_triangles[j]._vertexB, eye, eye._mv);
-	Vector3 xformedC = Transform(*_triangles[j]._vertexC, eye, eye._mv);
-
-#define SCREENSPACE(xformed, xx, yy)					    \
-	    xx = int(WIDTH/2  + SCREEN_DIST * xformed._y/xformed._z);	    \
-	    yy = int(HEIGHT/2 - SCREEN_DIST * xformed._x/xformed._z);	    \
-
-	bool agood = xformedA._z > ClipPlaneDistance;
-	bool bgood = xformedB._z > ClipPlaneDistance;
-	bool cgood = xformedC._z > ClipPlaneDistance;
-
-	if (agood) {
-	    int ax, ay;
-	    SCREENSPACE(xformedA, ax,ay)
-	    if (bgood) {
-		int bx,by;
-		SCREENSPACE(xformedB, bx,by)
-		my_aalineColor(canvas._surface, ax, ay, bx, by, greyPixel);
-		if (cgood) {
-		    int cx,cy;
-		    SCREENSPACE(xformedC, cx,cy)
-		    my_aalineColor(canvas._surface, ax, ay, cx, cy, greyPixel);
-		    my_aalineColor(canvas._surface, bx, by, cx, cy, greyPixel);
-		}
-	    } else {
-		if (cgood) {
-		    int cx,cy;
-		    SCREENSPACE(xformedC, cx,cy)
-		    my_aalineColor(canvas._surface, ax, ay, cx, cy, greyPixel);
+    for(int v=0; v<(int)visible.size(); v++) {
+	const TriangleCluster& cluster = _clusters[visible[v]];
+	for(unsigned k=cluster._start; k<cluster._start + cluster._count; k++) {
+	    const Triangle& triangle = _triangles[k];
+
+	    // First check if the triangle is visible from where we stand
+	    // (closed objects only)
+	    Vector3 triToEye = eye;
+	    triToEye -= triangle._center;
+	    // Normally we would normalize, but since we just need the sign
+	    // of the dot product (to determine if it facing us or not)...
+	    //triToEye.normalize();
+	    if (dot(triToEye, triangle._normal)<0)
+		continue;
+
+	    // For each of the 3 vertices of the triangle,
+	    // get them in camera space (and projected)
+	    unsigned idxA = triangle._idxA;
+	    unsigned idxB = triangle._idxB;
+	    unsigned idxC = triangle._idxC;
+
+#define SCREENSPACE(idx, xx, yy)					    \
+	    xx = int(xformed._screenX[idx]);				    \
+	    yy = int(xformed._screenY[idx]);				    \
+
+	    bool agood = xformed._z[idxA] > ClipPlaneDistance;
+	    bool bgood = xformed._z[idxB] > ClipPlaneDistance;
+	    bool cgood = xformed._z[idxC] > ClipPlaneDistance;
+
+	    if (agood) {
+		int ax, ay;
+		SCREENSPACE(idxA, ax,ay)
+		if (bgood) {
+		    int bx,by;
+		    SCREENSPACE(idxB, bx,by)
+		    my_aalineColor(canvas._frameSurface, ax, ay, bx, by, greyPixel);
+		    if (cgood) {
+			int cx,cy;
+			SCREENSPACE(idxC, cx,cy)
+			my_aalineColor(canvas._frameSurface, ax, ay, cx, cy, greyPixel);
+			my_aalineColor(canvas._frameSurface, bx, by, cx, cy, greyPixel);
+		    }
+		} else {
+		    if (cgood) {
+			int cx,cy;
+			SCREENSPACE(idxC, cx,cy)
+			my_aalineColor(canvas._frameSurface, ax, ay, cx, cy, greyPixel);
+		    }
 		}
+	    } else if (bgood && cgood) {
+		int bx,by;
+		int cx,cy;
+		SCREENSPACE(idxB, bx,by)
+		SCREENSPACE(idxC, cx,cy)
+		my_aalineColor(canvas._frameSurface, bx, by, cx, cy, greyPixel);
 	    }
-	} else if (bgood && cgood) {
-	    int bx,by;
-	    int cx,cy;
-	    SCREENSPACE(xformedB, bx,by)
-	    SCREENSPACE(xformedC, cx,cy)
-	    my_aalineColor(canvas._surface, bx, by, cx, cy, greyPixel);
 	}
     }
     canvas.ShowScreen();
@@ -198,8 +225,12 @@ void Scene::renderWireframe(const Camera& eye, Screen& canvas)
 // We use the preprocessor to make this class do the right thing
 // for all cases... which should be simple, but it isn't :-)
 //
+// The triangles to draw are given as a list of clusters (i.e. the ones
+// that survived the view frustum and backface culling - see Scene::CullClusters),
+// and the threads work on one cluster at a time.
+//
 // TBB:
-// the operator() will be called, with the range of indexes
+// the operator() will be called, with the range of indexes (in the list)
 // that this thread is to work on. We simply call DrawTriangles
 // with this range, and since we are already in the scope of our
 // working thread, we allocate scanline buffers (and a TriangleCarrier)
@@ -207,7 +238,7 @@ void Scene::renderWireframe(const Camera& eye, Screen& canvas)
 // is thread-private).
 //
 // OpenMP and SingleThreaded:
-// For these, we directly call DrawTriangles(0, totalTriangles).
+// For these, we directly call DrawTriangles(0, totalClusters).
 // This means that when DrawTriangles runs, we are not in thread-scope (yet).
 // For SingleThreaded, we just declare stack-based containers
 // (we could have used "static", but the cost is low anyway).
@@ -229,17 +260,21 @@ void Scene::renderWireframe(const Camera& eye, Screen& canvas)
 template <typename InterpolatedType>
 class RasterizeScene {
     const Scene& scene;
+    const TransformedVertices& xformed;
+    const unsigned *visible;
     const Camera& eye;
     Screen& canvas;
 public:
-    RasterizeScene(const Scene& scene, const Camera& e, Screen& c)
+    RasterizeScene(const Scene& scene, const unsigned *v, const Camera& e, Screen& c)
 	:
 	scene(scene),
+	xformed(scene._cameraSpaceVertices),
+	visible(v),
 	eye(e),
 	canvas(c)
     {}
 
-    void DrawTriangles(int iStartingTriangleIndex, int iOnePastEndingTriangleIndex) const
+    void DrawTriangles(int iStartingClusterIndex, int iOnePastEndingClusterIndex) const
     {
 	std::vector<unsigned> lines;
 	std::vector<InterpolatedType> left;
@@ -247,65 +282,72 @@ public:
 	TriangleCarrier<InterpolatedType> triInfoForFillerToFill;
 
 #ifdef USE_OPENMP
-	#pragma omp parallel for private(lines, left, right, triInfoForFillerToFill) schedule(dynamic,TRIANGLES_PER_THREAD)
+	#pragma omp parallel for private(lines, left, right, triInfoForFillerToFill) schedule(dynamic,1)
 #endif
-	for(int j=iStartingTriangleIndex; j<iOnePastEndingTriangleIndex; j++) {
+	for(int r=iStartingClusterIndex; r<iOnePastEndingClusterIndex; r++) {
 
 	    lines.resize(HEIGHT);
 	    left.resize(HEIGHT);
 	    right.resize(HEIGHT);
 
-	    // Draw triangle j on the canvas and the Zbuffer
-	    const Triangle& triangle = scene._triangles[j];
+	    const TriangleCluster& cluster = scene._clusters[visible[r]];
+	    for(unsigned k=cluster._start; k<cluster._start + cluster._count; k++) {
+
+		// Draw triangle k of the cluster on the canvas and the Zbuffer
+		const Triangle& triangle = scene._triangles[k];
+
+		// First check if the triangle is visible from where we stand
+		// (we only work with closed objects)
+		if (!scene._materials[triangle._material]._twoSided) {
+		    Vector3 triToEye = eye;
+		    triToEye -= triangle._center;
+		    // Normally we would normalize, but since we just need the sign
+		    // of the dot product (to determine if it facing us or not)...
+		    //triToEye.normalize();
+		    if (dot(triToEye, triangle._normal)<0)
+			continue;
+		}
 
-	    // First check if the triangle is visible from where we stand
-	    // (we only work with closed objects)
-	    if (!triangle._twoSided) {
-		Vector3 triToEye = eye;
-		triToEye -= triangle._center;
-		// Normally we would normalize, but since we just need the sign
-		// of the dot product (to determine if it facing us or not)...
-		//triToEye.normalize();
-		if (dot(triToEye, triangle._normal)<0)
-		    continue;
+		// Triangle is visible, get its vertices (already in camera space)
+		unsigned idxA = triangle._idxA;
+		if (xformed._z[idxA]<ClipPlaneDistance) continue;
+
+		unsigned idxB = triangle._idxB;
+		if (xformed._z[idxB]<ClipPlaneDistance) continue;
+
+		unsigned idxC = triangle._idxC;
+		if (xformed._z[idxC]<ClipPlaneDistance) continue;
+
+		// Projected coordinates (on screen), also precalculated
+
+		coord ax,ay, bx,by, cx,cy;
+
+		ay = xformed._screenY[idxA];
+		by = xformed._screenY[idxB];
+		cy = xformed._screenY[idxC];
+		if (ay<0 && by<0 && cy<0) continue;
+		if (ay>=HEIGHT && by>=HEIGHT && cy>=HEIGHT) continue;
+		ax = xformed._screenX[idxA];
+		bx = xformed._screenX[idxB];
+		cx = xformed._screenX[idxC];
+
+		Vector3 inCameraSpaceA = xformed.InViewSpace(idxA);
+		Vector3 inCameraSpaceB = xformed.InViewSpace(idxB);
+		Vector3 inCameraSpaceC = xformed.InViewSpace(idxC);
+
+		// Prepare the values to interpolate per pixel (mode-dependent)
+		Filler(
+		    scene,
+		    ax,ay, bx,by, cx,cy,
+		    inCameraSpaceA, inCameraSpaceB, inCameraSpaceC,
+		    triangle,
+		    eye,
+		    triInfoForFillerToFill);
+
+		// And rasterize the triangle, interpolating per-pixel... (mode-dependent)
+		canvas.RasterizeTriangle(
+		    triInfoForFillerToFill, eye, &lines[0], &left[0], &right[0]);
 	    }
-
-	    // Triangle is visible, transform its vertices into camera space
-	    Vector3 inCameraSpaceA = Transform(*triangle._vertexA, eye, eye._mv);
-	    if (inCameraSpaceA._z<ClipPlaneDistance) continue;
-
-	    Vector3 inCameraSpaceB = Transform(*triangle._vertexB, eye, eye._mv);
-	    if (inCameraSpaceB._z<ClipPlaneDistance) continue;
-
-	    Vector3 inCameraSpaceC = Transform(*triangle._vertexC, eye, eye._mv);
-	    if (inCameraSpaceC._z<ClipPlaneDistance) continue;
-
-	    // Calculate projected coordinates (on screen)
-	    // and prepare for linear interpolation (x/z, y/z, 1/z)
-
-	    coord ax,ay, bx,by, cx,cy;
-
-	    ay = HEIGHT/2 - SCREEN_DIST * inCameraSpaceA._x/inCameraSpaceA._z;
-	    by = HEIGHT/2 - SCREEN_DIST * inCameraSpaceB._x/inCameraSpaceB._z;
-	    cy = HEIGHT/2 - SCREEN_DIST * inCameraSpaceC._x/inCameraSpaceC._z;
-	    if (ay<0 && by<0 && cy<0) continue;
-	    if (ay>=HEIGHT && by>=HEIGHT && cy>=HEIGHT) continue;
-	    ax = WIDTH/2  + SCREEN_DIST * inCameraSpaceA._y/inCameraSpaceA._z;
-	    bx = WIDTH/2  + SCREEN_DIST * inCameraSpaceB._y/inCameraSpaceB._z;
-	    cx = WIDTH/2  + SCREEN_DIST * inCameraSpaceC._y/inCameraSpaceC._z;
-
-	    // Prepare the values to interpolate per pixel (mode-dependent)
-	    Filler(
-		scene,
-		ax,ay, bx,by, cx,cy,
-		inCameraSpaceA, inCameraSpaceB, inCameraSpaceC,
-		triangle,
-		eye,
-		triInfoForFillerToFill);
-
-	    // And rasterize the triangle, interpolating per-pixel... (mode-dependent)
-	    canvas.RasterizeTriangle(
-		triInfoForFillerToFill, eye, &lines[0], &left[0], &right[0]);
 	}
     }
 
@@ -317,6 +359,55 @@ public:
 #endif
 };
 
+// Per-frame work on the vertices, before the triangles are drawn
+// (after they are transformed to camera space) - for the modes that need any
+template <typename InterpolatedType>
+void inline PrepareVertices(Scene&, const Camera&) {}
+
+// The Gouraud mode lights each vertex once per frame, instead of once for
+// each triangle that uses it: the Gouraud Filler just reads the results
+// (Scene::_vertexDiffuse and _vertexSpecular) and shades its material with them.
+
+// Vertices lit by each task of the ParallelFor
+#define LIT_VERTICES_PER_BLOCK 1024
+
+class LightVertexBlock {
+    Scene& _scene;
+    const Camera& _eye;
+public:
+    LightVertexBlock(Scene& scene, const Camera& eye)
+	:
+	_scene(scene),
+	_eye(eye)
+    {}
+
+    void operator()(int block) const {
+	const TransformedVertices& xformed = _scene._cameraSpaceVertices;
+	LightingEquation<NoShadows> compute(_scene);
+	unsigned start = block*LIT_VERTICES_PER_BLOCK;
+	unsigned end = std::min(start + LIT_VERTICES_PER_BLOCK, (unsigned)_scene._vertices.size());
+	for(unsigned i=start; i<end; i++) {
+	    // (the triangles of the vertices behind the clip plane aren't drawn)
+	    if (xformed._z[i]<ClipPlaneDistance)
+		continue;
+	    Vector3 normal = _eye._mv.multiplyRightWith(_scene._vertices[i]._normal);
+	    compute.ComputeLighting(
+		xformed.InViewSpace(i), normal, (coord)_scene._ambientOcclusion[i],
+		_scene._vertexDiffuse[i], _scene._vertexSpecular[i]);
+	}
+    }
+};
+
+template <>
+void inline PrepareVertices<FatPointGouraud>(Scene& scene, const Camera& eye)
+{
+    unsigned total = scene._vertices.size();
+    scene._vertexDiffuse.resize(total);
+    scene._vertexSpecular.resize(total);
+    int blocks = (total + LIT_VERTICES_PER_BLOCK - 1)/LIT_VERTICES_PER_BLOCK;
+    ParallelFor(0, blocks, 1, LightVertexBlock(scene, eye));
+}
+
 template <typename InterpolatedType>
 void RenderInParallel(
     Scene& scene,
@@ -326,6 +417,19 @@ void RenderInParallel(
     canvas.ClearScreen();
     canvas.ClearZbuffer();
 
+    // Transform all vertices to camera space (once, no matter how many triangles use them)
+    scene._cameraSpaceVertices.Update(
+	scene._vertices, eye, eye._mv, TransformedVertices::OnScreen());
+    PrepareVertices<InterpolatedType>(scene, eye);
+
+    // Skip the parts of the scene that are off-screen, or facing away from us
+    std::vector<unsigned> visible;
+    scene.CullClusters(CameraFrustum(eye), true, visible);
+    if (visible.empty()) {
+	canvas.ShowScreen();
+	return;
+    }
+
 /* Done in the main loop, only when the user moves the light - Huge savings...
 
     for(unsigned i=0; i<_lights.size(); i++) {
@@ -338,19 +442,19 @@ void RenderInParallel(
     // For TBB, use the parallel_for construct.
     // Different threads will execute for segments of the triangles' vector,
     // calling the operator(), which in turn calls DrawTriangles for the vector's segment.
-    // We use the third parameter of parallel_for to chop the triangle list down
-    // into batches of TRIANGLES_PER_THREAD triangles - the dynamic scheduler will feed
-    // these batches to our threads, keeping them busy (just like schedule(dynamic,N) does for OpenMP)
+    // We use the third parameter of parallel_for to feed the visible clusters (of up to
+    // CLUSTER_TRIANGLES triangles each) one by one to our threads - the dynamic scheduler
+    // keeps them busy (just like schedule(dynamic,1) does for OpenMP)
     tbb::parallel_for(
-	tbb::blocked_range<size_t>(0, scene._triangles.size(), TRIANGLES_PER_THREAD),
-	RasterizeScene<InterpolatedType>(scene, eye, canvas) );
+	tbb::blocked_range<size_t>(0, visible.size(), 1),
+	RasterizeScene<InterpolatedType>(scene, &visible[0], eye, canvas) );
 #else
     // For both OpenMP and single-threaded, call the DrawTriangles member
-    // of the RasterizeScene, requesting drawing of ALL triangles.
+    // of the RasterizeScene, requesting drawing of ALL visible clusters.
     // For OpenMP, the appropriate pragma inside DrawTriangles will make it execute via SMP...
     RasterizeScene<InterpolatedType>(
-	scene, eye, canvas).
-	    DrawTriangles(0, scene._triangles.size());
+	scene, &visible[0], eye, canvas).
+	    DrawTriangles(0, visible.size());
 #endif
     canvas.ShowScreen();
 }
@@ -381,3 +485,8 @@ void Scene::renderPhongAndSoftShadowed(const Camera& eye, Screen& canvas)
 {
     RenderInParallel<FatPointPhongAndSoftShadowed>( *this, eye, canvas);
 }
+
+void Scene::renderPhongAndVarianceShadowed(const Camera& eye, Screen& canvas)
+{
+    RenderInParallel<FatPointPhongAndVarianceShadowed>( *this, eye, canvas);
+}
@@ -0,0 +1,422 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <cfloat>
+
+#include "3d.h"
+#include "RayQuery.h"
+#include "Parallel.h"
+#include "RayStatistics.h"
+
+///////////////////////////////////////////////
+// Ray queries against the scene's BVH:
+//    Scene::Intersect / Scene::IntersectBatch (closest hit)
+//    Scene::Occluded  / Scene::OccludedBatch  (any hit)
+///////////////////////////////////////////////
+
+// Ray intersections of a distance <=NUDGE_FACTOR (from the origin) don't count
+#define NUDGE_FACTOR     1e-5f
+
+// Helper function, that checks whether a ray intersects a bbox
+// (at a distance smaller than tMax)
+inline bool RayIntersectsBox(
+    const Vector3& originInWorldSpace, const Vector3& rayInWorldSpace,
+    const Vector3& bottom, const Vector3& top, coord tMax)
+{
+    // set Tnear = - infinity, Tfar = infinity
+    //
+    // For each pair of planes P associated with X, Y, and Z do:
+    //     (example using X planes)
+    //     if direction Xd = 0 then the ray is parallel to the X planes, so
+    //         if origin Xo is not between the slabs ( Xo < Xl or Xo > Xh) then
+    //             return false
+    //     else, if the ray is not parallel to the plane then
+    //     begin
+    //         compute the intersection distance of the planes
+    //         T1 = (Xl - Xo) / Xd
+    //         T2 = (Xh - Xo) / Xd
+    //         If T1 > T2 swap (T1, T2) /* since T1 intersection with near plane */
+    //         If T1 > Tnear set Tnear =T1 /* want largest Tnear */
+    //         If T2 < Tfar set Tfar="T2" /* want smallest Tfar */
+    //         If Tnear > Tfar box is missed so
+    //             return false
+    //         If Tfar < 0 box is behind ray
+    //             return false
+    //     end
+    // end of for loop
+    //
+    // If Box survived all above tests, return true with intersection point Tnear and exit point Tfar.
+
+    coord Tnear, Tfar;
+    Tnear = -FLT_MAX;
+    Tfar = FLT_MAX;
+
+#define CHECK_NEAR_AND_FAR_INTERSECTION(c)                                            \
+    if (rayInWorldSpace._ ## c == 0.) {                                               \
+	if (originInWorldSpace._##c < bottom._##c) return false;                      \
+	if (originInWorldSpace._##c > top._##c) return false;                         \
+    } else {                                                                          \
+	coord T1 = (bottom._##c - originInWorldSpace._##c)/rayInWorldSpace._##c;      \
+	coord T2 = (top._##c    - originInWorldSpace._##c)/rayInWorldSpace._##c;      \
+	if (T1>T2) { coord tmp=T1; T1=T2; T2=tmp; }                                   \
+	if (T1 > Tnear) Tnear = T1;                                                   \
+	if (T2 < Tfar)  Tfar = T2;                                                    \
+	if (Tnear > Tfar)                                                             \
+	    return false;                                                             \
+	if (Tfar < 0.)                                                                \
+	    return false;                                                             \
+    }
+
+    CHECK_NEAR_AND_FAR_INTERSECTION(x)
+    CHECK_NEAR_AND_FAR_INTERSECTION(y)
+    CHECK_NEAR_AND_FAR_INTERSECTION(z)
+
+    // The box is further away than what we look for (e.g. the light, or
+    // the closest hit so far)
+    if (Tnear >= tMax)
+	return false;
+
+    return true;
+}
+
+// When a BVHShortStack has lost entries and empties, this finds the node
+// to continue from: all of the subtree of node 'idx' has been visited, so
+// continue with the right child of the closest ancestor whose left subtree
+// contains 'idx' (the traversals visit left children first).
+// Returns BVH_NO_NODE when there is no such ancestor, i.e. the traversal is over.
+inline unsigned NextBVHNodeAfterSubtree(const Scene& scene, unsigned idx)
+{
+    while (idx != 0) {
+	unsigned parent = scene._pBVHParents[idx];
+#ifdef BVH_QUANTIZED
+	unsigned idxLeft = scene._pQBVH[parent]._idxLeftOrCount;
+	if (idx == idxLeft)
+	    return idxLeft + 1;
+#else
+	const CacheFriendlyBVHNode& p = scene._pCFBVH[parent];
+	if (idx == p.u.inner._idxLeft)
+	    return p.u.inner._idxRight;
+#endif
+	idx = parent;
+    }
+    return BVH_NO_NODE;
+}
+
+#ifdef BVH_QUANTIZED
+// The decoded box of a quantized node, for the (rare) cases where the traversal
+// resumes from a node that it didn't get from its stack (see above). Walks down from
+// the root, decoding the boxes of the ancestors of node 'idx' - in O(depth^2),
+// but without needing any memory for the path.
+inline void DecodeQuantizedBox(const Scene& scene, unsigned idx, Vector3& bottom, Vector3& top)
+{
+    bottom = scene._QBVHRootBottom;
+    top = scene._QBVHRootTop;
+    unsigned idxCurrent = 0;
+    while (idxCurrent != idx) {
+	unsigned idxChild = idx;
+	while (scene._pBVHParents[idxChild] != idxCurrent)
+	    idxChild = scene._pBVHParents[idxChild];
+	const QuantizedBVHNode& node = scene._pQBVH[idxCurrent];
+	Vector3 childBottom, childTop;
+	DecodeQuantizedChild(node, idxChild - node._idxLeftOrCount, bottom, top, childBottom, childTop);
+	bottom = childBottom;
+	top = childTop;
+	idxCurrent = idxChild;
+    }
+}
+#endif
+
+// The best hit found so far, while traversing the BVH
+struct TraversalHit {
+    // Distance of the hit (starts from the ray's _tMax)
+    coord _t;
+    const Triangle *_pTri;
+    // perpendicular distances of the hit point from the 3 triangle edges
+    coord _kAB, _kBC, _kCA;
+};
+
+// Checks the triangles of a BVH leaf (the 'count' ones starting at index 'start'
+// of the triangle index list).
+//
+// Two compile-time options:
+//
+// The first one is used to discriminate between any-hit queries (e.g. shadow rays,
+// that stop at the first hit) and closest-hit ones, that have to find the closest hit.
+//
+// The second one enables or disables culling of backfacing triangles.
+//
+// Returns true only for any-hit queries that hit something.
+template <bool anyHit, bool doCulling>
+inline bool IntersectLeafTriangles(
+    const Scene& scene, unsigned start, unsigned count, const Ray& ray, TraversalHit& best)
+{
+    const Vector3& origin = ray._origin;
+    const Vector3& direction = ray._direction;
+    for(unsigned i=start; i<start+count; i++) {
+	unsigned t = scene._triIndexList[i];
+	const Triangle& triangle = scene._triangles[t];
+	RAYSTAT(_trianglesTested++);
+
+	if (ray._ignoreTriangle == &triangle)
+	    continue; // avoid self-reflections/refractions
+
+	// doCulling is a compile-time param, this code will be "codegenerated"
+	// at compile time only for the queries that asked for it
+	if (doCulling && !scene._materials[triangle._material]._twoSided) {
+	    // Check visibility of triangle via dot product
+	    Vector3 fromTriToOrigin = origin;
+	    fromTriToOrigin -= triangle._center;
+	    // Normally we would normalize, but since we just need the sign
+	    // of the dot product (to determine if it facing us or not)...
+	    if (dot(fromTriToOrigin, triangle._normal)<0)
+		continue;
+	}
+
+	// Use the pre-computed triangle intersection data: normal, d, e1/d1, e2/d2, e3/d3
+	const TriangleIntersectionData& data = scene._triangleIntersectionData[t];
+	coord k = dot(data._normal, direction);
+	if (k == 0.0)
+	    continue; // this triangle is parallel to the ray, ignore it.
+
+	coord s = (data._d - dot(data._normal, origin))/k;
+	if (s <= NUDGE_FACTOR) // this triangle is "behind" (or too close to) the origin.
+	    continue;
+	if (s >= best._t) // further away than the light/closest hit so far
+	    continue;
+
+	Vector3 hit = direction*s;
+	hit += origin;
+
+	// Is the intersection of the ray with the triangle's plane INSIDE the triangle?
+	coord kt1 = dot(data._e1, hit) - data._d1; if (kt1<0.0) continue;
+	coord kt2 = dot(data._e2, hit) - data._d2; if (kt2<0.0) continue;
+	coord kt3 = dot(data._e3, hit) - data._d3; if (kt3<0.0) continue;
+
+	// It is, "hit" is the world space coordinate of the intersection.
+
+	// Any-hit query? (template param)
+	if (anyHit)
+	    return true;
+
+	// maintain the closest hit
+	best._t = s;
+	best._pTri = &triangle;
+	best._kAB = kt1;
+	best._kBC = kt2;
+	best._kCA = kt3;
+    }
+    return false;
+}
+
+// Walks the BVH, looking for the closest hit (anyHit=false) or any hit (anyHit=true)
+// closer than best._t. Returns true if it found one (closest hits are placed in 'best').
+template <bool anyHit, bool doCulling>
+bool TraverseBVH(const Scene& scene, const Ray& ray, TraversalHit& best)
+{
+    const Vector3& origin = ray._origin;
+    const Vector3& direction = ray._direction;
+
+    // The stack doesn't limit the depth of the BVH, see BVHShortStack
+#ifdef BVH_QUANTIZED
+    // Quantized nodes don't carry their own box, so the stack keeps the decoded
+    // boxes of the nodes it holds (they were tested when they were pushed).
+    struct StackEntry {
+	unsigned _idx;
+	Vector3 _bottom;
+	Vector3 _top;
+    };
+    BVHShortStack<StackEntry> stack;
+    StackEntry current;
+    current._idx = 0;
+    current._bottom = scene._QBVHRootBottom;
+    current._top = scene._QBVHRootTop;
+    if (!RayIntersectsBox(origin, direction, current._bottom, current._top, best._t))
+	return false;
+    stack.push(current);
+    while(true) {
+	if (!stack.empty())
+	    current = stack.pop();
+	else if (stack._overflowed) {
+	    // We lost stack entries - find where to continue from, via the parent links
+	    current._idx = NextBVHNodeAfterSubtree(scene, current._idx);
+	    if (current._idx == BVH_NO_NODE)
+		break;
+	    DecodeQuantizedBox(scene, current._idx, current._bottom, current._top);
+	    if (!RayIntersectsBox(origin, direction, current._bottom, current._top, best._t))
+		continue;
+	} else
+	    break;
+	const QuantizedBVHNode& node = scene._pQBVH[current._idx];
+	RAYSTAT(_nodesVisited++);
+	if (!(node._idxLeftOrCount & 0x80000000)) {
+	    // Right child first, so that the left one is popped first
+	    for(int c=1; c>=0; c--) {
+		StackEntry child;
+		DecodeQuantizedChild(node, c, current._bottom, current._top, child._bottom, child._top);
+		if (RayIntersectsBox(origin, direction, child._bottom, child._top, best._t)) {
+		    child._idx = node._idxLeftOrCount + c;
+		    stack.push(child);
+		}
+	    }
+	} else {
+	    unsigned start = node.u.leaf._startIndexInTriIndexList;
+	    unsigned count = node._idxLeftOrCount & 0x7fffffff;
+	    if (IntersectLeafTriangles<anyHit, doCulling>(scene, start, count, ray, best))
+		return true;
+	}
+    }
+#else
+    BVHShortStack<unsigned> stack;
+    unsigned idxCurrent = 0;
+    stack.push(idxCurrent);
+    while(true) {
+	if (!stack.empty())
+	    idxCurrent = stack.pop();
+	else if (stack._overflowed) {
+	    // We lost stack entries - find where to continue from, via the parent links
+	    idxCurrent = NextBVHNodeAfterSubtree(scene, idxCurrent);
+	    if (idxCurrent == BVH_NO_NODE)
+		break;
+	} else
+	    break;
+	const CacheFriendlyBVHNode *pCurrent = &scene._pCFBVH[idxCurrent];
+	RAYSTAT(_nodesVisited++);
+	//if (!pCurrent->IsLeaf()) {
+	if (!(pCurrent->u.leaf._count & 0x80000000)) {
+	    if (RayIntersectsBox(origin, direction, pCurrent->_bottom, pCurrent->_top, best._t)) {
+		stack.push(pCurrent->u.inner._idxRight);
+		stack.push(pCurrent->u.inner._idxLeft);
+	    }
+	} else {
+	    unsigned start = pCurrent->u.leaf._startIndexInTriIndexList;
+	    unsigned count = pCurrent->u.leaf._count & 0x7fffffff;
+	    if (IntersectLeafTriangles<anyHit, doCulling>(scene, start, count, ray, best))
+		return true;
+	}
+    }
+#endif
+    // Closest-hit or any-hit? (compile-time template param)
+    if (!anyHit)
+	// for closest hits, return true if we pierced a triangle
+	return best._pTri != NULL;
+    else
+	// for any-hit, we would have returned true above
+	return false;
+}
+
+bool Scene::Intersect(const Ray& ray, RayHit& hit, bool cullBackfaces) const
+{
+    ASSERT_OR_DIE(HasBVH());
+
+    TraversalHit best;
+    best._t = ray._tMax;
+    best._pTri = NULL;
+    best._kAB = best._kBC = best._kCA = 0.f;
+
+    bool found = cullBackfaces ?
+	TraverseBVH<false, true>(*this, ray, best) :
+	TraverseBVH<false, false>(*this, ray, best);
+    if (!found) {
+	hit = RayHit();
+	return false;
+    }
+
+    const Triangle& tri = *best._pTri;
+    hit._t = best._t;
+    hit._triangleIdx = int(best._pTri - &_triangles[0]);
+    hit._point = ray._direction*best._t;
+    hit._point += ray._origin;
+
+    // The barycentric coordinates are the areas of the three sub-triangles
+    // formed by the hit point, divided by the area of the triangle
+    // (in fact, we should divide all of them by 2, but since we're only
+    //  interested in ratios, there is no need).
+    // Each sub-triangle's area is the distance of the hit point from an edge
+    // (kXX, found above), times the length of that edge - and we use the area
+    // of the sub-triangle ACROSS a vertex, to weigh that vertex.
+    const Vector3& A = _vertices[tri._idxA];
+    const Vector3& B = _vertices[tri._idxB];
+    const Vector3& C = _vertices[tri._idxC];
+    Vector3 AB = B; AB -= A;
+    Vector3 BC = C; BC -= B;
+    coord area = cross(AB, BC).length();      // 2*area(ABC)
+    hit._baryA = best._kBC*distance(B, C)/area;
+    hit._baryB = best._kCA*distance(C, A)/area;
+    hit._baryC = best._kAB*distance(A, B)/area;
+    return true;
+}
+
+bool Scene::Occluded(const Ray& ray, bool cullBackfaces) const
+{
+    ASSERT_OR_DIE(HasBVH());
+
+    TraversalHit best;
+    best._t = ray._tMax;
+    best._pTri = NULL;
+    return cullBackfaces ?
+	TraverseBVH<true, true>(*this, ray, best) :
+	TraverseBVH<true, false>(*this, ray, best);
+}
+
+// Functors for the batched queries, see Parallel.h
+
+class IntersectBatchBody {
+    const Scene& _scene;
+    const Ray *_rays;
+    RayHit *_hits;
+    bool _cullBackfaces;
+public:
+    IntersectBatchBody(const Scene& scene, const Ray *rays, RayHit *hits, bool cullBackfaces)
+	:
+	_scene(scene), _rays(rays), _hits(hits), _cullBackfaces(cullBackfaces) {}
+    void operator()(int i) const {
+	_scene.Intersect(_rays[i], _hits[i], _cullBackfaces);
+    }
+};
+
+class OccludedBatchBody {
+    const Scene& _scene;
+    const Ray *_rays;
+    bool *_occluded;
+    bool _cullBackfaces;
+public:
+    OccludedBatchBody(const Scene& scene, const Ray *rays, bool *occluded, bool cullBackfaces)
+	:
+	_scene(scene), _rays(rays), _occluded(occluded), _cullBackfaces(cullBackfaces) {}
+    void operator()(int i) const {
+	_occluded[i] = _scene.Occluded(_rays[i], _cullBackfaces);
+    }
+};
+
+// How many rays each thread gets at a time
+#define RAYS_PER_BATCH_TASK 64
+
+void Scene::IntersectBatch(const Ray *rays, RayHit *hits, int count, bool cullBackfaces) const
+{
+    ASSERT_OR_DIE(HasBVH());
+    ParallelFor(0, count, RAYS_PER_BATCH_TASK, IntersectBatchBody(*this, rays, hits, cullBackfaces));
+}
+
+void Scene::OccludedBatch(const Ray *rays, bool *occluded, int count, bool cullBackfaces) const
+{
+    ASSERT_OR_DIE(HasBVH());
+    ParallelFor(0, count, RAYS_PER_BATCH_TASK, OccludedBatchBody(*this, rays, occluded, cullBackfaces));
+}
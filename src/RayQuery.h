@@ -0,0 +1,67 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __rayquery_h__
+#define __rayquery_h__
+
+#include <cfloat>
+
+#include "Types.h"
+
+// Ray queries against the BVH of a Scene (see Scene::Intersect, Scene::Occluded
+// and their batched versions). The raytracer is built on top of them, and so can
+// anything else that needs to shoot rays (picking, AO baking, etc).
+//
+// The BVH must have been created before any query (see UpdateBoundingVolumeHierarchy).
+
+struct Triangle;
+
+struct Ray {
+    Vector3 _origin;
+    // Must be normalized - distances (_tMax, RayHit::_t) are measured along it
+    Vector3 _direction;
+    // Hits at distances >= _tMax don't count
+    // (e.g. for shadow rays, the distance to the light)
+    coord _tMax;
+    // Hits on this triangle don't count (e.g. the triangle the ray starts from)
+    const Triangle *_ignoreTriangle;
+
+    Ray(const Vector3& origin, const Vector3& direction,
+	coord tMax = FLT_MAX, const Triangle *ignoreTriangle = NULL)
+	:
+	_origin(origin), _direction(direction),
+	_tMax(tMax), _ignoreTriangle(ignoreTriangle) {}
+    Ray():_tMax(FLT_MAX), _ignoreTriangle(NULL) {}
+};
+
+struct RayHit {
+    // Distance of the hit from the ray origin
+    coord _t;
+    // Index of the triangle that was hit in Scene::_triangles, -1 for no hit
+    int _triangleIdx;
+    // Barycentric coordinates of the hit point, i.e. the weights
+    // of the triangle's vertices _idxA, _idxB and _idxC (they sum to 1)
+    coord _baryA, _baryB, _baryC;
+    // The hit point, in world space
+    Vector3 _point;
+
+    RayHit():_t(FLT_MAX), _triangleIdx(-1), _baryA(0.f), _baryB(0.f), _baryC(0.f) {}
+};
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include "Defines.h"
+
+#ifdef RAY_STATISTICS
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <atomic>
+
+#include "3d.h"
+#include "Screen.h"
+#include "RayStatistics.h"
+
+thread_local RayStatistics *g_pRayStatistics = NULL;
+
+// WIDTH*HEIGHT of them, one per pixel
+static std::vector<RayStatistics> g_pixelStatistics;
+
+// Small, dense thread indexes (works for both OpenMP and TBB threads)
+static std::atomic<unsigned> g_threadsSeen(0);
+static unsigned ThreadIndex()
+{
+    static thread_local unsigned index = g_threadsSeen++;
+    return index;
+}
+
+RayStatistics *RayStatisticsForPixel(int y, int x)
+{
+    RayStatistics *p = &g_pixelStatistics[y*WIDTH + x];
+    p->_thread = ThreadIndex();
+    return p;
+}
+
+void RayStatisticsFrameStart()
+{
+    g_pixelStatistics.resize(WIDTH*HEIGHT);
+    memset(&g_pixelStatistics[0], 0, WIDTH*HEIGHT*sizeof(RayStatistics));
+}
+
+// False-color palette: black, blue, cyan, green, yellow, red, for t in [0,1]
+static Uint32 HeatmapColor(Screen& canvas, coord t)
+{
+    static const coord palette[6][3] = {
+	{0,0,0}, {0,0,255}, {0,255,255}, {0,255,0}, {255,255,0}, {255,0,0}
+    };
+    t = std::max(0.f, std::min(1.f, t))*5.f;
+    int i = std::min(4, int(t));
+    coord f = t - i;
+    coord c[3];
+    for(int k=0; k<3; k++)
+	c[k] = palette[i][k] + f*(palette[i+1][k] - palette[i][k]);
+    return canvas.MapRGB(Uint8(c[0]), Uint8(c[1]), Uint8(c[2]));
+}
+
+void RayStatisticsFrameEnd(Screen& canvas, unsigned msFrame)
+{
+    RayStatistics total;
+    memset(&total, 0, sizeof(total));
+    std::vector<RayStatistics> perThread(g_threadsSeen);
+    unsigned maxNodes = 0;
+    for(int y=0; y<HEIGHT; y++)
+	for(int x=0; x<WIDTH; x++) {
+	    const RayStatistics& p = g_pixelStatistics[y*WIDTH + x];
+	    RayStatistics& t = perThread[p._thread];
+#define ACCUMULATE(field) total.field += p.field; t.field += p.field;
+	    ACCUMULATE(_nodesVisited)
+	    ACCUMULATE(_trianglesTested)
+	    ACCUMULATE(_primaryRays)
+	    ACCUMULATE(_secondaryRays)
+	    ACCUMULATE(_shadowRays)
+#undef ACCUMULATE
+	    maxNodes = std::max(maxNodes, p._nodesVisited);
+	}
+
+    // Frame totals...
+    double rays = double(total._primaryRays) + total._secondaryRays + total._shadowRays;
+    double seconds = std::max(msFrame, 1u)/1000.;
+    printf("Ray statistics: %.0f rays (%u primary, %u secondary, %u shadow) in %.3f seconds (%.0f rays/sec)\n",
+	rays, total._primaryRays, total._secondaryRays, total._shadowRays, seconds, rays/seconds);
+    printf("                %.1f BVH nodes/ray, %.1f triangles/ray (max %u nodes in a pixel)\n",
+	total._nodesVisited/std::max(rays, 1.), total._trianglesTested/std::max(rays, 1.), maxNodes);
+    // ...and per thread, to spot load imbalance
+    for(unsigned i=0; i<perThread.size(); i++) {
+	const RayStatistics& t = perThread[i];
+	unsigned threadRays = t._primaryRays + t._secondaryRays + t._shadowRays;
+	if (threadRays)
+	    printf("                thread %u: %u rays, %u nodes, %u triangles\n",
+		i, threadRays, t._nodesVisited, t._trianglesTested);
+    }
+
+    // Raw per-pixel counters: a CSV for quick looks, and a binary dump
+    // (two ints for width and height, then HEIGHT*WIDTH RayStatistics)
+    FILE *fp = fopen("raystats.csv", "w");
+    if (fp) {
+	fprintf(fp, "x,y,thread,nodes,triangles,primary,secondary,shadow\n");
+	for(int y=0; y<HEIGHT; y++)
+	    for(int x=0; x<WIDTH; x++) {
+		const RayStatistics& p = g_pixelStatistics[y*WIDTH + x];
+		fprintf(fp, "%d,%d,%u,%u,%u,%u,%u,%u\n", x, y, p._thread,
+		    p._nodesVisited, p._trianglesTested, p._primaryRays, p._secondaryRays, p._shadowRays);
+	    }
+	fclose(fp);
+    }
+    fp = fopen("raystats.bin", "wb");
+    if (fp) {
+	int dims[2] = { WIDTH, HEIGHT };
+	if (1 == fwrite(dims, sizeof(dims), 1, fp))
+	    fwrite(&g_pixelStatistics[0], WIDTH*HEIGHT*sizeof(RayStatistics), 1, fp);
+	fclose(fp);
+    }
+
+    // Show where the BVH traversal cost goes, instead of the image
+    for(int y=0; y<HEIGHT; y++)
+	for(int x=0; x<WIDTH; x++)
+	    canvas.DrawPixel(y, x, HeatmapColor(
+		canvas, g_pixelStatistics[y*WIDTH + x]._nodesVisited/coord(std::max(maxNodes, 1u))));
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __raystatistics_h__
+#define __raystatistics_h__
+
+#include "Defines.h"
+
+// Raytracer instrumentation, enabled via RAY_STATISTICS (see Defines.h).
+//
+// The raytracer points g_pRayStatistics to the counters of the pixel
+// it is working on (one pointer per thread), and the code that traces rays
+// increments them via RAYSTAT(...). Without RAY_STATISTICS, RAYSTAT
+// compiles to nothing.
+
+struct RayStatistics {
+    unsigned _nodesVisited;
+    unsigned _trianglesTested;
+    unsigned _primaryRays;
+    unsigned _secondaryRays; // reflections and refractions
+    unsigned _shadowRays;    // and ambient occlusion rays
+    unsigned _thread;        // index of the thread that traced this pixel
+};
+
+#ifdef RAY_STATISTICS
+
+extern thread_local RayStatistics *g_pRayStatistics;
+
+#define RAYSTAT(x) do { if (g_pRayStatistics) g_pRayStatistics->x; } while(0)
+
+struct Screen;
+
+// Called by the raytracer before/after each frame. RayStatisticsFrameEnd
+// prints the frame totals, dumps the per-pixel counters (raystats.csv and
+// raystats.bin) and replaces the image with a heatmap of the BVH nodes visited.
+void RayStatisticsFrameStart();
+void RayStatisticsFrameEnd(Screen& canvas, unsigned msFrame);
+
+// The counters of a pixel, to set g_pRayStatistics to
+RayStatistics *RayStatisticsForPixel(int y, int x);
+
+#else
+
+#define RAYSTAT(x) do {} while(0)
+
+#endif
+
+#endif
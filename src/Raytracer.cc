@@ -21,6 +21,7 @@
 
 #include <cstddef>
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <cfloat>
 
@@ -36,6 +37,8 @@
 #include "3d.h"
 #include "Screen.h"
 #include "Clock.h"
+#include "RayQuery.h"
+#include "RayStatistics.h"
 
 // Takes lots of time to raytrace a frame, provide quick abort via keys
 #include "Keyboard.h"
@@ -55,9 +58,6 @@
 // What depth to stop reflections and refractions?
 #define MAX_RAY_DEPTH	    3
 
-// Ray intersections of a distance <=NUDGE_FACTOR (from the origin) don't count
-#define NUDGE_FACTOR     1e-5f
-
 //////////////////////////////
 // Should we cast shadow rays?
 #define USE_SHADOWS
@@ -80,10 +80,6 @@
 // How close to check for ambient occlusion?
 #define AMBIENT_RANGE    0.15f
 
-// Maximum allowed depth of BVH
-// Checked at BVH build time, no runtime crash possible, see below
-#define BVH_STACK_SIZE 32
-
 //#define RTCORETEST
 //#ifdef RTCORETEST
 //#undef MAX_RAY_DEPTH
@@ -95,59 +91,22 @@
 //#define MAX_RAY_DEPTH 1
 //#endif
 
-// Helper function, that checks whether a ray intersects a bbox
-inline bool RayIntersectsBox(const Vector3& originInWorldSpace, const Vector3& rayInWorldSpace, CacheFriendlyBVHNode *pBox)
+// Xorshift random generator, returning a number in [0,1) and updating the
+// (never zero) seed. Cheap, and unlike rand() it keeps no shared state.
+inline coord RandomUnit(unsigned& seed)
 {
-    // set Tnear = - infinity, Tfar = infinity
-    //
-    // For each pair of planes P associated with X, Y, and Z do:
-    //     (example using X planes)
-    //     if direction Xd = 0 then the ray is parallel to the X planes, so
-    //         if origin Xo is not between the slabs ( Xo < Xl or Xo > Xh) then
-    //             return false
-    //     else, if the ray is not parallel to the plane then
-    //     begin
-    //         compute the intersection distance of the planes
-    //         T1 = (Xl - Xo) / Xd
-    //         T2 = (Xh - Xo) / Xd
-    //         If T1 > T2 swap (T1, T2) /* since T1 intersection with near plane */
-    //         If T1 > Tnear set Tnear =T1 /* want largest Tnear */
-    //         If T2 < Tfar set Tfar="T2" /* want smallest Tfar */
-    //         If Tnear > Tfar box is missed so
-    //             return false
-    //         If Tfar < 0 box is behind ray
-    //             return false
-    //     end
-    // end of for loop
-    //
-    // If Box survived all above tests, return true with intersection point Tnear and exit point Tfar.
-
-    CacheFriendlyBVHNode& box = *pBox;
-    coord Tnear, Tfar;
-    Tnear = -FLT_MAX;
-    Tfar = FLT_MAX;
-
-#define CHECK_NEAR_AND_FAR_INTERSECTION(c)                                            \
-    if (rayInWorldSpace._ ## c == 0.) {                                               \
-	if (originInWorldSpace._##c < box._bottom._##c) return false;                 \
-	if (originInWorldSpace._##c > box._top._##c) return false;                    \
-    } else {                                                                          \
-	coord T1 = (box._bottom._##c - originInWorldSpace._##c)/rayInWorldSpace._##c; \
-	coord T2 = (box._top._##c    - originInWorldSpace._##c)/rayInWorldSpace._##c; \
-	if (T1>T2) { coord tmp=T1; T1=T2; T2=tmp; }                                   \
-	if (T1 > Tnear) Tnear = T1;                                                   \
-	if (T2 < Tfar)  Tfar = T2;                                                    \
-	if (Tnear > Tfar)                                                             \
-	    return false;                                                             \
-	if (Tfar < 0.)                                                                \
-	    return false;                                                             \
-    }
-
-    CHECK_NEAR_AND_FAR_INTERSECTION(x)
-    CHECK_NEAR_AND_FAR_INTERSECTION(y)
-    CHECK_NEAR_AND_FAR_INTERSECTION(z)
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed >> 8)*(1.f/16777216.f);
+}
 
-    return true;
+// How important a light is for a point - used when picking lights
+// for the point's shadow rays (see Scene::_lightSamplesPerHit)
+inline coord LightSelectionWeight(const Light& light, const Vector3& point)
+{
+    coord distanceSq = distancesq(light, point);
+    return light._power*light.Falloff(distanceSq)/std::max(distanceSq, 1e-6f);
 }
 
 template <bool antialias>
@@ -169,142 +128,83 @@ public:
 	y(scanline)
     {}
 
-    // Templated member - offers two compile-time options:
-    //
-    // The first one is used to discriminate between shadow rays (that stop at the first hit)
-    // and normal rays, that have to find the closest hit.
-    //
-    // The second one enables or disables culling of backfacing triangles, and is enabled
-    // by the refraction call (which needs both front and back-faces), but disabled for
-    // reflections and shadow rays.
-    //
-    // C++ power...
-    //
-    template <bool stopAtfirstRayHit, bool doCulling>
-    bool BVH_IntersectTriangles(
-	// Inputs
-	const Vector3& origin, const Vector3& ray, const Triangle *avoidSelf,
-	// outputs
-	const Triangle*& pBestTri,
-	//
-	// both inputs and outputs!
-	//
-	// for normal rays:
-	//  pointHitInWorldSpace (output)
-        //  kXX (outputs) perpendicular distances of intersection point from the 3 triangle edges
-	//     (used for PhongNormal calculations)
-	//
-	// for shadow rays:
-	//  pointHitInWorldSpace (input) provides the light position
-	Vector3& pointHitInWorldSpace,
-	coord& kAB, coord& kBC, coord& kCA) const
+    // The diffuse and specular contribution of a light to the point we hit
+    // (black, if the point is in the light's shadow).
+    template <bool doCulling>
+    Pixel ShadeLight(
+	const Light& light, const Vector3& pointHitInWorldSpace, const Vector3& phongNormal,
+	const Triangle *pBestTri, const Triangle *avoidSelf) const
     {
-	// in the loop below, maintain the closest triangle and the point where we hit it:
-	pBestTri = NULL;
-	coord bestTriDist;
+	// This light's diffuse and specular contribution
+	Pixel dColor = Pixel(); // start with black
 
-	// light position passed-in pointHitInWorldSpace (only in shadow mode - i.e. stopAtfirstRayHit=true)
-	Vector3& lightPos = pointHitInWorldSpace;
+	// We calculate the vector from point hit, to light (both in world space).
+	Vector3 pointToLight = light;
+	pointToLight -= pointHitInWorldSpace;
 
-	// Compile-time work (stopAtfirstRayHit is template param)
-	if (stopAtfirstRayHit)
-	    // In shadow ray mode, start from light distance
-	    bestTriDist = distancesq(origin, lightPos);
-	else
-	    // In normal mode, start from infinity
-	    bestTriDist = FLT_MAX;
-
-	CacheFriendlyBVHNode* stack[BVH_STACK_SIZE];
-	int stackIdx = 0;
-	stack[stackIdx++] = scene._pCFBVH;
-	while(stackIdx) {
-	    CacheFriendlyBVHNode *pCurrent = stack[stackIdx-1];
-	    stackIdx--;
-	    //if (!pCurrent->IsLeaf()) {
-	    if (!(pCurrent->u.leaf._count & 0x80000000)) {
-		if (RayIntersectsBox(origin, ray, pCurrent)) {
-		    stack[stackIdx++] = &scene._pCFBVH[pCurrent->u.inner._idxRight];
-		    stack[stackIdx++] = &scene._pCFBVH[pCurrent->u.inner._idxLeft];
-		    assert(stackIdx<=BVH_STACK_SIZE);
-		}
-	    } else {
-		//BVHLeaf *p = dynamic_cast<BVHLeaf*>(pCurrent);
-		//for(std::list<const Triangle*>::iterator it=p->_triangles.begin();
-		//    it != p->_triangles.end();
-		//    ++it)
-		for(unsigned i=pCurrent->u.leaf._startIndexInTriIndexList;
-		    i<pCurrent->u.leaf._startIndexInTriIndexList + (pCurrent->u.leaf._count & 0x7fffffff);
-		    i++)
-		{
-		    //const Triangle& triangle = *(*it);
-		    const Triangle& triangle = scene._triangles[scene._triIndexList[i]];
-
-		    if (avoidSelf == &triangle)
-			continue; // avoid self-reflections/refractions
-
-		    // doCulling is a compile-time param, this code will be "codegenerated"
-		    // at compile time only for reflection-related calls to Raytrace (see below)
-		    if (doCulling && !triangle._twoSided) {
-			// Check visibility of triangle via dot product
-			Vector3 fromTriToOrigin = origin;
-			fromTriToOrigin -= triangle._center;
-			// Normally we would normalize, but since we just need the sign
-			// of the dot product (to determine if it facing us or not)...
-			//fromTriToOrigin.normalize();
-			if (dot(fromTriToOrigin, triangle._normal)<0)
-			    continue;
-		    }
-
-		    // Use the pre-computed triangle intersection data: normal, d, e1/d1, e2/d2, e3/d3
-		    coord k = dot(triangle._normal, ray);
-		    if (k == 0.0)
-			continue; // this triangle is parallel to the ray, ignore it.
-
-		    coord s = (triangle._d - dot(triangle._normal, origin))/k;
-		    if (s <= 0.0) // this triangle is "behind" the origin.
-			continue;
-		    if (s <= NUDGE_FACTOR)
-			continue;
-
-		    Vector3 hit = ray*s;
-		    hit += origin;
-
-		    // Is the intersection of the ray with the triangle's plane INSIDE the triangle?
-		    coord kt1 = dot(triangle._e1, hit) - triangle._d1; if (kt1<0.0) continue;
-		    coord kt2 = dot(triangle._e2, hit) - triangle._d2; if (kt2<0.0) continue;
-		    coord kt3 = dot(triangle._e3, hit) - triangle._d3; if (kt3<0.0) continue;
-
-		    // It is, "hit" is the world space coordinate of the intersection.
-
-		    // Was this a normal ray or a shadow ray? (template param)
-		    if (stopAtfirstRayHit) {
-			// Shadow ray, check whether the triangle obstructs the light
-			coord dist = distancesq(lightPos, hit);
-			if (dist < bestTriDist) // distance to light (squared) passed in kAB
-			    return true; // we found a triangle obstructing the light, return true
-		    } else {
-			// Normal ray - it this intersection closer than all the others?
-			coord hitZ = distancesq(origin, hit);
-			if (hitZ < bestTriDist) {
-			    // maintain the closest hit
-			    bestTriDist = hitZ;
-			    pBestTri = &triangle;
-			    pointHitInWorldSpace = hit;
-			    kAB = kt1;
-			    kBC = kt2;
-			    kCA = kt3;
-			}
-		    }
-		}
+	// this is our distance from the light (squared, i.e. we didnt use an sqrt)
+	coord distanceFromLightSq = pointToLight.lengthsq();
+
+	// Lights with a range (see Light::Falloff) may not reach us at all
+	// - and then, there's no need for a shadow ray
+	coord falloff = light.Falloff(distanceFromLightSq);
+	if (falloff <= 0.f)
+	    return dColor;
+
+#ifdef USE_SHADOWS
+
+	coord distanceFromLight = sqrt(distanceFromLightSq);
+
+	Vector3 shadowrayInWorldSpace = pointToLight;
+	shadowrayInWorldSpace /= distanceFromLight;
+
+	// Only the triangles between us and the light matter
+	RAYSTAT(_shadowRays++);
+	if (scene.Occluded(
+		Ray(pointHitInWorldSpace, shadowrayInWorldSpace, distanceFromLight, avoidSelf),
+		doCulling))
+	{
+	    return dColor; // we were in shadow, no contribution from this light
+	}
+#endif // USE_SHADOWS
+
+	// Diffuse color
+	pointToLight.normalize();  // vector from point to light (in world space)
+
+	coord intensity = dot(phongNormal, pointToLight);
+	if (intensity<0.) {
+	    ; // in shadow, let it be in ambient
+	} else {
+	    Pixel diffuse = scene._materials[pBestTri->_material]._colorf;
+	    diffuse *= (coord) (DIFFUSE*intensity/255.);   // diffuse set to a maximum of 130/255
+	    dColor += diffuse;
+#ifndef RTCORETEST
+	    // Specular color
+	    // We will use the half vector: pointToLight + point to camera
+	    Vector3 pointToCamera = eye;
+	    pointToCamera -= pointHitInWorldSpace;
+	    pointToCamera.normalize();
+
+	    Vector3 half = pointToLight;
+	    half += pointToCamera;
+	    half.normalize();
+
+	    // use the interpolated phong normal!
+	    coord intensity2 = dot(half, phongNormal);
+	    if (intensity2>0.) {
+		intensity2 *= intensity2;
+		intensity2 *= intensity2;
+		intensity2 *= intensity2;
+		intensity2 *= intensity2;
+		intensity2 *= intensity2;
+		dColor += Pixel(
+		    (unsigned char)(SPECULAR*intensity2),
+		    (unsigned char)(SPECULAR*intensity2),
+		    (unsigned char)(SPECULAR*intensity2));
 	    }
+#endif // RTCORETEST
 	}
-	// Normal ray or shadow ray? (compile-time template param)
-	if (!stopAtfirstRayHit)
-	    // for normal ray, return true if we pierced a triangle
-	    return pBestTri != NULL;
-	else
-	    // for shadow ray, return true if we found a triangle obstructing the light.
-	    return false;
+	return dColor*(light._power*falloff);
     }
 
     // Templated member - offers a single compile-time option, whether we are doing culling or not.
@@ -312,23 +212,30 @@ public:
     // but disable it for refraction rays.
     //
     // Class-nested C++ recursion, provided via templates...
+    //
+    // The seed is the state of the random generator used for picking lights (see RandomUnit).
     template <bool doCulling>
-    Pixel Raytrace(Vector3 originInWorldSpace, Vector3 rayInWorldSpace, const Triangle *avoidSelf, int depth) const
+    Pixel Raytrace(
+	Vector3 originInWorldSpace, Vector3 rayInWorldSpace, const Triangle *avoidSelf, int depth,
+	unsigned& seed) const
     {
 	if (depth >= MAX_RAY_DEPTH)
 	    return Pixel(0.,0.,0.);
 
-	const Triangle *pBestTri = NULL;
-	Vector3 pointHitInWorldSpace;
-	coord kAB=0.f, kBC=0.f, kCA=0.f; // distances from the 3 edges of the triangle (from where we hit it)
+	if (depth)
+	    RAYSTAT(_secondaryRays++);
+	else
+	    RAYSTAT(_primaryRays++);
 
 	// Use the surface-area heuristic based, bounding volume hierarchy of axis-aligned bounding boxes
 	// (keywords: SAH, BVH, AABB)
-	if (!BVH_IntersectTriangles<false,doCulling>(
-		originInWorldSpace, rayInWorldSpace, avoidSelf,
-		pBestTri, pointHitInWorldSpace, kAB, kBC, kCA))
+	RayHit hit;
+	if (!scene.Intersect(
+		Ray(originInWorldSpace, rayInWorldSpace, FLT_MAX, avoidSelf), hit, doCulling))
 	    // We pierced no triangle, return with no contribution (ambient is black)
 	    return Pixel(0.,0.,0.);
+	const Triangle *pBestTri = &scene._triangles[hit._triangleIdx];
+	const Vector3& pointHitInWorldSpace = hit._point;
 
 	// Set this to pass to recursive calls below, so that we don't get self-shadow or self-reflection
 	// from this triangle...
@@ -336,45 +243,19 @@ public:
 
 	// We'll also calculate the color contributed from this intersection
 	// Start from the triangle's color
-	Pixel color = pBestTri->_colorf;
+	Pixel color = scene._materials[pBestTri->_material]._colorf;
 
 #ifdef USE_PHONG_NORMAL
-	// These are the closest triangle's vertices...
-	const Vector3& bestTriA = *pBestTri->_vertexA;
-	const Vector3& bestTriB = *pBestTri->_vertexB;
-	const Vector3& bestTriC = *pBestTri->_vertexC;
-	// ...and their normal vectors:
-	const Vector3& bestTriNrmA = pBestTri->_vertexA->_normal;
-	const Vector3& bestTriNrmB = pBestTri->_vertexB->_normal;
-	const Vector3& bestTriNrmC = pBestTri->_vertexC->_normal;
-
 	// We now want to interpolate the triangle's normal,
 	// so that as the "pointHitInWorldSpace" gets closer to
-	// a vertex X, the interpolated normal becomes closer to bestTriNrmX,
-	// and becomes EXACTLY bestTriNrmX, if the pointHitInWorldSpace is X.
-	//
-	// To do that, we use the 3 areas of the triangle, as it is divided
-	// by the pointHitInWorldSpace.
+	// a vertex X, the interpolated normal becomes closer to the normal of X,
+	// and becomes EXACTLY that, if the pointHitInWorldSpace is X.
 	//
-	// This is the total triangle's area: cross product of two edges
-	// (in fact, we should divide by 2, but since we're only interested
-	//  in ratios (see below), there is no need)
-	Vector3 AB = bestTriB; AB-= bestTriA;  // edge AB
-	Vector3 BC = bestTriC; BC-= bestTriB;  // edge BC
-	Vector3 crossAB_BC = cross(AB, BC);
-	coord area = crossAB_BC.length();      // 2*area(ABC)
-
-	// And these are the three sub-triangles - kAB,kBC,kCA were found above...
-	coord ABx = kAB*distance(bestTriA, bestTriB);
-	coord BCx = kBC*distance(bestTriB, bestTriC);
-	coord CAx = kCA*distance(bestTriC, bestTriA);
-
-	// use the area of the sub-triangle ACROSS a point, to scale!
-	// (which means that if pointHitInCameraSpace is exactly on a vertex,
-	//  the area of the sub-triangle becomes the area of the triangle!)
-	Vector3 phongNormalA = bestTriNrmA; phongNormalA *= BCx / area;
-	Vector3 phongNormalB = bestTriNrmB; phongNormalB *= CAx / area;
-	Vector3 phongNormalC = bestTriNrmC; phongNormalC *= ABx / area;
+	// To do that, we use the barycentric coordinates of the hit, i.e. the
+	// 3 areas of the triangle, as it is divided by the pointHitInWorldSpace.
+	Vector3 phongNormalA = scene._vertices[pBestTri->_idxA]._normal; phongNormalA *= hit._baryA;
+	Vector3 phongNormalB = scene._vertices[pBestTri->_idxB]._normal; phongNormalB *= hit._baryB;
+	Vector3 phongNormalC = scene._vertices[pBestTri->_idxC]._normal; phongNormalC *= hit._baryC;
 
 	// and finally, accumulate the three contributions and normalize.
 	Vector3 phongNormal = phongNormalA + phongNormalB + phongNormalC;
@@ -398,17 +279,12 @@ public:
 	    i++;
 	    maxLight += cosangle;
 	    ambientRay.normalize();
-	    Vector3 temp(pointHitInWorldSpace);
-	    temp += ambientRay*AMBIENT_RANGE;
-	    const Triangle *dummy;
 	    // Some objects needs a "nudge", to avoid self-shadowing
 	    //Vector3 nudgedPointHitInWorldSpace = pointHitInWorldSpace;
 	    //nudgedPointHitInWorldSpace += ambientRay*.005f;
-	    //if (!BVH_IntersectTriangles<true,true>(
-	    //	    nudgedPointHitInWorldSpace, ambientRay, avoidSelf,
-	    if (!BVH_IntersectTriangles<true,true>(
-		    pointHitInWorldSpace, ambientRay, avoidSelf,
-		    dummy, temp, kAB, kAB, kAB)) {
+	    RAYSTAT(_shadowRays++);
+	    if (!scene.Occluded(
+		    Ray(pointHitInWorldSpace, ambientRay, AMBIENT_RANGE, avoidSelf), true)) {
 		// Accumulate contribution of this random ray
 		totalLight += cosangle;
 	    }
@@ -419,89 +295,51 @@ public:
 	// Dont calculate ambient occlusion, use the pre-calculated value from the model
 	// (assuming it exists!)
 	#ifdef USE_PHONG_NORMAL
-	// we have a phong normal, so use the subtriangle areas
+	// we have a phong normal, so use the subtriangle areas (barycentrics)
 	// to interpolate the 3 ambientOcclusionCoeff values
 	coord ambientOcclusionCoeff =
-	    pBestTri->_vertexA->_ambientOcclusionCoeff*BCx/area +
-	    pBestTri->_vertexB->_ambientOcclusionCoeff*CAx/area +
-	    pBestTri->_vertexC->_ambientOcclusionCoeff*ABx/area;
+	    scene._ambientOcclusion[pBestTri->_idxA]*hit._baryA +
+	    scene._ambientOcclusion[pBestTri->_idxB]*hit._baryB +
+	    scene._ambientOcclusion[pBestTri->_idxC]*hit._baryC;
 	#else
 	// we dont have a phong normal, just average the 3 values of the vertices
 	coord ambientOcclusionCoeff = (
-	    pBestTri->_vertexA->_ambientOcclusionCoeff +
-	    pBestTri->_vertexB->_ambientOcclusionCoeff +
-	    pBestTri->_vertexC->_ambientOcclusionCoeff)/3.f;
+	    scene._ambientOcclusion[pBestTri->_idxA] +
+	    scene._ambientOcclusion[pBestTri->_idxB] +
+	    scene._ambientOcclusion[pBestTri->_idxC])/3.f;
 	#endif
 	coord ambientFactor = (coord) ((AMBIENT*ambientOcclusionCoeff/255.0)/255.0);
 	color *= ambientFactor;
 #endif // AMBIENT_OCCLUSION
 
-	// Now, for all the lights...
-	for(unsigned i=0; i<scene._lights.size(); i++) {
-	    Light& light = *scene._lights[i];
-
-	    // This light's diffuse and specular contribution
-	    Pixel dColor = Pixel(); // start with black
-
-	    // We calculate the vector from point hit, to light (both in world space).
-	    Vector3 pointToLight = light;
-	    pointToLight -= pointHitInWorldSpace;
-
-#ifdef USE_SHADOWS
-	    // this is our distance from the light (squared, i.e. we didnt use an sqrt)
-	    coord distanceFromLightSq = pointToLight.lengthsq();
-
-	    Vector3 shadowrayInWorldSpace = pointToLight;
-	    shadowrayInWorldSpace /= sqrt(distanceFromLightSq);
-
-	    const Triangle *pDummy; // just to fill-in the param, not used for shadowrays
-	    if (BVH_IntersectTriangles<true,doCulling>(
-		pointHitInWorldSpace, shadowrayInWorldSpace, avoidSelf,
-		pDummy, // dummy
-		light,
-		kAB, kAB, kAB)) // dummies
-	    {
-		continue; // we were in shadow, go to next light
-	    }
-#endif // USE_SHADOWS
-
-	    // Diffuse color
-	    pointToLight.normalize();  // vector from point to light (in world space)
-
-	    coord intensity = dot(phongNormal, pointToLight);
-	    if (intensity<0.) {
-		; // in shadow, let it be in ambient
-	    } else {
-		Pixel diffuse = pBestTri->_colorf;
-		diffuse *= (coord) (DIFFUSE*intensity/255.);   // diffuse set to a maximum of 130/255
-		dColor += diffuse;
-#ifndef RTCORETEST
-		// Specular color
-		// We will use the half vector: pointToLight + point to camera
-		Vector3 pointToCamera = eye;
-		pointToCamera -= pointHitInWorldSpace;
-		pointToCamera.normalize();
-
-		Vector3 half = pointToLight;
-		half += pointToCamera;
-		half.normalize();
-
-		// use the interpolated phong normal!
-		coord intensity2 = dot(half, phongNormal);
-		if (intensity2>0.) {
-		    intensity2 *= intensity2;
-		    intensity2 *= intensity2;
-		    intensity2 *= intensity2;
-		    intensity2 *= intensity2;
-		    intensity2 *= intensity2;
-		    dColor += Pixel(
-			(unsigned char)(SPECULAR*intensity2),
-			(unsigned char)(SPECULAR*intensity2),
-			(unsigned char)(SPECULAR*intensity2));
+	unsigned lightsNo = (unsigned) scene._lights.size();
+	if (!scene._lightSamplesPerHit || scene._lightSamplesPerHit >= lightsNo) {
+	    // Now, for all the lights...
+	    for(unsigned i=0; i<lightsNo; i++)
+		color += ShadeLight<doCulling>(
+		    *scene._lights[i], pointHitInWorldSpace, phongNormal, pBestTri, avoidSelf);
+	} else {
+	    // Too many lights: shoot shadow rays to just _lightSamplesPerHit of them, picked
+	    // (with replacement) with probability proportional to their power/distance^2.
+	    // Weighing each one by 1/(samples*probability) keeps the sum of the lights
+	    // unbiased - and the cost per hit independent of the number of lights.
+	    coord totalWeight = 0.f;
+	    for(unsigned i=0; i<lightsNo; i++)
+		totalWeight += LightSelectionWeight(*scene._lights[i], pointHitInWorldSpace);
+	    for(unsigned k=0; totalWeight>0.f && k<scene._lightSamplesPerHit; k++) {
+		coord u = RandomUnit(seed)*totalWeight;
+		unsigned i = 0;
+		coord weight = LightSelectionWeight(*scene._lights[0], pointHitInWorldSpace);
+		while (u >= weight && i+1<lightsNo) {
+		    u -= weight;
+		    weight = LightSelectionWeight(*scene._lights[++i], pointHitInWorldSpace);
 		}
-#endif // RTCORETEST
+		if (weight<=0.f)
+		    continue;
+		color += ShadeLight<doCulling>(
+		    *scene._lights[i], pointHitInWorldSpace, phongNormal, pBestTri, avoidSelf)
+		    * (totalWeight/(weight*scene._lightSamplesPerHit));
 	    }
-	    color += dColor;
 	}
 
 #if defined(REFLECTIONS) || defined(REFRACTIONS)
@@ -538,16 +376,16 @@ public:
 	    color
 #ifdef REFLECTIONS
 	    /* use backface culling for reflection rays: <true> */
-	    + Raytrace<true>(originInWorldSpace, reflectedRay, avoidSelf, depth+1) * REFLECTIONS_RATE
+	    + Raytrace<true>(originInWorldSpace, reflectedRay, avoidSelf, depth+1, seed) * REFLECTIONS_RATE
 #endif
 #ifdef REFRACTIONS
 	    /* Makes chessboard look much better
 	    + (nrm._z>0.9 ?
 		Pixel(0.,0.,0.) :
-		Raytrace<false>(originInWorldSpace, refractedRay, avoidSelf, depth+1) * REFRACTIONS_RATE) */
+		Raytrace<false>(originInWorldSpace, refractedRay, avoidSelf, depth+1, seed) * REFRACTIONS_RATE) */
 
 	    /* dont use backface culling for refraction rays: <false> */
-	    + Raytrace<false>(originInWorldSpace, refractedRay, avoidSelf, depth+1) * REFRACTIONS_RATE
+	    + Raytrace<false>(originInWorldSpace, refractedRay, avoidSelf, depth+1, seed) * REFRACTIONS_RATE
 #endif
 	    ;
     }
@@ -560,6 +398,15 @@ public:
 	for(int x=xStarting; x<iOnePastEndingX; x++) {
 	    Pixel finalColor(0,0,0);
 
+	    // Per-pixel seed for picking lights, so that frames are reproducible
+	    // (and independent of the thread scheduling)
+	    unsigned seed = 0x9E3779B9u ^ (unsigned(x)*73856093u) ^ (unsigned(y)*19349663u);
+	    if (!seed) seed = 1;
+
+#ifdef RAY_STATISTICS
+	    g_pRayStatistics = RayStatisticsForPixel(y, x);
+#endif
+
 	    int pixelsTraced = 1;
 	    if (antialias)
 		pixelsTraced = 4;
@@ -593,15 +440,18 @@ public:
 		rayInWorldSpace.normalize();
 
 		// Primary ray, we want backface culling: <true>
-		finalColor += Raytrace<true>(originInWorldSpace, rayInWorldSpace, NULL, 0);
+		finalColor += Raytrace<true>(originInWorldSpace, rayInWorldSpace, NULL, 0, seed);
 	    }
 	    if (antialias)
 		finalColor /= 4.;
 	    if (finalColor._r>255.0f) finalColor._r=255.0f;
 	    if (finalColor._g>255.0f) finalColor._g=255.0f;
 	    if (finalColor._b>255.0f) finalColor._b=255.0f;
-	    canvas.DrawPixel(y,x, SDL_MapRGB(
-		canvas._surface->format, (Uint8)finalColor._r, (Uint8)finalColor._g, (Uint8)finalColor._b));
+	    canvas.DrawPixel(y,x, canvas.MapRGB(
+		(Uint8)finalColor._r, (Uint8)finalColor._g, (Uint8)finalColor._b));
+#ifdef RAY_STATISTICS
+	    g_pRayStatistics = NULL;
+#endif
 	}
     }
 
@@ -623,61 +473,102 @@ int CountBoxes(BVHNode *root)
 	return 1;
 }
 
-unsigned CountTriangles(BVHNode *root)
+void Scene::PopulateCacheFriendlyBVH(
+    BVHNode *root,
+    unsigned& idxBoxes,
+    unsigned& idxTriList)
 {
+    unsigned currIdxBoxes = idxBoxes;
+    _pCFBVH[currIdxBoxes]._bottom = root->_bottom;
+    _pCFBVH[currIdxBoxes]._top    = root->_top;
     if (!root->IsLeaf()) {
 	BVHInner *p = dynamic_cast<BVHInner*>(root);
         ASSERT_OR_DIE(p);
-	return CountTriangles(p->_left) + CountTriangles(p->_right);
+	int idxLeft = ++idxBoxes;
+	PopulateCacheFriendlyBVH(p->_left, idxBoxes, idxTriList);
+	int idxRight = ++idxBoxes;
+	PopulateCacheFriendlyBVH(p->_right, idxBoxes, idxTriList);
+	_pCFBVH[currIdxBoxes].u.inner._idxLeft  = idxLeft;
+	_pCFBVH[currIdxBoxes].u.inner._idxRight = idxRight;
     } else {
 	BVHLeaf *p = dynamic_cast<BVHLeaf*>(root);
         ASSERT_OR_DIE(p);
-	return (unsigned) p->_triangles.size();
+	// The leaves' ranges of _triIndexList come in the order we visit them
+	ASSERT_OR_DIE(p->_start == idxTriList);
+	_pCFBVH[currIdxBoxes].u.leaf._count = 0x80000000 | p->_count;
+	_pCFBVH[currIdxBoxes].u.leaf._startIndexInTriIndexList = p->_start;
+	idxTriList += p->_count;
     }
 }
 
-void CountDepth(BVHNode *root, int depth, int& maxDepth)
+// Quantizes the [childBottom,childTop] range of axis k, relative to the (decoded)
+// parent range [bottom,top]. The decoded child range must contain the original one,
+// so round outwards - and verify it, using the exact arithmetic of the traversal.
+static void QuantizeChildAxis(
+    coord bottom, coord top, coord childBottom, coord childTop,
+    unsigned char& qBottom, unsigned char& qTop)
 {
-    if (maxDepth<depth)
-	maxDepth=depth;
-    if (!root->IsLeaf()) {
-	BVHInner *p = dynamic_cast<BVHInner*>(root);
-        ASSERT_OR_DIE(p);
-	CountDepth(p->_left, depth+1, maxDepth);
-	CountDepth(p->_right, depth+1, maxDepth);
+    coord scale = (top - bottom)*(1.f/255.f);
+    if (scale <= 0.f) {
+	// Flat parent box, all children are flat as well
+	qBottom = 0;
+	qTop = 0;
+	return;
     }
+    int lo = (int) floorf((childBottom - bottom)/scale);
+    int hi = (int) ceilf((childTop - bottom)/scale);
+    lo = std::max(0, std::min(255, lo));
+    hi = std::max(0, std::min(255, hi));
+    while (lo>0 && DecodeQuantizedCoord(bottom, top, scale, lo) > childBottom) lo--;
+    while (hi<255 && DecodeQuantizedCoord(bottom, top, scale, hi) < childTop) hi++;
+    qBottom = (unsigned char) lo;
+    qTop = (unsigned char) hi;
 }
 
-void Scene::PopulateCacheFriendlyBVH(
-    Triangle *pFirstTriangle,
+// Same walk as PopulateCacheFriendlyBVH, but the two children of each inner node
+// are placed in consecutive slots (allocated from idxFreeNode), and their boxes
+// are quantized relative to the decoded box of their parent, [bottom,top].
+void Scene::PopulateQuantizedBVH(
     BVHNode *root,
-    unsigned& idxBoxes,
+    unsigned idxNode,
+    const Vector3& bottom,
+    const Vector3& top,
+    unsigned& idxFreeNode,
     unsigned& idxTriList)
 {
-    unsigned currIdxBoxes = idxBoxes;
-    _pCFBVH[currIdxBoxes]._bottom = root->_bottom;
-    _pCFBVH[currIdxBoxes]._top    = root->_top;
+    QuantizedBVHNode& node = _pQBVH[idxNode];
     if (!root->IsLeaf()) {
 	BVHInner *p = dynamic_cast<BVHInner*>(root);
         ASSERT_OR_DIE(p);
-	int idxLeft = ++idxBoxes;
-	PopulateCacheFriendlyBVH(pFirstTriangle, p->_left, idxBoxes, idxTriList);
-	int idxRight = ++idxBoxes;
-	PopulateCacheFriendlyBVH(pFirstTriangle, p->_right, idxBoxes, idxTriList);
-	_pCFBVH[currIdxBoxes].u.inner._idxLeft  = idxLeft;
-	_pCFBVH[currIdxBoxes].u.inner._idxRight = idxRight;
+	unsigned idxLeft = idxFreeNode;
+	idxFreeNode += 2;
+	node._idxLeftOrCount = idxLeft;
+	BVHNode *children[2] = { p->_left, p->_right };
+	for(int c=0; c<2; c++)
+	    for(int k=0; k<3; k++)
+		QuantizeChildAxis(
+		    bottom._v[k], top._v[k],
+		    children[c]->_bottom._v[k], children[c]->_top._v[k],
+		    node.u.inner._bottom[c][k], node.u.inner._top[c][k]);
+	for(int c=0; c<2; c++) {
+	    Vector3 childBottom, childTop;
+	    DecodeQuantizedChild(node, c, bottom, top, childBottom, childTop);
+	    for(int k=0; k<3; k++)
+		ASSERT_OR_DIE(
+		    childBottom._v[k] <= children[c]->_bottom._v[k] &&
+		    childTop._v[k] >= children[c]->_top._v[k]);
+	    PopulateQuantizedBVH(
+		children[c], idxLeft + c,
+		childBottom, childTop, idxFreeNode, idxTriList);
+	}
     } else {
 	BVHLeaf *p = dynamic_cast<BVHLeaf*>(root);
         ASSERT_OR_DIE(p);
-	unsigned count = (unsigned) p->_triangles.size();
-	_pCFBVH[currIdxBoxes].u.leaf._count = 0x80000000 | count;
-	_pCFBVH[currIdxBoxes].u.leaf._startIndexInTriIndexList = idxTriList;
-	for(std::list<const Triangle*>::iterator it=p->_triangles.begin();
-	    it != p->_triangles.end();
-	    ++it)
-	{
-	    _triIndexList[idxTriList++] = *it - pFirstTriangle;
-	}
+	ASSERT_OR_DIE(p->_start == idxTriList);
+	node._idxLeftOrCount = 0x80000000 | p->_count;
+	node.u.leaf._startIndexInTriIndexList = p->_start;
+	node.u.leaf._unused[0] = node.u.leaf._unused[1] = 0;
+	idxTriList += p->_count;
     }
 }
 
@@ -691,15 +582,16 @@ void Scene::CreateCFBVH()
     unsigned idxTriList=0;
     unsigned idxBoxes=0;
 
-    _triIndexListNo = CountTriangles(_pSceneBVH);
+    // The leaves' triangles are already in a single array, in the right order
+    _triIndexListNo = _pSceneBVH->_triIndices.size();
     _triIndexList = new int[_triIndexListNo];
+    std::copy(_pSceneBVH->_triIndices.begin(), _pSceneBVH->_triIndices.end(), _triIndexList);
 
-    _pCFBVH_No = CountBoxes(_pSceneBVH);
+    _pCFBVH_No = CountBoxes(_pSceneBVH->_root);
     _pCFBVH = new CacheFriendlyBVHNode[_pCFBVH_No];
 
     PopulateCacheFriendlyBVH(
-	&_triangles[0],
-	_pSceneBVH,
+	_pSceneBVH->_root,
 	idxBoxes,
 	idxTriList);
 
@@ -708,36 +600,78 @@ void Scene::CreateCFBVH()
 	exit(1);
     }
 
-    int maxDepth = 0;
-    CountDepth(_pSceneBVH, 0, maxDepth);
-    if (maxDepth>=BVH_STACK_SIZE) {
-	printf("Max depth of BVH was %d\n", maxDepth);
-	puts("Recompile with BVH_STACK_SIZE set to more than that..."); fflush(stdout);
+#ifdef BVH_QUANTIZED
+    // Quantize the boxes, and drop the 32-byte nodes
+    _pQBVH_No = _pCFBVH_No;
+    _pQBVH = new QuantizedBVHNode[_pQBVH_No];
+    _QBVHRootBottom = _pSceneBVH->_root->_bottom;
+    _QBVHRootTop = _pSceneBVH->_root->_top;
+    unsigned idxFreeNode = 1; // node 0 is the root
+    idxTriList = 0;
+    PopulateQuantizedBVH(
+	_pSceneBVH->_root,
+	0, _QBVHRootBottom, _QBVHRootTop,
+	idxFreeNode,
+	idxTriList);
+    if ((idxFreeNode != _pQBVH_No) || (idxTriList != _triIndexListNo)) {
+	puts("Internal bug in CreateCFBVH, please report it..."); fflush(stdout);
 	exit(1);
     }
+    delete [] _pCFBVH;
+    _pCFBVH = NULL;
+    _pCFBVH_No = 0;
+#endif
+}
+
+// The .bvh cache starts with a tag identifying the node layout,
+// so that a cache written by a build with a different BVH_QUANTIZED
+// setting is simply rebuilt (instead of being misread).
+#ifdef BVH_QUANTIZED
+#define BVH_CACHE_MAGIC BVH_MAGICQUANTIZED
+#else
+#define BVH_CACHE_MAGIC BVH_MAGIC
+#endif
+
+bool Scene::HasBVH() const
+{
+#ifdef BVH_QUANTIZED
+    return _pQBVH != NULL;
+#else
+    return _pCFBVH != NULL;
+#endif
 }
 
 void Scene::UpdateBoundingVolumeHierarchy(const char *filename, bool forceRecalc)
 {
-    if (!_pCFBVH) {
+    // Only the raytracer needs these (the BVH queries use them)
+    UpdateTriangleIntersectionData();
+    if (!HasBVH()) {
 	std::string BVHcacheFilename(filename);
+	if (_meshOrderOptimized)
+	    BVHcacheFilename += ".reordered";
 	BVHcacheFilename += ".bvh";
 	FILE *fp = fopen(BVHcacheFilename.c_str(), "rb");
 	if (forceRecalc || !fp) {
 	    // No cached BVH data - we need to calculate them
 	    Clock me;
 	    _pSceneBVH = CreateBVH(this);
-	    printf("Building the BVH%s took %.2f seconds\n",
+	    printf("Building the BVH%s took %.2f seconds (%.1f MB of temporary nodes)\n",
 		#ifdef SIMD_SSE
 		" with SSE",
 		#else
 		"",
 		#endif
-		me.readMS()/1000.);
+		me.readMS()/1000., _pSceneBVH->_arena.Bytes()/1048576.);
 
 	    // Now that the BVH has been created, copy its data into a more cache-friendly format
-	    // (CacheFriendlyBVHNode occupies exactly 32 bytes, i.e. a cache-line)
+	    // (CacheFriendlyBVHNode occupies exactly 32 bytes, i.e. a cache-line,
+	    //  QuantizedBVHNode occupies 16)
 	    CreateCFBVH();
+	    // ...and release the build-time tree (its nodes all at once, see BVHArena)
+	    delete _pSceneBVH;
+	    _pSceneBVH = NULL;
+	    LinkBVHParents();
+	    ReportBVHMemory();
 
 	    // Now store the results, if possible...
 
@@ -746,51 +680,152 @@ void Scene::UpdateBoundingVolumeHierarchy(const char *filename, bool forceRecalc
 
 	    fp = fopen(BVHcacheFilename.c_str(), "wb");
 	    if (!fp) return;
+	    unsigned magic = BVH_CACHE_MAGIC;
+	    if (1 != fwrite(&magic, sizeof(unsigned), 1, fp)) { fclose(fp); return; }
+#ifdef BVH_QUANTIZED
+	    if (1 != fwrite(&_pQBVH_No, sizeof(unsigned), 1, fp)) { fclose(fp); return; }
+	    if (1 != fwrite(&_triIndexListNo, sizeof(unsigned), 1, fp)) { fclose(fp); return; }
+	    if (1 != fwrite(&_QBVHRootBottom, sizeof(Vector3), 1, fp)) { fclose(fp); return; }
+	    if (1 != fwrite(&_QBVHRootTop, sizeof(Vector3), 1, fp)) { fclose(fp); return; }
+	    if (_pQBVH_No != fwrite(_pQBVH, sizeof(QuantizedBVHNode), _pQBVH_No, fp)) { fclose(fp); return; }
+#else
 	    if (1 != fwrite(&_pCFBVH_No, sizeof(unsigned), 1, fp)) { fclose(fp); return; }
 	    if (1 != fwrite(&_triIndexListNo, sizeof(unsigned), 1, fp)) { fclose(fp); return; }
 	    if (_pCFBVH_No != fwrite(_pCFBVH, sizeof(CacheFriendlyBVHNode), _pCFBVH_No, fp)) { fclose(fp); return; }
+#endif
 	    if (_triIndexListNo != fwrite(_triIndexList, sizeof(int), _triIndexListNo, fp)) { fclose(fp); return; }
 	    fclose(fp);
 	} else {
 	    puts("Cache exists, reading the pre-calculated BVH data...");
-	    if (1 != fread(&_pCFBVH_No, sizeof(unsigned), 1, fp)) {
-		UpdateBoundingVolumeHierarchy(filename, true);
-                fclose(fp);
-		return;
-	    }
-	    if (1 != fread(&_triIndexListNo, sizeof(unsigned), 1, fp)) {
-		UpdateBoundingVolumeHierarchy(filename, true);
-                fclose(fp);
-		return;
-	    }
-	    _pCFBVH = new CacheFriendlyBVHNode[_pCFBVH_No];
-	    _triIndexList = new int[_triIndexListNo];
-	    if (_pCFBVH_No != fread(_pCFBVH, sizeof(CacheFriendlyBVHNode), _pCFBVH_No, fp)) {
-		delete [] _pCFBVH;
-		delete [] _triIndexList;
-		_pCFBVH = NULL;
-		_triIndexList = NULL;
-		UpdateBoundingVolumeHierarchy(filename, true);
-                fclose(fp);
-		return;
-	    }
-	    if (_triIndexListNo != fread(_triIndexList, sizeof(int), _triIndexListNo, fp)) {
+	    if (!ReadBVHCache(fp)) {
+		// Stale (e.g. written with a different BVH_QUANTIZED setting), truncated or corrupt cache
 		delete [] _pCFBVH;
+		delete [] _pQBVH;
 		delete [] _triIndexList;
 		_pCFBVH = NULL;
+		_pQBVH = NULL;
 		_triIndexList = NULL;
 		UpdateBoundingVolumeHierarchy(filename, true);
                 fclose(fp);
 		return;
 	    }
 	    fclose(fp);
+	    LinkBVHParents();
+	    ReportBVHMemory();
 	}
     }
 }
 
+bool Scene::ReadBVHCache(FILE *fp)
+{
+    unsigned magic;
+    if (1 != fread(&magic, sizeof(unsigned), 1, fp)) return false;
+    if (magic != BVH_CACHE_MAGIC) return false;
+#ifdef BVH_QUANTIZED
+    if (1 != fread(&_pQBVH_No, sizeof(unsigned), 1, fp)) return false;
+    if (1 != fread(&_triIndexListNo, sizeof(unsigned), 1, fp)) return false;
+    if (1 != fread(&_QBVHRootBottom, sizeof(Vector3), 1, fp)) return false;
+    if (1 != fread(&_QBVHRootTop, sizeof(Vector3), 1, fp)) return false;
+    _pQBVH = new QuantizedBVHNode[_pQBVH_No];
+    _triIndexList = new int[_triIndexListNo];
+    if (_pQBVH_No != fread(_pQBVH, sizeof(QuantizedBVHNode), _pQBVH_No, fp)) return false;
+#else
+    if (1 != fread(&_pCFBVH_No, sizeof(unsigned), 1, fp)) return false;
+    if (1 != fread(&_triIndexListNo, sizeof(unsigned), 1, fp)) return false;
+    _pCFBVH = new CacheFriendlyBVHNode[_pCFBVH_No];
+    _triIndexList = new int[_triIndexListNo];
+    if (_pCFBVH_No != fread(_pCFBVH, sizeof(CacheFriendlyBVHNode), _pCFBVH_No, fp)) return false;
+#endif
+    if (_triIndexListNo != fread(_triIndexList, sizeof(int), _triIndexListNo, fp)) return false;
+
+    // A truncated or corrupt cache may still have a valid header - check every
+    // index before the traversals (and LinkBVHParents) use it. Children always
+    // come after their parent (see PopulateCacheFriendlyBVH/PopulateQuantizedBVH),
+    // which also rules out cycles.
+#ifdef BVH_QUANTIZED
+    unsigned nodes = _pQBVH_No;
+#else
+    unsigned nodes = _pCFBVH_No;
+#endif
+    if (!nodes) return false;
+    for(unsigned i=0; i<nodes; i++) {
+#ifdef BVH_QUANTIZED
+	unsigned idxLeftOrCount = _pQBVH[i]._idxLeftOrCount;
+	if (!(idxLeftOrCount & 0x80000000)) {
+	    if (idxLeftOrCount <= i || idxLeftOrCount >= nodes-1) return false;
+	} else {
+	    unsigned long long end =
+		(unsigned long long)_pQBVH[i].u.leaf._startIndexInTriIndexList +
+		(idxLeftOrCount & 0x7FFFFFFF);
+	    if (end > _triIndexListNo) return false;
+	}
+#else
+	unsigned count = _pCFBVH[i].u.leaf._count;
+	if (!(count & 0x80000000)) {
+	    unsigned idxLeft = _pCFBVH[i].u.inner._idxLeft;
+	    unsigned idxRight = _pCFBVH[i].u.inner._idxRight;
+	    if (idxLeft <= i || idxLeft >= nodes) return false;
+	    if (idxRight <= i || idxRight >= nodes) return false;
+	} else {
+	    unsigned long long end =
+		(unsigned long long)_pCFBVH[i].u.leaf._startIndexInTriIndexList +
+		(count & 0x7FFFFFFF);
+	    if (end > _triIndexListNo) return false;
+	}
+#endif
+    }
+    for(unsigned i=0; i<_triIndexListNo; i++)
+	if (_triIndexList[i] < 0 || unsigned(_triIndexList[i]) >= _triangles.size())
+	    return false;
+    return true;
+}
+
+void Scene::LinkBVHParents()
+{
+#ifdef BVH_QUANTIZED
+    unsigned nodes = _pQBVH_No;
+#else
+    unsigned nodes = _pCFBVH_No;
+#endif
+    delete [] _pBVHParents;
+    _pBVHParents = new unsigned[nodes];
+    _pBVHParents[0] = BVH_NO_NODE;
+    for(unsigned i=0; i<nodes; i++) {
+#ifdef BVH_QUANTIZED
+	unsigned idxLeftOrCount = _pQBVH[i]._idxLeftOrCount;
+	if (!(idxLeftOrCount & 0x80000000))
+	    _pBVHParents[idxLeftOrCount] = _pBVHParents[idxLeftOrCount+1] = i;
+#else
+	if (!(_pCFBVH[i].u.leaf._count & 0x80000000)) {
+	    _pBVHParents[_pCFBVH[i].u.inner._idxLeft] = i;
+	    _pBVHParents[_pCFBVH[i].u.inner._idxRight] = i;
+	}
+#endif
+    }
+}
+
+void Scene::ReportBVHMemory() const
+{
+#ifdef BVH_QUANTIZED
+    unsigned nodes = _pQBVH_No;
+    size_t nodeBytes = _pQBVH_No*sizeof(QuantizedBVHNode);
+    const char *layout = "quantized";
+#else
+    unsigned nodes = _pCFBVH_No;
+    size_t nodeBytes = _pCFBVH_No*sizeof(CacheFriendlyBVHNode);
+    const char *layout = "cache-friendly";
+#endif
+    size_t indexBytes = _triIndexListNo*sizeof(int);
+    size_t parentBytes = nodes*sizeof(unsigned);
+    printf("BVH memory: %u %s nodes of %u bytes (%.2f MB), plus %.2f MB of triangle indices"
+	" and %.2f MB of parent links\n",
+	nodes, layout, unsigned(nodeBytes/(nodes?nodes:1)),
+	nodeBytes/1048576., indexBytes/1048576., parentBytes/1048576.);
+}
+
 bool Scene::renderRaytracer(Camera& eye, Screen& canvas, bool antialias)
 {
-    bool needToUpdateTitleBar = !_pSceneBVH; // see below
+    bool needToUpdateTitleBar = !HasBVH(); // see below
 
     // Update the BVH and its cache-friendly version
     extern const char *g_filename;
@@ -805,11 +840,16 @@ bool Scene::renderRaytracer(Camera& eye, Screen& canvas, bool antialias)
 	    modeMsg = "Raytracing with antialiasing";
 	else
 	    modeMsg = "Raytracing";
-	SDL_WM_SetCaption(modeMsg, modeMsg);
+	canvas.SetCaption(modeMsg);
     }
 
     Keyboard keys;
 
+#ifdef RAY_STATISTICS
+    Clock frameTime;
+    RayStatisticsFrameStart();
+#endif
+
     // Main loop: for each pixel...
     for(int y=0; y<HEIGHT; y++) {
 #ifdef USE_TBB
@@ -858,11 +898,14 @@ bool Scene::renderRaytracer(Camera& eye, Screen& canvas, bool antialias)
 	    strncpy(asyncBufferForCaption, percentage.str().c_str(), sizeof(asyncBufferForCaption));
             asyncBufferForCaption[sizeof(asyncBufferForCaption)-1] = '\0';
 
-	    SDL_WM_SetCaption(asyncBufferForCaption, asyncBufferForCaption);
+	    canvas.SetCaption(asyncBufferForCaption);
 	    canvas.ShowScreen(true,false);
 	}
 #endif
     }
+#ifdef RAY_STATISTICS
+    RayStatisticsFrameEnd(canvas, frameTime.readMS());
+#endif
     canvas.ShowScreen(true,true);
     return true;
 }
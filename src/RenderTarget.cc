@@ -0,0 +1,159 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#ifdef SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "Defines.h"
+#include "Exceptions.h"
+#include "RenderTarget.h"
+
+// Whether a surface has the frames' pixel format (so they can be just copied)
+static bool IsFrameFormat(const SDL_PixelFormat *format)
+{
+    return
+	format->BytesPerPixel == 4 &&
+	format->Rmask == (0xFFu << FRAME_RSHIFT) &&
+	format->Gmask == (0xFFu << FRAME_GSHIFT) &&
+	format->Bmask == (0xFFu << FRAME_BSHIFT);
+}
+
+WindowTarget::WindowTarget()
+{
+    if ( SDL_InitSubSystem(SDL_INIT_VIDEO) < 0 ) {
+	std::cerr << "Couldn't initialize SDL: " <<  SDL_GetError() << std::endl;
+	exit(0);
+    }
+
+    // We ask for 32bit surface...
+    _surface = SDL_SetVideoMode( WIDTH, HEIGHT, 32, SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_HWACCEL | SDL_ASYNCBLIT);
+    if (!_surface)
+	// ...and if that fails, we settle for a software-emulation of 16bit
+	_surface = SDL_SetVideoMode( WIDTH, HEIGHT, 16, SDL_SWSURFACE | SDL_DOUBLEBUF);
+
+    if (!_surface) {
+	std::cerr << "Couldn't set video mode: " << SDL_GetError() << std::endl;
+	exit(0);
+    }
+    std::cout << "Window pixel format: " << int(_surface->format->BitsPerPixel) << " bits";
+    if (IsFrameFormat(_surface->format))
+	std::cout << " (same as the frame)";
+    std::cout << std::endl;
+}
+
+WindowTarget::~WindowTarget()
+{
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+}
+
+void WindowTarget::Present(const Uint32 *frame, bool partial)
+{
+    if (!IsFrameFormat(_surface->format)) {
+	// SDL converts it
+	SDL_Surface *frameSurface = SDL_CreateRGBSurfaceFrom(
+	    const_cast<Uint32 *>(frame), WIDTH, HEIGHT, 32, WIDTH*sizeof(Uint32),
+	    0xFFu << FRAME_RSHIFT, 0xFFu << FRAME_GSHIFT, 0xFFu << FRAME_BSHIFT, 0);
+	if (frameSurface) {
+	    SDL_BlitSurface(frameSurface, NULL, _surface, NULL);
+	    SDL_FreeSurface(frameSurface);
+	}
+    } else {
+	if ( SDL_MUSTLOCK(_surface) ) {
+	    if ( SDL_LockSurface(_surface) < 0 ) {
+		std::cerr << "Couldn't lock _surface: " << SDL_GetError() << std::endl;
+		exit(0);
+	    }
+	}
+	for(int y=0; y<HEIGHT; y++) {
+	    const Uint32 *src = &frame[y*WIDTH];
+	    Uint32 *dst = (Uint32 *)((Uint8 *)_surface->pixels + y*_surface->pitch);
+	    int x = 0;
+#ifdef SIMD_SSE2
+	    // We won't read the window's pixels, so there is no reason to write
+	    // them via the CPU cache: use the SSE2 "streaming" stores, that
+	    // write directly to main memory - 16 bytes at a time, once we are
+	    // at an aligned address of the scanline
+	    for(; x<WIDTH && (size_t(&dst[x]) & 15); x++)
+		dst[x] = src[x];
+	    for(; x+4<=WIDTH; x+=4)
+		_mm_stream_si128((__m128i*)&dst[x], _mm_loadu_si128((const __m128i*)&src[x]));
+#endif
+	    for(; x<WIDTH; x++)
+		dst[x] = src[x];
+	}
+#ifdef SIMD_SSE2
+	_mm_sfence();
+#endif
+	if ( SDL_MUSTLOCK(_surface) )
+	    SDL_UnlockSurface(_surface);
+    }
+
+    if (partial)
+	SDL_UpdateRect(_surface, 0, 0, 0, 0);
+    else
+	SDL_Flip(_surface);
+}
+
+void WindowTarget::SetCaption(const char *caption)
+{
+    SDL_WM_SetCaption(caption, caption);
+}
+
+ImageTarget::ImageTarget(const char *prefix)
+    :
+    _prefix(prefix ? prefix : ""),
+    _framesWritten(0)
+{}
+
+void ImageTarget::Present(const Uint32 *frame, bool partial)
+{
+    if (_prefix.empty() || partial)
+	return;
+
+    char number[16];
+    sprintf(number, "%05u", _framesWritten++);
+    std::string filename = _prefix + number + ".ppm";
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+	THROW("Failed to create '" << filename << "'");
+
+    // Binary PPM: a header, and then the RGB bytes of each pixel
+    fprintf(fp, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+    std::vector<Uint8> scanline(3*WIDTH);
+    bool ok = true;
+    for(int y=0; y<HEIGHT && ok; y++) {
+	const Uint32 *src = &frame[y*WIDTH];
+	for(int x=0; x<WIDTH; x++) {
+	    scanline[3*x]   = Uint8(src[x] >> FRAME_RSHIFT);
+	    scanline[3*x+1] = Uint8(src[x] >> FRAME_GSHIFT);
+	    scanline[3*x+2] = Uint8(src[x] >> FRAME_BSHIFT);
+	}
+	ok = 1 == fwrite(&scanline[0], scanline.size(), 1, fp);
+    }
+    if (fclose(fp) || !ok)
+	THROW("Failed to write '" << filename << "'");
+}
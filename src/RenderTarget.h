@@ -0,0 +1,70 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __rendertarget_h__
+#define __rendertarget_h__
+
+#include <string>
+
+#include <SDL.h>
+
+// The pixel format of the frames the renderers draw (see Screen::_frame):
+// 8 bits per channel, packed in 32-bit words as 0x00RRGGBB - i.e. the
+// format of most 32-bit displays, so that WindowTarget just copies them.
+#define FRAME_RSHIFT	16
+#define FRAME_GSHIFT	8
+#define FRAME_BSHIFT	0
+
+// Where the finished frames go. The renderers never touch it: they draw on
+// Screen's frame (WIDTH x HEIGHT pixels, in the format above), and
+// Screen::ShowScreen hands that over to Present.
+struct RenderTarget {
+    virtual ~RenderTarget() {}
+
+    // A frame is ready - or, with 'partial' set, a part of one
+    // (the raytracer shows its progress every 16 scanlines)
+    virtual void Present(const Uint32 *frame, bool partial) = 0;
+
+    // Progress and status messages
+    virtual void SetCaption(const char *) {}
+};
+
+// An SDL window, showing the frames
+struct WindowTarget : RenderTarget {
+    SDL_Surface *_surface;
+
+    WindowTarget();
+    ~WindowTarget();
+
+    virtual void Present(const Uint32 *frame, bool partial);
+    virtual void SetCaption(const char *caption);
+};
+
+// No video at all: the frames stay in memory - and if a prefix is given,
+// each one is written to disk, as prefix00000.ppm, prefix00001.ppm, etc
+struct ImageTarget : RenderTarget {
+    std::string _prefix;
+    unsigned _framesWritten;
+
+    ImageTarget(const char *prefix);
+
+    virtual void Present(const Uint32 *frame, bool partial);
+};
+
+#endif
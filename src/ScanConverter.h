@@ -24,16 +24,17 @@
 
 #include <assert.h>
 
-template <class ScanlineDatatype, class GetHorizontalData, int height>
+template <class ScanlineDatatype, class GetHorizontalData>
 class ScanConverter {
 private:
+    int _height;
     unsigned* _scanlines;
     ScanlineDatatype* _left;
     ScanlineDatatype* _right;
 
     void ScanlineAdd(int idx, const ScanlineDatatype& v)
     {
-	assert(idx>=0 && idx<height);
+	assert(idx>=0 && idx<_height);
 	if (!_scanlines[idx]) {
 	    _left[idx] = v;
 	    _scanlines[idx]++;
@@ -59,32 +60,30 @@ private:
 public:
     int _minimum, _maximum;
 public:
+    // The array that reports whether a scanline is filled with one or two
+    // "endpoints" ('lines', one per scanline) must be all zeroes - and Clear
+    // leaves it so, after the triangle is drawn. Clearing all of it here
+    // would cost e.g. 2160 scanlines per triangle at 4K, instead of the
+    // few the triangle covers.
     ScanConverter(
+	int scanlines,
 	unsigned* lines,
 	ScanlineDatatype* left,
 	ScanlineDatatype* right)
 	:
+	_height(scanlines),
 	_scanlines(lines),
 	_left(left),
 	_right(right),
-	_minimum(height),
+	_minimum(scanlines),
 	_maximum(-1)
+    {}
+
+    // Zeroes the part of the 'lines' array we used (see the constructor)
+    void Clear()
     {
-	// Ah, the joy of coding. Upon startup, we clear up the array of booleans
-	// that reports whether a scanline is filled with one or two "endpoints".
-	//
-	// When GCC is not used with SSE optimizations, the type-unsafe,
-	// brute-force memset is the fastest way to do it...
-	//
-	//memset(reinterpret_cast<void*>(_scanlines), 0, sizeof(unsigned)*height);
-	//
-	// But when using SSE optimizations, the type-safe STL fill_n algorithm
-	// (with a very simple loop-based implementation) is the fastest one!
-	//
-	// What am I supposed to do to detect this at compile time? :-)
-	//
-	// By default, leave the type-safe, SSE champion in...
-	std::fill_n(_scanlines, height, 0);
+	if (_minimum <= _maximum)
+	    std::fill(_scanlines + _minimum, _scanlines + _maximum + 1, 0);
     }
 
     void InnerLoop(
@@ -95,7 +94,7 @@ public:
 	assert(y1<y2);
 	if (y1<0 && y2<0)
 	    return;
-	if (y1>=height && y2>=height)
+	if (y1>=_height && y2>=_height)
 	    return;
 	ScanlineDatatype vtc = v1;
 	ScanlineDatatype d12 = v2; d12 -= v1; d12 /= (coord)(y2-y1);
@@ -105,7 +104,7 @@ public:
 	    vtc += d;
 	    y1 = 0;
 	}
-	y2 = std::min(y2, height-1);
+	y2 = std::min(y2, _height-1);
 	assert(y1<=y2);
 	int steps = y2-y1;
 	ScanlineAdd(y1, vtc);
@@ -122,7 +121,7 @@ public:
 	const ScanlineDatatype& v2)
     {
 	if (y1 == y2) {
-	    if (y1>=0 && y1<height) {
+	    if (y1>=0 && y1<_height) {
 		ScanlineAdd(y1, v1);
 		ScanlineAdd(y1, v2);
 	    }
@@ -24,10 +24,15 @@
 
 #include "Base3d.h"
 #include "BVH.h"
+#include "TransformedVertices.h"
+#include "CullingHierarchy.h"
+#include "LightClusters.h"
 
 struct Light;
 struct Screen;
 struct Camera;
+struct Ray;
+struct RayHit;
 
 struct Scene {
     static const coord MaxCoordAfterRescale;
@@ -36,8 +41,24 @@ struct Scene {
     std::vector<Triangle>  _triangles;
     std::vector<Light*>	   _lights;
 
-    // Bounding Volume Hierarchy
-    BVHNode *_pSceneBVH;
+    // The lights that reach each part of the view, for the lighting
+    // equation - updated by the main loop, in modes 5-8 (see LightClusters.h)
+    LightClusters _lightClusters;
+
+    // Per vertex, 0-255 (see Vertex)
+    std::vector<unsigned char> _ambientOcclusion;
+    // Shared by the triangles (see Triangle::_material)
+    std::vector<Material> _materials;
+    // Per triangle, only for the raytracer - created along with the BVH
+    std::vector<TriangleIntersectionData> _triangleIntersectionData;
+
+    // Raytracer: how many lights to shoot shadow rays to, at each hit.
+    // 0 means all of them - otherwise, lights are picked randomly,
+    // based on their power and distance (see Raytrace in Raytracer.cc).
+    unsigned _lightSamplesPerHit;
+
+    // Bounding Volume Hierarchy, while it is built (see CreateBVH)
+    BVHTree *_pSceneBVH;
 
     // Cache-friendly version of the Bounding Volume Hierarchy data
     // (32 bytes per CacheFriendlyBVHNode, i.e. one CPU cache line)
@@ -46,13 +67,48 @@ struct Scene {
     unsigned _pCFBVH_No;
     CacheFriendlyBVHNode *_pCFBVH;
 
+    // Quantized version of the above (16 bytes per QuantizedBVHNode),
+    // used instead of _pCFBVH when BVH_QUANTIZED is defined.
+    // Only the root box is kept in full precision.
+    unsigned _pQBVH_No;
+    QuantizedBVHNode *_pQBVH;
+    Vector3 _QBVHRootBottom;
+    Vector3 _QBVHRootTop;
+
+    // Index of the parent of each node (of either layout), BVH_NO_NODE for the root.
+    // Lets the BVH traversals handle trees deeper than BVH_STACK_SIZE.
+    unsigned *_pBVHParents;
+
+    // The vertices in camera space, updated by the rasterizing renderers
+    // at the start of each frame (see TransformedVertices.h)
+    TransformedVertices _cameraSpaceVertices;
+
+    // The lighting of each vertex (see LightingEquation::ComputeLighting),
+    // updated at the start of each frame in the Gouraud mode
+    std::vector<coord> _vertexDiffuse, _vertexSpecular;
+
+    // Triangle clusters and the culling hierarchy over them (see CullingHierarchy.h):
+    // the clusters (each covering a range of _triangles) and the nodes
+    // (each covering a range of clusters)
+    std::vector<TriangleCluster> _clusters;
+    std::vector<CullingNode> _cullingNodes;
+
+    // Set by OptimizeMeshOrder - the triangles are then in a different
+    // order, so the BVH is cached in a different file
+    bool _meshOrderOptimized;
+
     Scene()
 	:
+	_lightSamplesPerHit(0),
 	_pSceneBVH(NULL),
 	_triIndexListNo(0),
 	_triIndexList(NULL),
 	_pCFBVH_No(0),
-	_pCFBVH(NULL)
+	_pCFBVH(NULL),
+	_pQBVH_No(0),
+	_pQBVH(NULL),
+	_pBVHParents(NULL),
+	_meshOrderOptimized(false)
 	{}
 
     // Load object
@@ -60,19 +116,67 @@ struct Scene {
 
     // Update triangle normals
     void fix_normals(void);
+    // The triangles that use each vertex: those of vertex v are
+    // trianglesOfVertex[firstOfVertex[v]] ... trianglesOfVertex[firstOfVertex[v+1]-1],
+    // in increasing order
+    void BuildVertexTriangles(
+	std::vector<unsigned>& firstOfVertex, std::vector<int>& trianglesOfVertex) const;
+    // Prints the memory used by the scene's vertices and triangles
+    void ReportMemory() const;
+
+    // Pre-computes the raytracer's intersection data (if not already there)
+    void UpdateTriangleIntersectionData();
 
     // Cache-friendly version of the Bounding Volume Hierarchy data
     // (creation functions)
     void PopulateCacheFriendlyBVH(
-	Triangle *pFirstTriangle,
 	BVHNode *root,
 	unsigned& idxBoxes,
 	unsigned& idxTriList);
+    void PopulateQuantizedBVH(
+	BVHNode *root,
+	unsigned idxNode,
+	const Vector3& bottom,
+	const Vector3& top,
+	unsigned& idxFreeNode,
+	unsigned& idxTriList);
     void CreateCFBVH();
 
+    // Is the (cache-friendly or quantized, see BVH_QUANTIZED) BVH available?
+    bool HasBVH() const;
+    bool ReadBVHCache(FILE *fp);
+    void LinkBVHParents();
+    void ReportBVHMemory() const;
+
     // Creates BVH and Cache-friendly version of BVH
     void UpdateBoundingVolumeHierarchy(const char *filename, bool forceRecalc=false);
 
+    // Ray queries, using the BVH (see RayQuery.h)
+    // Closest hit - returns false (and RayHit::_triangleIdx=-1) if nothing was hit
+    bool Intersect(const Ray&, RayHit&, bool cullBackfaces=false) const;
+    // Any hit - returns true if something is hit before Ray::_tMax
+    bool Occluded(const Ray&, bool cullBackfaces=false) const;
+    // Same as the above, for arrays of rays (executed in parallel)
+    void IntersectBatch(const Ray *rays, RayHit *hits, int count, bool cullBackfaces=false) const;
+    void OccludedBatch(const Ray *rays, bool *occluded, int count, bool cullBackfaces=false) const;
+
+    // Splits the mesh in clusters (reordering _triangles) and builds
+    // the culling hierarchy - called by load
+    void CreateClusters();
+    // Fills 'visible' with the indexes of the clusters that may be visible:
+    // i.e. not outside the view frustum, and (if cullBackfaces is set)
+    // not facing away from its eye - for clusters of one-sided triangles only
+    void CullClusters(const ViewFrustum&, bool cullBackfaces, std::vector<unsigned>& visible) const;
+
+    // Merges the vertices with the same position and normal (within a
+    // tolerance), for the loaders that create one per triangle corner
+    // (see Weld.cc)
+    void WeldVertices();
+
+    // Reorders the triangles of each cluster and renumbers the vertices,
+    // for the locality of the vertex accesses (see MeshOrder.cc)
+    void OptimizeMeshOrder();
+
     void renderPoints(const Camera&, Screen&, bool asTriangles = true);
     void renderWireframe(const Camera&, Screen&);
     void renderAmbient(const Camera&, Screen&);
@@ -80,6 +184,7 @@ struct Scene {
     void renderPhong(const Camera&, Screen&);
     void renderPhongAndShadowed(const Camera&, Screen&);
     void renderPhongAndSoftShadowed(const Camera&, Screen&);
+    void renderPhongAndVarianceShadowed(const Camera&, Screen&);
 
     // Since it may be aborted for taking too long, this returns "boolCompletedOK"
     bool renderRaytracer(Camera&, Screen&, bool antiAlias = false);
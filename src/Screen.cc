@@ -28,8 +28,8 @@
 #include "Fillers.h"
 #include "OnlineHelpKeys.h"
 
-SDL_Surface *Screen::_surface = NULL;
-Screen::DrawPixelFun Screen::DrawPixel = NULL;
+Uint32 *Screen::_frame = NULL;
+SDL_Surface *Screen::_frameSurface = NULL;
 
 template<>
 void Screen::Plot(
@@ -37,7 +37,7 @@ void Screen::Plot(
 {
     // Normal ambient lighting: the per-pixel interpolated color is the
     // ambient occlusion factor times the triangle color (FillerAmbient)
-    DrawPixel(y,x,SDL_MapRGB(_surface->format,
+    DrawPixel(y,x,MapRGB(
 		(unsigned char)v._color._r,
 		(unsigned char)v._color._g,
 		(unsigned char)v._color._b));
@@ -49,7 +49,7 @@ void Screen::Plot(
 {
     // Complete lighting equation (ambient + specular + diffuse) done in FillerGouraud.
     // Color is then interpolated per-pixel:
-    DrawPixel(y,x,SDL_MapRGB(_surface->format,
+    DrawPixel(y,x,MapRGB(
 		(unsigned char)v._color._r,
 		(unsigned char)v._color._g,
 		(unsigned char)v._color._b));
@@ -72,10 +72,12 @@ SELECT_SHADOWS(FatPointPhong, NoShadows)
 SELECT_SHADOWS(FatPointPhongAndShadowed, ShadowMapping)
 // For FatPointPhongAndSoftShadowed, involve shadows, AND use soft shadows
 SELECT_SHADOWS(FatPointPhongAndSoftShadowed, SoftShadowMapping)
+// For FatPointPhongAndVarianceShadowed, use soft shadows from the prefiltered variance shadow maps
+SELECT_SHADOWS(FatPointPhongAndVarianceShadowed, VarianceShadowMapping)
 
 template <typename InterpolatedType, typename TriangleCarrier>
 Uint32 IlluminatePixel(
-    const InterpolatedType& v, const TriangleCarrier& tri, const Scene& _scene, SDL_Surface *_surface)
+    const InterpolatedType& v, const TriangleCarrier& tri, const Scene& _scene)
 {
     // The FatPoint (v) carries the camera space coordinates (_x/_z, _y/_z, 1/_z => x, y, z)
     Vector3 point = v;
@@ -87,26 +89,126 @@ Uint32 IlluminatePixel(
     Pixel color = Pixel(); // Start from complete darkness...
     typename ModeSpecificLighting<InterpolatedType>::ShadowModel compute(_scene);
     compute.ComputePixel( point, normal, tri.color, v._ambientOcclusionCoeff, color);
-    return SDL_MapRGB(_surface->format, (Uint8)color._r, (Uint8)color._g, (Uint8)color._b);
+    return Screen::MapRGB((Uint8)color._r, (Uint8)color._g, (Uint8)color._b);
 }
 
 template<>
 void Screen::Plot(
     int y, int x, const FatPointPhong& v, const TriangleCarrier<FatPointPhong>& tri, const Camera& /*camera*/)
 {
-    DrawPixel(y,x,IlluminatePixel(v,tri,_scene,_surface));
+    DrawPixel(y,x,IlluminatePixel(v,tri,_scene));
 }
 
 template<>
 void Screen::Plot(
     int y, int x, const FatPointPhongAndShadowed& v, const TriangleCarrier<FatPointPhongAndShadowed>& tri, const Camera& /*camera*/)
 {
-    DrawPixel(y,x,IlluminatePixel(v,tri,_scene,_surface));
+    DrawPixel(y,x,IlluminatePixel(v,tri,_scene));
 }
 
 template<>
 void Screen::Plot(
     int y, int x, const FatPointPhongAndSoftShadowed& v, const TriangleCarrier<FatPointPhongAndSoftShadowed>& tri, const Camera& /*camera*/)
 {
-    DrawPixel(y,x,IlluminatePixel(v,tri,_scene,_surface));
+    DrawPixel(y,x,IlluminatePixel(v,tri,_scene));
 }
+
+template<>
+void Screen::Plot(
+    int y, int x, const FatPointPhongAndVarianceShadowed& v, const TriangleCarrier<FatPointPhongAndVarianceShadowed>& tri, const Camera& /*camera*/)
+{
+    DrawPixel(y,x,IlluminatePixel(v,tri,_scene));
+}
+
+#ifdef SIMD_SSE2
+// Shades the pixels of a batch (see LightingEquation::ComputePixels) and
+// draws them on scanline y of the frame - packing the colors in the
+// SSE registers (see Screen::MapRGB), and storing all 4 at once if
+// they are next to each other.
+template <typename InterpolatedType>
+void ShadeBatch(ShadingBatch& batch, int y, const Pixel& material, const Scene& scene)
+{
+    // (the lanes past the pixels we have are copies of the first one)
+    for(int i=batch._count; i<ShadingBatch::Size; i++) {
+	batch._x[i] = batch._x[0];
+	batch._y[i] = batch._y[0];
+	batch._z[i] = batch._z[0];
+	batch._normalX[i] = batch._normalX[0];
+	batch._normalY[i] = batch._normalY[0];
+	batch._normalZ[i] = batch._normalZ[0];
+	batch._ambientOcclusionCoeff[i] = batch._ambientOcclusionCoeff[0];
+    }
+
+    __m128 r, g, b;
+    typename ModeSpecificLighting<InterpolatedType>::ShadowModel compute(scene);
+    compute.ComputePixels(batch, material, r, g, b);
+    __m128i color = _mm_or_si128(
+	_mm_or_si128(
+	    _mm_slli_epi32(_mm_cvttps_epi32(r), FRAME_RSHIFT),
+	    _mm_slli_epi32(_mm_cvttps_epi32(g), FRAME_GSHIFT)),
+	_mm_slli_epi32(_mm_cvttps_epi32(b), FRAME_BSHIFT));
+
+    Uint32 *scanline = &Screen::_frame[y*WIDTH];
+    if (batch._count == ShadingBatch::Size &&
+	batch._screenX[ShadingBatch::Size-1] - batch._screenX[0] == ShadingBatch::Size-1)
+    {
+	_mm_storeu_si128((__m128i*)&scanline[batch._screenX[0]], color);
+    } else {
+	Uint32 colors[ShadingBatch::Size];
+	_mm_storeu_si128((__m128i*)colors, color);
+	for(int i=0; i<batch._count; i++)
+	    scanline[batch._screenX[i]] = colors[i];
+    }
+    batch._count = 0;
+}
+
+// Instead of shading each pixel that passes the ZBuffer check right away
+// (CheckZBufferAndMaybePlot), queue it in a batch - and shade them 4 at a time
+template <typename InterpolatedType>
+void PlotSpanInBatches(
+    Screen& screen, int y, int x, int steps,
+    InterpolatedType& v, const InterpolatedType& dLR, const TriangleCarrier<InterpolatedType>& tri)
+{
+    ShadingBatch batch;
+    batch._count = 0;
+    coord *zbuffer = &screen._Zbuffer[y*WIDTH];
+    for(;;) {
+	if (zbuffer[x] < v._z) {
+	    zbuffer[x] = v._z;
+	    int i = batch._count++;
+	    batch._screenX[i] = x;
+	    batch._x[i] = v._x;
+	    batch._y[i] = v._y;
+	    batch._z[i] = v._z;
+	    batch._normalX[i] = v._normal._x;
+	    batch._normalY[i] = v._normal._y;
+	    batch._normalZ[i] = v._normal._z;
+	    batch._ambientOcclusionCoeff[i] = v._ambientOcclusionCoeff;
+	    if (batch._count == ShadingBatch::Size)
+		ShadeBatch<InterpolatedType>(batch, y, tri.color, screen._scene);
+	}
+	if (!steps--)
+	    break;
+	// Interpolate over the span...
+	x++;
+	v += dLR;
+    }
+    if (batch._count)
+	ShadeBatch<InterpolatedType>(batch, y, tri.color, screen._scene);
+}
+
+#undef BATCHED_SPANS
+#define BATCHED_SPANS(TypeOfPoint) \
+template<> \
+void Screen::PlotSpan( \
+    int y, int x, int steps, TypeOfPoint& v, const TypeOfPoint& dLR, \
+    const TriangleCarrier<TypeOfPoint>& tri, const Camera&) \
+{ \
+    PlotSpanInBatches(*this, y, x, steps, v, dLR, tri); \
+}
+
+BATCHED_SPANS(FatPointPhong)
+BATCHED_SPANS(FatPointPhongAndShadowed)
+BATCHED_SPANS(FatPointPhongAndSoftShadowed)
+BATCHED_SPANS(FatPointPhongAndVarianceShadowed)
+#endif
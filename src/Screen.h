@@ -34,6 +34,7 @@
 #include "Defines.h"
 #include "ScanConverter.h"
 #include "OnlineHelpKeys.h"
+#include "RenderTarget.h"
 
 #include "MLAA.h"
 
@@ -43,68 +44,43 @@
 
 struct Camera;
 
-template <int BytesPerPixel>
-void DrawPixelBasic(int y, int x, Uint32 color);
+// The per-pixel buffers (frame, ZBuffer) are allocated when the resolution
+// is known, aligned to a cache line
+#define PIXEL_BUFFER_ALIGNMENT 64
 
 struct Screen
 {
-    static SDL_Surface *_surface;
-    coord _Zbuffer[HEIGHT][WIDTH];
+    // The frame: WIDTH x HEIGHT pixels (see FRAME_RSHIFT), row after row.
+    // All the renderers draw here, and ShowScreen hands it to the target.
+    // _frameSurface is the same pixels, for the drawing that is done with
+    // SDL (see Wu.h).
+    static Uint32 *_frame;
+    static SDL_Surface *_frameSurface;
+    // WIDTH x HEIGHT depths (1/z, see CheckZBufferAndMaybePlot), row after row
+    coord *_Zbuffer;
     const struct Scene& _scene;
-    typedef void (*DrawPixelFun)(int y, int x, Uint32 color);
-    static DrawPixelFun DrawPixel;
+    // Where the frames go: a window, or just memory (see RenderTarget.h)
+    RenderTarget& _target;
 
  public:
 
-    Screen( const struct Scene& scene)
+    Screen( const struct Scene& scene, RenderTarget& target)
 	:
-	_scene(scene)
+	_scene(scene),
+	_target(target)
     {
-	if ( SDL_Init(SDL_INIT_VIDEO) < 0 ) {
-	    std::cerr << "Couldn't initialize SDL: " <<  SDL_GetError() << std::endl;
-	    exit(0);
-	}
-
-	// Clean up on exit
-	atexit(SDL_Quit);
-
-	// We ask for 32bit surface...
-	_surface = SDL_SetVideoMode( WIDTH, HEIGHT, 32, SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_HWACCEL | SDL_ASYNCBLIT);
-	if (!_surface)
-	    // ...and if that fails, we settle for a software-emulation of 16bit
-	    _surface = SDL_SetVideoMode( WIDTH, HEIGHT, 16, SDL_SWSURFACE | SDL_DOUBLEBUF);
-
-	if (!_surface) {
-	    std::cerr << "Couldn't set video mode: " << SDL_GetError() << std::endl;
-	    exit(0);
-	}
-
-	if ( SDL_MUSTLOCK(_surface) ) {
-	    if ( SDL_LockSurface(_surface) < 0 ) {
-		std::cerr << "Couldn't lock _surface: " << SDL_GetError() << std::endl;
-		exit(0);
-	    }
-	}
-
-	//
-	// The original form of DrawPixel (DrawPixelBasic) is doing
-	// a 'switch' at run-time, reading the bytes per pixel of the surface,
-	// and dispatching.
-	//
-	// To avoid this cost, I turned it into a template, and store
-	// a function pointer (DrawPixel) to the proper "plotter" -
-	// and being a template, the switch in DrawPixelBasic evaporates.
-	//
-	// Speed is a most important attribute - for a renderer...
-	//
-	std::cout << "Selected pixel plotter: ";
-	switch(_surface->format->BytesPerPixel) {
-	case 1: DrawPixel = &DrawPixelBasic<1>; std::cout << "1" << std::endl; break;
-	case 2: DrawPixel = &DrawPixelBasic<2>; std::cout << "2" << std::endl; break;
-	case 3: DrawPixel = &DrawPixelBasic<3>; std::cout << "3" << std::endl; break;
-	case 4: DrawPixel = &DrawPixelBasic<4>; std::cout << "4" << std::endl; break;
-	default:
-	    std::cerr << "Can't pre-compile pixel plotter..." << std::endl;
+	// The renderers draw on a frame of our own, with a fixed pixel format:
+	// plotting a pixel is just a store (no plotter for the window's bytes
+	// per pixel, no SDL_MapRGB per pixel) - and the target takes it from
+	// there, in one pass (see WindowTarget::Present).
+	_frame = (Uint32 *) AllocatePixels(sizeof(Uint32));
+	_Zbuffer = (coord *) AllocatePixels(sizeof(coord));
+	if (_frame)
+	    _frameSurface = SDL_CreateRGBSurfaceFrom(
+		_frame, WIDTH, HEIGHT, 32, WIDTH*sizeof(Uint32),
+		0xFFu << FRAME_RSHIFT, 0xFFu << FRAME_GSHIFT, 0xFFu << FRAME_BSHIFT, 0);
+	if (!_frameSurface || !_Zbuffer) {
+	    std::cerr << "Couldn't allocate the frame: " << SDL_GetError() << std::endl;
 	    exit(0);
 	}
 
@@ -114,32 +90,59 @@ struct Screen
 
     ~Screen()
     {
-	if ( SDL_MUSTLOCK(_surface) )
-	    SDL_UnlockSurface(_surface);
+	SDL_FreeSurface(_frameSurface);
+	FreePixels(_frame);
+	FreePixels(_Zbuffer);
+    }
+
+    // A buffer of WIDTH x HEIGHT elements, of the given size
+    static void *AllocatePixels(size_t bytesPerPixel) {
+#ifdef SIMD_SSE
+	return _mm_malloc(size_t(WIDTH)*HEIGHT*bytesPerPixel, PIXEL_BUFFER_ALIGNMENT);
+#else
+	return malloc(size_t(WIDTH)*HEIGHT*bytesPerPixel);
+#endif
+    }
+
+    static void FreePixels(void *pixels) {
+#ifdef SIMD_SSE
+	_mm_free(pixels);
+#else
+	free(pixels);
+#endif
+    }
+
+    // The frame's version of SDL_MapRGB
+    static Uint32 MapRGB(Uint8 r, Uint8 g, Uint8 b) {
+	return (Uint32(r) << FRAME_RSHIFT) | (Uint32(g) << FRAME_GSHIFT) | (Uint32(b) << FRAME_BSHIFT);
+    }
+
+    // Plots a pixel on the frame (color: from MapRGB)
+    static void DrawPixel(int y, int x, Uint32 color) {
+	_frame[y*WIDTH + x] = color;
     }
 
     void ClearScreen() {
-	Uint32 color = SDL_MapRGB(_surface->format, 0, 0, 0);
-	SDL_FillRect(_surface, NULL, color);
+	memset(_frame, 0x0, size_t(WIDTH)*HEIGHT*sizeof(Uint32));
     }
 
     void ClearZbuffer() {
-	memset(reinterpret_cast<void*>(&_Zbuffer[0][0]), 0x0, sizeof(_Zbuffer));
+	memset(reinterpret_cast<void*>(_Zbuffer), 0x0, size_t(WIDTH)*HEIGHT*sizeof(coord));
     }
 
-    void ShowScreen(bool raytracerOutput=false, bool doMLAA=true) 
+    // Hands the frame to the target. The raytracer also shows its progress,
+    // with frames that are not 'finished' (no MLAA for these)
+    void ShowScreen(bool raytracerOutput=false, bool finished=true) 
     {
 #ifdef MLAA_ENABLED
-	if (doMLAA && _surface->format->BytesPerPixel==4 && NULL==getenv("NOMLAA"))
-	    MLAA((unsigned int*)_surface->pixels, NULL, _surface->pitch/4, HEIGHT);
-#else
-	(void)doMLAA;
+	if (finished && NULL==getenv("NOMLAA"))
+	    MLAA((unsigned int*)_frame, NULL, WIDTH, HEIGHT);
 #endif
 	if (!raytracerOutput) {
 
 	    // Hack, to add the "Press H for help" when not benchmarking
 	    extern bool g_benchmark;
-	    if (!g_benchmark) {
+	    if (!g_benchmark && WIDTH >= OHELPW+40 && HEIGHT >= OHELPH+20) {
 		unsigned char *pData = onlineHelpKeysImage;
 		for(int h=0; h<OHELPH; h++)
 		    for(int w=0; w<OHELPW; w++) {
@@ -150,24 +153,16 @@ struct Screen
 			    DrawPixel(
 				h + 20,
 				WIDTH-20-OHELPW + w,
-				SDL_MapRGB(_surface->format, 255-c, 255-c, 255-c));
+				MapRGB(255-c, 255-c, 255-c));
 		    }
 	    }
 	}
 
-	if ( SDL_MUSTLOCK(_surface) ) {
-	    SDL_UnlockSurface(_surface);
-	}
-	if (raytracerOutput)
-	    SDL_UpdateRect(_surface, 0, 0, 0, 0);
-	else
-	    SDL_Flip(_surface);
-	if ( SDL_MUSTLOCK(_surface) ) {
-	    if ( SDL_LockSurface(_surface) < 0 ) {
-		std::cerr << "Couldn't lock _surface: " << SDL_GetError() << std::endl;
-		exit(0);
-	    }
-	}
+	_target.Present(_frame, !finished);
+    }
+
+    void SetCaption(const char *caption) {
+	_target.SetCaption(caption);
     }
 
 
@@ -206,14 +201,42 @@ struct Screen
 
 	assert(y>=0 && y<HEIGHT && x>=0 && x<WIDTH);
 	// If the Z-Buffer says this pixel maps closer to the screen than any previous ones...
-	if (_Zbuffer[y][x] < v._z) {
+	coord& depth = _Zbuffer[y*WIDTH + x];
+	if (depth < v._z) {
 	    // then update the Z-Buffer
-	    _Zbuffer[y][x] = v._z;
+	    depth = v._z;
 	    // ...and Plot it.
 	    Plot(y, x, v, tri, camera);
 	}
     }
 
+    // Interpolates over a span of pixels (already clipped): from x to x+steps,
+    // starting from v and stepping by dLR - and plots the ones that pass
+    // the ZBuffer check. The Phong modes specialize it (see Screen.cc),
+    // to shade the visible pixels in SSE batches.
+    template <typename InterpolatedType, typename TriangleCarrier>
+    void PlotSpan(
+	int y,
+	int x,
+	int steps,
+	InterpolatedType& v,
+	const InterpolatedType& dLR,
+	const TriangleCarrier& tri,
+	const Camera& camera)
+    {
+	// Plot the left-most one (checking X-range: no, since we're already clipped)
+	CheckZBufferAndMaybePlot<NoCheckXRange>(
+	    y, x, v, tri, camera);
+	while(steps--) {
+	    // Interpolate over the span...
+	    x++;
+	    v += dLR;
+	    // ... and Plot (checking X-range: no, since we're already clipped)
+	    CheckZBufferAndMaybePlot<NoCheckXRange>(
+		y, x, v, tri, camera);
+	}
+    }
+
     // 10% faster than calling floor(x+0.5f)
     inline int myfloor(coord val) {
 	if (val<0.) return int(val-0.5f);
@@ -230,9 +253,8 @@ struct Screen
     {
 	ScanConverter<
 	    InterpolatedType,
-	    AccessProjectionX<InterpolatedType>,
-	    HEIGHT>
-	    scanner(lines, left, right);
+	    AccessProjectionX<InterpolatedType> >
+	    scanner(HEIGHT, lines, left, right);
 
 	// Scan convert the three triangle edges (line segments)
 	// into the left and right arrays of InterpolatedType[HEIGHT]
@@ -274,91 +296,13 @@ struct Screen
 			// Don't calculate any more steps after we reach the right edge.
 			steps -= (x2-WIDTH+1);
 		    }
-		    // Plot the left-most one (checking X-range: no, since we're already clipped)
-		    CheckZBufferAndMaybePlot<NoCheckXRange>(
-			i, x1, start, tri, camera);
-		    while(steps--) {
-			// Interpolate over the span...
-			x1++;
-			start += dLR;
-			// ... and Plot (checking X-range: no, since we're already clipped)
-			CheckZBufferAndMaybePlot<NoCheckXRange>(
-			    i, x1, start, tri, camera);
-		    }
+		    PlotSpan(i, x1, steps, start, dLR, tri, camera);
 		}
 	    }
 	}
+	scanner.Clear();
     }
 
 };
 
-// Almost verbatim copy from www.libsdl.org "Introduction" section
-//
-// This is the original form of DrawPixel. It is doing a 'switch'
-// at run-time, reading the bytes per pixel of the surface,
-// and dispatching.
-//
-// To avoid this cost, I turned it into a template, and store
-// a function pointer (see Screen class above, member 'DrawPixel')
-// to the proper "plotter".
-//
-// This being a template, the switch on BytesPerPixel evaporates!
-//
-// Speed is a most important attribute - for a renderer...
-//
-template <int BytesPerPixel>
-void DrawPixelBasic(int y, int x, Uint32 color)
-{
-    SDL_Surface*& _surface = Screen::_surface;
-
-    // template-based - so this switch is done at compile-time
-    switch (BytesPerPixel) {
-    //switch (_surface->format->BytesPerPixel) {
-	case 1: { /* Assuming 8-bpp */
-	    Uint8 *bufp;
-
-	    bufp = (Uint8 *)_surface->pixels + y*_surface->pitch + x;
-	    *bufp = color;
-	}
-	break;
-
-	case 2: { /* Probably 15-bpp or 16-bpp */
-	    Uint16 *bufp;
-
-	    bufp = (Uint16 *)_surface->pixels + y*_surface->pitch/2 + x;
-	    *bufp = color;
-	}
-	break;
-
-	case 3: { /* Slow 24-bpp mode, usually not used */
-	    Uint8 *bufp;
-
-	    bufp = (Uint8 *)_surface->pixels + y*_surface->pitch + x;
-	    *(bufp+_surface->format->Rshift/8) =
-		((color & _surface->format->Rmask) >> _surface->format->Rshift) << _surface->format->Rloss;
-	    *(bufp+_surface->format->Gshift/8) =
-		((color & _surface->format->Gmask) >> _surface->format->Gshift) << _surface->format->Gloss;
-	    *(bufp+_surface->format->Bshift/8) =
-		((color & _surface->format->Bmask) >> _surface->format->Bshift) << _surface->format->Bloss;
-	}
-	break;
-
-	case 4: { /* Probably 32-bpp */
-	    Uint32 *bufp;
-
-	    bufp = (Uint32 *)_surface->pixels + y*_surface->pitch/4 + x;
-	    #ifndef SIMD_SSE2
-	    *bufp = color;
-	    #else
-	    // There is no reason to do the following write via the CPU cache
-	    // the screen pixel will not be read again - so use the SSE2
-	    // "streaming" instruction, that sidesteps the cache and writes
-	    // directly to main memory (speedup).
-	    _mm_stream_si32((int*)bufp, (int)color);
-	    #endif
-	}
-	break;
-    }
-}
-
 #endif
@@ -0,0 +1,349 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#ifdef SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "3d.h"
+#include "Parallel.h"
+
+// Depth-only rasterization of the scene into a light's shadow buffer.
+//
+// The shadow buffer is split in tiles of SHADOW_TILE x SHADOW_TILE pixels.
+// First, the triangles of the visible clusters are binned to the tiles that
+// their bounding boxes overlap (in parallel, over batches of clusters).
+// Then the threads rasterize whole tiles: no two of them ever write the
+// same shadow pixels, and each works on a tile that fits in its L1 cache.
+//
+// In a tile, each triangle covers the pixels whose centers are inside its
+// three edges - tested (along with the depth) for 4 pixels of a row at a
+// time with SSE, when it is available. The 1/z of the vertices is linear in
+// (shadow buffer) screen space, so it is interpolated with a plane equation.
+
+// Width and height of the tiles - a multiple of 4, so the 4-pixel groups
+// of the SSE loop never cross from one tile to the next
+#define SHADOW_TILE 64
+
+// Clusters per batch of the binning
+#define SHADOW_BIN_CLUSTERS 64
+
+// Triangles at least this wide (in a tile) only scan the inside of each row
+#define SHADOW_CLIP_WIDTH 16
+
+// The pixels (whose centers are) inside a triangle's bounding box, clipped
+// to the shadow buffer. False if there are none, or if the triangle is not
+// completely in front of the light.
+static bool ShadowPixelBounds(
+    const TransformedVertices& xformed, const Triangle& triangle, int size,
+    int& x0, int& y0, int& x1, int& y1)
+{
+    unsigned a = triangle._idxA, b = triangle._idxB, c = triangle._idxC;
+    if (!(xformed._invZ[a] > 0.f && xformed._invZ[b] > 0.f && xformed._invZ[c] > 0.f))
+	return false;
+    coord minX = std::min(xformed._screenX[a], std::min(xformed._screenX[b], xformed._screenX[c]));
+    coord maxX = std::max(xformed._screenX[a], std::max(xformed._screenX[b], xformed._screenX[c]));
+    coord minY = std::min(xformed._screenY[a], std::min(xformed._screenY[b], xformed._screenY[c]));
+    coord maxY = std::max(xformed._screenY[a], std::max(xformed._screenY[b], xformed._screenY[c]));
+    // (clamped before the conversions to int, which can't take huge values)
+    coord limit = coord(size);
+    x0 = int(ceilf(std::min(std::max(minX - 0.5f, -1.f), limit)));
+    x1 = int(floorf(std::min(std::max(maxX - 0.5f, -1.f), limit)));
+    y0 = int(ceilf(std::min(std::max(minY - 0.5f, -1.f), limit)));
+    y1 = int(floorf(std::min(std::max(maxY - 0.5f, -1.f), limit)));
+    x0 = std::max(x0, 0); x1 = std::min(x1, size - 1);
+    y0 = std::max(y0, 0); y1 = std::min(y1, size - 1);
+    return x0<=x1 && y0<=y1;
+}
+
+// The edge functions of a triangle, A*x + B*y + C: positive on the inside
+// of each edge (for either orientation of the triangle) - and the plane of
+// its 1/z values, w = Aw*x + Bw*y + Cw. False if it has no area.
+struct ShadowTriangleSetup {
+    coord _A[3], _B[3], _C[3];
+    coord _Aw, _Bw, _Cw;
+
+    bool Setup(const TransformedVertices& xformed, const Triangle& triangle) {
+	unsigned a = triangle._idxA, b = triangle._idxB, c = triangle._idxC;
+	coord ax = xformed._screenX[a], ay = xformed._screenY[a], aw = xformed._invZ[a];
+	coord bx = xformed._screenX[b], by = xformed._screenY[b], bw = xformed._invZ[b];
+	coord cx = xformed._screenX[c], cy = xformed._screenY[c], cw = xformed._invZ[c];
+
+	coord area = (bx - ax)*(cy - ay) - (by - ay)*(cx - ax);
+	if (!(area != 0.f))
+	    return false;
+	coord sign = area > 0.f ? 1.f : -1.f;
+	_A[0] = sign*(ay - by); _B[0] = sign*(bx - ax); _C[0] = -(_A[0]*ax + _B[0]*ay);  // edge ab
+	_A[1] = sign*(by - cy); _B[1] = sign*(cx - bx); _C[1] = -(_A[1]*bx + _B[1]*by);  // edge bc
+	_A[2] = sign*(cy - ay); _B[2] = sign*(ax - cx); _C[2] = -(_A[2]*cx + _B[2]*cy);  // edge ca
+
+	// (edge ca is zero on a and c, and 'area' on b - and edge ab likewise on c)
+	coord invArea = sign/area;
+	_Aw = ((bw - aw)*_A[2] + (cw - aw)*_A[0])*invArea;
+	_Bw = ((bw - aw)*_B[2] + (cw - aw)*_B[0])*invArea;
+	_Cw = aw - _Aw*ax - _Bw*ay;
+	return true;
+    }
+
+    // Can the triangle cover any of the pixels [x0,x1]x[y0,y1]? (i.e. is the
+    // corner of the rectangle that is furthest inside each edge, inside it)
+    bool Overlaps(int x0, int y0, int x1, int y1) const {
+	for(int e=0; e<3; e++) {
+	    coord x = (_A[e] > 0.f ? x1 : x0) + 0.5f;
+	    coord y = (_B[e] > 0.f ? y1 : y0) + 0.5f;
+	    if (_A[e]*x + _B[e]*y + _C[e] < 0.f)
+		return false;
+	}
+	return true;
+    }
+};
+
+// The triangles of a batch of clusters, per tile: the ones of tile t are
+// _triangles[_firstOfTile[t]] up to (but not including) _triangles[_firstOfTile[t+1]]
+struct ShadowBin {
+    std::vector<unsigned> _firstOfTile;
+    std::vector<unsigned> _triangles;
+};
+
+class BinShadowTriangles {
+    const Scene& _scene;
+    const TransformedVertices& _xformed;
+    const std::vector<unsigned>& _visible;
+    int _size, _tilesPerRow;
+    std::vector<ShadowBin>& _bins;
+public:
+    BinShadowTriangles(
+	const Scene& scene, const TransformedVertices& xformed, const std::vector<unsigned>& visible,
+	int size, std::vector<ShadowBin>& bins)
+	:
+	_scene(scene), _xformed(xformed), _visible(visible),
+	_size(size), _tilesPerRow((size + SHADOW_TILE - 1)/SHADOW_TILE), _bins(bins)
+	{}
+
+    void operator()(int batch) const {
+	// (tile, triangle) pairs...
+	std::vector<std::pair<unsigned, unsigned> > pairs;
+	unsigned first = batch*SHADOW_BIN_CLUSTERS;
+	unsigned last = std::min<unsigned>(first + SHADOW_BIN_CLUSTERS, _visible.size());
+	unsigned triangles = 0;
+	for(unsigned r=first; r<last; r++)
+	    triangles += _scene._clusters[_visible[r]]._count;
+	pairs.reserve(triangles + triangles/4);
+	for(unsigned r=first; r<last; r++) {
+	    const TriangleCluster& cluster = _scene._clusters[_visible[r]];
+	    for(unsigned k=cluster._start; k<cluster._start + cluster._count; k++) {
+		int x0, y0, x1, y1;
+		if (!ShadowPixelBounds(_xformed, _scene._triangles[k], _size, x0, y0, x1, y1))
+		    continue;
+		int tx0 = x0/SHADOW_TILE, tx1 = x1/SHADOW_TILE;
+		int ty0 = y0/SHADOW_TILE, ty1 = y1/SHADOW_TILE;
+		if (tx0 == tx1 && ty0 == ty1) {
+		    pairs.push_back(std::make_pair(unsigned(ty0*_tilesPerRow + tx0), k));
+		    continue;
+		}
+		// The bigger ones skip the tiles of their bounding box that
+		// they don't cover (most of them, for the thin ones)
+		ShadowTriangleSetup setup;
+		if (!setup.Setup(_xformed, _scene._triangles[k]))
+		    continue;
+		for(int ty=ty0; ty<=ty1; ty++)
+		    for(int tx=tx0; tx<=tx1; tx++) {
+			if (!setup.Overlaps(
+			    std::max(x0, tx*SHADOW_TILE), std::max(y0, ty*SHADOW_TILE),
+			    std::min(x1, tx*SHADOW_TILE + SHADOW_TILE - 1),
+			    std::min(y1, ty*SHADOW_TILE + SHADOW_TILE - 1)))
+			    continue;
+			pairs.push_back(std::make_pair(unsigned(ty*_tilesPerRow + tx), k));
+		    }
+	    }
+	}
+
+	// ...counting-sorted by tile
+	ShadowBin& bin = _bins[batch];
+	unsigned tiles = _tilesPerRow*_tilesPerRow;
+	bin._firstOfTile.assign(tiles + 1, 0);
+	for(unsigned i=0; i<pairs.size(); i++)
+	    bin._firstOfTile[pairs[i].first + 1]++;
+	for(unsigned t=0; t<tiles; t++)
+	    bin._firstOfTile[t + 1] += bin._firstOfTile[t];
+	bin._triangles.resize(pairs.size());
+	std::vector<unsigned> next(bin._firstOfTile.begin(), bin._firstOfTile.end() - 1);
+	for(unsigned i=0; i<pairs.size(); i++)
+	    bin._triangles[next[pairs[i].first]++] = pairs[i].second;
+    }
+};
+
+// Rasterizes a triangle in the pixels [x0,x1]x[y0,y1] of the shadow buffer
+// (the part of its bounding box that is inside the tile)
+static void DrawShadowTriangle(
+    coord *buffer, int size, const ShadowTriangleSetup& t, int x0, int y0, int x1, int y1)
+{
+    coord A0 = t._A[0], B0 = t._B[0], C0 = t._C[0];
+    coord A1 = t._A[1], B1 = t._B[1], C1 = t._C[1];
+    coord A2 = t._A[2], B2 = t._B[2], C2 = t._C[2];
+    coord Aw = t._Aw, Bw = t._Bw, Cw = t._Cw;
+
+    // Wide bounding boxes are mostly empty, for thin triangles - so in those,
+    // each row is only scanned in the part that is inside all three edges
+    // (give or take a pixel - the edges are tested exactly, below)
+    bool clipRows = x1 - x0 >= SHADOW_CLIP_WIDTH;
+    coord invA[3];
+    if (clipRows)
+	for(int e=0; e<3; e++)
+	    invA[e] = t._A[e] != 0.f ? -1.f/t._A[e] : 0.f;
+
+#ifdef SIMD_SSE
+    // Rows are scanned in 4-pixel groups, from the one x0 is in (see SHADOW_TILE).
+    // The edge functions (and 1/z) at that group, on the row before y0: each
+    // row adds B to them, and each group 4*A
+    int xStart = x0 & ~3;
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 vx = _mm_add_ps(_mm_set1_ps(xStart + 0.5f), _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+    const coord py0 = y0 - 0.5f;
+    __m128 row0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A0), vx), _mm_set1_ps(B0*py0 + C0));
+    __m128 row1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A1), vx), _mm_set1_ps(B1*py0 + C1));
+    __m128 row2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A2), vx), _mm_set1_ps(B2*py0 + C2));
+    __m128 rowW = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(Aw), vx), _mm_set1_ps(Bw*py0 + Cw));
+    const __m128 down0 = _mm_set1_ps(B0), step0 = _mm_set1_ps(4.f*A0);
+    const __m128 down1 = _mm_set1_ps(B1), step1 = _mm_set1_ps(4.f*A1);
+    const __m128 down2 = _mm_set1_ps(B2), step2 = _mm_set1_ps(4.f*A2);
+    const __m128 downW = _mm_set1_ps(Bw), stepW = _mm_set1_ps(4.f*Aw);
+#endif
+    for(int y=y0; y<=y1; y++) {
+	coord *row = &buffer[y*size];
+	coord py = y + 0.5f;
+#ifdef SIMD_SSE
+	row0 = _mm_add_ps(row0, down0);
+	row1 = _mm_add_ps(row1, down1);
+	row2 = _mm_add_ps(row2, down2);
+	rowW = _mm_add_ps(rowW, downW);
+#endif
+
+	int xFrom = x0, xTo = x1;
+	if (clipRows) {
+	    coord from = coord(x0), to = coord(x1);
+	    bool empty = false;
+	    for(int e=0; e<3; e++) {
+		coord rest = t._B[e]*py + t._C[e];
+		if (t._A[e] > 0.f)
+		    from = std::max(from, rest*invA[e] - 1.5f);
+		else if (t._A[e] < 0.f)
+		    to = std::min(to, rest*invA[e] + 0.5f);
+		else
+		    empty = empty || rest < 0.f;
+	    }
+	    if (empty || from > to)
+		continue;
+	    // (both are in [x0,x1] by now, so truncation is floor)
+	    xFrom = int(from);
+	    xTo = int(to);
+	}
+	int x = xFrom;
+
+#ifdef SIMD_SSE
+	x &= ~3;
+	__m128 e0 = row0, e1 = row1, e2 = row2, w = rowW;
+	if (x != xStart) {
+	    coord dx = coord(x - xStart);
+	    e0 = _mm_add_ps(e0, _mm_set1_ps(A0*dx));
+	    e1 = _mm_add_ps(e1, _mm_set1_ps(A1*dx));
+	    e2 = _mm_add_ps(e2, _mm_set1_ps(A2*dx));
+	    w = _mm_add_ps(w, _mm_set1_ps(Aw*dx));
+	}
+	// (the last group of a row may not fit in the shadow buffer - so that's left
+	// for the scalar loop below; the lanes outside [xFrom,xTo] are still in the
+	// tile, and fail the edge tests)
+	for(; x<=xTo && x+4<=size; x+=4) {
+	    __m128 inside = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+	    // (stored even when no pixel is inside - a branch on that is a
+	    // coin toss for small triangles, and the tile is only ours anyway)
+	    __m128 old = _mm_loadu_ps(row + x);
+	    __m128 closer = _mm_and_ps(inside, _mm_cmpgt_ps(w, old));
+	    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(closer, w), _mm_andnot_ps(closer, old)));
+	    e0 = _mm_add_ps(e0, step0);
+	    e1 = _mm_add_ps(e1, step1);
+	    e2 = _mm_add_ps(e2, step2);
+	    w = _mm_add_ps(w, stepW);
+	}
+#endif
+	for(coord px = x + 0.5f; x<=xTo; x++, px+=1.f) {
+	    if (A0*px + B0*py + C0 >= 0.f && A1*px + B1*py + C1 >= 0.f && A2*px + B2*py + C2 >= 0.f) {
+		coord depth = Aw*px + Bw*py + Cw;
+		if (row[x] < depth)
+		    row[x] = depth;
+	    }
+	}
+    }
+}
+
+class RasterizeShadowTile {
+    const Scene& _scene;
+    const TransformedVertices& _xformed;
+    const std::vector<ShadowBin>& _bins;
+    coord *_buffer;
+    int _size, _tilesPerRow;
+public:
+    RasterizeShadowTile(
+	const Scene& scene, const TransformedVertices& xformed, const std::vector<ShadowBin>& bins,
+	coord *buffer, int size)
+	:
+	_scene(scene), _xformed(xformed), _bins(bins),
+	_buffer(buffer), _size(size), _tilesPerRow((size + SHADOW_TILE - 1)/SHADOW_TILE)
+	{}
+
+    void operator()(int tile) const {
+	int tileX0 = (tile % _tilesPerRow)*SHADOW_TILE;
+	int tileY0 = (tile / _tilesPerRow)*SHADOW_TILE;
+	int tileX1 = std::min(tileX0 + SHADOW_TILE, _size) - 1;
+	int tileY1 = std::min(tileY0 + SHADOW_TILE, _size) - 1;
+	for(unsigned b=0; b<_bins.size(); b++) {
+	    const ShadowBin& bin = _bins[b];
+	    for(unsigned i=bin._firstOfTile[tile]; i<bin._firstOfTile[tile + 1]; i++) {
+		const Triangle& triangle = _scene._triangles[bin._triangles[i]];
+		int x0, y0, x1, y1;
+		ShadowTriangleSetup setup;
+		if (!setup.Setup(_xformed, triangle))
+		    continue;
+		ShadowPixelBounds(_xformed, triangle, _size, x0, y0, x1, y1);
+		DrawShadowTriangle(
+		    _buffer, _size, setup,
+		    std::max(x0, tileX0), std::max(y0, tileY0),
+		    std::min(x1, tileX1), std::min(y1, tileY1));
+	    }
+	}
+    }
+};
+
+void Light::RasterizeShadowBuffer(const Scene& scene, const std::vector<unsigned>& visible)
+{
+    int batches = (visible.size() + SHADOW_BIN_CLUSTERS - 1)/SHADOW_BIN_CLUSTERS;
+    std::vector<ShadowBin> bins(batches);
+    ParallelFor(0, batches, 1, BinShadowTriangles(scene, _lightSpaceVertices, visible, _shadowMapSize, bins));
+
+    int tilesPerRow = (_shadowMapSize + SHADOW_TILE - 1)/SHADOW_TILE;
+    ParallelFor(0, tilesPerRow*tilesPerRow, 1,
+	RasterizeShadowTile(scene, _lightSpaceVertices, bins, &_shadowBuffer[0], _shadowMapSize));
+}
@@ -0,0 +1,129 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include "3d.h"
+#include "Exceptions.h"
+#include "ShadowRegenerator.h"
+
+ShadowRegenerator::ShadowRegenerator(const Scene& scene, Light& light, bool useVarianceShadows)
+    :
+    _scene(scene),
+    _light(light),
+    _back(light._x, light._y, light._z, light._power, light._shadowMapSize),
+    _useVarianceShadows(useVarianceShadows),
+    _thread(NULL),
+    _mutex(SDL_CreateMutex()),
+    _cond(SDL_CreateCond()),
+    _target(light),
+    _pending(false),
+    _busy(false),
+    _ready(false),
+    _quit(false)
+{
+    if (_mutex && _cond)
+	_thread = SDL_CreateThread(Work, this);
+    if (!_thread) {
+	if (_cond)
+	    SDL_DestroyCond(_cond);
+	if (_mutex)
+	    SDL_DestroyMutex(_mutex);
+	THROW("Failed to create the shadow buffer thread");
+    }
+}
+
+ShadowRegenerator::~ShadowRegenerator()
+{
+    SDL_LockMutex(_mutex);
+    _quit = true;
+    SDL_CondBroadcast(_cond);
+    SDL_UnlockMutex(_mutex);
+    SDL_WaitThread(_thread, NULL);
+    SDL_DestroyCond(_cond);
+    SDL_DestroyMutex(_mutex);
+}
+
+int ShadowRegenerator::Work(void *self)
+{
+    ShadowRegenerator& me = *static_cast<ShadowRegenerator *>(self);
+    SDL_LockMutex(me._mutex);
+    while(!me._quit) {
+	// (_back is only ours once Poll took the last one from it)
+	if (!me._pending || me._ready) {
+	    SDL_CondWait(me._cond, me._mutex);
+	    continue;
+	}
+	Vector3 target = me._target;
+	me._pending = false;
+	me._busy = true;
+	SDL_UnlockMutex(me._mutex);
+
+	Light& back = me._back;
+	back._x = target._x;
+	back._y = target._y;
+	back._z = target._z;
+	back.UpdateShadowBuffer(me._scene, me._useVarianceShadows);
+
+	SDL_LockMutex(me._mutex);
+	me._busy = false;
+	me._ready = true;
+	SDL_CondBroadcast(me._cond);
+    }
+    SDL_UnlockMutex(me._mutex);
+    return 0;
+}
+
+void ShadowRegenerator::SwapInIfReady()
+{
+    if (!_ready)
+	return;
+    _light.SwapShadowBuffer(_back);
+    _ready = false;
+    // (the thread may be waiting for _back, to render a newer request)
+    SDL_CondBroadcast(_cond);
+}
+
+void ShadowRegenerator::Request(const Vector3& position)
+{
+    SDL_LockMutex(_mutex);
+    _target = position;
+    _pending = true;
+    SDL_CondBroadcast(_cond);
+    SDL_UnlockMutex(_mutex);
+}
+
+void ShadowRegenerator::Poll()
+{
+    SDL_LockMutex(_mutex);
+    SwapInIfReady();
+    SDL_UnlockMutex(_mutex);
+}
+
+void ShadowRegenerator::Finish()
+{
+    SDL_LockMutex(_mutex);
+    for(;;) {
+	SwapInIfReady();
+	if (!_pending && !_busy)
+	    break;
+	SDL_CondWait(_cond, _mutex);
+    }
+    SDL_UnlockMutex(_mutex);
+}
@@ -0,0 +1,80 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __shadowregenerator_h__
+#define __shadowregenerator_h__
+
+#include <SDL.h>
+#include <SDL_thread.h>
+
+#include "Light.h"
+
+struct Scene;
+
+// Regenerates the shadow buffer of a moving light in a thread of its own,
+// so that moving it (the Q/W keys, in modes 7 and 8) doesn't stall the
+// frames: they keep rendering with the light's current shadow buffer
+// until the new one is ready.
+//
+// The new one is rendered into a second Light (the "back" buffer), and
+// Poll swaps the two - including their positions, since a shadow buffer
+// can only be looked up from the position it was rendered from. So the
+// light itself moves when its shadows do.
+//
+// Requests that arrive while one is being rendered are merged: only the
+// latest position is rendered next.
+class ShadowRegenerator {
+    const Scene& _scene;
+    Light& _light;
+    Light _back;
+    bool _useVarianceShadows;
+
+    SDL_Thread *_thread;
+    SDL_mutex *_mutex;
+    SDL_cond *_cond;
+
+    // Guarded by _mutex
+    Vector3 _target;	// the position to render next, if _pending
+    bool _pending;	// a position waits to be rendered
+    bool _busy;		// the thread is rendering
+    bool _ready;	// _back has a new shadow buffer, for Poll to swap in
+    bool _quit;
+
+    static int Work(void *self);
+    void SwapInIfReady();	// (with _mutex locked)
+
+    ShadowRegenerator(const ShadowRegenerator&);
+    ShadowRegenerator& operator=(const ShadowRegenerator&);
+public:
+    // THROWs if the thread can't be created
+    ShadowRegenerator(const Scene& scene, Light& light, bool useVarianceShadows);
+    ~ShadowRegenerator();
+
+    // Starts rendering the shadow buffer for 'position' (returns at once)
+    void Request(const Vector3& position);
+
+    // Swaps in the new shadow buffer (and position), if one is ready
+    void Poll();
+
+    // Waits for the requested shadow buffers, and swaps in the last
+    // (e.g. before changing modes, or modifying the scene)
+    void Finish();
+};
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <algorithm>
+
+#include "Defines.h"
+#include "TransformedVertices.h"
+#include "Parallel.h"
+
+// Vertices transformed by each task of the ParallelFor
+#define VERTICES_PER_BLOCK 1024
+
+// Screen x comes from view space y, screen y from (minus) view space x
+// (the same projection as RENDER_POINTS/RENDER_LINES and the Fillers use)
+TransformedVertices::Projection TransformedVertices::OnScreen()
+{
+    // (not a constant: the size of the window is only known at runtime)
+    Projection p = {
+	coord(WIDTH/2),  0.f,  coord(SCREEN_DIST),
+	coord(HEIGHT/2), coord(-SCREEN_DIST), 0.f
+    };
+    return p;
+}
+
+const TransformedVertices::Projection TransformedVertices::Perspective = {
+    0.f, 1.f, 0.f,
+    0.f, 0.f, 1.f
+};
+
+// Transforms (in place) and projects view-space-relative positions. Plain
+// arrays that don't alias each other, so GCC vectorizes the loop (4 vertices
+// at a time with SSE).
+static void TransformAndProject(
+    const Matrix3& mv, const TransformedVertices::Projection& p,
+    coord * __restrict__ pX, coord * __restrict__ pY, coord * __restrict__ pZ,
+    coord * __restrict__ pScreenX, coord * __restrict__ pScreenY, coord * __restrict__ pInvZ,
+    unsigned start, unsigned end)
+{
+    for(unsigned i=start; i<end; i++) {
+	coord wx = pX[i], wy = pY[i], wz = pZ[i];
+	coord x = mv._row1._x*wx + mv._row1._y*wy + mv._row1._z*wz;
+	coord y = mv._row2._x*wx + mv._row2._y*wy + mv._row2._z*wz;
+	coord z = mv._row3._x*wx + mv._row3._y*wy + mv._row3._z*wz;
+	pX[i] = x;
+	pY[i] = y;
+	pZ[i] = z;
+	// Vertices behind the 'eye' get garbage here, but the
+	// rasterizers clip (or ignore) their triangles anyway
+	pScreenX[i] = p._centerX + (p._xx*x + p._xy*y)/z;
+	pScreenY[i] = p._centerY + (p._yx*x + p._yy*y)/z;
+	pInvZ[i] = 1.0f/z;
+    }
+}
+
+class TransformVertexBlock {
+    const Vertex *_pVertices;
+    unsigned _total;
+    const Vector3& _origin;
+    const Matrix3& _mv;
+    const TransformedVertices::Projection& _p;
+    coord *_x, *_y, *_z, *_screenX, *_screenY, *_invZ;
+public:
+    TransformVertexBlock(
+	const std::vector<Vertex>& vertices, const Vector3& origin, const Matrix3& mv,
+	const TransformedVertices::Projection& p, TransformedVertices& out)
+	:
+	_pVertices(&vertices[0]), _total(vertices.size()),
+	_origin(origin), _mv(mv), _p(p),
+	_x(&out._x[0]), _y(&out._y[0]), _z(&out._z[0]),
+	_screenX(&out._screenX[0]), _screenY(&out._screenY[0]), _invZ(&out._invZ[0])
+    {}
+
+    void operator()(int block) const {
+	unsigned start = block*VERTICES_PER_BLOCK;
+	unsigned end = std::min(start + VERTICES_PER_BLOCK, _total);
+
+	// Gather the positions (relative to the origin) in the output arrays first...
+	for(unsigned i=start; i<end; i++) {
+	    _x[i] = _pVertices[i]._x - _origin._x;
+	    _y[i] = _pVertices[i]._y - _origin._y;
+	    _z[i] = _pVertices[i]._z - _origin._z;
+	}
+
+	// ...and transform them there
+	TransformAndProject(_mv, _p, _x, _y, _z, _screenX, _screenY, _invZ, start, end);
+    }
+};
+
+void TransformedVertices::Update(
+    const std::vector<Vertex>& vertices,
+    const Vector3& origin, const Matrix3& mv,
+    const Projection& projection)
+{
+    if (vertices.empty())
+	return;
+
+    // A no-op after the first frame
+    unsigned total = vertices.size();
+    _x.resize(total); _y.resize(total); _z.resize(total);
+    _screenX.resize(total); _screenY.resize(total); _invZ.resize(total);
+
+    int blocks = (total + VERTICES_PER_BLOCK - 1)/VERTICES_PER_BLOCK;
+    ParallelFor(0, blocks, 1, TransformVertexBlock(vertices, origin, mv, projection, *this));
+}
@@ -0,0 +1,63 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __transformedvertices_h__
+#define __transformedvertices_h__
+
+#include <vector>
+
+#include "Types.h"
+#include "Base3d.h"
+#include "Algebra.h"
+
+// The vertices of a scene, transformed into a view space (camera or light)
+// and projected, once per frame - instead of once for every triangle that
+// uses them (a vertex is typically shared by 6 triangles).
+//
+// The results are stored as a structure of arrays, so the transform loop
+// vectorizes well; triangle setup then gathers its 3 vertices from here,
+// at triangle._idxA, etc.
+
+struct TransformedVertices {
+    // How view space coordinates map to the 'screen' (window or shadow map):
+    //    screenX = _centerX + (_xx*x + _xy*y)/z
+    //    screenY = _centerY + (_yx*x + _yy*y)/z
+    struct Projection {
+	coord _centerX, _xx, _xy;
+	coord _centerY, _yx, _yy;
+    };
+    static Projection OnScreen();	    // the window (see SCREEN_DIST)
+    static const Projection Perspective;    // just x/z and y/z (see Light::_shadowProjection)
+
+    // In view space...
+    std::vector<coord> _x, _y, _z;
+    // ...and projected
+    std::vector<coord> _screenX, _screenY, _invZ;
+
+    // Transforms all the vertices into the space at 'origin', with axes 'mv'
+    // (in parallel, like the renderers)
+    void Update(
+	const std::vector<Vertex>& vertices,
+	const Vector3& origin, const Matrix3& mv,
+	const Projection& projection);
+
+    Vector3 InViewSpace(unsigned idx) const { return Vector3(_x[idx], _y[idx], _z[idx]); }
+};
+
+#endif
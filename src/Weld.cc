@@ -0,0 +1,286 @@
+/*
+ *  renderer - A simple implementation of polygon-based 3D algorithms.
+ *  Copyright (C) 2004  Thanassis Tsiodras (ttsiodras@gmail.com)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <config.h>
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+#include "3d.h"
+#include "Clock.h"
+#include "Parallel.h"
+
+// Welding of the vertices, for the loaders that create one per triangle
+// corner (.3ds and .ra2).
+//
+// Two vertices weld if their positions fall in the same cell of a grid
+// of WELD_TOLERANCE (times the size of the scene), and their normals in
+// the same cell of a grid of WELD_NORMAL_TOLERANCE. The .3ds normals are
+// calculated per smoothing group, so the corners of faces in different
+// groups keep their own vertices (and the hard edges between them). The
+// .ra2 ones are not calculated yet, so only the positions matter - and
+// fix_normals() then smooths across the faces.
+//
+// Comparing cells (instead of distances) keeps the welding transitive, so
+// it doesn't depend on the order the vertices are visited in: they are
+// hashed by their cells into partitions, that are welded in parallel.
+// Each vertex is replaced by the first (in the original order) of its
+// cell, and the remaining ones keep their order.
+
+#define WELD_TOLERANCE 1e-6f
+#define WELD_NORMAL_TOLERANCE 1e-3f
+
+// Vertices per block of the parallel passes (and, roughly, per partition)
+#define WELD_BLOCK 4096
+
+struct WeldKey {
+    int _position[3];
+    int _normal[3];
+
+    bool operator==(const WeldKey& rhs) const {
+	return
+	    _position[0] == rhs._position[0] && _position[1] == rhs._position[1] &&
+	    _position[2] == rhs._position[2] && _normal[0] == rhs._normal[0] &&
+	    _normal[1] == rhs._normal[1] && _normal[2] == rhs._normal[2];
+    }
+
+    // FNV-1a over the cells, and a final mix, since both the
+    // lower bits (partition) and the upper ones (slot) are used
+    unsigned Hash() const {
+	unsigned h = 2166136261u;
+	for(int i=0; i<3; i++) {
+	    h = (h ^ unsigned(_position[i])) * 16777619u;
+	    h = (h ^ unsigned(_normal[i])) * 16777619u;
+	}
+	h ^= h >> 16; h *= 0x85EBCA6Bu;
+	h ^= h >> 13; h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+    }
+};
+
+static int WeldBlocks(unsigned total)
+{
+    return (total + WELD_BLOCK - 1)/WELD_BLOCK;
+}
+
+class VertexBlockBounds {
+    const std::vector<Vertex>& _vertices;
+    Vector3 *_bottom, *_top;
+public:
+    VertexBlockBounds(const std::vector<Vertex>& vertices, Vector3 *bottom, Vector3 *top)
+	:_vertices(vertices), _bottom(bottom), _top(top) {}
+
+    void operator()(int block) const {
+	unsigned start = block*WELD_BLOCK;
+	unsigned end = std::min<unsigned>(start + WELD_BLOCK, _vertices.size());
+	Vector3 minp(FLT_MAX,FLT_MAX,FLT_MAX), maxp(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	for(unsigned i=start; i<end; i++) {
+	    minp.assignSmaller(_vertices[i]);
+	    maxp.assignBigger(_vertices[i]);
+	}
+	_bottom[block] = minp;
+	_top[block] = maxp;
+    }
+};
+
+class WeldKeys {
+    const std::vector<Vertex>& _vertices;
+    const Vector3& _origin;
+    coord _invCell;
+    std::vector<WeldKey>& _keys;
+    std::vector<unsigned>& _hashes;
+public:
+    WeldKeys(
+	const std::vector<Vertex>& vertices, const Vector3& origin, coord cell,
+	std::vector<WeldKey>& keys, std::vector<unsigned>& hashes)
+	:
+	_vertices(vertices), _origin(origin), _invCell(1.f/cell), _keys(keys), _hashes(hashes)
+	{}
+
+    void operator()(int block) const {
+	unsigned start = block*WELD_BLOCK;
+	unsigned end = std::min<unsigned>(start + WELD_BLOCK, _vertices.size());
+	for(unsigned i=start; i<end; i++) {
+	    const Vertex& v = _vertices[i];
+	    WeldKey& key = _keys[i];
+	    key._position[0] = int(floorf((v._x - _origin._x)*_invCell + 0.5f));
+	    key._position[1] = int(floorf((v._y - _origin._y)*_invCell + 0.5f));
+	    key._position[2] = int(floorf((v._z - _origin._z)*_invCell + 0.5f));
+	    key._normal[0] = int(floorf(v._normal._x/WELD_NORMAL_TOLERANCE + 0.5f));
+	    key._normal[1] = int(floorf(v._normal._y/WELD_NORMAL_TOLERANCE + 0.5f));
+	    key._normal[2] = int(floorf(v._normal._z/WELD_NORMAL_TOLERANCE + 0.5f));
+	    _hashes[i] = key.Hash();
+	}
+    }
+};
+
+// Finds the first vertex of each cell, for the vertices of a partition
+// (with an open addressing hash table of their own)
+class WeldPartition {
+    const std::vector<WeldKey>& _keys;
+    const std::vector<unsigned>& _hashes;
+    unsigned _partitionBits;
+    const std::vector<unsigned>& _firstOfPartition;
+    const std::vector<unsigned>& _verticesOfPartitions;
+    std::vector<unsigned>& _representative;
+public:
+    WeldPartition(
+	const std::vector<WeldKey>& keys, const std::vector<unsigned>& hashes,
+	unsigned partitionBits, const std::vector<unsigned>& firstOfPartition,
+	const std::vector<unsigned>& verticesOfPartitions, std::vector<unsigned>& representative)
+	:
+	_keys(keys), _hashes(hashes), _partitionBits(partitionBits),
+	_firstOfPartition(firstOfPartition), _verticesOfPartitions(verticesOfPartitions),
+	_representative(representative)
+	{}
+
+    void operator()(int partition) const {
+	unsigned start = _firstOfPartition[partition];
+	unsigned end = _firstOfPartition[partition + 1];
+	unsigned size = 1;
+	while(size < 2*(end - start))
+	    size <<= 1;
+	const unsigned Empty = 0xFFFFFFFFu;
+	std::vector<unsigned> slots(size, Empty);
+	for(unsigned i=start; i<end; i++) {
+	    unsigned v = _verticesOfPartitions[i];
+	    unsigned slot = (_hashes[v] >> _partitionBits) & (size - 1);
+	    while(slots[slot] != Empty && !(_keys[slots[slot]] == _keys[v]))
+		slot = (slot + 1) & (size - 1);
+	    if (slots[slot] == Empty)
+		slots[slot] = v;
+	    _representative[v] = slots[slot];
+	}
+    }
+};
+
+class CompactVertexBlock {
+    const Scene& _scene;
+    const std::vector<unsigned>& _representative;
+    const std::vector<unsigned>& _newIndex;
+    std::vector<Vertex>& _vertices;
+    std::vector<unsigned char>& _ambientOcclusion;
+public:
+    CompactVertexBlock(
+	const Scene& scene, const std::vector<unsigned>& representative,
+	const std::vector<unsigned>& newIndex,
+	std::vector<Vertex>& vertices, std::vector<unsigned char>& ambientOcclusion)
+	:
+	_scene(scene), _representative(representative), _newIndex(newIndex),
+	_vertices(vertices), _ambientOcclusion(ambientOcclusion)
+	{}
+
+    void operator()(int block) const {
+	unsigned start = block*WELD_BLOCK;
+	unsigned end = std::min<unsigned>(start + WELD_BLOCK, _scene._vertices.size());
+	for(unsigned i=start; i<end; i++)
+	    if (_representative[i] == i) {
+		_vertices[_newIndex[i]] = _scene._vertices[i];
+		if (!_ambientOcclusion.empty())
+		    _ambientOcclusion[_newIndex[i]] = _scene._ambientOcclusion[i];
+	    }
+    }
+};
+
+class RemapTriangleBlock {
+    Scene& _scene;
+    const std::vector<unsigned>& _newIndex;
+public:
+    RemapTriangleBlock(Scene& scene, const std::vector<unsigned>& newIndex)
+	:_scene(scene), _newIndex(newIndex) {}
+
+    void operator()(int block) const {
+	unsigned start = block*WELD_BLOCK;
+	unsigned end = std::min<unsigned>(start + WELD_BLOCK, _scene._triangles.size());
+	for(unsigned i=start; i<end; i++) {
+	    Triangle& triangle = _scene._triangles[i];
+	    triangle._idxA = _newIndex[triangle._idxA];
+	    triangle._idxB = _newIndex[triangle._idxB];
+	    triangle._idxC = _newIndex[triangle._idxC];
+	}
+    }
+};
+
+void Scene::WeldVertices()
+{
+    unsigned total = _vertices.size();
+    if (!total)
+	return;
+
+    Clock me;
+
+    // The size of the scene, for the size of the cells
+    int blocks = WeldBlocks(total);
+    std::vector<Vector3> blockBottom(blocks), blockTop(blocks);
+    ParallelFor(0, blocks, 1, VertexBlockBounds(_vertices, &blockBottom[0], &blockTop[0]));
+    Vector3 minp(FLT_MAX,FLT_MAX,FLT_MAX), maxp(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+    for(int i=0; i<blocks; i++) {
+	minp.assignSmaller(blockBottom[i]);
+	maxp.assignBigger(blockTop[i]);
+    }
+    coord extent = std::max(maxp._x - minp._x, std::max(maxp._y - minp._y, maxp._z - minp._z));
+    coord cell = std::max(extent*WELD_TOLERANCE, FLT_MIN);
+
+    std::vector<WeldKey> keys(total);
+    std::vector<unsigned> hashes(total);
+    ParallelFor(0, blocks, 1, WeldKeys(_vertices, minp, cell, keys, hashes));
+
+    // Split the vertices in partitions of about WELD_BLOCK, by their hashes
+    // (in their original order, within each partition)
+    unsigned partitionBits = 0;
+    while((total >> partitionBits) > WELD_BLOCK)
+	partitionBits++;
+    unsigned partitions = 1 << partitionBits;
+    std::vector<unsigned> firstOfPartition(partitions + 1, 0);
+    for(unsigned i=0; i<total; i++)
+	firstOfPartition[(hashes[i] & (partitions - 1)) + 1]++;
+    for(unsigned p=0; p<partitions; p++)
+	firstOfPartition[p + 1] += firstOfPartition[p];
+    std::vector<unsigned> verticesOfPartitions(total);
+    std::vector<unsigned> next(firstOfPartition.begin(), firstOfPartition.end() - 1);
+    for(unsigned i=0; i<total; i++)
+	verticesOfPartitions[next[hashes[i] & (partitions - 1)]++] = i;
+
+    std::vector<unsigned> representative(total);
+    ParallelFor(0, partitions, 1,
+	WeldPartition(keys, hashes, partitionBits, firstOfPartition, verticesOfPartitions, representative));
+
+    // The first vertex of each cell comes before the others,
+    // so it is numbered by the time they need its number
+    std::vector<unsigned> newIndex(total);
+    unsigned welded = 0;
+    for(unsigned i=0; i<total; i++)
+	newIndex[i] = (representative[i] == i) ? welded++ : newIndex[representative[i]];
+
+    if (welded != total) {
+	std::vector<Vertex> vertices(welded);
+	std::vector<unsigned char> ambientOcclusion(_ambientOcclusion.empty() ? 0 : welded);
+	ParallelFor(0, blocks, 1,
+	    CompactVertexBlock(*this, representative, newIndex, vertices, ambientOcclusion));
+	ParallelFor(0, WeldBlocks(_triangles.size()), 1, RemapTriangleBlock(*this, newIndex));
+	_vertices.swap(vertices);
+	_ambientOcclusion.swap(ambientOcclusion);
+    }
+
+    printf("Welding the vertices took %.2f seconds: %u vertices, from %u\n",
+	me.readMS()/1000., welded, total);
+}
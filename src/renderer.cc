@@ -35,8 +35,11 @@
 #include "Screen.h"
 #include "Keyboard.h"
 #include "Clock.h"
+#include "RayQuery.h"
 #include "HelpKeys.h"
 #include "OnlineHelpKeys.h"
+#include "ShadowRegenerator.h"
+#include "RenderTarget.h"
 
 #ifdef _WIN32
 #include <sstream>
@@ -120,7 +123,21 @@ void usage()
 #endif
     cerr << "  -b         benchmark rendering of N frames (default: 100)\n";
     cerr << "  -n N       set number of benchmarking frames\n";
+    cerr << "  -x         render offscreen, without a window (implies -b)\n";
+    cerr << "  -p <pfx>   save the frames to pfx00000.ppm, pfx00001.ppm, ... (implies -x)\n";
+    cerr << "  -g WxH     resolution (default: " << DEFAULT_WIDTH << "x" << DEFAULT_HEIGHT << ")\n";
     cerr << "  -w         use two lights\n";
+    cerr << "  -t N       add N more lights, on a ring above the object\n";
+    cerr << "  -l <file>  add the lights listed in 'file', one per line: x y z [power [range]]\n";
+    cerr << "             (a light with a range fades to nothing at that distance,\n";
+    cerr << "             and one too close to the scene casts no shadows)\n";
+    cerr << "  -k N       raytracing: shoot shadow rays to at most N lights per hit,\n";
+    cerr << "             picked randomly based on their power and distance\n";
+    cerr << "  -q N       benchmark N ray queries (closest and any hit) and exit\n";
+    cerr << "  -o         reorder the mesh for cache locality, after loading it\n";
+    cerr << "  -s N       shadow map resolution, NxN (default: " << SHADOWMAPSIZE << ")\n";
+    cerr << "  -v         soft shadows (mode 8) from prefiltered variance shadow maps,\n";
+    cerr << "             instead of 3x3 percentage-closer filtering of the shadow maps\n";
     cerr << "  -m <mode>  rendering mode:\n";
     cerr << "       1 : point mode\n";
     cerr << "       2 : points based on triangles (culling,color)\n";
@@ -141,18 +158,17 @@ void usage()
 void ShowHelp(Screen& canvas, Keyboard& keys)
 {
     assert(sizeof(helpKeysImage) == HELPW*HELPH*3);
-    Uint32 color = SDL_MapRGB(canvas._surface->format, 0, 0, 0);
-    SDL_FillRect(canvas._surface, NULL, color);
+    canvas.ClearScreen();
     unsigned char *pData = helpKeysImage;
     for(int h=0; h<HELPH; h++)
 	for(int w=0; w<HELPW; w++) {
 	    unsigned char r = 255-*pData++;
 	    unsigned char g = 255-*pData++;
 	    unsigned char b = 255-*pData++;
-	    canvas.DrawPixel(
-		(HEIGHT-HELPH)/2 + h,
-		(WIDTH-HELPW)/2 + w,
-		SDL_MapRGB(canvas._surface->format, r,g,b));
+	    // (in small windows, only the middle of it)
+	    int y = (HEIGHT-HELPH)/2 + h, x = (WIDTH-HELPW)/2 + w;
+	    if (y>=0 && y<HEIGHT && x>=0 && x<WIDTH)
+		canvas.DrawPixel(y, x, canvas.MapRGB(r,g,b));
 	}
     canvas.ShowScreen();
     keys.poll();
@@ -162,9 +178,100 @@ void ShowHelp(Screen& canvas, Keyboard& keys)
 	keys.poll();
 }
 
+// Microbenchmark of the ray query API (see RayQuery.h), for the -q option:
+// shoots 'count' rays from the eye towards the centers of random triangles,
+// and then 'count' shadow rays from whatever they hit towards the light.
+void RayQueryBenchmark(const Scene& scene, const Vector3& eye, const Vector3& light, int count)
+{
+    std::vector<Ray> rays(count);
+    std::vector<RayHit> hits(count);
+    unsigned seed = 1;
+    for(int i=0; i<count; i++) {
+	seed = seed*1103515245 + 12345; // deterministic, for comparable runs
+	const Vector3& target = scene._triangles[(seed>>8) % scene._triangles.size()]._center;
+	Vector3 direction = target;
+	direction -= eye;
+	direction.normalize();
+	rays[i] = Ray(eye, direction);
+    }
+
+    Clock single;
+    unsigned hitsNo = 0;
+    for(int i=0; i<count; i++)
+	if (scene.Intersect(rays[i], hits[i]))
+	    hitsNo++;
+    double singleMS = single.readMS();
+
+    Clock batch;
+    scene.IntersectBatch(&rays[0], &hits[0], count);
+    double batchMS = batch.readMS();
+
+    // Shadow rays, from the hit points to the light
+    std::vector<Ray> shadowRays;
+    for(int i=0; i<count; i++) {
+	if (hits[i]._triangleIdx == -1)
+	    continue;
+	Vector3 toLight = light;
+	toLight -= hits[i]._point;
+	coord distanceFromLight = toLight.length();
+	toLight /= distanceFromLight;
+	shadowRays.push_back(
+	    Ray(hits[i]._point, toLight, distanceFromLight, &scene._triangles[hits[i]._triangleIdx]));
+    }
+    int shadowCount = int(shadowRays.size());
+    bool *occluded = new bool[shadowCount+1];
+    Clock occlusion;
+    scene.OccludedBatch(shadowCount?&shadowRays[0]:NULL, occluded, shadowCount);
+    double occlusionMS = occlusion.readMS();
+    unsigned occludedNo = 0;
+    for(int i=0; i<shadowCount; i++)
+	if (occluded[i]) occludedNo++;
+    delete [] occluded;
+
+    printf("Closest hit, single rays : %d rays (%u hits) in %.3f seconds (%.0f queries/sec)\n",
+	count, hitsNo, singleMS/1000., count/(std::max(singleMS,1.)/1000.));
+    printf("Closest hit, batched     : %d rays in %.3f seconds (%.0f queries/sec)\n",
+	count, batchMS/1000., count/(std::max(batchMS,1.)/1000.));
+    printf("Any hit, batched         : %d rays (%u occluded) in %.3f seconds (%.0f queries/sec)\n",
+	shadowCount, occludedNo, occlusionMS/1000., shadowCount/(std::max(occlusionMS,1.)/1000.));
+}
+
+// Reads the lights of the -l option: one per line, "x y z [power [range]]",
+// in the coordinates of the rescaled scene (i.e. within +/- MaxCoordAfterRescale).
+// Empty lines, and the ones starting with '#', are skipped.
+void LoadLights(const char *filename, int shadowMapSize, std::vector<unique_ptr<Light> >& lights)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+	THROW("Failed to open lights file '" << filename << "'");
+    char line[1024];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), fp)) {
+	lineNo++;
+	const char *p = line;
+	while (*p == ' ' || *p == '\t')
+	    p++;
+	if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+	    continue;
+	float x, y, z, power = 1.f, range = 0.f;
+	if (sscanf(p, "%f %f %f %f %f", &x, &y, &z, &power, &range) < 3 || power < 0.f || range < 0.f) {
+	    fclose(fp);
+	    THROW("Invalid light in line " << lineNo << " of '" << filename << "'");
+	}
+	lights.push_back(unique_ptr<Light>(new Light(x, y, z, power, shadowMapSize)));
+	lights.back()->_range = range;
+    }
+    fclose(fp);
+    if (lights.empty())
+	THROW("No lights in '" << filename << "'");
+}
+
 bool g_benchmark = false;
 const char *g_filename = NULL;
 
+// The resolution (see Defines.h)
+int g_width = DEFAULT_WIDTH, g_height = DEFAULT_HEIGHT;
+
 int main(int argc, char *argv[])
 {
 #ifdef USE_TBB
@@ -179,12 +286,21 @@ int main(int argc, char *argv[])
     bool doBenchmark = false;
     bool useTwoLights = false;
     unsigned benchmarkFrames = 100;
+    int rayQueries = 0;
+    int ringLights = 0;
+    const char *lightsFile = NULL;
+    int lightSamplesPerHit = 0;
+    bool optimizeMeshOrder = false;
+    bool useVarianceShadows = false;
+    int shadowMapSize = SHADOWMAPSIZE;
+    bool offscreen = false;
+    const char *framesPrefix = NULL;
 
 #ifdef HAVE_GETOPT_H
     int c;
     opterr = 0;
 
-    while ((c = getopt (argc, argv, "hbrwn:m:c:")) != -1)
+    while ((c = getopt (argc, argv, "hbrwovxn:m:c:q:t:k:s:l:p:g:")) != -1)
 	switch(c) {
 	case 'h':
 	    usage();
@@ -205,9 +321,45 @@ int main(int argc, char *argv[])
 	case 'w':
 	    useTwoLights = true;
 	    break;
+	case 'o':
+	    optimizeMeshOrder = true;
+	    break;
+	case 'v':
+	    useVarianceShadows = true;
+	    break;
+	case 's':
+	    shadowMapSize = atoi(optarg);
+	    if (shadowMapSize<16) usage();
+	    break;
 	case 'n':
 	    benchmarkFrames = atoi(optarg);
 	    break;
+	case 'x':
+	    offscreen = true;
+	    break;
+	case 'p':
+	    framesPrefix = optarg;
+	    offscreen = true;
+	    break;
+	case 'g':
+	    if (2 != sscanf(optarg, "%dx%d", &g_width, &g_height)) usage();
+	    if (g_width<16 || g_height<16) usage();
+	    break;
+	case 'q':
+	    rayQueries = atoi(optarg);
+	    if (rayQueries<=0) usage();
+	    break;
+	case 't':
+	    ringLights = atoi(optarg);
+	    if (ringLights<0) usage();
+	    break;
+	case 'l':
+	    lightsFile = optarg;
+	    break;
+	case 'k':
+	    lightSamplesPerHit = atoi(optarg);
+	    if (lightSamplesPerHit<0) usage();
+	    break;
 #ifdef _WIN32
 	case 'c':
 	    reportFile = string(optarg);
@@ -236,6 +388,10 @@ int main(int argc, char *argv[])
 
     g_filename = fname;
 
+    // Without a window, there is no keyboard either
+    if (offscreen)
+	doBenchmark = true;
+
     // Show "Press H for help" only when not benchmarking.
     // I hate globals, but I hate needlessly polluting interfaces more (see ShowScreen)
     g_benchmark = doBenchmark;
@@ -243,14 +399,30 @@ int main(int argc, char *argv[])
     try {
 	bool autoRotate = true;
 
+	// The video subsystem is only initialized for the window
+	if ( SDL_Init(0) < 0 ) {
+	    cerr << "Couldn't initialize SDL: " <<  SDL_GetError() << endl;
+	    exit(0);
+	}
+
+	// Clean up on exit
+	atexit(SDL_Quit);
+
+	unique_ptr<RenderTarget> target(
+	    offscreen ?
+		static_cast<RenderTarget*>(new ImageTarget(framesPrefix)) :
+		static_cast<RenderTarget*>(new WindowTarget()));
+
 	Scene scene;
-	static Screen canvas(scene);
+	static Screen canvas(scene, *target);
 
 	coord angle1=0.0f;
 	coord angle2=0.0f*M_PI/180.f;
 	coord angle3=45.0f*M_PI/180.f;
 
 	scene.load(fname);
+	if (optimizeMeshOrder)
+	    scene.OptimizeMeshOrder();
 	if (g_benchmark && (mode == RENDER_RAYTRACE_ANTIALIAS || mode == RENDER_RAYTRACE)) {
 	    // When benchmarking, we dont want the first frame to "suffer" the BVH creation
 	    puts("Creating BVH... please wait...");
@@ -259,15 +431,9 @@ int main(int argc, char *argv[])
 
 	coord maxi = Scene::MaxCoordAfterRescale; // this is the
 
-	// A tradeoff...
-	// The closer the light is, the higher the chance that the
-	// shadow buffer won't "contain" all of the object, and that shadowing
-	// will have "clip-errors".
-	// The farther away the light is, chances increase that the object
-	// will be "contained" in the shadow buffer, but less shadow pixels
-	// are actually drawn... the shadow is less accurate...
-	// Of course, this distinction applies only to the shadowmapped modes
-	// (not raytracing or non-shadowed Gouraud/Phong)
+	// The shadow buffers are fitted to the object, wherever the light is
+	// (see Light::RenderSceneIntoShadowBuffer) - so the distance of the
+	// light only changes the look of the lighting (and of the shadows).
 	const coord LightDistanceFactor = 4.0;
 
 	// Just the distance to initially place the camera
@@ -278,26 +444,75 @@ int main(int argc, char *argv[])
 	    new Light(
 		LightDistanceFactor*maxi,
 		LightDistanceFactor*maxi,
-		LightDistanceFactor*maxi));
+		LightDistanceFactor*maxi,
+		1.f, shadowMapSize));
 	scene._lights.push_back(pLight.get());
 	pLight->_x = LightDistanceFactor*maxi*cos(angle3);
 	pLight->_y = LightDistanceFactor*maxi*sin(angle3);
-	pLight->ClearShadowBuffer();
+
+	// The lights that cast shadows (in modes 7 and 8): each one has its own
+	// shadow buffer, which is only rendered again after the light moves
+	// (see Light::UpdateShadowBuffer)
+	std::vector<Light*> shadowCasters;
+	shadowCasters.push_back(pLight.get());
 
 	// Optionally, add a second, static light.
 	unique_ptr<Light> pLight2(
 	    new Light(
 		LightDistanceFactor*maxi,
 		-LightDistanceFactor*maxi,
-		LightDistanceFactor*maxi));
+		LightDistanceFactor*maxi,
+		1.f, shadowMapSize));
 	if (useTwoLights) {
 	    scene._lights.push_back(pLight2.get());
-	    pLight2->ClearShadowBuffer();
+	    shadowCasters.push_back(pLight2.get());
 	}
 
+	// Optionally, add a ring of static lights (for testing many-light setups).
+	// Together, they are as strong as the main light.
+	std::vector<unique_ptr<Light> > ringOfLights;
+	for(int i=0; i<ringLights; i++) {
+	    coord angle = 2.f*M_PI*i/ringLights;
+	    ringOfLights.push_back(unique_ptr<Light>(
+		new Light(
+		    LightDistanceFactor*maxi*cos(angle),
+		    LightDistanceFactor*maxi*sin(angle),
+		    LightDistanceFactor*maxi,
+		    1.f/ringLights)));
+	    scene._lights.push_back(ringOfLights.back().get());
+	}
+
+	// Optionally, add the lights of a file (-l) - the ones with a range only
+	// light what is near them (see LightClusters.h). Only the ones whose
+	// shadow buffer can contain the scene cast shadows.
+	std::vector<unique_ptr<Light> > fileLights;
+	if (lightsFile) {
+	    LoadLights(lightsFile, shadowMapSize, fileLights);
+	    unsigned withoutShadows = 0;
+	    for(unsigned i=0; i<fileLights.size(); i++) {
+		scene._lights.push_back(fileLights[i].get());
+		if (fileLights[i]->CanShadowScene(scene))
+		    shadowCasters.push_back(fileLights[i].get());
+		else
+		    withoutShadows++;
+	    }
+	    if (withoutShadows)
+		cout << withoutShadows << " of the " << fileLights.size() <<
+		    " lights of '" << lightsFile << "' are too close to the scene to cast shadows\n";
+	}
+	scene._lightSamplesPerHit = lightSamplesPerHit;
+
 	Keyboard keys;
 
 	Vector3 eye(maxi*EyeDistanceFactor, 0.0, 0.0);
+
+	if (rayQueries) {
+	    puts("Creating BVH... please wait...");
+	    scene.UpdateBoundingVolumeHierarchy(fname);
+	    RayQueryBenchmark(scene, eye, *pLight, rayQueries);
+	    return 0;
+	}
+
 	Vector3 lookat(eye._x + 1.0f*cos(angle2)*cos(angle1),
 		       eye._y + 1.0f*cos(angle2)*sin(angle1),
 		       eye._z + 1.0f*sin(angle2));
@@ -305,8 +520,10 @@ int main(int argc, char *argv[])
 
 	Uint32 framesDrawn = 0, previousReport = 0;
 
-	SDL_WM_SetCaption(modes[mode-1], modes[mode-1]);
-	canvas.ShowScreen();
+	canvas.SetCaption(modes[mode-1]);
+	// (an empty window, until the first frame - nothing to show offscreen)
+	if (!offscreen)
+	    canvas.ShowScreen();
 
 	Clock globalTime; // for reporting of FPS every 5 seconds (-r option)
 
@@ -316,17 +533,15 @@ int main(int argc, char *argv[])
 	coord dAngle = DEGREES_TO_RADIANS(0.3f);
 
 	keys.poll();
-	pLight->CalculatePositionInCameraSpace(sony);
-	pLight->RenderSceneIntoShadowBuffer(scene);
-	pLight->CalculateXformFromWorldToLightSpace();
-
-	if (useTwoLights) {
-	    pLight2->CalculatePositionInCameraSpace(sony);
-	    pLight2->RenderSceneIntoShadowBuffer(scene);
-	    pLight2->CalculateXformFromWorldToLightSpace();
+	for(unsigned i=0; i<shadowCasters.size(); i++) {
+	    // (the other modes render them when switching to 7 or 8)
+	    if (mode == RENDER_PHONG_SHADOWMAPS || mode == RENDER_PHONG_SOFTSHADOWMAPS)
+		shadowCasters[i]->UpdateShadowBuffer(scene, useVarianceShadows);
+	    shadowCasters[i]->CalculateXformFromWorldToLightSpace();
 	}
 
-	bool dirtyShadowBuffer = true;
+	// Renders the shadow buffer of the moving light in the background
+	ShadowRegenerator shadowRegenerator(scene, *pLight, useVarianceShadows);
 
 	// "Cache-ing" of state, to avoid redraws if all are the same
 	Vector3
@@ -412,21 +627,25 @@ int main(int argc, char *argv[])
 			angle3 += 4*dAngle;
 		    else
 			angle3 -= 4*dAngle;
-		    pLight->_x = LightDistanceFactor*maxi*cos(angle3);
-		    pLight->_y = LightDistanceFactor*maxi*sin(angle3);
+		    Vector3 lightPosition(
+			LightDistanceFactor*maxi*cos(angle3),
+			LightDistanceFactor*maxi*sin(angle3),
+			pLight->_z);
 		    // When we move the light, we really should clean up the shadow buffer
 		    // However, this takes a lot of time. When in no-shadows modes (e.g. Gouraud)
 		    // why should the user wait for these functions? He shouldn't.
-		    // Which is why we use the "dirty..." booleans below.
-		    // We set them to true whenever we move the light, and use them
-		    // to only compute these shadow-related stuff when needed, and only when needed.
-		    dirtyShadowBuffer = true;
+		    // Which is why the shadow buffers are only updated (if the light moved
+		    // since they were rendered) when switching to the shadowing modes.
 		    if (mode == RENDER_PHONG_SHADOWMAPS || mode == RENDER_PHONG_SOFTSHADOWMAPS) {
-			pLight->ClearShadowBuffer();
-			pLight->RenderSceneIntoShadowBuffer(scene);
-			dirtyShadowBuffer = false;
-		    } else if (mode == RENDER_RAYTRACE || mode == RENDER_RAYTRACE_ANTIALIAS) {
-			pLight->CalculateXformFromWorldToLightSpace();
+			// Even then, the user shouldn't wait for them: the shadow buffer is
+			// rendered in the background, and the light moves when it is ready
+			// (the frames in the meantime use the old one - see ShadowRegenerator)
+			shadowRegenerator.Request(lightPosition);
+		    } else {
+			pLight->_x = lightPosition._x;
+			pLight->_y = lightPosition._y;
+			if (mode == RENDER_RAYTRACE || mode == RENDER_RAYTRACE_ANTIALIAS)
+			    pLight->CalculateXformFromWorldToLightSpace();
 		    }
 		}
 		// Change rendering mode, via 0-9 or PgUp/PgDown
@@ -460,15 +679,15 @@ int main(int argc, char *argv[])
 		    newMode = true;
 		}
 		if (newMode) {
-		    SDL_WM_SetCaption(modes[mode-1], modes[mode-1]);
+		    canvas.SetCaption(modes[mode-1]);
+		    // The other modes need the light where it was last moved to
+		    shadowRegenerator.Finish();
 		    // Since we just changed mode, make sure we calculate the proper shadow related stuff,
 		    // if and only if we have to!    (speed advantage!)
-		    // (use the dirty... booleans, see also comment above)
-		    if (dirtyShadowBuffer && (mode == RENDER_PHONG_SHADOWMAPS || mode == RENDER_PHONG_SOFTSHADOWMAPS)) {
-			pLight->ClearShadowBuffer();
-			pLight->RenderSceneIntoShadowBuffer(scene);
-			dirtyShadowBuffer = false;
-		    }
+		    // (only the lights that moved re-render theirs, see also comment above)
+		    if (mode == RENDER_PHONG_SHADOWMAPS || mode == RENDER_PHONG_SOFTSHADOWMAPS)
+			for(unsigned i=0; i<shadowCasters.size(); i++)
+			    shadowCasters[i]->UpdateShadowBuffer(scene, useVarianceShadows);
 		    if (mode == RENDER_RAYTRACE || mode == RENDER_RAYTRACE_ANTIALIAS)
 			pLight->CalculateXformFromWorldToLightSpace();
 		    dAngle = DEGREES_TO_RADIANS(0.3f);
@@ -495,16 +714,18 @@ int main(int argc, char *argv[])
 
 	    sony.set(eye, lookat);
 
-	    if (mode >= RENDER_GOURAUD) {
-		pLight->CalculatePositionInCameraSpace(sony);
-		if (useTwoLights)
-		    pLight2->CalculatePositionInCameraSpace(sony);
-	    }
-	    if (mode >= RENDER_PHONG_SHADOWMAPS) {
-		pLight->CalculateXformFromCameraToLightSpace(sony);
-		if (useTwoLights)
-		    pLight2->CalculateXformFromCameraToLightSpace(sony);
-	    }
+	    // Has the background shadow buffer (and so, the light) arrived?
+	    shadowRegenerator.Poll();
+
+	    if (mode >= RENDER_GOURAUD)
+		for(unsigned i=0; i<scene._lights.size(); i++)
+		    scene._lights[i]->CalculatePositionInCameraSpace(sony);
+	    if (mode >= RENDER_PHONG_SHADOWMAPS)
+		for(unsigned i=0; i<shadowCasters.size(); i++)
+		    shadowCasters[i]->CalculateXformFromCameraToLightSpace(sony);
+	    // ...and which of them reach each part of the view
+	    if (mode >= RENDER_GOURAUD && mode <= RENDER_PHONG_SOFTSHADOWMAPS)
+		scene._lightClusters.Update(scene, sony);
 
 	    // Avoid redrawing if possible (saving CPU utilization)
 	    if (oldLightPosition != Vector3(*pLight) ||
@@ -535,7 +756,11 @@ int main(int argc, char *argv[])
 		case RENDER_PHONG_SHADOWMAPS:
 		    scene.renderPhongAndShadowed(sony, canvas); break;
 		case RENDER_PHONG_SOFTSHADOWMAPS:
-		    scene.renderPhongAndSoftShadowed(sony, canvas); break;
+		    if (useVarianceShadows)
+			scene.renderPhongAndVarianceShadowed(sony, canvas);
+		    else
+			scene.renderPhongAndSoftShadowed(sony, canvas);
+		    break;
 		case RENDER_RAYTRACE:
 		case RENDER_RAYTRACE_ANTIALIAS:
 		    // Since the raytracing mode is orders of magnitude slower than
@@ -562,13 +787,13 @@ int main(int argc, char *argv[])
 			    msg << "aytracing completed in ";
 			    msg << (raytraceFrameTime.readMS()+999)/1000;
 			    msg << " seconds - hit ESC to return to soft shadowmapping mode...";
-			    SDL_WM_SetCaption(msg.str().c_str(), msg.str().c_str());
+			    canvas.SetCaption(msg.str().c_str());
 			    while(!keys._isAbort) keys.poll();
 			    while(keys._isAbort) keys.poll();
 			}
 			// Do a normal rendering with soft shadow maps
 			mode = RENDER_PHONG_SOFTSHADOWMAPS;
-			SDL_WM_SetCaption(modes[mode-1], modes[mode-1]);
+			canvas.SetCaption(modes[mode-1]);
 			msSpentDrawing = 0;
 			framesDrawn = 0;
 			forceRedraw = true;
@@ -606,7 +831,7 @@ int main(int argc, char *argv[])
 		if (msSpentDrawing) {
 		    speed << "FPS: " << framesDrawn/(msSpentDrawing/1000.0);
 		    #ifdef _WIN32
-		    SDL_WM_SetCaption(speed.str().c_str(), speed.str().c_str());
+		    canvas.SetCaption(speed.str().c_str());
 		    #else
 		    cout << speed.str().c_str() << endl;
 		    #endif
@@ -631,6 +856,16 @@ int main(int argc, char *argv[])
 	    cout << "Rendering " << framesDrawn << " frames in ";
 	    cout << msSpentDrawing/1000.0 << " seconds. (";
 	    cout << framesDrawn/(msSpentDrawing/1000.0) << " fps)\n";
+	    // For comparing resolutions (see the -g option)
+	    cout << "Pixels/sec at " << WIDTH << "x" << HEIGHT << ": ";
+	    cout << double(framesDrawn)*WIDTH*HEIGHT/(msSpentDrawing/1000.0)/1e6 << " million\n";
+	    if (mode == RENDER_RAYTRACE || mode == RENDER_RAYTRACE_ANTIALIAS) {
+		// For comparing BVH layouts (see BVH_QUANTIZED in Defines.h)
+		double primaryRays = double(framesDrawn)*WIDTH*HEIGHT;
+		if (mode == RENDER_RAYTRACE_ANTIALIAS)
+		    primaryRays *= 4.;
+		cout << "Primary rays/sec: " << primaryRays/(msSpentDrawing/1000.0) << "\n";
+	    }
 	    #endif
 	}
     }